@@ -133,6 +133,10 @@ class XrCube : public vik::Application {
   }
 
   uint64_t get_animation_time() {
+    // Benchmarks advance with a fixed timestep
+    if (benchmark.enabled)
+      return renderer->timer.elapsed_seconds * 1000.0 / 5;
+
     timeval tv;
     gettimeofday(&tv, nullptr);
     return (get_ms_from_tv(tv) - get_ms_from_tv(start_tv)) / 5;
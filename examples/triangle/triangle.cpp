@@ -66,8 +66,6 @@ class Triangle : public vik::Application {
   VkDescriptorSetLayout descriptorSetLayout;
   VkDescriptorSet descriptorSet;
 
-  std::vector<VkFence> waitFences;
-
   Triangle(int argc, char *argv[]) : Application(argc, argv) {
     name = "Triangle";
     camera = new vik::CameraArcBall();
@@ -89,9 +87,6 @@ class Triangle : public vik::Application {
 
     vkDestroyBuffer(renderer->device, uniformBufferVS.buffer, nullptr);
     vkFreeMemory(renderer->device, uniformBufferVS.memory, nullptr);
-
-    for (auto& fence : waitFences)
-      vkDestroyFence(renderer->device, fence, nullptr);
   }
 
   uint32_t getMemoryTypeIndex(uint32_t typeBits, VkMemoryPropertyFlags properties) {
@@ -104,18 +99,6 @@ class Triangle : public vik::Application {
     throw "Could not find a suitable memory type!";
   }
 
-  void prepareSynchronizationPrimitives() {
-    VkFenceCreateInfo fenceCreateInfo = {
-      .sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO,
-      // Create in signaled state so we don't wait on first render of each command buffer
-      .flags = VK_FENCE_CREATE_SIGNALED_BIT
-    };
-
-    waitFences.resize(renderer->cmd_buffers.size());
-    for (auto& fence : waitFences)
-      vik_log_check(vkCreateFence(renderer->device, &fenceCreateInfo, nullptr, &fence));
-  }
-
   // End the command buffer and submit it to the queue
   // Uses a fence to ensure command buffer has finished executing before deleting it
   void flushCommandBuffer(VkCommandBuffer commandBuffer) {
@@ -218,10 +201,8 @@ class Triangle : public vik::Application {
     vik_log_d("buildCommandBuffers size: %ld", renderer->cmd_buffers.size());
   }
 
+  // The renderer waits until the command buffer of the image is idle
   void draw() {
-    vik_log_check(vkWaitForFences(renderer->device, 1, &waitFences[renderer->current_buffer], VK_TRUE, UINT64_MAX));
-    vik_log_check(vkResetFences(renderer->device, 1, &waitFences[renderer->current_buffer]));
-
     VkSubmitInfo submit_info = renderer->init_render_submit_info();
 
     std::array<VkPipelineStageFlags, 1> stage_flags = {
@@ -230,7 +211,7 @@ class Triangle : public vik::Application {
     submit_info.pWaitDstStageMask = stage_flags.data();
 
     submit_info.pCommandBuffers = renderer->get_current_command_buffer();
-    vik_log_check(vkQueueSubmit(renderer->queue, 1, &submit_info, waitFences[renderer->current_buffer]));
+    vik_log_check(vkQueueSubmit(renderer->queue, 1, &submit_info, VK_NULL_HANDLE));
   }
 
   void prepareVertices(bool useStagingBuffers) {
@@ -648,7 +629,6 @@ class Triangle : public vik::Application {
 
   void init() {
     Application::init();
-    prepareSynchronizationPrimitives();
     prepareVertices(USE_STAGING);
 
     camera->set_perspective(60.0f,
@@ -25,12 +25,15 @@
 #include <glm/gtc/matrix_transform.hpp>
 #include <gli/gli.hpp>
 
+#include <algorithm>
 #include <vector>
 #include <string>
 
 #include "system/vikApplication.hpp"
 #include "render/vikModel.hpp"
 #include "scene/vikNodeGear.hpp"
+#include "scene/vikFrustum.hpp"
+#include "scene/vikInstancedScene.hpp"
 #include "scene/vikSkyBox.hpp"
 #include "render/vikDistortion.hpp"
 #include "render/vikOffscreenPass.hpp"
@@ -57,6 +60,10 @@ class XRGears : public vik::Application {
   bool enable_hmd_cam = true;
   bool enable_distortion = true;
   bool enable_stereo = true;
+  // Render the eyes into the offscreen layers without geometry shaders
+  bool enable_multiview = false;
+  // Draw each node twice as instances, the vertex shader picks the viewport
+  bool enable_stereo_instancing = false;
 
   vik::SkyBox *sky_box = nullptr;
   vik::Distortion *distortion = nullptr;
@@ -73,32 +80,59 @@ class XRGears : public vik::Application {
   } vertices;
 
   std::vector<vik::Node*> nodes;
+  // Nodes in either eye's frustum this frame, the ones that are recorded
+  std::vector<vik::Node*> visible_nodes;
+
+  // Generates the gears with --gpu-gears and --gear-benchmark
+  vik::GearGenerator gear_generator;
+  // Teeth to add to the generated gears, from the keypad
+  int tooth_count_change = 0;
+
+  // Replaces the nodes with --gear-instances and --merged-draws
+  vik::InstancedScene *instanced_scene = nullptr;
+  // Planes of both eyes for the instance culler, pushed every frame
+  uint32_t frusta_offset = 0;
+  void *frusta_mapped = nullptr;
+
+  // Head motion the late latch may add after culling, per second
+  static constexpr float MAX_HEAD_ROTATION_SPEED = 600.0f;  // degrees
+  static constexpr float MAX_HEAD_SPEED = 2.0f;  // meters
 
   struct UBOLights {
     glm::vec4 lights[4];
   } ubo_lights;
 
-  struct {
-    vik::Buffer lights;
-  } uniform_buffers;
+  // Lights are written to the upload arena every frame
+  VkDescriptorBufferInfo lights_descriptor;
+  uint32_t lights_offset = 0;
 
   struct {
     VkPipeline pbr;
   } pipelines;
+  std::shared_future<VkPipeline> pbr_pipeline_future;
 
   VkPipelineLayout pipeline_layout;
   VkDescriptorSetLayout descriptor_set_layout;
 
-  VkCommandBuffer offscreen_command_buffer = VK_NULL_HANDLE;
-  // Semaphore used to synchronize between offscreen and final scene rendering
-  VkSemaphore offscreen_semaphore = VK_NULL_HANDLE;
+  // GPU profiler scopes, scene includes the sky
+  struct {
+    uint32_t scene;
+    uint32_t sky;
+    uint32_t warp;
+  } gpu_scopes;
+
+  // One offscreen command buffer per frame in flight
+  std::vector<VkCommandBuffer> offscreen_command_buffers;
+  // Semaphores used to synchronize between offscreen and final scene rendering
+  std::vector<VkSemaphore> offscreen_semaphores;
 
   XRGears(int argc, char *argv[]) : Application(argc, argv) {
     name = "XR Gears";
 
     renderer->timer.animation_timer_speed *= 0.25f;
 
-    enable_hmd_cam = !settings.mouse_navigation;
+    // Benchmarks follow a scripted camera path instead of the HMD
+    enable_hmd_cam = !settings.mouse_navigation && !benchmark.enabled;
 
     if (settings.distortion_type
         == vik::Settings::DistortionType::DISTORTION_TYPE_NONE)
@@ -106,6 +140,13 @@ class XRGears : public vik::Application {
   }
 
   virtual ~XRGears() {
+    // Workers may still be uploading to the nodes' buffers
+    renderer->asset_loader.destroy();
+    gear_generator.destroy();
+
+    if (instanced_scene)
+      delete instanced_scene;
+
     if (offscreen_pass)
       delete offscreen_pass;
 
@@ -120,31 +161,39 @@ class XRGears : public vik::Application {
     if (distortion)
       delete distortion;
 
-    uniform_buffers.lights.destroy();
-
     for (auto& node : nodes)
       delete(node);
 
-    vkDestroySemaphore(renderer->device, offscreen_semaphore, nullptr);
+    for (auto& semaphore : offscreen_semaphores)
+      vkDestroySemaphore(renderer->device, semaphore, nullptr);
 
     delete hmd;
   }
 
   // Enable physical device features required for this example
   virtual void enable_required_features() {
-    check_feature(geometryShader);
-    check_feature(multiViewport);
+    // Only needed without multiview, checked once the device exists
+    if (renderer->device_features.geometryShader)
+      renderer->enabled_features.geometryShader = VK_TRUE;
+    if (renderer->device_features.multiViewport)
+      renderer->enabled_features.multiViewport = VK_TRUE;
     check_feature(textureCompressionBC);
     check_feature(samplerAnisotropy);
+
+    // Instances are found by the first instance of the indirect draws
+    if (settings.gear_instances > 0 || settings.merged_draws) {
+      check_feature(drawIndirectFirstInstance);
+      if (renderer->device_features.multiDrawIndirect)
+        renderer->enabled_features.multiDrawIndirect = VK_TRUE;
+    }
   }
 
+  // The scene command buffers bind this frame's uniform offsets
+  // and are recorded in draw(), only the warp pass is static
   void build_command_buffers() {
     if (enable_distortion) {
       for (uint32_t i = 0; i < renderer->cmd_buffers.size(); ++i)
-        build_warp_command_buffer(renderer->cmd_buffers[i], renderer->frame_buffers[i]);
-    } else {
-      for (uint32_t i = 0; i < renderer->cmd_buffers.size(); ++i)
-        build_pbr_command_buffer(renderer->cmd_buffers[i], renderer->frame_buffers[i], false);
+        build_warp_command_buffer(renderer->cmd_buffers[i], renderer->frame_buffers[i], i);
     }
   }
 
@@ -167,7 +216,8 @@ class XRGears : public vik::Application {
   }
 
   void build_warp_command_buffer(VkCommandBuffer command_buffer,
-                                 VkFramebuffer framebuffer) {
+                                 VkFramebuffer framebuffer,
+                                 uint32_t index) {
     std::array<VkClearValue, 2> clear_values;
     clear_values[0].color = { { 0.0f, 0.0f, 0.2f, 0.0f } };
     clear_values[1].depthStencil = { 1.0f, 0 };
@@ -184,6 +234,9 @@ class XRGears : public vik::Application {
     };
     vik_log_check(vkBeginCommandBuffer(command_buffer, &command_buffer_info));
 
+    renderer->gpu_profiler.reset(command_buffer, index, gpu_scopes.warp);
+    renderer->gpu_profiler.begin(command_buffer, index, gpu_scopes.warp);
+
     vkCmdBeginRenderPass(command_buffer, &render_pass_begin_info, VK_SUBPASS_CONTENTS_INLINE);
 
     VkViewport viewport = {
@@ -205,23 +258,31 @@ class XRGears : public vik::Application {
 
     vkCmdEndRenderPass(command_buffer);
 
+    renderer->gpu_profiler.end(command_buffer, index, gpu_scopes.warp);
+
     vik_log_check(vkEndCommandBuffer(command_buffer));
   }
 
-  // Build command buffer for rendering the scene to the offscreen frame buffer attachments
-  void build_offscreen_command_buffer() {
-    if (offscreen_command_buffer == VK_NULL_HANDLE)
-      offscreen_command_buffer = renderer->create_command_buffer();
+  // Command buffers for rendering the scene to the offscreen frame buffer attachments
+  void init_offscreen_command_buffers() {
+    uint32_t count = renderer->get_frames_in_flight();
 
-    // Create a semaphore used to synchronize offscreen rendering and usage
-    VkSemaphoreCreateInfo semaphore_info = {
-      .sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
-    };
-    vik_log_check(vkCreateSemaphore(renderer->device, &semaphore_info,
-                                    nullptr, &offscreen_semaphore));
+    if (offscreen_command_buffers.empty()) {
+      offscreen_command_buffers.resize(count);
+      for (auto& command_buffer : offscreen_command_buffers)
+        command_buffer = renderer->create_command_buffer();
+    }
 
-    VkFramebuffer unused;
-    build_pbr_command_buffer(offscreen_command_buffer, unused, true);
+    // Create semaphores used to synchronize offscreen rendering and usage
+    if (offscreen_semaphores.empty()) {
+      VkSemaphoreCreateInfo semaphore_info = {
+        .sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
+      };
+      offscreen_semaphores.resize(count);
+      for (auto& semaphore : offscreen_semaphores)
+        vik_log_check(vkCreateSemaphore(renderer->device, &semaphore_info,
+                                        nullptr, &semaphore));
+    }
   }
 
   void build_pbr_command_buffer(const VkCommandBuffer& command_buffer,
@@ -237,9 +298,28 @@ class XRGears : public vik::Application {
                                     offscreen ? "Pbr offscreen" : "PBR Pass Onscreen",
                                     glm::vec4(0.3f, 0.94f, 1.0f, 1.0f));
 
+    // Gears generated on the GPU since the last frame
+    gear_generator.record(command_buffer);
+
+    if (instanced_scene)
+      instanced_scene->cull(command_buffer, renderer->current_frame,
+                            frusta_offset, renderer->timer.animation_timer);
+
+    // Recorded every frame, after the image was acquired
+    vik::GpuProfiler *profiler = &renderer->gpu_profiler;
+    uint32_t pool = renderer->current_buffer;
+    profiler->reset(command_buffer, pool, gpu_scopes.scene);
+    if (enable_sky && !enable_multiview)
+      profiler->reset(command_buffer, pool, gpu_scopes.sky);
+    profiler->begin(command_buffer, pool, gpu_scopes.scene);
+
+    bool parallel = renderer->secondary_recorder.enabled;
+    VkSubpassContents contents = parallel
+        ? VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS
+        : VK_SUBPASS_CONTENTS_INLINE;
+
     if (offscreen) {
-      offscreen_pass->beginRenderPass(command_buffer);
-      offscreen_pass->setViewPortAndScissorStereo(command_buffer);
+      offscreen_pass->beginRenderPass(command_buffer, contents);
     } else {
       std::array<VkClearValue, 2> clear_values;
       clear_values[0].color = { { 1.0f, 1.0f, 1.0f, 1.0f } };
@@ -250,32 +330,75 @@ class XRGears : public vik::Application {
       render_pass_begin_info.pClearValues = clear_values.data();
       render_pass_begin_info.framebuffer = framebuffer;
 
-      vkCmdBeginRenderPass(command_buffer, &render_pass_begin_info, VK_SUBPASS_CONTENTS_INLINE);
-
-      if (enable_stereo)
-        set_stereo_viewport_and_scissors(command_buffer);
-      else
-        set_mono_viewport_and_scissors(command_buffer);
+      vkCmdBeginRenderPass(command_buffer, &render_pass_begin_info, contents);
     }
 
-    draw_scene(command_buffer);
+    if (parallel) {
+      draw_scene_parallel(command_buffer, framebuffer, offscreen);
+    } else {
+      set_viewports_and_scissors(command_buffer, offscreen);
+      draw_scene(command_buffer, 0, visible_nodes.size(), true);
+    }
 
     vkCmdEndRenderPass(command_buffer);
 
+    profiler->end(command_buffer, pool, gpu_scopes.scene);
+
     if (vik::debugmarker::active)
       vik::debugmarker::endRegion(command_buffer);
 
     vik_log_check(vkEndCommandBuffer(command_buffer));
   }
 
-  void draw_scene(VkCommandBuffer command_buffer) {
-    if (enable_sky)
-      sky_box->draw(command_buffer, pipeline_layout);
+  void draw_scene(VkCommandBuffer command_buffer,
+                  uint32_t first, uint32_t count, bool first_chunk) {
+    if (enable_sky && first_chunk)
+      sky_box->draw(command_buffer, pipeline_layout, camera->uniform_offset);
 
     vkCmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelines.pbr);
 
-    for (auto& node : nodes)
-      node->draw(command_buffer, pipeline_layout);
+    for (uint32_t i = first; i < first + count; i++)
+      visible_nodes[i]->draw(command_buffer, pipeline_layout,
+                             lights_offset, camera->uniform_offset,
+                             enable_stereo_instancing ? 2 : 1);
+
+    if (instanced_scene && first_chunk)
+      instanced_scene->draw(command_buffer, lights_offset, camera->uniform_offset,
+                            renderer->timer.animation_timer);
+  }
+
+  // Record chunks of nodes on the renderer's worker threads
+  void draw_scene_parallel(VkCommandBuffer command_buffer,
+                           VkFramebuffer framebuffer, bool offscreen) {
+    VkCommandBufferInheritanceInfo inheritance = {
+      .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO,
+      .renderPass = offscreen ? offscreen_pass->getRenderPass()
+                              : renderer->render_pass,
+      .subpass = 0,
+      .framebuffer = offscreen ? offscreen_pass->getFrameBuffer() : framebuffer
+    };
+
+    auto record_cb = [this, offscreen](VkCommandBuffer cmd_buffer, uint32_t chunk,
+                                       uint32_t first, uint32_t count) {
+      set_viewports_and_scissors(cmd_buffer, offscreen);
+      // The sky is the background, it goes into the first chunk
+      draw_scene(cmd_buffer, first, count, chunk == 0);
+    };
+
+    const std::vector<VkCommandBuffer>& secondaries =
+        renderer->secondary_recorder.record(renderer->current_frame, inheritance,
+                                            visible_nodes.size(), record_cb);
+
+    vkCmdExecuteCommands(command_buffer, secondaries.size(), secondaries.data());
+  }
+
+  void set_viewports_and_scissors(VkCommandBuffer command_buffer, bool offscreen) {
+    if (offscreen)
+      offscreen_pass->setViewPortAndScissorStereo(command_buffer);
+    else if (enable_stereo)
+      set_stereo_viewport_and_scissors(command_buffer);
+    else
+      set_mono_viewport_and_scissors(command_buffer);
   }
 
   void set_mono_viewport_and_scissors(VkCommandBuffer command_buffer) {
@@ -345,7 +468,8 @@ class XRGears : public vik::Application {
       // file_name = "cubemaps/sdr/cubemap_space.ktx";
       // format = VK_FORMAT_R8G8B8A8_UNORM;
 
-      sky_box->load_assets(vertex_layout, renderer->vik_device, renderer->queue,
+      sky_box->load_assets(&renderer->asset_loader, vertex_layout,
+                           renderer->vik_device,
                            vik::Assets::get_texture_path() + file_name, format);
     }
   }
@@ -372,10 +496,10 @@ class XRGears : public vik::Application {
     std::vector<float> rotation_speeds = { 1.0f, -2.0f, -2.0f };
     std::vector<float> rotation_offsets = { 0.0f, -9.0f, -30.0f };
 
-    nodes.resize(positions.size());
-    for (uint32_t i = 0; i < nodes.size(); ++i) {
-
-      vik::GearInfo gear_info = {
+    std::vector<vik::GearInfo> gear_infos(positions.size());
+    std::vector<vik::Node::NodeInfo> gear_node_infos(positions.size());
+    for (uint32_t i = 0; i < positions.size(); ++i) {
+      gear_infos[i] = {
         .inner_radius = inner_radiuses[i],
         .outer_radius = outer_radiuses[i],
         .width = widths[i],
@@ -383,25 +507,92 @@ class XRGears : public vik::Application {
         .tooth_depth = tooth_depth[i]
       };
 
-      vik::Node::NodeInfo gear_node_info = {
+      gear_node_infos[i] = {
         .position = positions[i],
         .rotation_speed = rotation_speeds[i],
         .rotation_offset = rotation_offsets[i],
         .material = materials[i]
       };
+    }
+
+    bool use_generator = settings.gpu_gears || settings.gear_benchmark > 0;
+    if (use_generator)
+      gear_generator.init(renderer->vik_device, renderer->pipeline_cache);
+
+    if (settings.gear_benchmark > 0)
+      gear_generator.benchmark(gear_infos[0], settings.gear_benchmark,
+                               renderer->queue);
+
+    if (instanced_scene) {
+      init_instanced_scene(gear_infos, gear_node_infos);
+      return;
+    }
 
+    nodes.resize(gear_infos.size());
+    for (uint32_t i = 0; i < nodes.size(); ++i) {
       nodes[i] = new vik::NodeGear();
-      nodes[i]->setInfo(&gear_node_info);
-      ((vik::NodeGear*)nodes[i])->generate(renderer->vik_device,
-                                           &gear_info, renderer->queue);
+      nodes[i]->setInfo(&gear_node_infos[i]);
+      if (settings.gpu_gears)
+        ((vik::NodeGear*)nodes[i])->generate(&gear_generator, &gear_infos[i]);
+      else
+        ((vik::NodeGear*)nodes[i])->generate(&renderer->asset_loader,
+                                             renderer->vik_device,
+                                             &gear_infos[i]);
     }
 
+    init_teapot();
+  }
+
+  /*
+   * The gears and the teapot in merged buffers. With --gear-instances the
+   * gear definitions fill a cube around the origin.
+   */
+  void init_instanced_scene(const std::vector<vik::GearInfo> &gear_infos,
+                            const std::vector<vik::Node::NodeInfo> &node_infos) {
+    for (auto& gear_info : gear_infos)
+      instanced_scene->add_gear(gear_info);
+
+    if (settings.gear_instances > 0) {
+      const float spacing = 10.0f;
+      uint32_t count = settings.gear_instances;
+      uint32_t side = (uint32_t) ceil(cbrt((double) count));
+      float center = (side - 1) * spacing * 0.5f;
+
+      for (uint32_t i = 0; i < count; i++) {
+        uint32_t mesh = i % gear_infos.size();
+        glm::vec3 grid_position(i % side, (i / side) % side, i / (side * side));
+
+        vik::Node::NodeInfo info = node_infos[mesh];
+        info.position = grid_position * spacing - glm::vec3(center);
+        // Keep neighbouring gears out of phase
+        info.rotation_offset += (i * 7) % 360;
+        instanced_scene->add(mesh, info);
+      }
+    } else {
+      for (uint32_t i = 0; i < node_infos.size(); i++)
+        instanced_scene->add(i, node_infos[i]);
+    }
+
+    uint32_t teapot = instanced_scene->add_model(
+          vik::Assets::get_asset_path() + "models/teapot.dae", 0.25f);
+    vik::Node::NodeInfo teapot_info = {
+      .position = glm::vec3(-15.0, -5.0, -5.0),
+      .rotation_speed = 0.0f,
+      .rotation_offset = 0.0f,
+      .material = vik::Material("Cream", glm::vec3(1.0f, 1.0f, 0.7f), 1.0f, 1.0f)
+    };
+    instanced_scene->add(teapot, teapot_info);
+
+    instanced_scene->load(&renderer->asset_loader, vertex_layout);
+  }
+
+  void init_teapot() {
     vik::NodeModel* teapot_node = new vik::NodeModel();
-    teapot_node->load_model("teapot.dae",
-                          vertex_layout,
-                          0.25f,
-                          renderer->vik_device,
-                          renderer->queue);
+    teapot_node->load_model(&renderer->asset_loader,
+                            "teapot.dae",
+                            vertex_layout,
+                            0.25f,
+                            renderer->vik_device);
 
     vik::Material teapot_material = vik::Material("Cream", glm::vec3(1.0f, 1.0f, 0.7f), 1.0f, 1.0f);
     teapot_node->setMateral(teapot_material);
@@ -458,18 +649,28 @@ class XRGears : public vik::Application {
     // Example uses two ubos
     std::vector<VkDescriptorPoolSize> pool_sizes = {
       {
-        .type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
+        .type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC,
         .descriptorCount = 16
       },
+      // distortion parameters
+      {
+        .type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
+        .descriptorCount = 1
+      },
       {
         .type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
         .descriptorCount = 6
+      },
+      // gear instances
+      {
+        .type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+        .descriptorCount = 1
       }
     };
 
     VkDescriptorPoolCreateInfo descriptor_pool_info = {
       .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
-      .maxSets = 6,
+      .maxSets = 7,
       .poolSizeCount = static_cast<uint32_t>(pool_sizes.size()),
       .pPoolSizes = pool_sizes.data()
     };
@@ -483,23 +684,25 @@ class XRGears : public vik::Application {
       // ubo model
       {
         .binding = 0,
-        .descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
+        .descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC,
         .descriptorCount = 1,
-        .stageFlags = VK_SHADER_STAGE_GEOMETRY_BIT
+        .stageFlags = VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_GEOMETRY_BIT
       },
       // ubo lights
       {
         .binding = 1,
-        .descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
+        .descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC,
         .descriptorCount = 1,
         .stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT
       },
       // ubo camera
       {
         .binding = 2,
-        .descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
+        .descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC,
         .descriptorCount = 1,
-        .stageFlags = VK_SHADER_STAGE_GEOMETRY_BIT | VK_SHADER_STAGE_FRAGMENT_BIT
+        .stageFlags = VK_SHADER_STAGE_VERTEX_BIT
+                    | VK_SHADER_STAGE_GEOMETRY_BIT
+                    | VK_SHADER_STAGE_FRAGMENT_BIT
       }
     };
 
@@ -527,7 +730,7 @@ class XRGears : public vik::Application {
      * Push Constants
      */
     std::vector<VkPushConstantRange> push_constant_ranges = {{
-      .stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT,
+      .stageFlags = VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_GEOMETRY_BIT,
       .offset = sizeof(glm::vec3),
       .size = sizeof(vik::Material::PushBlock)
     }};
@@ -552,15 +755,21 @@ class XRGears : public vik::Application {
         .descriptorSetCount = 1,
         .pSetLayouts = &descriptor_set_layout
       };
-      sky_box->create_descriptor_set(info, &camera->uniform_buffer.descriptor);
+      sky_box->create_descriptor_set(info, &camera->uniform_descriptor);
     }
 
     for (auto& node : nodes)
       node->create_descriptor_set(renderer->device, renderer->descriptor_pool,
                                 descriptor_set_layout,
-                                &uniform_buffers.lights.descriptor,
-                                &camera->uniform_buffer.descriptor,
+                                &lights_descriptor,
+                                &camera->uniform_descriptor,
                                 sky_box);
+
+    if (instanced_scene)
+      instanced_scene->create_descriptor_set(renderer->descriptor_pool,
+                                             &lights_descriptor,
+                                             &camera->uniform_descriptor,
+                                             sky_box);
 }
 
   void init_pipelines() {
@@ -603,10 +812,12 @@ class XRGears : public vik::Application {
       }
     };
 
+    // Multiview renders each eye into its own layer with one viewport
+    uint32_t viewport_count = enable_stereo && !enable_multiview ? 2 : 1;
     VkPipelineViewportStateCreateInfo viewport_state = {
       .sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO,
-      .viewportCount = static_cast<uint32_t>(enable_stereo ? 2 : 1),
-      .scissorCount = static_cast<uint32_t>(enable_stereo ? 2 : 1)
+      .viewportCount = viewport_count,
+      .scissorCount = viewport_count
     };
 
     VkPipelineMultisampleStateCreateInfo multisample_state = {
@@ -627,14 +838,24 @@ class XRGears : public vik::Application {
 
     // Load shaders
     std::array<VkPipelineShaderStageCreateInfo, 3> shader_stages;
-    shader_stages[0] = vik::Shader::load(renderer->device, "xrgears/scene.vert.spv", VK_SHADER_STAGE_VERTEX_BIT);
+    if (enable_multiview)
+      shader_stages[0] = vik::Shader::load(renderer->device, "xrgears/scene_multiview.vert.spv", VK_SHADER_STAGE_VERTEX_BIT);
+    else if (enable_stereo_instancing && renderer->vik_device->enable_viewport_index_layer)
+      shader_stages[0] = vik::Shader::load(renderer->device, "xrgears/scene_stereo.vert.spv", VK_SHADER_STAGE_VERTEX_BIT);
+    else if (enable_stereo_instancing)
+      shader_stages[0] = vik::Shader::load(renderer->device, "xrgears/scene_stereo_nv.vert.spv", VK_SHADER_STAGE_VERTEX_BIT);
+    else
+      shader_stages[0] = vik::Shader::load(renderer->device, "xrgears/scene.vert.spv", VK_SHADER_STAGE_VERTEX_BIT);
 
     if (enable_sky)
       shader_stages[1] = vik::Shader::load(renderer->device, "xrgears/scene.frag.spv", VK_SHADER_STAGE_FRAGMENT_BIT);
     else
       shader_stages[1] = vik::Shader::load(renderer->device, "xrgears/scene_no_sky.frag.spv", VK_SHADER_STAGE_FRAGMENT_BIT);
 
-    shader_stages[2] = vik::Shader::load(renderer->device, "xrgears/multiview.geom.spv", VK_SHADER_STAGE_GEOMETRY_BIT);
+    // The sky and the instanced scene load their own stages
+    bool use_geometry_shader = !enable_multiview && !enable_stereo_instancing;
+    if (use_geometry_shader)
+      shader_stages[2] = vik::Shader::load(renderer->device, "xrgears/multiview.geom.spv", VK_SHADER_STAGE_GEOMETRY_BIT);
 
     // Vertex bindings an attributes
     std::vector<VkVertexInputBindingDescription> vertex_input_bindings = {{
@@ -676,7 +897,7 @@ class XRGears : public vik::Application {
 
     VkGraphicsPipelineCreateInfo pipeline_info = {
       .sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO,
-      .stageCount = static_cast<uint32_t>(shader_stages.size()),
+      .stageCount = static_cast<uint32_t>(use_geometry_shader ? 3 : 2),
       .pStages = shader_stages.data(),
       .pVertexInputState = &vertex_input_state,
       .pInputAssemblyState = &input_assembly_state,
@@ -696,44 +917,106 @@ class XRGears : public vik::Application {
     else
       pipeline_info.renderPass = renderer->render_pass;
 
-    vik_log_check(vkCreateGraphicsPipelines(renderer->device,
-                                            renderer->pipeline_cache, 1,
-                                            &pipeline_info,
-                                            nullptr, &pipelines.pbr));
+    pbr_pipeline_future = renderer->pipeline_builder.build(pipeline_info);
+
+    if (instanced_scene)
+      instanced_scene->init_pipeline(pipeline_info, &renderer->pipeline_builder,
+                                     enable_sky, enable_multiview);
 
     if (enable_sky)
-      sky_box->init_pipeline(&pipeline_info, renderer->pipeline_cache);
+      sky_box->init_pipeline(&pipeline_info, &renderer->pipeline_builder,
+                             enable_multiview);
+  }
 
-    vkDestroyShaderModule(renderer->device, shader_stages[0].module, nullptr);
-    vkDestroyShaderModule(renderer->device, shader_stages[1].module, nullptr);
-    vkDestroyShaderModule(renderer->device, shader_stages[2].module, nullptr);
+  void wait_for_pipelines() {
+    vik_trace_zone("wait_for_pipelines");
+    pipelines.pbr = pbr_pipeline_future.get();
+    if (instanced_scene)
+      instanced_scene->wait_for_pipeline();
+    if (enable_sky)
+      sky_box->wait_for_pipeline();
+    if (enable_distortion)
+      distortion->wait_for_pipeline();
   }
 
-  // Prepare and initialize uniform buffer containing shader uniforms
+  // Uniform buffers live in the renderer's upload arena.
+  // Everything written per frame is reserved before the first descriptor.
   void init_uniform_buffers() {
-    renderer->vik_device->create_and_map(&uniform_buffers.lights, sizeof(ubo_lights));
+    vik::UploadArena *arena = &renderer->upload_arena;
+    arena->reserve(sizeof(ubo_lights));
+    arena->reserve(sizeof(camera->ubo));
+    for (auto& node : nodes)
+      arena->reserve(sizeof(node->ubo));
+    if (instanced_scene)
+      arena->reserve(sizeof(vik::StereoFrustum));
 
-    camera->init_uniform_buffer(renderer->vik_device);
+    lights_descriptor = renderer->upload_arena.get_descriptor(sizeof(ubo_lights));
+
+    camera->init_uniform_buffer(&renderer->upload_arena);
 
     for (auto& node : nodes)
-      node->init_uniform_buffer(renderer->vik_device);
+      node->init_uniform_buffer(&renderer->upload_arena);
 
-    update_uniform_buffers();
+    if (instanced_scene && settings.culling)
+      instanced_scene->init_culling(
+            renderer->pipeline_cache, renderer->get_frames_in_flight(),
+            renderer->upload_arena.get_descriptor(sizeof(vik::StereoFrustum)));
   }
 
+  // Write this frame's uniforms into the current arena slice
   void update_uniform_buffers() {
-    camera->update_uniform_buffer();
+    vik_trace_zone("update_uniform_buffers");
+    camera->update_uniform_buffer(&renderer->upload_arena);
 
     vik::Camera::StereoView sv = {};
     sv.view[0] = camera->ubo.view[0];
     sv.view[1] = camera->ubo.view[1];
 
     for (auto& node : nodes)
-      node->update_uniform_buffer(sv, renderer->timer.animation_timer);
+      node->update_uniform_buffer(sv, renderer->timer.animation_timer,
+                                  &renderer->upload_arena);
+
+    cull_nodes();
+
+    if (instanced_scene) {
+      instanced_scene->update();
+      // Rewritten with the late latched pose before submit
+      vik::StereoFrustum frusta(camera->ubo);
+      vik::UploadArena::Allocation allocation =
+          renderer->upload_arena.allocate(sizeof(frusta));
+      memcpy(allocation.data, &frusta, sizeof(frusta));
+      frusta_offset = allocation.offset;
+      frusta_mapped = allocation.data;
+    }
 
     update_lights();
   }
 
+  void cull_nodes() {
+    vik_trace_zone("cull_nodes");
+    if (!settings.culling) {
+      visible_nodes = nodes;
+      return;
+    }
+
+    vik::PackedStereoFrustum frusta(vik::StereoFrustum(camera->ubo));
+
+    // The nodes are recorded with this pose, the late latch moves it after
+    if (settings.late_latch && enable_hmd_cam) {
+      float seconds = settings.frame_budget_ms / 1000.0f;
+      glm::vec3 eye = 0.5f * (glm::vec3(glm::inverse(camera->ubo.view[0])[3])
+                              + glm::vec3(glm::inverse(camera->ubo.view[1])[3]));
+      frusta.set_pose_margin(eye,
+                             glm::radians(MAX_HEAD_ROTATION_SPEED) * seconds,
+                             MAX_HEAD_SPEED * seconds);
+    }
+
+    visible_nodes.clear();
+    for (auto& node : nodes)
+      if (node->is_visible(frusta))
+        visible_nodes.push_back(node);
+  }
+
   void update_lights() {
     const float p = 15.0f;
     ubo_lights.lights[0] = glm::vec4(-p, -p*0.5f, -p, 1.0f);
@@ -750,10 +1033,38 @@ class XRGears : public vik::Application {
       ubo_lights.lights[1].y = sin(rad) * 20.0f;
     }
 
-    memcpy(uniform_buffers.lights.mapped, &ubo_lights, sizeof(ubo_lights));
+    lights_offset = renderer->upload_arena.push(&ubo_lights, sizeof(ubo_lights));
   }
 
   void draw() {
+    // Record the scene with the uniform offsets of this frame
+    {
+      vik_trace_zone("build_pbr_command_buffer");
+      if (enable_distortion) {
+        VkFramebuffer unused;
+        build_pbr_command_buffer(offscreen_command_buffers[renderer->current_frame],
+                                 unused, true);
+      } else {
+        build_pbr_command_buffer(*renderer->get_current_command_buffer(),
+                                 renderer->frame_buffers[renderer->current_buffer],
+                                 false);
+      }
+    }
+
+    // Resample the HMD pose as late as possible
+    if (settings.late_latch) {
+      vik_trace_zone("late_latch");
+      camera->late_latch();
+
+      // The cull shader reads the frusta when the frame runs
+      if (instanced_scene) {
+        vik::StereoFrustum frusta(camera->ubo);
+        memcpy(frusta_mapped, &frusta, sizeof(frusta));
+      }
+    }
+
+    vik_trace_zone("queue_submit");
+
     VkSubmitInfo submit_info = renderer->init_render_submit_info();
 
     std::array<VkPipelineStageFlags, 1> stage_flags = {
@@ -775,21 +1086,23 @@ class XRGears : public vik::Application {
 
       // Offscreen rendering
 
+      uint32_t frame = renderer->current_frame;
+
       // Wait for swap chain presentation to finish
-      submit_info.pWaitSemaphores = &renderer->semaphores.present_complete;
+      submit_info.pWaitSemaphores = &renderer->semaphores.present_complete[frame];
       // Signal ready with offscreen semaphore
-      submit_info.pSignalSemaphores = &offscreen_semaphore;
+      submit_info.pSignalSemaphores = &offscreen_semaphores[frame];
 
       // Submit work
-      submit_info.pCommandBuffers = &offscreen_command_buffer;
+      submit_info.pCommandBuffers = &offscreen_command_buffers[frame];
       vik_log_check(vkQueueSubmit(renderer->queue, 1, &submit_info, VK_NULL_HANDLE));
 
       // Scene rendering
 
       // Wait for offscreen semaphore
-      submit_info.pWaitSemaphores = &offscreen_semaphore;
+      submit_info.pWaitSemaphores = &offscreen_semaphores[frame];
       // Signal ready with render complete semaphpre
-      submit_info.pSignalSemaphores = &renderer->semaphores.render_complete;
+      submit_info.pSignalSemaphores = &renderer->semaphores.render_complete[frame];
     }
 
     // Submit to queue
@@ -818,51 +1131,143 @@ class XRGears : public vik::Application {
 
     camera->set_view_updated_cb([this]() { view_updated = true; });
 
+    // Multiview needs the offscreen layers, the window gets both eyes side by side
+    enable_multiview = enable_distortion && enable_stereo && settings.multiview
+        && renderer->vik_device->enable_multiview;
+    if (enable_multiview) {
+      vik_log_i("Rendering stereo with VK_KHR_multiview.");
+    } else {
+      vik_log_f_if(!renderer->enabled_features.geometryShader
+                   || !renderer->enabled_features.multiViewport,
+                   "Stereo without VK_KHR_multiview needs geometry shaders and multiple viewports.");
+      vik_log_i("Rendering stereo with a geometry shader.");
+    }
+
+    // Without multiview the nodes can still skip the geometry shader
+    enable_stereo_instancing = enable_stereo && !enable_multiview
+        && settings.stereo_instancing
+        && (renderer->vik_device->enable_viewport_index_layer
+            || renderer->vik_device->enable_viewport_array2);
+    if (enable_stereo_instancing)
+      vik_log_i("Writing the viewport index in the vertex shader.");
+
     if (enable_sky)
       sky_box = new vik::SkyBox(renderer->device);
 
+    gpu_scopes.scene = renderer->gpu_profiler.add_scope("scene");
+    // Timestamps in a multiview pass take a query per view
+    if (enable_sky && !enable_multiview) {
+      gpu_scopes.sky = renderer->gpu_profiler.add_scope("sky");
+      sky_box->set_profiler(&renderer->gpu_profiler, gpu_scopes.sky);
+    }
+    if (enable_distortion)
+      gpu_scopes.warp = renderer->gpu_profiler.add_scope("warp");
+
+
+    // Start compiling the pipelines, they are built while assets load
+    init_descriptor_set_layout();
+
+    if (enable_distortion) {
+      offscreen_pass = new vik::OffscreenPass(renderer->device);
+      offscreen_pass->init_offscreen_framebuffer(renderer->vik_device, renderer->physical_device,
+                                                 enable_multiview);
+      distortion = new vik::Distortion(renderer->device);
+      distortion->init_descriptor_set_layout();
+      distortion->init_pipeline_layout();
+      distortion->init_pipeline(renderer->render_pass, &renderer->pipeline_builder,
+                                settings.distortion_type, enable_multiview);
+    }
+
+    if (settings.gear_instances > 0 || settings.merged_draws) {
+      bool multi_draw = renderer->enabled_features.multiDrawIndirect;
+      instanced_scene = new vik::InstancedScene(renderer->vik_device, multi_draw);
+      instanced_scene->init_descriptor_set_layout(enable_sky);
+    }
+
+    init_pipelines();
 
     load_assets();
     init_gears();
     prepare_vertices();
     init_uniform_buffers();
     init_descriptor_pool();
-    init_descriptor_set_layout();
 
     if (enable_distortion) {
-      offscreen_pass = new vik::OffscreenPass(renderer->device);
-      offscreen_pass->init_offscreen_framebuffer(renderer->vik_device, renderer->physical_device);
-      distortion = new vik::Distortion(renderer->device);
       distortion->init_quads(renderer->vik_device);
       distortion->init_uniform_buffer(renderer->vik_device);
       distortion->update_uniform_buffer_warp(hmd->device);
-      distortion->init_descriptor_set_layout();
-      distortion->init_pipeline_layout();
-      distortion->init_pipeline(renderer->render_pass, renderer->pipeline_cache,
-                                settings.distortion_type);
       distortion->init_descriptor_set(offscreen_pass, renderer->descriptor_pool);
     }
 
-    init_pipelines();
+    wait_for_pipelines();
     init_descriptor_set();
     build_command_buffers();
 
     if (enable_distortion)
-      build_offscreen_command_buffer();
+      init_offscreen_command_buffers();
+
+    if (settings.gear_benchmark > 0)
+      exit();
+  }
+
+  void update_text_overlay(vik::TextOverlay *overlay) {
+    uint32_t visible_count = visible_nodes.size();
+    uint32_t count = nodes.size();
+    if (instanced_scene) {
+      visible_count = instanced_scene->get_visible_count();
+      count = instanced_scene->get_instance_count();
+    }
+
+    std::string visible = "Visible: "
+        + std::to_string(visible_count) + " / " + std::to_string(count);
+    overlay->addText(visible, 5.0f, renderer->height - 25.0f,
+                     vik::TextOverlay::alignLeft);
   }
 
   virtual void render() {
-    vkDeviceWaitIdle(renderer->device);
+    if (enable_sky && sky_box->has_pending_cube_map())
+      update_sky_descriptors();
+    if (tooth_count_change != 0)
+      regenerate_gears();
+    update_uniform_buffers();
     draw();
-    vkDeviceWaitIdle(renderer->device);
-    if (!renderer->timer.animation_paused)
-      update_uniform_buffers();
   }
 
-  virtual void view_changed_cb() {
-    update_uniform_buffers();
+  // Replace the placeholder cube map once the sky has loaded
+  void update_sky_descriptors() {
+    vik_trace_zone("update_sky_descriptors");
+
+    // Older frames may still sample the placeholder through these sets
+    renderer->wait_other_frames();
+
+    sky_box->bind_cube_map();
+    for (auto& node : nodes)
+      node->update_sky_descriptor(renderer->device, sky_box);
+    if (instanced_scene)
+      instanced_scene->update_sky_descriptor(sky_box);
   }
 
+  // Regenerate the gears with the changed tooth count
+  void regenerate_gears() {
+    vik_trace_zone("regenerate_gears");
+
+    // Older frames may still draw the buffers and dispatch with the sets
+    renderer->wait_other_frames();
+
+    for (auto& node : nodes) {
+      vik::NodeGear *gear_node = dynamic_cast<vik::NodeGear*>(node);
+      if (gear_node == nullptr)
+        continue;
+      vik::GearInfo info = gear_node->get_gear_info();
+      info.tooth_count = std::max(info.tooth_count + tooth_count_change, 3);
+      gear_node->regenerate(&gear_generator, &info);
+    }
+    tooth_count_change = 0;
+  }
+
+  // Uniforms are rewritten every frame in render()
+  virtual void view_changed_cb() {}
+
   /*
   void change_eye_separation(float delta) {
     if (!enable_hmd_cam)
@@ -872,16 +1277,20 @@ class XRGears : public vik::Application {
   */
 
   virtual void key_pressed(vik::Input::Key keyCode) {
-    /*
+    // Applied in render(), after this frame's slot is free
+    if (!settings.gpu_gears || instanced_scene)
+      return;
+
     switch (keyCode) {
-      case KEY_KPADD:
-        change_eye_separation(0.005);
+      case vik::Input::Key::KPPLUS:
+        tooth_count_change++;
+        break;
+      case vik::Input::Key::KPMINUS:
+        tooth_count_change--;
         break;
-      case KEY_KPSUB:
-        change_eye_separation(-0.005);
+      default:
         break;
     }
-    */
   }
   void exit() {
     quit = true;
@@ -0,0 +1,61 @@
+#version 450
+
+#extension GL_ARB_separate_shader_objects : enable
+#extension GL_ARB_shading_language_420pack : enable
+
+layout (location = 0) in vec3 inPos;
+layout (location = 1) in vec3 inNormal;
+
+// Matches vik::InstancedScene::Instance
+struct Instance {
+	vec3 position;
+	float rotation_speed;
+	vec3 color;
+	float rotation_offset;
+	float roughness;
+	float metallic;
+	uint mesh;
+};
+
+layout (std430, binding = 0) readonly buffer Instances {
+	Instance instances[];
+};
+
+// Instance of each gl_InstanceIndex, compacted by cull.comp
+layout (std430, binding = 4) readonly buffer Visible {
+	uint visible[];
+};
+
+layout (push_constant) uniform PushConsts {
+	float time;
+} push;
+
+layout (location = 0) out vec3 outNormal;
+layout (location = 1) out vec3 outColor;
+layout (location = 2) out vec2 outMaterial;
+
+out gl_PerVertex
+{
+	vec4 gl_Position;
+};
+
+void main() 
+{
+	Instance instance = instances[visible[gl_InstanceIndex]];
+
+	// Same animation as vik::Node::update_uniform_buffer
+	float angle = radians(instance.rotation_speed * push.time * 360.0
+	                      + instance.rotation_offset);
+	float c = cos(angle);
+	float s = sin(angle);
+	mat3 rotation = mat3(c, s, 0.0,
+	                     -s, c, 0.0,
+	                     0.0, 0.0, 1.0);
+
+	outNormal = rotation * inNormal;
+	outColor = instance.color;
+	outMaterial = vec2(instance.roughness, instance.metallic);
+
+	// World space, the geometry shader projects it for each eye
+	gl_Position = vec4(rotation * inPos + instance.position, 1.0);
+}
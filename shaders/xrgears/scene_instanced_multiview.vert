@@ -0,0 +1,95 @@
+#version 450
+
+#extension GL_ARB_separate_shader_objects : enable
+#extension GL_ARB_shading_language_420pack : enable
+
+#extension GL_EXT_multiview : enable
+
+// scene_instanced.vert and multiview_instanced.geom for VK_KHR_multiview
+
+layout (location = 0) in vec3 inPos;
+layout (location = 1) in vec3 inNormal;
+
+// Matches vik::InstancedScene::Instance
+struct Instance {
+	vec3 position;
+	float rotation_speed;
+	vec3 color;
+	float rotation_offset;
+	float roughness;
+	float metallic;
+	uint mesh;
+};
+
+layout (std430, binding = 0) readonly buffer Instances {
+	Instance instances[];
+};
+
+layout (binding = 2) uniform UBOCamera {
+	mat4 projection[2];
+	mat4 view[2];
+	mat4 skyView[2];
+	vec3 position;
+} uboCamera;
+
+// Instance of each gl_InstanceIndex, compacted by cull.comp
+layout (std430, binding = 4) readonly buffer Visible {
+	uint visible[];
+};
+
+layout (push_constant) uniform PushConsts {
+	float time;
+} push;
+
+layout (location = 0) out vec3 outNormal;
+layout (location = 1) out vec3 outWorldPos;
+
+layout (location = 2) out vec3 outViewPos;
+layout (location = 3) out mat4 outInvModelView;
+
+layout (location = 10) out vec3 outViewNormal;
+layout (location = 11) out int inViewPortIndex;
+
+layout (location = 12) flat out Material {
+	float roughness;
+	float metallic;
+	vec3 color;
+} outMaterial;
+
+out gl_PerVertex
+{
+	vec4 gl_Position;
+};
+
+void main() 
+{
+	Instance instance = instances[visible[gl_InstanceIndex]];
+
+	// Same animation as vik::Node::update_uniform_buffer
+	float angle = radians(instance.rotation_speed * push.time * 360.0
+	                      + instance.rotation_offset);
+	float c = cos(angle);
+	float s = sin(angle);
+	mat3 rotation = mat3(c, s, 0.0,
+	                     -s, c, 0.0,
+	                     0.0, 0.0, 1.0);
+
+	const int index = int(gl_ViewIndex);
+	mat4 view = uboCamera.view[index];
+	vec4 worldPos = vec4(rotation * inPos + instance.position, 1.0);
+
+	outNormal = rotation * inNormal;
+	// Instances are only rotated and translated
+	outViewNormal = mat3(view) * outNormal;
+	outWorldPos = worldPos.xyz;
+	outViewPos = (view * worldPos).xyz;
+	outInvModelView = inverse(view);
+
+	gl_Position = uboCamera.projection[index] * view * worldPos;
+
+	inViewPortIndex = index;
+
+	outMaterial.roughness = instance.roughness;
+	outMaterial.metallic = instance.metallic;
+	outMaterial.color = instance.color;
+}
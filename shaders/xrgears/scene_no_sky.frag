@@ -16,12 +16,11 @@ layout (location = 11) in flat int inViewPortIndex;
 
 layout (location = 0) out vec4 outColor;
 
-layout(push_constant) uniform PushConsts {
-	layout(offset = 12) float roughness;
-	layout(offset = 16) float metallic;
-	layout(offset = 20) float r;
-	layout(offset = 24) float g;
-	layout(offset = 28) float b;
+// Passed on by the geometry shader, per node or per instance
+layout (location = 12) flat in Material {
+	float roughness;
+	float metallic;
+	vec3 color;
 } material;
 
 layout (binding = 1) uniform UBOLights {
@@ -43,7 +42,7 @@ const float PI = 3.14159265359;
 //#define ROUGHNESS_PATTERN 1
 
 vec3 materialcolor() {
-	return vec3(material.r, material.g, material.b);
+	return material.color;
 }
 
 // Normal Distribution function --------------------------------------
@@ -0,0 +1,78 @@
+#version 450
+
+#extension GL_ARB_separate_shader_objects : enable
+#extension GL_ARB_shading_language_420pack : enable
+
+#extension GL_ARB_shader_viewport_layer_array : require
+
+// Does the work of multiview.geom, each node is drawn as one instance per eye
+
+layout (location = 0) in vec3 inPos;
+layout (location = 1) in vec3 inNormal;
+
+layout (binding = 0) uniform UBOMatrices
+{
+	mat4 normal[2];
+	mat4 model;
+} uboModel;
+
+layout (binding = 2) uniform UBOCamera {
+	mat4 projection[2];
+	mat4 view[2];
+	mat4 skyView[2];
+	vec3 position;
+} uboCamera;
+
+layout(push_constant) uniform PushConsts {
+	layout(offset = 12) float roughness;
+	layout(offset = 16) float metallic;
+	layout(offset = 20) float r;
+	layout(offset = 24) float g;
+	layout(offset = 28) float b;
+} material;
+
+layout (location = 0) out vec3 outNormal;
+layout (location = 1) out vec3 outWorldPos;
+
+layout (location = 2) out vec3 outViewPos;
+layout (location = 3) out mat4 outInvModelView;
+
+layout (location = 10) out vec3 outViewNormal;
+layout (location = 11) out int inViewPortIndex;
+
+layout (location = 12) flat out Material {
+	float roughness;
+	float metallic;
+	vec3 color;
+} outMaterial;
+
+out gl_PerVertex
+{
+	vec4 gl_Position;
+};
+
+void main() 
+{
+	// Even instances go to the left eye, odd ones to the right
+	const int view = gl_InstanceIndex & 1;
+	vec4 pos = vec4(inPos, 1.0);
+
+	outNormal = mat3(uboModel.model) * inNormal;
+	outViewNormal = (uboModel.normal[view] * vec4(inNormal, 1)).xyz;
+
+	vec4 worldPos = uboModel.model * pos;
+	outWorldPos = worldPos.xyz;
+
+	mat4 modelView = uboCamera.view[view] * uboModel.model;
+	outViewPos = (modelView * pos).xyz;
+	outInvModelView = inverse(uboCamera.view[view]);
+
+	gl_Position = uboCamera.projection[view] * modelView * pos;
+
+	gl_ViewportIndex = view;
+	inViewPortIndex = view;
+
+	outMaterial.roughness = material.roughness;
+	outMaterial.metallic = material.metallic;
+	outMaterial.color = vec3(material.r, material.g, material.b);
+}
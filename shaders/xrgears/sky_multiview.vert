@@ -0,0 +1,29 @@
+#version 450
+
+#extension GL_EXT_multiview : enable
+
+// sky.vert and sky.geom for VK_KHR_multiview
+
+layout (location = 0) in vec3 inPos;
+layout (location = 1) in vec3 inNormal;
+
+layout (binding = 2) uniform UBOCamera {
+	mat4 projection[2];
+	mat4 view[2];
+	mat4 skyView[2];
+	vec3 position;
+} uboCamera;
+
+layout (location = 0) out vec3 outUVW;
+
+out gl_PerVertex
+{
+	vec4 gl_Position;
+};
+
+void main() 
+{
+	outUVW = inPos;
+	gl_Position = uboCamera.projection[gl_ViewIndex]
+	            * uboCamera.skyView[gl_ViewIndex] * vec4(inPos, 1.0);
+}
@@ -0,0 +1,283 @@
+/*
+ * vik-cook
+ *
+ * Copyright 2017-2018 Collabora Ltd.
+ *
+ * Authors: Lubosz Sarnecki <lubosz.sarnecki@collabora.com>
+ * SPDX-License-Identifier: MIT
+ *
+ * Converts models and cube maps into an asset pack that vitamin-k maps
+ * and uploads from without parsing the source files.
+ */
+
+#include <getopt.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include <gli/gli.hpp>
+
+#include <string>
+#include <vector>
+
+#include "render/vikModel.hpp"
+#include "system/vikAssetPack.hpp"
+#include "system/vikAssets.hpp"
+#include "system/vikLog.hpp"
+
+class PackWriter {
+  std::vector<uint8_t> data;
+  std::vector<vik::PackEntry> entries;
+
+ public:
+  PackWriter() {
+    vik::PackHeader header = {};
+    append(&header, sizeof(header));
+  }
+
+  uint64_t append(const void *blob, uint64_t size) {
+    uint64_t offset = data.size();
+    data.resize(offset + size);
+    memcpy(data.data() + offset, blob, size);
+    // Keep every blob aligned for reading in place
+    uint64_t aligned = (data.size() + vik::PACK_ALIGNMENT - 1)
+        & ~(vik::PACK_ALIGNMENT - 1);
+    data.resize(aligned);
+    return offset;
+  }
+
+  void add_entry(const std::string &path, uint32_t type,
+                 uint64_t offset, uint64_t size) {
+    std::string name = vik::AssetPack::get_name(path);
+    vik_log_f_if(name.size() >= sizeof(vik::PackEntry::name),
+                 "Asset name %s is too long.", name.c_str());
+
+    struct stat st;
+    vik_log_f_if(stat(path.c_str(), &st) != 0,
+                 "Could not stat %s.", path.c_str());
+
+    vik::PackEntry entry = {};
+    strncpy(entry.name, name.c_str(), sizeof(entry.name) - 1);
+    entry.type = type;
+    entry.source_size = st.st_size;
+    entry.source_mtime = st.st_mtime;
+    entry.offset = offset;
+    entry.size = size;
+    entries.push_back(entry);
+
+    vik_log_i("Cooked %s (%ld bytes)", name.c_str(), size);
+  }
+
+  void write(const std::string &path) {
+    uint64_t index_offset = append(entries.data(),
+                                   entries.size() * sizeof(vik::PackEntry));
+
+    vik::PackHeader *header = (vik::PackHeader *) data.data();
+    memcpy(header->magic, vik::PACK_MAGIC, sizeof(vik::PACK_MAGIC));
+    header->version = vik::PACK_VERSION;
+    header->entry_count = entries.size();
+    header->index_offset = index_offset;
+
+    FILE *file = fopen(path.c_str(), "wb");
+    vik_log_f_if(file == nullptr, "Could not open %s.", path.c_str());
+    size_t written = fwrite(data.data(), 1, data.size(), file);
+    fclose(file);
+    vik_log_f_if(written != data.size(), "Could not write %s.", path.c_str());
+
+    vik_log_i("Wrote %zu entries to %s (%zu bytes)",
+              entries.size(), path.c_str(), data.size());
+  }
+};
+
+static vik::VertexLayout parse_layout(const std::string &str) {
+  std::vector<vik::Component> components;
+  for (char c : str) {
+    switch (c) {
+      case 'p': components.push_back(vik::VERTEX_COMPONENT_POSITION); break;
+      case 'n': components.push_back(vik::VERTEX_COMPONENT_NORMAL); break;
+      case 'c': components.push_back(vik::VERTEX_COMPONENT_COLOR); break;
+      case 'u': components.push_back(vik::VERTEX_COMPONENT_UV); break;
+      case 't': components.push_back(vik::VERTEX_COMPONENT_TANGENT); break;
+      case 'b': components.push_back(vik::VERTEX_COMPONENT_BITANGENT); break;
+      case 'f': components.push_back(vik::VERTEX_COMPONENT_DUMMY_FLOAT); break;
+      case 'v': components.push_back(vik::VERTEX_COMPONENT_DUMMY_VEC4); break;
+      default:
+        vik_log_f("Unknown vertex component '%c' in layout %s.", c, str.c_str());
+    }
+  }
+  vik_log_f_if(components.empty()
+               || components.size() > vik::PACK_MAX_COMPONENTS,
+               "Layout %s needs 1 to %d components.",
+               str.c_str(), vik::PACK_MAX_COMPONENTS);
+  return vik::VertexLayout(components);
+}
+
+static void cook_model(PackWriter *pack, const std::string &path,
+                       vik::VertexLayout layout, float scale) {
+  vik::ModelCreateInfo info(scale, 1.0f, 0.0f);
+  const int flags = vik::Model::defaultFlags;
+
+  vik::Model model;
+  std::vector<float> vertices;
+  std::vector<uint32_t> indices;
+  vik_log_f_if(!model.loadVertices(path, layout, &info,
+                                   &vertices, &indices, flags),
+               "Could not load model %s.", path.c_str());
+
+  std::vector<vik::PackModelPart> parts;
+  for (auto& part : model.parts)
+    parts.push_back({
+      .vertex_base = part.vertexBase,
+      .vertex_count = part.vertexCount,
+      .index_base = part.indexBase,
+      .index_count = part.indexCount
+    });
+
+  vik::PackModel cooked = {};
+  cooked.import_flags = flags;
+  cooked.component_count = layout.components.size();
+  for (uint32_t i = 0; i < cooked.component_count; i++)
+    cooked.components[i] = layout.components[i];
+  memcpy(cooked.scale, &info.scale, sizeof(cooked.scale));
+  memcpy(cooked.uvscale, &info.uvscale, sizeof(cooked.uvscale));
+  memcpy(cooked.center, &info.center, sizeof(cooked.center));
+  memcpy(cooked.dim_min, &model.dim.min, sizeof(cooked.dim_min));
+  memcpy(cooked.dim_max, &model.dim.max, sizeof(cooked.dim_max));
+
+  cooked.vertex_count = model.vertexCount;
+  cooked.index_count = model.indexCount;
+  cooked.part_count = parts.size();
+  cooked.index_type = model.indexType;
+
+  cooked.vertex_size = vertices.size() * sizeof(float);
+  cooked.vertex_offset = pack->append(vertices.data(), cooked.vertex_size);
+  if (model.indexType == VK_INDEX_TYPE_UINT16) {
+    std::vector<uint16_t> short_indices(indices.begin(), indices.end());
+    cooked.index_size = short_indices.size() * sizeof(uint16_t);
+    cooked.index_offset = pack->append(short_indices.data(), cooked.index_size);
+  } else {
+    cooked.index_size = indices.size() * sizeof(uint32_t);
+    cooked.index_offset = pack->append(indices.data(), cooked.index_size);
+  }
+  cooked.parts_offset = pack->append(parts.data(),
+                                     parts.size() * sizeof(vik::PackModelPart));
+
+  uint64_t offset = pack->append(&cooked, sizeof(cooked));
+  pack->add_entry(path, vik::PACK_ENTRY_MODEL, offset, sizeof(cooked));
+}
+
+static void cook_cube_map(PackWriter *pack, const std::string &path) {
+  gli::texture_cube tex_cube(gli::load(path));
+  vik_log_f_if(tex_cube.empty(), "Could not load cube map %s.", path.c_str());
+
+  // Same order as the faces and levels are stored in the data
+  std::vector<vik::PackRegion> regions;
+  uint64_t offset = 0;
+  for (uint32_t face = 0; face < 6; face++) {
+    for (uint32_t level = 0; level < tex_cube.levels(); level++) {
+      regions.push_back({
+        .offset = offset,
+        .size = tex_cube[face][level].size(),
+        .layer = face,
+        .level = level,
+        .width = static_cast<uint32_t>(tex_cube[face][level].extent().x),
+        .height = static_cast<uint32_t>(tex_cube[face][level].extent().y)
+      });
+      offset += tex_cube[face][level].size();
+    }
+  }
+
+  vik::PackTexture cooked = {};
+  cooked.width = tex_cube.extent().x;
+  cooked.height = tex_cube.extent().y;
+  cooked.levels = tex_cube.levels();
+  cooked.layers = 6;
+  cooked.region_count = regions.size();
+  cooked.format = static_cast<uint32_t>(tex_cube.format());
+  cooked.data_size = tex_cube.size();
+  cooked.data_offset = pack->append(tex_cube.data(), cooked.data_size);
+  cooked.regions_offset = pack->append(regions.data(),
+                                       regions.size() * sizeof(vik::PackRegion));
+
+  uint64_t entry_offset = pack->append(&cooked, sizeof(cooked));
+  pack->add_entry(path, vik::PACK_ENTRY_CUBE_MAP, entry_offset, sizeof(cooked));
+}
+
+static void print_help() {
+  printf("A tool to cook vitamin-k assets into a mappable pack\n"
+         "\n"
+         "Usage: vik-cook [options]\n"
+         "\n"
+         "Options:\n"
+         "      --layout L     Vertex layout of the following models, one letter per component\n"
+         "                     p position, n normal, c color, u uv, t tangent, b bitangent,\n"
+         "                     f dummy float, v dummy vec4 (default: pn)\n"
+         "      --scale S      Scale of the following models (default: 1.0)\n"
+         "      --model F      Cook a model, relative to the asset path\n"
+         "      --cube-map F   Cook a cube map, relative to the asset path\n"
+         "  -o, --output F     Pack to write (default: %sassets.pack)\n"
+         "  -h, --help         Show this help\n"
+         "\n"
+         "Run it from the same directory as the application. xrgears uses:\n"
+         "  vik-cook --scale 0.25 --model models/teapot.dae\n"
+         "           --scale 10.0 --model models/cube.obj\n"
+         "           --cube-map textures/cubemaps/sdr/cubemap_yokohama_bc3_unorm.ktx\n",
+         vik::Assets::get_asset_path().c_str());
+}
+
+int main(int argc, char *argv[]) {
+  PackWriter pack;
+  std::string output = vik::Assets::get_asset_path() + "assets.pack";
+  vik::VertexLayout layout = parse_layout("pn");
+  float scale = 1.0f;
+  uint32_t cooked_count = 0;
+
+  struct option long_options[] = {
+    {"layout", 1, 0, 0},
+    {"scale", 1, 0, 0},
+    {"model", 1, 0, 0},
+    {"cube-map", 1, 0, 0},
+    {"output", 1, 0, 0},
+    {"help", 0, 0, 0},
+    {0, 0, 0, 0}
+  };
+
+  int opt;
+  int option_index = -1;
+  while ((opt = getopt_long(argc, argv, "ho:",
+                            long_options, &option_index)) != -1) {
+    if (opt == '?' || opt == ':')
+      return 1;
+
+    std::string optname;
+    if (option_index != -1)
+      optname = long_options[option_index].name;
+    option_index = -1;
+
+    if (opt == 'h' || optname == "help") {
+      print_help();
+      return 0;
+    } else if (opt == 'o' || optname == "output") {
+      output = optarg;
+    } else if (optname == "layout") {
+      layout = parse_layout(optarg);
+    } else if (optname == "scale") {
+      scale = std::stof(optarg);
+    } else if (optname == "model") {
+      cook_model(&pack, vik::Assets::get_asset_path() + optarg, layout, scale);
+      cooked_count++;
+    } else if (optname == "cube-map") {
+      cook_cube_map(&pack, vik::Assets::get_asset_path() + optarg);
+      cooked_count++;
+    }
+  }
+
+  if (cooked_count == 0) {
+    print_help();
+    return 1;
+  }
+
+  pack.write(output);
+
+  return 0;
+}
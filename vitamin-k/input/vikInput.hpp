@@ -30,6 +30,8 @@ class Input {
     KPPLUS,
     KPMINUS,
     F1,
+    F2,
+    F3,
     W,
     A,
     S,
@@ -10,11 +10,13 @@
 
 #pragma once
 
+#include <algorithm>
 #include <vector>
 
 #include "vulkan/vulkan.h"
 
 #include "vikTools.hpp"
+#include "vikMemoryAllocator.hpp"
 
 namespace vik {
 /**
@@ -25,6 +27,9 @@ struct Buffer {
   VkDevice device;
   VkBuffer buffer = VK_NULL_HANDLE;
   VkDeviceMemory memory = VK_NULL_HANDLE;
+  /** @brief Range of memory the buffer is bound to, owned by the allocator */
+  Allocation allocation;
+  MemoryAllocator *allocator = nullptr;
   VkDescriptorBufferInfo descriptor;
   VkDeviceSize size = 0;
   VkDeviceSize alignment = 0;
@@ -38,36 +43,25 @@ struct Buffer {
   /**
     * Map a memory range of this buffer. If successful, mapped points to the specified buffer range.
     *
+    * @note Host visible memory blocks stay mapped, so this only returns a pointer into the block
+    *
     * @param size (Optional) Size of the memory range to map. Pass VK_WHOLE_SIZE to map the complete buffer range.
     * @param offset (Optional) Byte offset from beginning
     *
-    * @return VkResult of the buffer mapping call
+    * @return VK_ERROR_MEMORY_MAP_FAILED if the memory is not host visible
     */
   VkResult map(VkDeviceSize size = VK_WHOLE_SIZE, VkDeviceSize offset = 0) {
-    return vkMapMemory(device, memory, offset, size, 0, &mapped);
+    if (allocation.mapped == nullptr)
+      return VK_ERROR_MEMORY_MAP_FAILED;
+    mapped = (uint8_t *) allocation.mapped + offset;
+    return VK_SUCCESS;
   }
 
   /**
     * Unmap a mapped memory range
-    *
-    * @note Does not return a result as vkUnmapMemory can't fail
     */
   void unmap() {
-    if (mapped) {
-      vkUnmapMemory(device, memory);
-      mapped = nullptr;
-    }
-  }
-
-  /**
-    * Attach the allocated memory block to the buffer
-    *
-    * @param offset (Optional) Byte offset (from the beginning) for the memory region to bind
-    *
-    * @return VkResult of the bindBufferMemory call
-    */
-  VkResult bind(VkDeviceSize offset = 0) {
-    return vkBindBufferMemory(device, buffer, memory, offset);
+    mapped = nullptr;
   }
 
   /**
@@ -106,12 +100,7 @@ struct Buffer {
     * @return VkResult of the flush call
     */
   VkResult flush(VkDeviceSize size = VK_WHOLE_SIZE, VkDeviceSize offset = 0) {
-    VkMappedMemoryRange mappedRange = {
-      .sType = VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE,
-      .memory = memory,
-      .offset = offset,
-      .size = size
-    };
+    VkMappedMemoryRange mappedRange = get_mapped_range(size, offset);
 
     return vkFlushMappedMemoryRanges(device, 1, &mappedRange);
   }
@@ -127,12 +116,7 @@ struct Buffer {
     * @return VkResult of the invalidate call
     */
   VkResult invalidate(VkDeviceSize size = VK_WHOLE_SIZE, VkDeviceSize offset = 0) {
-    VkMappedMemoryRange mappedRange = {
-      .sType = VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE,
-      .memory = memory,
-      .offset = offset,
-      .size = size
-    };
+    VkMappedMemoryRange mappedRange = get_mapped_range(size, offset);
     return vkInvalidateMappedMemoryRanges(device, 1, &mappedRange);
   }
 
@@ -142,8 +126,36 @@ struct Buffer {
   void destroy() {
     if (buffer)
       vkDestroyBuffer(device, buffer, nullptr);
-    if (memory)
-      vkFreeMemory(device, memory, nullptr);
+    if (allocator)
+      allocator->free(allocation);
+    buffer = VK_NULL_HANDLE;
+    memory = VK_NULL_HANDLE;
+    allocator = nullptr;
+  }
+
+ private:
+  /**
+    * Range of the memory block covering a range of the buffer
+    *
+    * @note The start is aligned down and the end up to nonCoherentAtomSize, clamped to the buddy range of the allocation
+    */
+  VkMappedMemoryRange get_mapped_range(VkDeviceSize size, VkDeviceSize offset) {
+    VkDeviceSize atom = allocation.non_coherent_atom_size;
+    VkDeviceSize start = allocation.offset + offset;
+    VkDeviceSize end = size == VK_WHOLE_SIZE
+        ? allocation.offset + allocation.size
+        : start + size;
+    VkDeviceSize range_end = allocation.offset + allocation.get_range_size();
+
+    start = start / atom * atom;
+    end = std::min((end + atom - 1) / atom * atom, range_end);
+
+    return {
+      .sType = VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE,
+      .memory = memory,
+      .offset = start,
+      .size = end - start
+    };
   }
 };
 }  // namespace vik
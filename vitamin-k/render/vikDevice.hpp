@@ -20,6 +20,9 @@
 
 #include "vikTools.hpp"
 #include "vikBuffer.hpp"
+#include "vikMemoryAllocator.hpp"
+#include "vikStagingRing.hpp"
+#include "vikUploadBatcher.hpp"
 
 namespace vik {
 class Device {
@@ -42,8 +45,26 @@ class Device {
   /** @brief Default command pool for the graphics queue family index */
   VkCommandPool commandPool = VK_NULL_HANDLE;
 
+  /** @brief Sub-allocates the memory of buffers and images from large blocks */
+  MemoryAllocator allocator;
+
+  /** @brief Persistently mapped staging memory shared by all uploads */
+  StagingRing staging_ring;
+  VkDeviceSize staging_ring_size = 64 * 1024 * 1024;
+
+  /** @brief Batches staging uploads on the transfer queue */
+  UploadBatcher upload_batcher;
+
   /** @brief Set to true when the debug marker extension is detected */
   bool enable_debug_markers = false;
+  bool enable_calibrated_timestamps = false;
+  bool enable_draw_indirect_count = false;
+  // The multiview feature, queried before the device is created
+  bool multiview_supported = false;
+  bool enable_multiview = false;
+  // Viewport index can be written in the vertex shader
+  bool enable_viewport_index_layer = false;
+  bool enable_viewport_array2 = false;
 
   /** @brief Contains queue family indices */
   struct {
@@ -96,6 +117,9 @@ class Device {
     * @note Frees the logical device
     */
   ~Device() {
+    upload_batcher.destroy();
+    staging_ring.destroy();
+    allocator.destroy();
     if (commandPool)
       vkDestroyCommandPool(logicalDevice, commandPool, nullptr);
     if (logicalDevice)
@@ -184,7 +208,7 @@ class Device {
   VkResult createLogicalDevice(VkPhysicalDeviceFeatures enabledFeatures,
                                const std::vector<const char*> &window_extensions,
                                bool useSwapChain = true,
-                               VkQueueFlags requestedQueueTypes = VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT) {
+                               VkQueueFlags requestedQueueTypes = VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT | VK_QUEUE_TRANSFER_BIT) {
     // Desired queues need to be requested upon logical device creation
     // Due to differing queue family configurations of Vulkan implementations this can be a bit tricky, especially if the application
     // requests different queue types
@@ -256,9 +280,24 @@ class Device {
       deviceExtensions.push_back(VK_KHR_SWAPCHAIN_EXTENSION_NAME);
     }
 
-    enable_if_supported(&deviceExtensions, VK_KHR_MULTIVIEW_EXTENSION_NAME);
+    enable_multiview =
+        enable_if_supported(&deviceExtensions, VK_KHR_MULTIVIEW_EXTENSION_NAME)
+        && multiview_supported;
     enable_if_supported(&deviceExtensions, VK_NVX_MULTIVIEW_PER_VIEW_ATTRIBUTES_EXTENSION_NAME);
-    enable_if_supported(&deviceExtensions, VK_NV_VIEWPORT_ARRAY2_EXTENSION_NAME);
+    enable_viewport_array2 =
+        enable_if_supported(&deviceExtensions, VK_NV_VIEWPORT_ARRAY2_EXTENSION_NAME);
+#ifdef VK_EXT_shader_viewport_index_layer
+    enable_viewport_index_layer =
+        enable_if_supported(&deviceExtensions, VK_EXT_SHADER_VIEWPORT_INDEX_LAYER_EXTENSION_NAME);
+#endif
+#ifdef VK_EXT_calibrated_timestamps
+    enable_calibrated_timestamps =
+        enable_if_supported(&deviceExtensions, VK_EXT_CALIBRATED_TIMESTAMPS_EXTENSION_NAME);
+#endif
+#ifdef VK_KHR_draw_indirect_count
+    enable_draw_indirect_count =
+        enable_if_supported(&deviceExtensions, VK_KHR_DRAW_INDIRECT_COUNT_EXTENSION_NAME);
+#endif
 
     for (auto window_ext : window_extensions)
       enable_if_supported(&deviceExtensions, window_ext);
@@ -270,6 +309,13 @@ class Device {
       .pEnabledFeatures = &enabledFeatures
     };
 
+    VkPhysicalDeviceMultiviewFeaturesKHR multiview_features = {
+      .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MULTIVIEW_FEATURES_KHR,
+      .multiview = VK_TRUE
+    };
+    if (enable_multiview)
+      deviceCreateInfo.pNext = &multiview_features;
+
     // Enable the debug marker extension if it is present (likely meaning a debugging tool is present)
     // enableDebugMarkers = enableIfSupported(&deviceExtensions, VK_EXT_DEBUG_MARKER_EXTENSION_NAME);
 
@@ -281,72 +327,18 @@ class Device {
     VkResult result = vkCreateDevice(physicalDevice, &deviceCreateInfo,
                                      nullptr, &logicalDevice);
 
-    if (result == VK_SUCCESS)
+    if (result == VK_SUCCESS) {
       // Create a default command pool for graphics command buffers
       commandPool = createCommandPool(queueFamilyIndices.graphics);
-
-    return result;
-  }
-
-  /**
-    * Create a buffer on the device
-    *
-    * @param usageFlags Usage flag bitmask for the buffer (i.e. index, vertex, uniform buffer)
-    * @param memoryPropertyFlags Memory properties for this buffer (i.e. device local, host visible, coherent)
-    * @param size Size of the buffer in byes
-    * @param buffer Pointer to the buffer handle acquired by the function
-    * @param memory Pointer to the memory handle acquired by the function
-    * @param data Pointer to the data that should be copied to the buffer after creation (optional, if not set, no data is copied over)
-    *
-    * @return VK_SUCCESS if buffer handle and memory have been created and (optionally passed) data has been copied
-    */
-  VkResult createBuffer(VkBufferUsageFlags usageFlags, VkMemoryPropertyFlags memoryPropertyFlags, VkDeviceSize size, VkBuffer *buffer, VkDeviceMemory *memory, void *data = nullptr) {
-    // Create the buffer handle
-    VkBufferCreateInfo bufferCreateInfo = {
-      .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
-      .size = size,
-      .usage = usageFlags,
-      .sharingMode = VK_SHARING_MODE_EXCLUSIVE
-    };
-    vik_log_check(vkCreateBuffer(logicalDevice, &bufferCreateInfo, nullptr, buffer));
-
-    // Create the memory backing up the buffer handle
-    VkMemoryRequirements memReqs;
-    vkGetBufferMemoryRequirements(logicalDevice, *buffer, &memReqs);
-
-    VkMemoryAllocateInfo memAlloc {
-      .sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
-      .allocationSize = memReqs.size,
-      // Find a memory type index that fits the properties of the buffer
-      .memoryTypeIndex = getMemoryType(memReqs.memoryTypeBits, memoryPropertyFlags)
-    };
-
-    vik_log_check(vkAllocateMemory(logicalDevice, &memAlloc, nullptr, memory));
-
-    // If a pointer to the buffer data has been passed, map the buffer and copy over the data
-    if (data != nullptr) {
-      void *mapped;
-      vik_log_check(vkMapMemory(logicalDevice, *memory, 0, size, 0, &mapped));
-      memcpy(mapped, data, size);
-      // If host coherency hasn't been requested, do a manual flush to make writes visible
-      if ((memoryPropertyFlags & VK_MEMORY_PROPERTY_HOST_COHERENT_BIT) == 0) {
-
-        VkMappedMemoryRange mappedRange = {
-          .sType = VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE,
-          .memory = *memory,
-          .offset = 0,
-          .size = size
-        };
-
-        vkFlushMappedMemoryRanges(logicalDevice, 1, &mappedRange);
-      }
-      vkUnmapMemory(logicalDevice, *memory);
+      allocator.init(logicalDevice, properties, memoryProperties);
+      staging_ring.init(logicalDevice, memoryProperties, staging_ring_size);
+      upload_batcher.init(logicalDevice, &staging_ring,
+                          queueFamilyIndices.transfer,
+                          queueFamilyIndices.graphics,
+                          queueFamilyProperties[queueFamilyIndices.transfer]);
     }
 
-    // Attach the memory to the buffer object
-    vik_log_check(vkBindBufferMemory(logicalDevice, *buffer, *memory, 0));
-
-    return VK_SUCCESS;
+    return result;
   }
 
   void create_and_map(Buffer *buffer, VkDeviceSize size) {
@@ -383,22 +375,13 @@ class Device {
     };
     vik_log_check(vkCreateBuffer(logicalDevice, &bufferCreateInfo, nullptr, &buffer->buffer));
 
-    // Create the memory backing up the buffer handle
-    VkMemoryRequirements memReqs;
-    vkGetBufferMemoryRequirements(logicalDevice, buffer->buffer, &memReqs);
+    // Sub-allocate the memory backing up the buffer handle and attach it
+    buffer->allocator = &allocator;
+    buffer->allocation = allocator.allocate_buffer(buffer->buffer, memoryPropertyFlags);
+    buffer->memory = buffer->allocation.memory;
 
-    VkMemoryAllocateInfo memAlloc {
-      .sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
-      .allocationSize = memReqs.size,
-      // Find a memory type index that fits the properties of the buffer
-      .memoryTypeIndex = getMemoryType(memReqs.memoryTypeBits, memoryPropertyFlags)
-    };
-
-    vik_log_check(vkAllocateMemory(logicalDevice, &memAlloc,
-                                   nullptr, &buffer->memory));
-
-    buffer->alignment = memReqs.alignment;
-    buffer->size = memAlloc.allocationSize;
+    buffer->alignment = buffer->allocation.alignment;
+    buffer->size = buffer->allocation.size;
     buffer->usageFlags = usageFlags;
     buffer->memoryPropertyFlags = memoryPropertyFlags;
 
@@ -406,14 +389,16 @@ class Device {
     if (data != nullptr) {
       vik_log_check(buffer->map());
       memcpy(buffer->mapped, data, size);
+      // If host coherency hasn't been requested, do a manual flush to make writes visible
+      if ((memoryPropertyFlags & VK_MEMORY_PROPERTY_HOST_COHERENT_BIT) == 0)
+        vik_log_check(buffer->flush());
       buffer->unmap();
     }
 
     // Initialize a default descriptor that covers the whole buffer size
     buffer->setupDescriptor();
 
-    // Attach the memory to the buffer object
-    return buffer->bind();
+    return VK_SUCCESS;
   }
 
   /**
@@ -558,6 +543,23 @@ class Device {
                      extension) != supported_extensions.end();
   }
 
+  // Requires VK_KHR_get_physical_device_properties2 on the instance
+  void query_multiview_support(VkInstance instance) {
+    PFN_vkGetPhysicalDeviceFeatures2KHR fpGetPhysicalDeviceFeatures2KHR;
+    GET_INSTANCE_PROC_ADDR(instance, GetPhysicalDeviceFeatures2KHR);
+
+    VkPhysicalDeviceMultiviewFeaturesKHR multi_view_features = {
+      .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MULTIVIEW_FEATURES_KHR
+    };
+    VkPhysicalDeviceFeatures2KHR device_features = {
+      .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2_KHR,
+      .pNext = &multi_view_features
+    };
+    fpGetPhysicalDeviceFeatures2KHR(physicalDevice, &device_features);
+
+    multiview_supported = multi_view_features.multiview;
+  }
+
   void print_multiview_properties(VkInstance instance) {
     PFN_vkGetPhysicalDeviceFeatures2KHR fpGetPhysicalDeviceFeatures2KHR;
     PFN_vkGetPhysicalDeviceProperties2KHR fpGetPhysicalDeviceProperties2KHR;
@@ -21,6 +21,7 @@
 
 #include "vikOffscreenPass.hpp"
 #include "vikShader.hpp"
+#include "vikPipelineBuilder.hpp"
 
 #include "../system/vikSettings.hpp"
 
@@ -42,7 +43,8 @@ class Distortion {
   } ubo_data;
 
   VkPipelineLayout pipeline_layout;
-  VkPipeline pipeline;
+  VkPipeline pipeline = VK_NULL_HANDLE;
+  std::shared_future<VkPipeline> pipeline_future;
 
   VkDescriptorSetLayout descriptor_set_layout;
   VkDescriptorSet descriptor_set;
@@ -62,9 +64,11 @@ class Distortion {
     vkDestroyPipelineLayout(device, pipeline_layout, nullptr);
   }
 
+  // With multiview the eyes are sampled from the layers of the offscreen image
   void init_pipeline(const VkRenderPass& render_pass,
-                     const VkPipelineCache& pipeline_cache,
-                     Settings::DistortionType distortion_type) {
+                     PipelineBuilder *pipeline_builder,
+                     Settings::DistortionType distortion_type,
+                     bool multiview) {
     VkPipelineInputAssemblyStateCreateInfo input_assembly_state = {
       .sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO,
       .topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST,
@@ -160,25 +164,28 @@ class Distortion {
 
     switch (distortion_type) {
       case Settings::DistortionType::DISTORTION_TYPE_PANOTOOLS:
-        fragment_shader_name = "distortion/panotools.frag.spv";
+        fragment_shader_name = "distortion/panotools";
         break;
       case Settings::DistortionType::DISTORTION_TYPE_VIVE:
-        fragment_shader_name = "distortion/vive.frag.spv";
+        fragment_shader_name = "distortion/vive";
         break;
       default:
-        fragment_shader_name = "distortion/panotools.frag.spv";
+        fragment_shader_name = "distortion/panotools";
     }
 
+    if (multiview)
+      fragment_shader_name += "_multiview";
+    fragment_shader_name += ".frag.spv";
+
     shader_stages[1] = vik::Shader::load(device,
                                          fragment_shader_name,
                                          VK_SHADER_STAGE_FRAGMENT_BIT);
 
-    vik_log_check(vkCreateGraphicsPipelines(device, pipeline_cache, 1,
-                                            &pipeline_info, nullptr,
-                                            &pipeline));
+    pipeline_future = pipeline_builder->build(pipeline_info);
+  }
 
-    vkDestroyShaderModule(device, shader_stages[0].module, nullptr);
-    vkDestroyShaderModule(device, shader_stages[1].module, nullptr);
+  void wait_for_pipeline() {
+    pipeline = pipeline_future.get();
   }
 
   VkWriteDescriptorSet get_uniform_write_descriptor_set(uint32_t binding) {
@@ -294,9 +301,8 @@ class Distortion {
     vik_log_check(vik_device->createBuffer(
                     VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
                     VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                    &quad.vertices,
                     vertex_buffer.size() * sizeof(Vertex),
-                    &quad.vertices.buffer,
-                    &quad.vertices.memory,
                     vertex_buffer.data()));
 
     // Setup indices
@@ -307,9 +313,8 @@ class Distortion {
     vik_log_check(vik_device->createBuffer(
                     VK_BUFFER_USAGE_INDEX_BUFFER_BIT,
                     VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                    &quad.indices,
                     index_buffer.size() * sizeof(uint32_t),
-                    &quad.indices.buffer,
-                    &quad.indices.memory,
                     index_buffer.data()));
 
     quad.device = device;
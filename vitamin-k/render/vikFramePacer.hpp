@@ -0,0 +1,287 @@
+/*
+ * vitamin-k
+ *
+ * Copyright 2017-2018 Collabora Ltd.
+ *
+ * Authors: Lubosz Sarnecki <lubosz.sarnecki@collabora.com>
+ * SPDX-License-Identifier: MIT
+ */
+
+#pragma once
+
+#include <vulkan/vulkan.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../system/vikLog.hpp"
+
+namespace vik {
+
+/*
+ * Just-in-time frame start scheduling.
+ *
+ * Without pacing the CPU starts a frame right after the previous present
+ * and the result waits in the FIFO queue for the next vblank, so input and
+ * pose are sampled up to a refresh period too early.
+ *
+ * The pacer learns the refresh period from the points where the swap chain
+ * blocks us, which happen right after a flip. It then tracks the CPU cost
+ * (frame start to submit) and the GPU tail (submit to frame fence) and
+ * sleeps until the latest start that still makes the next vblank.
+ * Blocking in the swap chain again means the prediction drifted, in which
+ * case the vblank phase is re-anchored.
+ */
+class FramePacer {
+  typedef std::chrono::steady_clock clock;
+  typedef std::chrono::duration<double, std::milli> milliseconds;
+
+ public:
+  struct Stats {
+    double period_ms;
+    double cpu_ms;
+    double gpu_ms;
+    double sleep_ms;
+    uint32_t resyncs;
+  };
+
+  bool enabled = false;
+
+  // Frames rendered unpaced at start up to learn the refresh period
+  uint32_t calibration_frames = 120;
+  // Blocking longer than this in acquire means we hit the display cadence
+  double block_threshold_ms = 1.0;
+  // Headroom on top of the measured frame cost
+  double safety_margin_ms = 1.5;
+
+ private:
+  bool calibrated = false;
+  uint32_t frames = 0;
+
+  double period_ms = 0.0;
+  double cpu_ms = 0.0;
+  double gpu_ms = 0.0;
+  double sleep_ms = 0.0;
+  // Sleep and swap chain blocking of the current frame
+  double idle_ms = 0.0;
+  uint32_t resyncs = 0;
+
+  std::vector<double> calibration_intervals;
+
+  clock::time_point vblank_anchor;
+  clock::time_point last_target_vblank;
+  bool has_anchor = false;
+
+  clock::time_point frame_start;
+  clock::time_point acquire_start;
+  clock::time_point submit_time;
+  double blocked_ms = 0.0;
+  bool submitted = false;
+
+ public:
+  void init(bool enable, VkPresentModeKHR present_mode) {
+    enabled = enable;
+    if (!enabled)
+      return;
+
+    if (present_mode != VK_PRESENT_MODE_FIFO_KHR
+        && present_mode != VK_PRESENT_MODE_FIFO_RELAXED_KHR) {
+      vik_log_w("Frame pacing needs a FIFO present mode, disabling it.");
+      enabled = false;
+    }
+  }
+
+  /*
+   * Called at the start of the frame, before input is polled.
+   * last_fence signals once the previously submitted frame is done on the
+   * GPU. It is waited for with a timeout of the planned start, which gives
+   * the GPU tail without stalling the pipeline.
+   */
+  void wait_for_frame_start(VkDevice device, VkFence last_fence) {
+    sleep_ms = 0.0;
+
+    if (!enabled || !calibrated || !has_anchor) {
+      measure_gpu_tail(device, last_fence, clock::now());
+      frame_start = clock::now();
+      idle_ms = 0.0;
+      return;
+    }
+
+    double budget_ms = cpu_ms + gpu_ms + safety_margin_ms;
+    clock::time_point now = clock::now();
+
+    // Aim for the first vblank after the one we targeted last, that we can
+    // still make when starting now
+    double since_anchor = milliseconds(now - vblank_anchor).count();
+    double vblanks = std::ceil((since_anchor + budget_ms) / period_ms);
+    clock::time_point target_vblank = vblank_anchor + to_duration(vblanks * period_ms);
+    if (milliseconds(target_vblank - last_target_vblank).count() < period_ms * 0.5)
+      target_vblank += to_duration(period_ms);
+
+    clock::time_point target_start = target_vblank - to_duration(budget_ms);
+    last_target_vblank = target_vblank;
+
+    measure_gpu_tail(device, last_fence, target_start);
+
+    if (target_start > clock::now())
+      std::this_thread::sleep_until(target_start);
+
+    frame_start = clock::now();
+    sleep_ms = milliseconds(frame_start - now).count();
+    idle_ms = sleep_ms;
+  }
+
+  // Called around the fence wait and image acquire of the frame
+  void begin_acquire() {
+    acquire_start = clock::now();
+  }
+
+  void end_acquire() {
+    clock::time_point now = clock::now();
+    blocked_ms = milliseconds(now - acquire_start).count();
+    idle_ms += blocked_ms;
+
+    if (blocked_ms < block_threshold_ms)
+      return;
+
+    // The presentation engine released an image, a flip just happened
+    if (has_anchor) {
+      double interval = milliseconds(now - vblank_anchor).count();
+      if (!calibrated)
+        calibration_intervals.push_back(interval);
+      else
+        refine_period(interval);
+      if (calibrated)
+        resyncs++;
+    }
+
+    vblank_anchor = now;
+    last_target_vblank = now;
+    has_anchor = true;
+  }
+
+  // Called once the frame is handed to the queue
+  void frame_submitted() {
+    submit_time = clock::now();
+    submitted = true;
+
+    double cpu = milliseconds(submit_time - frame_start).count() - blocked_ms;
+    cpu_ms = track_peak(cpu_ms, std::max(cpu, 0.0));
+    blocked_ms = 0.0;
+
+    frames++;
+    if (!calibrated && frames >= calibration_frames)
+      finish_calibration();
+  }
+
+  // Time the current frame spent waiting instead of working
+  double get_idle_ms() {
+    return idle_ms;
+  }
+
+  Stats get_stats() {
+    Stats stats = {
+      .period_ms = period_ms,
+      .cpu_ms = cpu_ms,
+      .gpu_ms = gpu_ms,
+      .sleep_ms = sleep_ms,
+      .resyncs = resyncs
+    };
+    return stats;
+  }
+
+  std::string get_stats_string() {
+    std::stringstream ss;
+    ss << std::fixed << std::setprecision(2);
+    if (!enabled) {
+      ss << "pacing off";
+    } else if (!calibrated) {
+      ss << "pacing: calibrating";
+    } else {
+      ss << "pacing " << period_ms << "ms: "
+         << "cpu " << cpu_ms << " gpu " << gpu_ms
+         << " sleep " << sleep_ms
+         << " resync " << resyncs;
+    }
+    return ss.str();
+  }
+
+ private:
+  static clock::duration to_duration(double ms) {
+    return std::chrono::duration_cast<clock::duration>(milliseconds(ms));
+  }
+
+  // Follows increases immediately and decays slowly,
+  // so one cheap frame doesn't make us start too late
+  static double track_peak(double estimate, double sample) {
+    return std::max(sample, estimate * 0.95 + sample * 0.05);
+  }
+
+  void measure_gpu_tail(VkDevice device, VkFence fence, clock::time_point deadline) {
+    if (!submitted)
+      return;
+    submitted = false;
+
+    // A fence that signaled before we looked only tells that the GPU was
+    // done some time since submit. That includes the CPU time in between,
+    // which would only ever grow the peak estimate, so it is no sample.
+    VkResult err = vkGetFenceStatus(device, fence);
+    if (err == VK_SUCCESS)
+      return;
+    if (err != VK_NOT_READY)
+      vik_log_check(err);
+
+    double timeout_ms = std::max(milliseconds(deadline - clock::now()).count(), 0.0);
+    uint64_t timeout_ns = (uint64_t) (timeout_ms * 1000000.0);
+
+    // Signaling while we wait gives the tail, a timeout a lower bound
+    err = vkWaitForFences(device, 1, &fence, VK_TRUE, timeout_ns);
+    if (err != VK_SUCCESS && err != VK_TIMEOUT)
+      vik_log_check(err);
+
+    double gpu = milliseconds(clock::now() - submit_time).count();
+    gpu_ms = track_peak(gpu_ms, gpu);
+  }
+
+  void finish_calibration() {
+    if (!enabled) {
+      calibrated = true;
+      return;
+    }
+
+    if (calibration_intervals.size() < calibration_frames / 4) {
+      vik_log_w("Frame pacer could not learn the refresh period, disabling it.");
+      enabled = false;
+      return;
+    }
+
+    // The display cadence is the most common interval, use the median
+    std::sort(calibration_intervals.begin(), calibration_intervals.end());
+    period_ms = calibration_intervals[calibration_intervals.size() / 2];
+    calibration_intervals.clear();
+    calibrated = true;
+
+    vik_log_i("Frame pacer: refresh period %.3fms (%.2f Hz)",
+              period_ms, 1000.0 / period_ms);
+  }
+
+  void refine_period(double interval) {
+    // Intervals span one or more refresh periods
+    double periods = std::round(interval / period_ms);
+    if (periods < 1.0)
+      return;
+
+    double sample = interval / periods;
+    if (std::abs(sample - period_ms) > period_ms * 0.1)
+      return;
+
+    period_ms = period_ms * 0.95 + sample * 0.05;
+  }
+};
+}  // namespace vik
@@ -0,0 +1,323 @@
+/*
+ * vitamin-k
+ *
+ * Copyright 2017-2018 Collabora Ltd.
+ *
+ * Authors: Lubosz Sarnecki <lubosz.sarnecki@collabora.com>
+ * SPDX-License-Identifier: MIT
+ */
+
+#pragma once
+
+#include <vulkan/vulkan.h>
+
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "vikDevice.hpp"
+#include "../system/vikLog.hpp"
+#include "../system/vikTrace.hpp"
+
+namespace vik {
+
+/*
+ * Per pass GPU times from timestamp queries.
+ *
+ * There is one query pool per swap chain image, holding a begin and end
+ * timestamp for each scope. Command buffers write into the pool of the
+ * image they render to, so once the renderer has waited for an image to
+ * be idle, the results of its previous use are available and reading them
+ * never stalls.
+ *
+ * Each command buffer resets the queries of its scopes outside of a render
+ * pass before writing them. The pools are also reset once when they are
+ * created, so the queries of command buffers that were recorded but never
+ * submitted read back as unavailable.
+ *
+ * When tracing, the GPU clock is calibrated against the CPU clock with
+ * VK_EXT_calibrated_timestamps and the scopes are added to the trace.
+ */
+class GpuProfiler {
+ public:
+  static const uint32_t MAX_SCOPES = 16;
+
+  struct Scope {
+    std::string name;
+    double last_ms;
+    double average_ms;
+  };
+
+  bool enabled = false;
+
+  std::vector<Scope> scopes;
+
+  // Pool of the frame currently being recorded
+  uint32_t current_pool = 0;
+
+ private:
+  Device *vik_device = nullptr;
+  VkDevice device = VK_NULL_HANDLE;
+  VkQueue queue = VK_NULL_HANDLE;
+  std::vector<VkQueryPool> pools;
+
+  double timestamp_period = 1.0;
+  uint64_t timestamp_mask = ~0ULL;
+
+  std::ofstream csv;
+  uint64_t csv_frame = 0;
+  bool csv_header_written = false;
+
+  // Raw begin timestamps of the last readback, per scope
+  std::vector<uint64_t> begin_ticks;
+
+  bool calibrated_timestamps = false;
+  uint64_t calibration_gpu_ticks = 0;
+  int64_t calibration_cpu_ns = 0;
+#ifdef VK_EXT_calibrated_timestamps
+  PFN_vkGetCalibratedTimestampsEXT get_calibrated_timestamps = nullptr;
+#endif
+
+ public:
+  void init(Device *vik_device, VkInstance instance, VkQueue queue,
+            uint32_t pool_count, const std::string& csv_path) {
+    this->vik_device = vik_device;
+    this->queue = queue;
+    device = vik_device->logicalDevice;
+
+    uint32_t valid_bits = vik_device->queueFamilyProperties[
+        vik_device->queueFamilyIndices.graphics].timestampValidBits;
+
+    if (!vik_device->properties.limits.timestampComputeAndGraphics
+        || valid_bits == 0) {
+      vik_log_w("Timestamp queries not supported, GPU profiling disabled.");
+      return;
+    }
+
+    enabled = true;
+    timestamp_period = vik_device->properties.limits.timestampPeriod;
+    if (valid_bits < 64)
+      timestamp_mask = (1ULL << valid_bits) - 1;
+
+    create_pools(pool_count);
+
+    if (Trace::get().enabled)
+      init_calibration(vik_device, instance);
+
+    if (!csv_path.empty()) {
+      csv.open(csv_path);
+      vik_log_f_if(!csv.is_open(), "Could not open %s for writing.",
+                   csv_path.c_str());
+    }
+  }
+
+  void destroy() {
+    destroy_pools();
+    if (csv.is_open())
+      csv.close();
+  }
+
+  // The swap chain image count may change on resize
+  void resize(uint32_t pool_count) {
+    if (!enabled)
+      return;
+    destroy_pools();
+    create_pools(pool_count);
+  }
+
+  uint32_t add_scope(const std::string& name) {
+    vik_log_f_if(scopes.size() >= MAX_SCOPES,
+                 "Too many GPU profiler scopes, %d supported.", MAX_SCOPES);
+    Scope scope = {
+      .name = name,
+      .last_ms = 0.0,
+      .average_ms = 0.0
+    };
+    scopes.push_back(scope);
+    begin_ticks.push_back(0);
+    return scopes.size() - 1;
+  }
+
+  // Must be recorded outside of a render pass
+  void reset(VkCommandBuffer cmd, uint32_t pool, uint32_t scope) {
+    if (!enabled)
+      return;
+    vkCmdResetQueryPool(cmd, pools[pool], scope * 2, 2);
+  }
+
+  void begin(VkCommandBuffer cmd, uint32_t pool, uint32_t scope) {
+    if (!enabled)
+      return;
+    vkCmdWriteTimestamp(cmd, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+                        pools[pool], scope * 2);
+  }
+
+  void end(VkCommandBuffer cmd, uint32_t pool, uint32_t scope) {
+    if (!enabled)
+      return;
+    vkCmdWriteTimestamp(cmd, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+                        pools[pool], scope * 2 + 1);
+  }
+
+  /*
+   * Read back the results of the last frame that rendered to this pool.
+   * The caller makes sure the GPU is done with it.
+   */
+  void collect(uint32_t pool) {
+    current_pool = pool;
+
+    if (!enabled)
+      return;
+
+    bool trace = calibrated_timestamps && Trace::get().enabled;
+    if (trace)
+      calibrate();
+
+    for (uint32_t i = 0; i < scopes.size(); i++) {
+      // Begin, end and the availability of each
+      uint64_t results[4] = {};
+      VkResult err = vkGetQueryPoolResults(
+            device, pools[pool], i * 2, 2, sizeof(results), results,
+            2 * sizeof(uint64_t),
+            VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WITH_AVAILABILITY_BIT);
+
+      if (err == VK_NOT_READY || results[1] == 0 || results[3] == 0)
+        continue;
+      vik_log_check(err);
+
+      uint64_t ticks = (results[2] - results[0]) & timestamp_mask;
+      double ms = ticks * timestamp_period / 1000000.0;
+
+      scopes[i].last_ms = ms;
+      scopes[i].average_ms = scopes[i].average_ms * 0.9 + ms * 0.1;
+
+      // Static command buffers report the same queries again until rerun
+      if (trace && results[0] != begin_ticks[i])
+        Trace::get().add_gpu(scopes[i].name,
+                             to_cpu_ns(results[0]), to_cpu_ns(results[2]));
+      begin_ticks[i] = results[0];
+    }
+
+    if (csv.is_open())
+      write_csv_row();
+  }
+
+  std::string get_stats_string() {
+    std::stringstream ss;
+    ss << std::fixed << std::setprecision(2) << "gpu";
+    for (auto scope : scopes)
+      ss << " " << scope.name << " " << scope.average_ms;
+    ss << " ms";
+    return ss.str();
+  }
+
+ private:
+  void init_calibration(Device *vik_device, VkInstance instance) {
+#ifdef VK_EXT_calibrated_timestamps
+    if (!vik_device->enable_calibrated_timestamps) {
+      vik_log_w("No VK_EXT_calibrated_timestamps, GPU zones are not traced.");
+      return;
+    }
+
+    PFN_vkGetPhysicalDeviceCalibrateableTimeDomainsEXT get_time_domains =
+        (PFN_vkGetPhysicalDeviceCalibrateableTimeDomainsEXT)
+        vkGetInstanceProcAddr(instance, "vkGetPhysicalDeviceCalibrateableTimeDomainsEXT");
+    get_calibrated_timestamps = (PFN_vkGetCalibratedTimestampsEXT)
+        vkGetDeviceProcAddr(device, "vkGetCalibratedTimestampsEXT");
+    if (get_time_domains == nullptr || get_calibrated_timestamps == nullptr)
+      return;
+
+    uint32_t count = 0;
+    get_time_domains(vik_device->physicalDevice, &count, nullptr);
+    std::vector<VkTimeDomainEXT> domains(count);
+    get_time_domains(vik_device->physicalDevice, &count, domains.data());
+
+    bool has_device = false, has_monotonic = false;
+    for (auto domain : domains) {
+      if (domain == VK_TIME_DOMAIN_DEVICE_EXT)
+        has_device = true;
+      else if (domain == VK_TIME_DOMAIN_CLOCK_MONOTONIC_EXT)
+        has_monotonic = true;
+    }
+
+    calibrated_timestamps = has_device && has_monotonic;
+    if (!calibrated_timestamps)
+      vik_log_w("GPU clock can't be calibrated to CLOCK_MONOTONIC, GPU zones are not traced.");
+#else
+    vik_log_w("Built without VK_EXT_calibrated_timestamps, GPU zones are not traced.");
+#endif
+  }
+
+  void calibrate() {
+#ifdef VK_EXT_calibrated_timestamps
+    VkCalibratedTimestampInfoEXT infos[2] = {
+      {
+        .sType = VK_STRUCTURE_TYPE_CALIBRATED_TIMESTAMP_INFO_EXT,
+        .timeDomain = VK_TIME_DOMAIN_DEVICE_EXT
+      },
+      {
+        .sType = VK_STRUCTURE_TYPE_CALIBRATED_TIMESTAMP_INFO_EXT,
+        .timeDomain = VK_TIME_DOMAIN_CLOCK_MONOTONIC_EXT
+      }
+    };
+    uint64_t timestamps[2];
+    uint64_t max_deviation;
+    vik_log_check(get_calibrated_timestamps(device, 2, infos,
+                                            timestamps, &max_deviation));
+    calibration_gpu_ticks = timestamps[0];
+    calibration_cpu_ns = timestamps[1];
+#endif
+  }
+
+  int64_t to_cpu_ns(uint64_t ticks) {
+    // Signed distance to the calibration point, the counter may wrap
+    uint64_t delta = (ticks - calibration_gpu_ticks) & timestamp_mask;
+    int64_t signed_delta = delta > timestamp_mask / 2
+        ? -(int64_t) ((timestamp_mask - delta) + 1)
+        : (int64_t) delta;
+    return calibration_cpu_ns + signed_delta * timestamp_period;
+  }
+
+  void create_pools(uint32_t count) {
+    VkQueryPoolCreateInfo pool_info = {
+      .sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO,
+      .queryType = VK_QUERY_TYPE_TIMESTAMP,
+      .queryCount = MAX_SCOPES * 2
+    };
+
+    pools.resize(count);
+    for (auto& pool : pools)
+      vik_log_check(vkCreateQueryPool(device, &pool_info, nullptr, &pool));
+
+    // New queries are undefined until reset
+    VkCommandBuffer cmd =
+        vik_device->createCommandBuffer(VK_COMMAND_BUFFER_LEVEL_PRIMARY, true);
+    for (auto& pool : pools)
+      vkCmdResetQueryPool(cmd, pool, 0, MAX_SCOPES * 2);
+    vik_device->flushCommandBuffer(cmd, queue);
+  }
+
+  void destroy_pools() {
+    for (auto& pool : pools)
+      vkDestroyQueryPool(device, pool, nullptr);
+    pools.clear();
+  }
+
+  void write_csv_row() {
+    if (!csv_header_written) {
+      csv << "frame";
+      for (auto scope : scopes)
+        csv << "," << scope.name;
+      csv << "\n";
+      csv_header_written = true;
+    }
+
+    csv << csv_frame++;
+    for (auto scope : scopes)
+      csv << "," << scope.last_ms;
+    csv << "\n";
+  }
+};
+}  // namespace vik
@@ -0,0 +1,402 @@
+/*
+ * vitamin-k
+ *
+ * Copyright 2017-2018 Collabora Ltd.
+ *
+ * Authors: Lubosz Sarnecki <lubosz.sarnecki@collabora.com>
+ * SPDX-License-Identifier: MIT
+ */
+
+#pragma once
+
+#include <vulkan/vulkan.h>
+
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <vector>
+
+#include "../system/vikLog.hpp"
+
+namespace vik {
+
+/*
+ * One VkDeviceMemory allocation, split up with a buddy allocator.
+ *
+ * Ranges have a power of two size and are aligned to it, so any alignment
+ * up to the range size is met. Freeing a range merges it with its buddy
+ * as long as the buddy is free as well.
+ */
+class MemoryBlock {
+ public:
+  VkDeviceMemory memory = VK_NULL_HANDLE;
+  uint8_t *mapped = nullptr;
+  VkDeviceSize size = 0;
+  // Holds a single resource that was too large to share a block
+  bool dedicated = false;
+
+  VkDeviceSize used = 0;
+  uint32_t allocation_count = 0;
+
+ private:
+  uint32_t min_order = 0;
+  uint32_t max_order = 0;
+  // Offsets of the free ranges, indexed by order
+  std::vector<std::set<VkDeviceSize>> free_lists;
+
+ public:
+  MemoryBlock(VkDeviceMemory m, void *map, VkDeviceSize s,
+              uint32_t min, bool is_dedicated) {
+    memory = m;
+    mapped = (uint8_t *) map;
+    size = s;
+    dedicated = is_dedicated;
+
+    if (dedicated)
+      return;
+
+    min_order = min;
+    max_order = get_order(size);
+    free_lists.resize(max_order + 1);
+    free_lists[max_order].insert(0);
+  }
+
+  static uint32_t get_order(VkDeviceSize size) {
+    uint32_t order = 0;
+    while ((VkDeviceSize(1) << order) < size)
+      order++;
+    return order;
+  }
+
+  uint32_t get_allocation_order(VkDeviceSize size, VkDeviceSize alignment) {
+    return std::max(get_order(std::max(size, alignment)), min_order);
+  }
+
+  bool allocate(uint32_t order, VkDeviceSize *offset) {
+    if (dedicated) {
+      if (allocation_count > 0)
+        return false;
+      *offset = 0;
+      return true;
+    }
+
+    if (order > max_order)
+      return false;
+
+    uint32_t k = order;
+    while (k <= max_order && free_lists[k].empty())
+      k++;
+    if (k > max_order)
+      return false;
+
+    VkDeviceSize start = *free_lists[k].begin();
+    free_lists[k].erase(free_lists[k].begin());
+
+    // Split, keeping the lower half and freeing the upper one
+    while (k > order) {
+      k--;
+      free_lists[k].insert(start + (VkDeviceSize(1) << k));
+    }
+
+    *offset = start;
+    return true;
+  }
+
+  void free(VkDeviceSize offset, uint32_t order) {
+    if (dedicated)
+      return;
+
+    while (order < max_order) {
+      VkDeviceSize buddy = offset ^ (VkDeviceSize(1) << order);
+      auto it = free_lists[order].find(buddy);
+      if (it == free_lists[order].end())
+        break;
+      free_lists[order].erase(it);
+      offset = std::min(offset, buddy);
+      order++;
+    }
+    free_lists[order].insert(offset);
+  }
+
+  VkDeviceSize get_free_size() {
+    if (dedicated)
+      return 0;
+    VkDeviceSize free_size = 0;
+    for (uint32_t k = 0; k <= max_order; k++)
+      free_size += free_lists[k].size() * (VkDeviceSize(1) << k);
+    return free_size;
+  }
+
+  VkDeviceSize get_largest_free_range() {
+    if (dedicated)
+      return 0;
+    for (uint32_t k = max_order + 1; k-- > 0;)
+      if (!free_lists[k].empty())
+        return VkDeviceSize(1) << k;
+    return 0;
+  }
+};
+
+// A range of a memory block bound to a buffer or image
+struct Allocation {
+  VkDeviceMemory memory = VK_NULL_HANDLE;
+  VkDeviceSize offset = 0;
+  VkDeviceSize size = 0;
+  VkDeviceSize alignment = 0;
+  // Only set for host visible memory, which stays mapped
+  void *mapped = nullptr;
+  // Granularity of flushing and invalidating mapped memory
+  VkDeviceSize non_coherent_atom_size = 1;
+
+  uint32_t pool = 0;
+  uint32_t order = 0;
+  MemoryBlock *block = nullptr;
+
+  // Size of the whole buddy range, which no other allocation overlaps
+  VkDeviceSize get_range_size() const {
+    if (block == nullptr)
+      return size;
+    if (block->dedicated)
+      return block->size;
+    return std::min(VkDeviceSize(1) << order, block->size - offset);
+  }
+};
+
+/*
+ * Sub-allocates device memory for buffers and images from large blocks.
+ *
+ * There is a pool of blocks per memory type and per resource kind. Buffers
+ * and linear images never share a block with optimal images, which keeps
+ * them apart by more than bufferImageGranularity. Host visible blocks are
+ * mapped once when they are created.
+ *
+ * Resources larger than half a block get a dedicated allocation.
+ */
+class MemoryAllocator {
+  struct Pool {
+    std::vector<std::unique_ptr<MemoryBlock>> blocks;
+  };
+
+  // Also covers nonCoherentAtomSize, so mapped ranges can be flushed
+  static const uint32_t MIN_ORDER = 8;
+
+  VkDevice device = VK_NULL_HANDLE;
+  VkPhysicalDeviceMemoryProperties memory_properties;
+  VkDeviceSize buffer_image_granularity = 1;
+  VkDeviceSize non_coherent_atom_size = 1;
+
+  // Two pools per memory type, for linear and optimal resources
+  std::vector<Pool> pools;
+  std::mutex mutex;
+
+  uint64_t device_allocation_count = 0;
+
+ public:
+  VkDeviceSize block_size = 64 * 1024 * 1024;
+
+  void init(VkDevice d, const VkPhysicalDeviceProperties &properties,
+            const VkPhysicalDeviceMemoryProperties &memory_props) {
+    device = d;
+    memory_properties = memory_props;
+    buffer_image_granularity = properties.limits.bufferImageGranularity;
+    non_coherent_atom_size = properties.limits.nonCoherentAtomSize;
+    pools.resize(memory_properties.memoryTypeCount * 2);
+  }
+
+  void destroy() {
+    for (auto& pool : pools) {
+      for (auto& block : pool.blocks) {
+        if (block->allocation_count > 0)
+          vik_log_w("Freeing a memory block with %d allocations left.",
+                    block->allocation_count);
+        vkFreeMemory(device, block->memory, nullptr);
+      }
+      pool.blocks.clear();
+    }
+  }
+
+  // Allocate and bind memory for a buffer
+  Allocation allocate_buffer(VkBuffer buffer, VkMemoryPropertyFlags flags) {
+    VkMemoryRequirements requirements;
+    vkGetBufferMemoryRequirements(device, buffer, &requirements);
+    Allocation allocation = allocate(requirements, flags, true);
+    vik_log_check(vkBindBufferMemory(device, buffer, allocation.memory,
+                                     allocation.offset));
+    return allocation;
+  }
+
+  // Allocate and bind memory for an image
+  Allocation allocate_image(VkImage image, VkMemoryPropertyFlags flags,
+                            VkImageTiling tiling = VK_IMAGE_TILING_OPTIMAL) {
+    VkMemoryRequirements requirements;
+    vkGetImageMemoryRequirements(device, image, &requirements);
+    Allocation allocation = allocate(requirements, flags,
+                                     tiling == VK_IMAGE_TILING_LINEAR);
+    vik_log_check(vkBindImageMemory(device, image, allocation.memory,
+                                    allocation.offset));
+    return allocation;
+  }
+
+  Allocation allocate(const VkMemoryRequirements &requirements,
+                      VkMemoryPropertyFlags flags, bool linear) {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    Allocation allocation;
+    allocation.size = requirements.size;
+    allocation.alignment = requirements.alignment;
+    allocation.non_coherent_atom_size = non_coherent_atom_size;
+
+    uint32_t type = get_memory_type(requirements.memoryTypeBits, flags);
+    allocation.pool = type * 2 + (linear ? 1 : 0);
+    Pool *pool = &pools[allocation.pool];
+
+    VkDeviceSize pool_block_size = get_block_size(type);
+    bool dedicated = std::max(requirements.size, requirements.alignment)
+        > pool_block_size / 2;
+
+    if (!dedicated) {
+      for (auto& block : pool->blocks) {
+        if (block->dedicated)
+          continue;
+        allocation.order = block->get_allocation_order(requirements.size,
+                                                       requirements.alignment);
+        if (block->allocate(allocation.order, &allocation.offset)) {
+          allocation.block = block.get();
+          break;
+        }
+      }
+    }
+
+    if (allocation.block == nullptr) {
+      VkDeviceSize size = dedicated ? requirements.size : pool_block_size;
+      pool->blocks.emplace_back(create_block(type, size, dedicated));
+      allocation.block = pool->blocks.back().get();
+      allocation.order = allocation.block->get_allocation_order(
+            requirements.size, requirements.alignment);
+      vik_log_f_if(!allocation.block->allocate(allocation.order,
+                                               &allocation.offset),
+                   "Could not allocate %ld bytes from a new memory block.",
+                   requirements.size);
+    }
+
+    MemoryBlock *block = allocation.block;
+    block->allocation_count++;
+    block->used += requirements.size;
+
+    allocation.memory = block->memory;
+    if (block->mapped != nullptr)
+      allocation.mapped = block->mapped + allocation.offset;
+
+    return allocation;
+  }
+
+  void free(const Allocation &allocation) {
+    if (allocation.block == nullptr)
+      return;
+
+    std::lock_guard<std::mutex> lock(mutex);
+
+    MemoryBlock *block = allocation.block;
+    block->free(allocation.offset, allocation.order);
+    block->allocation_count--;
+    block->used -= allocation.size;
+
+    if (block->allocation_count > 0)
+      return;
+
+    // Keep one empty block around, so the next allocation can reuse it
+    Pool *pool = &pools[allocation.pool];
+    uint32_t empty_count = 0;
+    for (auto& b : pool->blocks)
+      if (!b->dedicated && b->allocation_count == 0)
+        empty_count++;
+    if (!block->dedicated && empty_count == 1)
+      return;
+
+    vkFreeMemory(device, block->memory, nullptr);
+    device_allocation_count--;
+    for (auto it = pool->blocks.begin(); it != pool->blocks.end(); ++it) {
+      if (it->get() == block) {
+        pool->blocks.erase(it);
+        break;
+      }
+    }
+  }
+
+  // Log the blocks of each memory type, their usage and fragmentation
+  void print_stats() {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    vik_log_i("Device memory: %ld allocations, bufferImageGranularity %ld",
+              device_allocation_count, buffer_image_granularity);
+
+    for (uint32_t i = 0; i < pools.size(); i++) {
+      Pool *pool = &pools[i];
+      if (pool->blocks.empty())
+        continue;
+
+      VkDeviceSize size = 0, used = 0, free_size = 0, largest_free = 0;
+      uint32_t allocation_count = 0, dedicated_count = 0;
+      for (auto& block : pool->blocks) {
+        size += block->size;
+        used += block->used;
+        free_size += block->get_free_size();
+        largest_free = std::max(largest_free, block->get_largest_free_range());
+        allocation_count += block->allocation_count;
+        if (block->dedicated)
+          dedicated_count++;
+      }
+
+      // How much of the free memory can't be handed out in one piece
+      double fragmentation = free_size > 0
+          ? 1.0 - (double) largest_free / free_size : 0.0;
+
+      vik_log_i("  type %d %s: %ld blocks (%d dedicated), %d allocations, "
+                "%.1f / %.1f MiB used, %.1f MiB free, %.0f%% fragmented",
+                i / 2, i % 2 ? "linear" : "optimal",
+                pool->blocks.size(), dedicated_count, allocation_count,
+                used / 1048576.0, size / 1048576.0, free_size / 1048576.0,
+                fragmentation * 100.0);
+    }
+  }
+
+ private:
+  VkDeviceSize get_block_size(uint32_t type) {
+    // Small heaps, like the host visible device local window, get smaller blocks
+    uint32_t heap = memory_properties.memoryTypes[type].heapIndex;
+    VkDeviceSize heap_size = memory_properties.memoryHeaps[heap].size;
+    VkDeviceSize size = block_size;
+    while (size > heap_size / 8 && size > (VkDeviceSize(1) << MIN_ORDER))
+      size >>= 1;
+    return size;
+  }
+
+  MemoryBlock* create_block(uint32_t type, VkDeviceSize size, bool dedicated) {
+    VkMemoryAllocateInfo alloc_info = {
+      .sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+      .allocationSize = size,
+      .memoryTypeIndex = type
+    };
+    VkDeviceMemory memory;
+    vik_log_check(vkAllocateMemory(device, &alloc_info, nullptr, &memory));
+    device_allocation_count++;
+
+    void *mapped = nullptr;
+    if (memory_properties.memoryTypes[type].propertyFlags
+        & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT)
+      vik_log_check(vkMapMemory(device, memory, 0, VK_WHOLE_SIZE, 0, &mapped));
+
+    return new MemoryBlock(memory, mapped, size, MIN_ORDER, dedicated);
+  }
+
+  uint32_t get_memory_type(uint32_t type_bits, VkMemoryPropertyFlags flags) {
+    for (uint32_t i = 0; i < memory_properties.memoryTypeCount; i++)
+      if ((type_bits & (1 << i))
+          && (memory_properties.memoryTypes[i].propertyFlags & flags) == flags)
+        return i;
+    vik_log_f("Could not find a matching memory type.");
+    return 0;
+  }
+};
+}  // namespace vik
@@ -0,0 +1,419 @@
+/*
+ * vitamin-k
+ *
+ * Copyright 2017-2018 Collabora Ltd.
+ *
+ * Authors: Lubosz Sarnecki <lubosz.sarnecki@collabora.com>
+ * SPDX-License-Identifier: MIT
+ */
+
+#pragma once
+
+#include <math.h>
+#include <string.h>
+
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "../system/vikLog.hpp"
+
+namespace vik {
+
+// Sizes and post-transform cache efficiency of a mesh
+struct MeshStats {
+  uint64_t vertex_count = 0;
+  uint64_t triangle_count = 0;
+  uint64_t cache_misses = 0;
+  uint64_t vertex_bytes = 0;
+  uint64_t index_bytes = 0;
+
+  void add(const MeshStats &other) {
+    vertex_count += other.vertex_count;
+    triangle_count += other.triangle_count;
+    cache_misses += other.cache_misses;
+    vertex_bytes += other.vertex_bytes;
+    index_bytes += other.index_bytes;
+  }
+
+  // Average cache miss ratio, vertex shader invocations per triangle
+  double get_acmr() const {
+    return triangle_count > 0 ? (double) cache_misses / triangle_count : 0.0;
+  }
+
+  void print_comparison(const std::string &name, const MeshStats &optimized) const {
+    vik_log_i("%s: %ld -> %ld vertices, ACMR %.3f -> %.3f, "
+              "%ld -> %ld vertex bytes, %ld -> %ld index bytes",
+              name.c_str(),
+              vertex_count, optimized.vertex_count,
+              get_acmr(), optimized.get_acmr(),
+              vertex_bytes, optimized.vertex_bytes,
+              index_bytes, optimized.index_bytes);
+  }
+};
+
+/*
+ * Reorders indexed triangle lists for the GPU.
+ *
+ * optimize() runs the passes in order: identical vertices are merged,
+ * triangles are sorted for the post-transform vertex cache with Forsyth's
+ * algorithm, clusters of those triangles are sorted so outward facing ones
+ * are drawn first to reduce overdraw, and the vertices are sorted in the
+ * order they are first fetched.
+ *
+ * Vertices are stride elements of T, with the position as 3 floats at
+ * position_offset floats into the vertex. A negative position_offset skips
+ * the overdraw pass.
+ */
+class MeshOptimizer {
+  // Size of the cache modelled for scoring vertices
+  static const uint32_t SCORE_CACHE_SIZE = 32;
+  // FIFO cache size used for the ACMR, as on most desktop GPUs
+  static const uint32_t FIFO_CACHE_SIZE = 16;
+  // Cluster ACMR allowed over the ACMR of the cache optimized mesh
+  static constexpr float OVERDRAW_THRESHOLD = 1.05f;
+
+ public:
+  template <typename T>
+  static void optimize(std::vector<T> *vertices, uint32_t stride,
+                       int32_t position_offset,
+                       std::vector<uint32_t> *indices) {
+    if (indices->empty())
+      return;
+
+    deduplicate(vertices, stride, indices);
+    uint32_t vertex_count = vertices->size() / stride;
+
+    optimize_vertex_cache(indices, vertex_count);
+
+    if (position_offset >= 0)
+      optimize_overdraw(indices, (const float *) vertices->data(),
+                        stride * sizeof(T) / sizeof(float), position_offset);
+
+    optimize_vertex_fetch(vertices, stride, indices);
+  }
+
+  template <typename T>
+  static MeshStats get_stats(const std::vector<T> &vertices, uint32_t stride,
+                             const std::vector<uint32_t> &indices,
+                             uint32_t index_size) {
+    MeshStats stats;
+    stats.vertex_count = vertices.size() / stride;
+    stats.triangle_count = indices.size() / 3;
+    stats.cache_misses = count_cache_misses(indices, 0, indices.size() / 3);
+    stats.vertex_bytes = vertices.size() * sizeof(T);
+    stats.index_bytes = indices.size() * index_size;
+    return stats;
+  }
+
+  // Misses of a FIFO cache drawing triangles [first, first + count)
+  static uint64_t count_cache_misses(const std::vector<uint32_t> &indices,
+                                     uint32_t first, uint32_t count) {
+    std::vector<uint32_t> cache;
+    uint64_t misses = 0;
+    for (uint32_t i = first * 3; i < (first + count) * 3; i++) {
+      if (std::find(cache.begin(), cache.end(), indices[i]) != cache.end())
+        continue;
+      misses++;
+      cache.insert(cache.begin(), indices[i]);
+      if (cache.size() > FIFO_CACHE_SIZE)
+        cache.pop_back();
+    }
+    return misses;
+  }
+
+  // Merge vertices with identical attributes
+  template <typename T>
+  static void deduplicate(std::vector<T> *vertices, uint32_t stride,
+                          std::vector<uint32_t> *indices) {
+    uint32_t vertex_count = vertices->size() / stride;
+    size_t vertex_size = stride * sizeof(T);
+    const uint8_t *data = (const uint8_t *) vertices->data();
+
+    auto less = [data, vertex_size](uint32_t a, uint32_t b) {
+      int order = memcmp(data + a * vertex_size, data + b * vertex_size,
+                         vertex_size);
+      return order != 0 ? order < 0 : a < b;
+    };
+    auto equal = [data, vertex_size](uint32_t a, uint32_t b) {
+      return memcmp(data + a * vertex_size, data + b * vertex_size,
+                    vertex_size) == 0;
+    };
+
+    std::vector<uint32_t> sorted(vertex_count);
+    for (uint32_t i = 0; i < vertex_count; i++)
+      sorted[i] = i;
+    std::sort(sorted.begin(), sorted.end(), less);
+
+    // Map every vertex to the first one with the same attributes
+    std::vector<uint32_t> first(vertex_count);
+    for (uint32_t i = 0; i < vertex_count; i++)
+      first[sorted[i]] = (i > 0 && equal(sorted[i - 1], sorted[i]))
+          ? first[sorted[i - 1]] : sorted[i];
+
+    std::vector<uint32_t> remap(vertex_count, UINT32_MAX);
+    std::vector<T> unique;
+    for (uint32_t i = 0; i < vertex_count; i++) {
+      if (first[i] != i)
+        continue;
+      remap[i] = unique.size() / stride;
+      unique.insert(unique.end(), vertices->begin() + i * stride,
+                    vertices->begin() + (i + 1) * stride);
+    }
+
+    for (auto& index : *indices)
+      index = remap[first[index]];
+    *vertices = std::move(unique);
+  }
+
+  // Forsyth, Linear-Speed Vertex Cache Optimisation
+  static void optimize_vertex_cache(std::vector<uint32_t> *indices,
+                                    uint32_t vertex_count) {
+    uint32_t triangle_count = indices->size() / 3;
+
+    // Triangles using each vertex
+    std::vector<uint32_t> valence(vertex_count, 0);
+    for (uint32_t index : *indices)
+      valence[index]++;
+    std::vector<uint32_t> adjacency_offset(vertex_count + 1, 0);
+    for (uint32_t v = 0; v < vertex_count; v++)
+      adjacency_offset[v + 1] = adjacency_offset[v] + valence[v];
+    std::vector<uint32_t> adjacency(indices->size());
+    std::vector<uint32_t> fill(adjacency_offset.begin(), adjacency_offset.end() - 1);
+    for (uint32_t i = 0; i < indices->size(); i++)
+      adjacency[fill[(*indices)[i]]++] = i / 3;
+
+    std::vector<int32_t> cache_position(vertex_count, -1);
+    std::vector<float> vertex_score(vertex_count);
+    for (uint32_t v = 0; v < vertex_count; v++)
+      vertex_score[v] = get_vertex_score(-1, valence[v]);
+
+    std::vector<float> triangle_score(triangle_count);
+    for (uint32_t t = 0; t < triangle_count; t++)
+      triangle_score[t] = vertex_score[(*indices)[t * 3]]
+          + vertex_score[(*indices)[t * 3 + 1]]
+          + vertex_score[(*indices)[t * 3 + 2]];
+
+    std::vector<bool> emitted(triangle_count, false);
+    std::vector<uint32_t> output;
+    output.reserve(indices->size());
+
+    std::vector<uint32_t> cache, new_cache;
+    uint32_t scan_cursor = 0;
+    int64_t best = -1;
+
+    for (uint32_t emitted_count = 0; emitted_count < triangle_count; emitted_count++) {
+      // Nothing in the cache references an open triangle, take the next one
+      if (best < 0) {
+        while (emitted[scan_cursor])
+          scan_cursor++;
+        best = scan_cursor;
+      }
+
+      const uint32_t *triangle = &(*indices)[best * 3];
+      output.insert(output.end(), triangle, triangle + 3);
+      emitted[best] = true;
+
+      // Remove the triangle from the open triangles of its vertices
+      for (uint32_t k = 0; k < 3; k++) {
+        uint32_t v = triangle[k];
+        uint32_t begin = adjacency_offset[v];
+        uint32_t end = begin + valence[v];
+        for (uint32_t a = begin; a < end; a++) {
+          if (adjacency[a] == best) {
+            std::swap(adjacency[a], adjacency[end - 1]);
+            break;
+          }
+        }
+        valence[v]--;
+      }
+
+      // The triangle's vertices move to the front of the cache
+      new_cache.assign(triangle, triangle + 3);
+      for (uint32_t v : cache)
+        if (v != triangle[0] && v != triangle[1] && v != triangle[2])
+          new_cache.push_back(v);
+
+      for (uint32_t i = 0; i < new_cache.size(); i++) {
+        uint32_t v = new_cache[i];
+        cache_position[v] = i < SCORE_CACHE_SIZE ? (int32_t) i : -1;
+        vertex_score[v] = get_vertex_score(cache_position[v], valence[v]);
+      }
+
+      // Rescore the open triangles of the touched vertices
+      best = -1;
+      float best_score = -1.0f;
+      for (uint32_t v : new_cache) {
+        uint32_t begin = adjacency_offset[v];
+        for (uint32_t a = begin; a < begin + valence[v]; a++) {
+          uint32_t t = adjacency[a];
+          const uint32_t *open = &(*indices)[t * 3];
+          triangle_score[t] = vertex_score[open[0]]
+              + vertex_score[open[1]] + vertex_score[open[2]];
+          if (triangle_score[t] > best_score) {
+            best_score = triangle_score[t];
+            best = t;
+          }
+        }
+      }
+
+      if (new_cache.size() > SCORE_CACHE_SIZE)
+        new_cache.resize(SCORE_CACHE_SIZE);
+      std::swap(cache, new_cache);
+    }
+
+    *indices = std::move(output);
+  }
+
+  /*
+   * Sander, Nehab, Barczak, Fast Triangle Reordering for Vertex Locality
+   * and Reduced Overdraw.
+   *
+   * The cache optimized triangles are split into clusters where the cache
+   * restarts, and further where a cluster's ACMR stays close to the mesh's.
+   * Clusters facing away from the mesh's center are drawn first, since they
+   * are more likely to occlude the others.
+   */
+  static void optimize_overdraw(std::vector<uint32_t> *indices,
+                                const float *vertices, uint32_t stride,
+                                uint32_t position_offset) {
+    uint32_t triangle_count = indices->size() / 3;
+    double mesh_acmr = (double) count_cache_misses(*indices, 0, triangle_count)
+        / triangle_count;
+
+    // Cluster boundaries, as first triangles
+    std::vector<uint32_t> clusters;
+    std::vector<uint32_t> cache;
+    uint32_t cluster_start = 0;
+    uint64_t cluster_misses = 0;
+    for (uint32_t t = 0; t < triangle_count; t++) {
+      uint32_t misses = 0;
+      for (uint32_t k = 0; k < 3; k++) {
+        uint32_t v = (*indices)[t * 3 + k];
+        if (std::find(cache.begin(), cache.end(), v) != cache.end())
+          continue;
+        misses++;
+        cache.insert(cache.begin(), v);
+        if (cache.size() > FIFO_CACHE_SIZE)
+          cache.pop_back();
+      }
+
+      // All vertices missed, the cache order restarts here
+      bool hard_boundary = misses == 3;
+      if (t == 0 || hard_boundary) {
+        clusters.push_back(t);
+        cluster_start = t;
+        cluster_misses = 0;
+      }
+      cluster_misses += misses;
+
+      // Splitting here costs little vertex cache efficiency
+      double cluster_acmr = (double) cluster_misses / (t - cluster_start + 1);
+      if (t + 1 < triangle_count && t - cluster_start >= 2
+          && cluster_acmr <= mesh_acmr * OVERDRAW_THRESHOLD) {
+        clusters.push_back(t + 1);
+        cluster_start = t + 1;
+        cluster_misses = 0;
+        cache.clear();
+      }
+    }
+    clusters.erase(std::unique(clusters.begin(), clusters.end()), clusters.end());
+    clusters.push_back(triangle_count);
+
+    auto position = [vertices, stride, position_offset](uint32_t v) {
+      const float *p = vertices + v * stride + position_offset;
+      return glm::vec3(p[0], p[1], p[2]);
+    };
+
+    // Area weighted centroids and normals
+    glm::vec3 mesh_centroid(0.0f);
+    float mesh_area = 0.0f;
+    uint32_t cluster_count = clusters.size() - 1;
+    std::vector<glm::vec3> centroids(cluster_count, glm::vec3(0.0f));
+    std::vector<glm::vec3> normals(cluster_count, glm::vec3(0.0f));
+    for (uint32_t c = 0; c < cluster_count; c++) {
+      float cluster_area = 0.0f;
+      for (uint32_t t = clusters[c]; t < clusters[c + 1]; t++) {
+        glm::vec3 p0 = position((*indices)[t * 3]);
+        glm::vec3 p1 = position((*indices)[t * 3 + 1]);
+        glm::vec3 p2 = position((*indices)[t * 3 + 2]);
+        glm::vec3 n = glm::cross(p1 - p0, p2 - p0);
+        float area = glm::length(n);
+        centroids[c] += (p0 + p1 + p2) * (area / 3.0f);
+        normals[c] += n;
+        cluster_area += area;
+      }
+      mesh_centroid += centroids[c];
+      mesh_area += cluster_area;
+      if (cluster_area > 0.0f)
+        centroids[c] /= cluster_area;
+      if (glm::length(normals[c]) > 0.0f)
+        normals[c] = glm::normalize(normals[c]);
+    }
+    if (mesh_area > 0.0f)
+      mesh_centroid /= mesh_area;
+
+    std::vector<float> sort_key(cluster_count);
+    std::vector<uint32_t> order(cluster_count);
+    for (uint32_t c = 0; c < cluster_count; c++) {
+      sort_key[c] = glm::dot(centroids[c] - mesh_centroid, normals[c]);
+      order[c] = c;
+    }
+    std::stable_sort(order.begin(), order.end(), [&sort_key](uint32_t a, uint32_t b) {
+      return sort_key[a] > sort_key[b];
+    });
+
+    std::vector<uint32_t> output;
+    output.reserve(indices->size());
+    for (uint32_t c : order)
+      output.insert(output.end(),
+                    indices->begin() + clusters[c] * 3,
+                    indices->begin() + clusters[c + 1] * 3);
+    *indices = std::move(output);
+  }
+
+  // Store vertices in the order the triangles first use them
+  template <typename T>
+  static void optimize_vertex_fetch(std::vector<T> *vertices, uint32_t stride,
+                                    std::vector<uint32_t> *indices) {
+    uint32_t vertex_count = vertices->size() / stride;
+    std::vector<uint32_t> remap(vertex_count, UINT32_MAX);
+    std::vector<T> reordered;
+    reordered.reserve(vertices->size());
+
+    for (auto& index : *indices) {
+      if (remap[index] == UINT32_MAX) {
+        remap[index] = reordered.size() / stride;
+        reordered.insert(reordered.end(), vertices->begin() + index * stride,
+                         vertices->begin() + (index + 1) * stride);
+      }
+      index = remap[index];
+    }
+
+    // Unreferenced vertices are dropped
+    *vertices = std::move(reordered);
+  }
+
+ private:
+  static float get_vertex_score(int32_t cache_position, uint32_t valence) {
+    // No open triangles left
+    if (valence == 0)
+      return -1.0f;
+
+    float score = 0.0f;
+    if (cache_position >= 0) {
+      // The last triangle's vertices score the same, so no direction is preferred
+      if (cache_position < 3)
+        score = 0.75f;
+      else
+        score = powf(1.0f - (float) (cache_position - 3) / (SCORE_CACHE_SIZE - 3), 1.5f);
+    }
+
+    // Favor vertices with few open triangles, to finish them off
+    score += 2.0f * powf((float) valence, -0.5f);
+    return score;
+  }
+};
+}  // namespace vik
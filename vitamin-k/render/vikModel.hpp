@@ -28,6 +28,9 @@
 
 #include "vikDevice.hpp"
 #include "vikBuffer.hpp"
+#include "vikMeshOptimizer.hpp"
+#include "../system/vikAssetPack.hpp"
+#include "../system/vikTrace.hpp"
 
 namespace vik {
 /** @brief Vertex layout components */
@@ -101,8 +104,10 @@ struct Model {
   Buffer indices;
   uint32_t indexCount = 0;
   uint32_t vertexCount = 0;
+  /** @brief 16 bit when every part has fewer than 65536 vertices */
+  VkIndexType indexType = VK_INDEX_TYPE_UINT32;
 
-  /** @brief Stores vertex and index base and counts for each part of a model */
+  /** @brief Stores vertex and index base and counts for each part of a model, indices are relative to the part's vertexBase */
   struct ModelPart {
     uint32_t vertexBase;
     uint32_t vertexCount;
@@ -119,30 +124,77 @@ struct Model {
     glm::vec3 size;
   } dim;
 
+  /** @brief Bind the vertex and index buffers and draw all parts */
+  void draw(VkCommandBuffer commandBuffer, uint32_t firstInstance = 0,
+            uint32_t instanceCount = 1) {
+    VkDeviceSize offsets[1] = { 0 };
+    vkCmdBindVertexBuffers(commandBuffer, 0, 1, &vertices.buffer, offsets);
+    vkCmdBindIndexBuffer(commandBuffer, indices.buffer, 0, indexType);
+    for (auto& part : parts)
+      vkCmdDrawIndexed(commandBuffer, part.indexCount, instanceCount, part.indexBase,
+                       static_cast<int32_t>(part.vertexBase), firstInstance);
+  }
+
   /** @brief Release all Vulkan resources of this model */
   void destroy() {
     assert(device);
-    vkDestroyBuffer(device, vertices.buffer, nullptr);
-    vkFreeMemory(device, vertices.memory, nullptr);
-    if (indices.buffer != VK_NULL_HANDLE) {
-      vkDestroyBuffer(device, indices.buffer, nullptr);
-      vkFreeMemory(device, indices.memory, nullptr);
-    }
+    vertices.destroy();
+    indices.destroy();
   }
 
   /**
     * Loads a 3D model from a file into Vulkan buffers
     *
+    * @note Uses the cooked model from the asset pack when there is one for this layout
+    *
     * @param device Pointer to the Vulkan device used to generated the vertex and index buffers on
     * @param filename File to load (must be a model format supported by ASSIMP)
     * @param layout Vertex layout components (position, normals, tangents, etc.)
     * @param createInfo MeshCreateInfo structure for load time settings like scale, center, etc.
-    * @param copyQueue Queue used for the memory staging copy commands (must support transfer)
     * @param (Optional) flags ASSIMP model loading flags
     */
-  bool loadFromFile(const std::string& filename, VertexLayout layout, ModelCreateInfo *createInfo, Device *device, VkQueue copyQueue, const int flags = defaultFlags) {
-    this->device = device->logicalDevice;
+  bool loadFromFile(const std::string& filename, VertexLayout layout, ModelCreateInfo *createInfo, Device *device, const int flags = defaultFlags) {
+    vik_trace_zone("load_model");
+
+    if (loadFromPack(filename, layout, createInfo, device, flags))
+      return true;
 
+    std::vector<float> vertexBuffer;
+    std::vector<uint32_t> indexBuffer;
+    if (!loadVertices(filename, layout, createInfo, &vertexBuffer, &indexBuffer, flags))
+      return false;
+
+    if (indexType == VK_INDEX_TYPE_UINT16) {
+      std::vector<uint16_t> shortIndices(indexBuffer.begin(), indexBuffer.end());
+      upload(device,
+             vertexBuffer.data(), vertexBuffer.size() * sizeof(float),
+             shortIndices.data(), shortIndices.size() * sizeof(uint16_t));
+    } else {
+      upload(device,
+             vertexBuffer.data(), vertexBuffer.size() * sizeof(float),
+             indexBuffer.data(), indexBuffer.size() * sizeof(uint32_t));
+    }
+    return true;
+  }
+
+  /**
+    * Loads the vertices of a 3D model from a file, converted to a vertex layout
+    *
+    * Each part is deduplicated and reordered for the vertex cache, overdraw and vertex fetch.
+    * Indices are relative to the part, and should be stored as indexType.
+    *
+    * @note Does not create any Vulkan resources, used by the asset cooker
+    *
+    * @param filename File to load (must be a model format supported by ASSIMP)
+    * @param layout Vertex layout components (position, normals, tangents, etc.)
+    * @param createInfo MeshCreateInfo structure for load time settings like scale, center, etc.
+    * @param vertexBuffer Interleaved vertex data
+    * @param indexBuffer Triangle list indices
+    * @param (Optional) flags ASSIMP model loading flags
+    */
+  bool loadVertices(const std::string& filename, VertexLayout layout, ModelCreateInfo *createInfo,
+                    std::vector<float> *vertexBuffer, std::vector<uint32_t> *indexBuffer,
+                    const int flags = defaultFlags) {
     Assimp::Importer Importer;
     const aiScene* pScene;
 
@@ -162,21 +214,27 @@ struct Model {
         center = createInfo->center;
       }
 
-      std::vector<float> vertexBuffer;
-      std::vector<uint32_t> indexBuffer;
-
       vertexCount = 0;
       indexCount = 0;
 
+      const uint32_t stride = layout.stride() / sizeof(float);
+      int32_t positionOffset = -1;
+      uint32_t componentOffset = 0;
+      for (auto& component : layout.components) {
+        if (component == VERTEX_COMPONENT_POSITION)
+          positionOffset = componentOffset;
+        componentOffset += VertexLayout({ component }).stride() / sizeof(float);
+      }
+
+      MeshStats imported, optimized;
+      indexType = VK_INDEX_TYPE_UINT16;
+
       // Load meshes
       for (unsigned int i = 0; i < pScene->mNumMeshes; i++) {
         const aiMesh* paiMesh = pScene->mMeshes[i];
 
-        parts[i] = {};
-        parts[i].vertexBase = vertexCount;
-        parts[i].indexBase = indexCount;
-
-        vertexCount += pScene->mMeshes[i]->mNumVertices;
+        std::vector<float> partVertices;
+        std::vector<uint32_t> partIndices;
 
         aiColor3D pColor(0.f, 0.f, 0.f);
         pScene->mMaterials[paiMesh->mMaterialIndex]->Get(AI_MATKEY_COLOR_DIFFUSE, pColor);
@@ -193,43 +251,43 @@ struct Model {
           for (auto& component : layout.components) {
             switch (component) {
               case VERTEX_COMPONENT_POSITION:
-                vertexBuffer.push_back(pPos->x * scale.x + center.x);
-                vertexBuffer.push_back(-pPos->y * scale.y + center.y);
-                vertexBuffer.push_back(pPos->z * scale.z + center.z);
+                partVertices.push_back(pPos->x * scale.x + center.x);
+                partVertices.push_back(-pPos->y * scale.y + center.y);
+                partVertices.push_back(pPos->z * scale.z + center.z);
                 break;
               case VERTEX_COMPONENT_NORMAL:
-                vertexBuffer.push_back(pNormal->x);
-                vertexBuffer.push_back(-pNormal->y);
-                vertexBuffer.push_back(pNormal->z);
+                partVertices.push_back(pNormal->x);
+                partVertices.push_back(-pNormal->y);
+                partVertices.push_back(pNormal->z);
                 break;
               case VERTEX_COMPONENT_UV:
-                vertexBuffer.push_back(pTexCoord->x * uvscale.s);
-                vertexBuffer.push_back(pTexCoord->y * uvscale.t);
+                partVertices.push_back(pTexCoord->x * uvscale.s);
+                partVertices.push_back(pTexCoord->y * uvscale.t);
                 break;
               case VERTEX_COMPONENT_COLOR:
-                vertexBuffer.push_back(pColor.r);
-                vertexBuffer.push_back(pColor.g);
-                vertexBuffer.push_back(pColor.b);
+                partVertices.push_back(pColor.r);
+                partVertices.push_back(pColor.g);
+                partVertices.push_back(pColor.b);
                 break;
               case VERTEX_COMPONENT_TANGENT:
-                vertexBuffer.push_back(pTangent->x);
-                vertexBuffer.push_back(pTangent->y);
-                vertexBuffer.push_back(pTangent->z);
+                partVertices.push_back(pTangent->x);
+                partVertices.push_back(pTangent->y);
+                partVertices.push_back(pTangent->z);
                 break;
               case VERTEX_COMPONENT_BITANGENT:
-                vertexBuffer.push_back(pBiTangent->x);
-                vertexBuffer.push_back(pBiTangent->y);
-                vertexBuffer.push_back(pBiTangent->z);
+                partVertices.push_back(pBiTangent->x);
+                partVertices.push_back(pBiTangent->y);
+                partVertices.push_back(pBiTangent->z);
                 break;
                 // Dummy components for padding
               case VERTEX_COMPONENT_DUMMY_FLOAT:
-                vertexBuffer.push_back(0.0f);
+                partVertices.push_back(0.0f);
                 break;
               case VERTEX_COMPONENT_DUMMY_VEC4:
-                vertexBuffer.push_back(0.0f);
-                vertexBuffer.push_back(0.0f);
-                vertexBuffer.push_back(0.0f);
-                vertexBuffer.push_back(0.0f);
+                partVertices.push_back(0.0f);
+                partVertices.push_back(0.0f);
+                partVertices.push_back(0.0f);
+                partVertices.push_back(0.0f);
                 break;
             }
           }
@@ -245,84 +303,162 @@ struct Model {
 
         dim.size = dim.max - dim.min;
 
-        parts[i].vertexCount = paiMesh->mNumVertices;
-
-        uint32_t indexBase = static_cast<uint32_t>(indexBuffer.size());
         for (unsigned int j = 0; j < paiMesh->mNumFaces; j++) {
           const aiFace& Face = paiMesh->mFaces[j];
           if (Face.mNumIndices != 3)
             continue;
-          indexBuffer.push_back(indexBase + Face.mIndices[0]);
-          indexBuffer.push_back(indexBase + Face.mIndices[1]);
-          indexBuffer.push_back(indexBase + Face.mIndices[2]);
-          parts[i].indexCount += 3;
-          indexCount += 3;
+          partIndices.push_back(Face.mIndices[0]);
+          partIndices.push_back(Face.mIndices[1]);
+          partIndices.push_back(Face.mIndices[2]);
         }
-      }
-
-
-      uint32_t vBufferSize = static_cast<uint32_t>(vertexBuffer.size()) * sizeof(float);
-      uint32_t iBufferSize = static_cast<uint32_t>(indexBuffer.size()) * sizeof(uint32_t);
 
-      // Use staging buffer to move vertex and index buffer to device local memory
-      // Create staging buffers
-      Buffer vertexStaging, indexStaging;
+        imported.add(MeshOptimizer::get_stats(partVertices, stride, partIndices, sizeof(uint32_t)));
+        MeshOptimizer::optimize(&partVertices, stride, positionOffset, &partIndices);
+        optimized.add(MeshOptimizer::get_stats(partVertices, stride, partIndices, sizeof(uint32_t)));
+
+        uint32_t partVertexCount = static_cast<uint32_t>(partVertices.size() / stride);
+        if (partVertexCount >= 65536)
+          indexType = VK_INDEX_TYPE_UINT32;
+
+        parts[i] = {
+          .vertexBase = vertexCount,
+          .vertexCount = partVertexCount,
+          .indexBase = indexCount,
+          .indexCount = static_cast<uint32_t>(partIndices.size())
+        };
+        vertexCount += parts[i].vertexCount;
+        indexCount += parts[i].indexCount;
+
+        vertexBuffer->insert(vertexBuffer->end(), partVertices.begin(), partVertices.end());
+        indexBuffer->insert(indexBuffer->end(), partIndices.begin(), partIndices.end());
+      }
 
-      // Vertex buffer
-      vik_log_check(device->createBuffer(
-                        VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-                        VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT,
-                        &vertexStaging,
-                        vBufferSize,
-                        vertexBuffer.data()));
+      if (indexType == VK_INDEX_TYPE_UINT16)
+        optimized.index_bytes = indexCount * sizeof(uint16_t);
+      imported.print_comparison(filename, optimized);
 
-      // Index buffer
-      vik_log_check(device->createBuffer(
-                        VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-                        VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT,
-                        &indexStaging,
-                        iBufferSize,
-                        indexBuffer.data()));
+      return true;
+    } else {
+      printf("Error parsing '%s': '%s'\n", filename.c_str(), Importer.GetErrorString());
+      return false;
+    }
+  }
 
-      // Create device local target buffers
-      // Vertex buffer
-      vik_log_check(device->createBuffer(
-                        VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
-                        VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
-                        &vertices,
-                        vBufferSize));
+  /**
+    * Loads a cooked 3D model from the mapped asset pack into Vulkan buffers
+    *
+    * @return false if the pack has no model cooked with these parameters
+    */
+  bool loadFromPack(const std::string& filename, VertexLayout layout, ModelCreateInfo *createInfo, Device *device, const int flags = defaultFlags) {
+    AssetPack& pack = AssetPack::get();
+
+    const PackEntry *entry = nullptr;
+    while ((entry = pack.find(filename, PACK_ENTRY_MODEL, entry)) != nullptr) {
+      if (entry->size < sizeof(PackModel))
+        continue;
+      const PackModel *cooked = pack.get<PackModel>(entry->offset);
+      if (!isCookedWith(cooked, layout, createInfo, flags))
+        continue;
+      uint32_t indexSize = cooked->index_type == VK_INDEX_TYPE_UINT16 ? sizeof(uint16_t) : sizeof(uint32_t);
+      if ((cooked->index_type != VK_INDEX_TYPE_UINT16 && cooked->index_type != VK_INDEX_TYPE_UINT32)
+          || cooked->index_size != (uint64_t) cooked->index_count * indexSize)
+        continue;
+      if (!pack.contains(cooked->vertex_offset, cooked->vertex_size)
+          || !pack.contains(cooked->index_offset, cooked->index_size)
+          || !pack.contains(cooked->parts_offset, cooked->part_count * sizeof(PackModelPart)))
+        continue;
+      if (cooked->vertex_size != (uint64_t) cooked->vertex_count * layout.stride()
+          || !hasValidParts(cooked, pack.get<PackModelPart>(cooked->parts_offset))) {
+        vik_log_w("Cooked %s is inconsistent, loading the source file.", entry->name);
+        continue;
+      }
 
-      // Index buffer
-      vik_log_check(device->createBuffer(
-                        VK_BUFFER_USAGE_INDEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
-                        VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
-                        &indices,
-                        iBufferSize));
+      vertexCount = cooked->vertex_count;
+      indexCount = cooked->index_count;
+      indexType = static_cast<VkIndexType>(cooked->index_type);
+
+      const PackModelPart *cookedParts = pack.get<PackModelPart>(cooked->parts_offset);
+      parts.resize(cooked->part_count);
+      for (uint32_t i = 0; i < cooked->part_count; i++)
+        parts[i] = {
+          .vertexBase = cookedParts[i].vertex_base,
+          .vertexCount = cookedParts[i].vertex_count,
+          .indexBase = cookedParts[i].index_base,
+          .indexCount = cookedParts[i].index_count
+        };
+
+      dim.min = glm::make_vec3(cooked->dim_min);
+      dim.max = glm::make_vec3(cooked->dim_max);
+      dim.size = dim.max - dim.min;
+
+      upload(device,
+             pack.get<uint8_t>(cooked->vertex_offset), cooked->vertex_size,
+             pack.get<uint8_t>(cooked->index_offset), cooked->index_size);
+
+      vik_log_d("Loaded %s from the asset pack.", entry->name);
+      return true;
+    }
+    return false;
+  }
 
-      // Copy from staging buffers
-      VkCommandBuffer copyCmd = device->createCommandBuffer(VK_COMMAND_BUFFER_LEVEL_PRIMARY, true);
+  /** @brief Create device local buffers and copy the vertices and indices to them */
+  void upload(Device *device,
+              const void *vertexData, VkDeviceSize vBufferSize,
+              const void *indexData, VkDeviceSize iBufferSize) {
+    this->device = device->logicalDevice;
 
-      VkBufferCopy copyRegion{};
+    // Create device local target buffers
+    // Vertex buffer
+    vik_log_check(device->createBuffer(
+                      VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                      VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                      &vertices,
+                      vBufferSize));
+
+    // Index buffer
+    vik_log_check(device->createBuffer(
+                      VK_BUFFER_USAGE_INDEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                      VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                      &indices,
+                      iBufferSize));
+
+    // Copy through the staging ring in the next upload batch
+    device->upload_batcher.upload_buffer(vertexData, vBufferSize, vertices.buffer,
+                                         VK_PIPELINE_STAGE_VERTEX_INPUT_BIT,
+                                         VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT);
+    device->upload_batcher.upload_buffer(indexData, iBufferSize, indices.buffer,
+                                         VK_PIPELINE_STAGE_VERTEX_INPUT_BIT,
+                                         VK_ACCESS_INDEX_READ_BIT);
+  }
 
-      copyRegion.size = vertices.size;
-      vkCmdCopyBuffer(copyCmd, vertexStaging.buffer, vertices.buffer, 1, &copyRegion);
+  /** @brief Whether a cooked model was converted with the same parameters as a load */
+  static bool isCookedWith(const PackModel *cooked, const VertexLayout &layout,
+                           ModelCreateInfo *createInfo, const int flags) {
+    if (cooked->import_flags != (uint32_t) flags
+        || cooked->component_count > PACK_MAX_COMPONENTS
+        || cooked->component_count != layout.components.size())
+      return false;
 
-      copyRegion.size = indices.size;
-      vkCmdCopyBuffer(copyCmd, indexStaging.buffer, indices.buffer, 1, &copyRegion);
+    for (uint32_t i = 0; i < cooked->component_count; i++)
+      if (cooked->components[i] != (uint32_t) layout.components[i])
+        return false;
 
-      device->flushCommandBuffer(copyCmd, copyQueue);
+    ModelCreateInfo defaultInfo(glm::vec3(1.0f), glm::vec2(1.0f), glm::vec3(0.0f));
+    if (createInfo == nullptr)
+      createInfo = &defaultInfo;
 
-      // Destroy staging resources
-      vkDestroyBuffer(device->logicalDevice, vertexStaging.buffer, nullptr);
-      vkFreeMemory(device->logicalDevice, vertexStaging.memory, nullptr);
-      vkDestroyBuffer(device->logicalDevice, indexStaging.buffer, nullptr);
-      vkFreeMemory(device->logicalDevice, indexStaging.memory, nullptr);
+    return glm::make_vec3(cooked->scale) == createInfo->scale
+        && glm::make_vec2(cooked->uvscale) == createInfo->uvscale
+        && glm::make_vec3(cooked->center) == createInfo->center;
+  }
 
-      return true;
-    } else {
-      printf("Error parsing '%s': '%s'\n", filename.c_str(), Importer.GetErrorString());
-      return false;
-    }
+  /** @brief Whether all cooked parts lie within the cooked vertex and index ranges */
+  static bool hasValidParts(const PackModel *cooked, const PackModelPart *cookedParts) {
+    for (uint32_t i = 0; i < cooked->part_count; i++)
+      if ((uint64_t) cookedParts[i].vertex_base + cookedParts[i].vertex_count > cooked->vertex_count
+          || (uint64_t) cookedParts[i].index_base + cookedParts[i].index_count > cooked->index_count)
+        return false;
+    return true;
   }
 
   /**
@@ -332,12 +468,11 @@ struct Model {
     * @param filename File to load (must be a model format supported by ASSIMP)
     * @param layout Vertex layout components (position, normals, tangents, etc.)
     * @param scale Load time scene scale
-    * @param copyQueue Queue used for the memory staging copy commands (must support transfer)
     * @param (Optional) flags ASSIMP model loading flags
     */
-  bool loadFromFile(const std::string& filename, VertexLayout layout, float scale, Device *device, VkQueue copyQueue, const int flags = defaultFlags) {
+  bool loadFromFile(const std::string& filename, VertexLayout layout, float scale, Device *device, const int flags = defaultFlags) {
     ModelCreateInfo modelCreateInfo(scale, 1.0f, 0.0f);
-    return loadFromFile(filename, layout, &modelCreateInfo, device, copyQueue, flags);
+    return loadFromFile(filename, layout, &modelCreateInfo, device, flags);
   }
 };
 }  // namespace vik
@@ -24,6 +24,7 @@ namespace vik {
 class OffscreenPass {
  private:
   VkDevice device;
+  MemoryAllocator *allocator = nullptr;
 
   // One sampler for the frame buffer color attachments
   VkSampler colorSampler;
@@ -31,13 +32,15 @@ class OffscreenPass {
   // Framebuffer for offscreen rendering
   struct FrameBufferAttachment {
     VkImage image;
-    VkDeviceMemory mem;
+    Allocation allocation;
     VkImageView view;
     VkFormat format;
   };
 
   struct FrameBuffer {
     uint32_t width, height;
+    // One layer per eye with multiview, else both eyes side by side
+    uint32_t layers;
     VkFramebuffer frameBuffer;
     FrameBufferAttachment diffuseColor;
     FrameBufferAttachment depth;
@@ -55,12 +58,12 @@ class OffscreenPass {
     // Color attachments
     vkDestroyImageView(device, offScreenFrameBuf.diffuseColor.view, nullptr);
     vkDestroyImage(device, offScreenFrameBuf.diffuseColor.image, nullptr);
-    vkFreeMemory(device, offScreenFrameBuf.diffuseColor.mem, nullptr);
+    allocator->free(offScreenFrameBuf.diffuseColor.allocation);
 
     // Depth attachment
     vkDestroyImageView(device, offScreenFrameBuf.depth.view, nullptr);
     vkDestroyImage(device, offScreenFrameBuf.depth.image, nullptr);
-    vkFreeMemory(device, offScreenFrameBuf.depth.mem, nullptr);
+    allocator->free(offScreenFrameBuf.depth.allocation);
 
     vkDestroyFramebuffer(device, offScreenFrameBuf.frameBuffer, nullptr);
 
@@ -85,27 +88,18 @@ class OffscreenPass {
         .depth = 1
       },
       .mipLevels = 1,
-      .arrayLayers = 1,
+      .arrayLayers = offScreenFrameBuf.layers,
       .samples = VK_SAMPLE_COUNT_1_BIT,
       .tiling = VK_IMAGE_TILING_OPTIMAL
     };
 
     image.usage = usage | VK_IMAGE_USAGE_SAMPLED_BIT;
 
-    VkMemoryRequirements memReqs;
     vik_log_check(vkCreateImage(device, &image, nullptr, &attachment->image));
-    vkGetImageMemoryRequirements(device, attachment->image, &memReqs);
-
-    VkMemoryAllocateInfo memAlloc = {
-      .sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
-      .allocationSize = memReqs.size,
-      .memoryTypeIndex =
-        vulkanDevice->getMemoryType(memReqs.memoryTypeBits,
-                                    VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT)
-    };
 
-    vik_log_check(vkAllocateMemory(device, &memAlloc, nullptr, &attachment->mem));
-    vik_log_check(vkBindImageMemory(device, attachment->image, attachment->mem, 0));
+    allocator = &vulkanDevice->allocator;
+    attachment->allocation = allocator->allocate_image(
+          attachment->image, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
 
     VkImageAspectFlags aspectMask = 0;
     if (usage & VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT) {
@@ -118,24 +112,32 @@ class OffscreenPass {
     VkImageViewCreateInfo imageView = {
       .sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
       .image = attachment->image,
-      .viewType = VK_IMAGE_VIEW_TYPE_2D,
+      .viewType = offScreenFrameBuf.layers > 1 ? VK_IMAGE_VIEW_TYPE_2D_ARRAY
+                                               : VK_IMAGE_VIEW_TYPE_2D,
       .format = format,
       .subresourceRange = {
         .aspectMask = aspectMask,
         .baseMipLevel = 0,
         .levelCount = 1,
         .baseArrayLayer = 0,
-        .layerCount = 1,
+        .layerCount = offScreenFrameBuf.layers,
       },
     };
 
     vik_log_check(vkCreateImageView(device, &imageView, nullptr, &attachment->view));
   }
 
-  // Prepare a new framebuffer and attachments for offscreen rendering (G-Buffer)
-  void init_offscreen_framebuffer(Device *vulkanDevice, const VkPhysicalDevice& physicalDevice) {
-    offScreenFrameBuf.width = FB_DIM;
+  /*
+   * Prepare a new framebuffer and attachments for offscreen rendering.
+   * With multiview both eyes are rendered by one draw into the two layers
+   * of the attachments, the device needs to have enabled VK_KHR_multiview.
+   */
+  void init_offscreen_framebuffer(Device *vulkanDevice, const VkPhysicalDevice& physicalDevice,
+                                  bool multiview = false) {
+    // Same size per eye in both modes
+    offScreenFrameBuf.width = multiview ? FB_DIM / 2 : FB_DIM;
     offScreenFrameBuf.height = FB_DIM;
+    offScreenFrameBuf.layers = multiview ? 2 : 1;
 
     // Color attachments
     // (World space) Positions
@@ -229,6 +231,18 @@ class OffscreenPass {
       .pDependencies = dependencies.data()
     };
 
+    // Broadcast the subpass to both layers, the views are correlated
+    const uint32_t view_mask = 0x3;
+    VkRenderPassMultiviewCreateInfoKHR multiview_info = {
+      .sType = VK_STRUCTURE_TYPE_RENDER_PASS_MULTIVIEW_CREATE_INFO_KHR,
+      .subpassCount = 1,
+      .pViewMasks = &view_mask,
+      .correlationMaskCount = 1,
+      .pCorrelationMasks = &view_mask
+    };
+    if (multiview)
+      renderPassInfo.pNext = &multiview_info;
+
     vik_log_check(vkCreateRenderPass(device, &renderPassInfo,
                                      nullptr, &offScreenFrameBuf.renderPass));
 
@@ -293,7 +307,8 @@ class OffscreenPass {
     };
   }
 
-  void beginRenderPass(const VkCommandBuffer& cmdBuffer) {
+  void beginRenderPass(const VkCommandBuffer& cmdBuffer,
+                       VkSubpassContents contents = VK_SUBPASS_CONTENTS_INLINE) {
     // Clear values for all attachments written in the fragment sahder
     std::array<VkClearValue, 2> clearValues;
     clearValues[0].color = { { 1.0f, 1.0f, 1.0f, 1.0f } };
@@ -313,8 +328,7 @@ class OffscreenPass {
       .pClearValues = clearValues.data()
     };
 
-    vkCmdBeginRenderPass(cmdBuffer, &renderPassBeginInfo,
-                         VK_SUBPASS_CONTENTS_INLINE);
+    vkCmdBeginRenderPass(cmdBuffer, &renderPassBeginInfo, contents);
   }
 
   void setViewPortAndScissor(const VkCommandBuffer& cmdBuffer) {
@@ -336,7 +350,13 @@ class OffscreenPass {
     vkCmdSetScissor(cmdBuffer, 0, 1, &scissor);
   }
 
+  // Both eyes side by side, a layer per eye needs no stereo viewports
   void setViewPortAndScissorStereo(const VkCommandBuffer& cmdBuffer) {
+    if (is_multiview()) {
+      setViewPortAndScissor(cmdBuffer);
+      return;
+    }
+
     VkViewport viewports[2];
 
     uint32_t w = offScreenFrameBuf.width, h = offScreenFrameBuf.height;
@@ -361,8 +381,16 @@ class OffscreenPass {
     vkCmdSetScissor(cmdBuffer, 0, 2, scissorRects);
   }
 
+  bool is_multiview() {
+    return offScreenFrameBuf.layers > 1;
+  }
+
   VkRenderPass getRenderPass() {
     return offScreenFrameBuf.renderPass;
   }
+
+  VkFramebuffer getFrameBuffer() {
+    return offScreenFrameBuf.frameBuffer;
+  }
 };
 }  // namespace vik
@@ -0,0 +1,228 @@
+/*
+ * vitamin-k
+ *
+ * Copyright 2017-2018 Collabora Ltd.
+ *
+ * Authors: Lubosz Sarnecki <lubosz.sarnecki@collabora.com>
+ * SPDX-License-Identifier: MIT
+ */
+
+#pragma once
+
+#include <vulkan/vulkan.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "../system/vikLog.hpp"
+#include "../system/vikTrace.hpp"
+
+namespace vik {
+
+/*
+ * Copy of a graphics pipeline create info and all the state it points to,
+ * so it stays valid after the caller's stack frame is gone.
+ * pNext chains and specialization info are not copied.
+ */
+class PipelineDescription {
+  std::vector<VkPipelineShaderStageCreateInfo> stages;
+  std::vector<VkVertexInputBindingDescription> vertex_bindings;
+  std::vector<VkVertexInputAttributeDescription> vertex_attributes;
+  std::vector<VkViewport> viewports;
+  std::vector<VkRect2D> scissors;
+  std::vector<VkPipelineColorBlendAttachmentState> blend_attachments;
+  std::vector<VkDynamicState> dynamic_states;
+
+  VkPipelineVertexInputStateCreateInfo vertex_input;
+  VkPipelineInputAssemblyStateCreateInfo input_assembly;
+  VkPipelineTessellationStateCreateInfo tessellation;
+  VkPipelineViewportStateCreateInfo viewport;
+  VkPipelineRasterizationStateCreateInfo rasterization;
+  VkPipelineMultisampleStateCreateInfo multisample;
+  VkPipelineDepthStencilStateCreateInfo depth_stencil;
+  VkPipelineColorBlendStateCreateInfo color_blend;
+  VkPipelineDynamicStateCreateInfo dynamic;
+
+  VkGraphicsPipelineCreateInfo info;
+
+ public:
+  explicit PipelineDescription(const VkGraphicsPipelineCreateInfo &i) {
+    info = i;
+
+    stages.assign(i.pStages, i.pStages + i.stageCount);
+    info.pStages = stages.data();
+
+    if (i.pVertexInputState) {
+      vertex_input = *i.pVertexInputState;
+      copy(&vertex_bindings, vertex_input.pVertexBindingDescriptions,
+           vertex_input.vertexBindingDescriptionCount);
+      copy(&vertex_attributes, vertex_input.pVertexAttributeDescriptions,
+           vertex_input.vertexAttributeDescriptionCount);
+      vertex_input.pVertexBindingDescriptions = vertex_bindings.data();
+      vertex_input.pVertexAttributeDescriptions = vertex_attributes.data();
+      info.pVertexInputState = &vertex_input;
+    }
+
+    if (i.pViewportState) {
+      viewport = *i.pViewportState;
+      copy(&viewports, viewport.pViewports, viewport.viewportCount);
+      copy(&scissors, viewport.pScissors, viewport.scissorCount);
+      viewport.pViewports = viewports.empty() ? nullptr : viewports.data();
+      viewport.pScissors = scissors.empty() ? nullptr : scissors.data();
+      info.pViewportState = &viewport;
+    }
+
+    if (i.pColorBlendState) {
+      color_blend = *i.pColorBlendState;
+      copy(&blend_attachments, color_blend.pAttachments,
+           color_blend.attachmentCount);
+      color_blend.pAttachments = blend_attachments.data();
+      info.pColorBlendState = &color_blend;
+    }
+
+    if (i.pDynamicState) {
+      dynamic = *i.pDynamicState;
+      copy(&dynamic_states, dynamic.pDynamicStates, dynamic.dynamicStateCount);
+      dynamic.pDynamicStates = dynamic_states.data();
+      info.pDynamicState = &dynamic;
+    }
+
+    copy_state(&input_assembly, i.pInputAssemblyState, &info.pInputAssemblyState);
+    copy_state(&tessellation, i.pTessellationState, &info.pTessellationState);
+    copy_state(&rasterization, i.pRasterizationState, &info.pRasterizationState);
+    copy_state(&multisample, i.pMultisampleState, &info.pMultisampleState);
+    copy_state(&depth_stencil, i.pDepthStencilState, &info.pDepthStencilState);
+  }
+
+  const VkGraphicsPipelineCreateInfo* get_create_info() {
+    return &info;
+  }
+
+  void destroy_shader_modules(VkDevice device) {
+    for (auto& stage : stages)
+      vkDestroyShaderModule(device, stage.module, nullptr);
+  }
+
+ private:
+  template <typename T>
+  static void copy(std::vector<T> *dst, const T *src, uint32_t count) {
+    if (src != nullptr)
+      dst->assign(src, src + count);
+  }
+
+  template <typename T>
+  static void copy_state(T *dst, const T *src, const T **pointer) {
+    if (src == nullptr)
+      return;
+    *dst = *src;
+    *pointer = dst;
+  }
+};
+
+/*
+ * Compiles graphics pipelines on a pool of worker threads.
+ *
+ * All pipelines are created against the renderer's pipeline cache, which
+ * Vulkan synchronizes internally. build() returns right away, so the
+ * application can load assets while the driver compiles shaders, and only
+ * waits on the future once it needs the pipeline.
+ *
+ * The builder takes ownership of the shader modules in the create info and
+ * destroys them once the pipeline is built.
+ */
+class PipelineBuilder {
+  struct Job {
+    std::unique_ptr<PipelineDescription> description;
+    std::promise<VkPipeline> promise;
+  };
+
+  VkDevice device = VK_NULL_HANDLE;
+  VkPipelineCache pipeline_cache = VK_NULL_HANDLE;
+
+  std::vector<std::thread> workers;
+  std::deque<Job> jobs;
+  std::mutex mutex;
+  std::condition_variable jobs_available;
+  bool stopping = false;
+
+ public:
+  ~PipelineBuilder() {
+    destroy();
+  }
+
+  void init(VkDevice d, VkPipelineCache cache) {
+    device = d;
+    pipeline_cache = cache;
+
+    // Leave a core to the thread recording the scene
+    uint32_t thread_count =
+        std::max(std::thread::hardware_concurrency(), 2u) - 1;
+
+    for (uint32_t i = 0; i < thread_count; i++)
+      workers.push_back(std::thread([this]() { work(); }));
+
+    vik_log_d("Building pipelines on %d threads.", thread_count);
+  }
+
+  // Finishes the queued jobs before joining the workers
+  void destroy() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    jobs_available.notify_all();
+
+    for (auto& worker : workers)
+      worker.join();
+    workers.clear();
+  }
+
+  std::shared_future<VkPipeline> build(const VkGraphicsPipelineCreateInfo &info) {
+    Job job;
+    job.description.reset(new PipelineDescription(info));
+    std::shared_future<VkPipeline> future = job.promise.get_future().share();
+
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      vik_log_f_if(stopping, "Pipeline builder was already destroyed.");
+      jobs.push_back(std::move(job));
+    }
+    jobs_available.notify_one();
+
+    return future;
+  }
+
+ private:
+  void work() {
+    while (true) {
+      Job job;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        jobs_available.wait(lock, [this]() {
+          return stopping || !jobs.empty();
+        });
+        if (jobs.empty())
+          return;
+        job = std::move(jobs.front());
+        jobs.pop_front();
+      }
+
+      vik_trace_zone("build_pipeline");
+
+      VkPipeline pipeline;
+      vik_log_check(vkCreateGraphicsPipelines(
+                      device, pipeline_cache, 1,
+                      job.description->get_create_info(), nullptr, &pipeline));
+      job.description->destroy_shader_modules(device);
+
+      job.promise.set_value(pipeline);
+    }
+  }
+};
+}  // namespace vik
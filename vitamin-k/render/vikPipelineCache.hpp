@@ -0,0 +1,215 @@
+/*
+ * vitamin-k
+ *
+ * Copyright 2017-2018 Collabora Ltd.
+ *
+ * Authors: Lubosz Sarnecki <lubosz.sarnecki@collabora.com>
+ * SPDX-License-Identifier: MIT
+ */
+
+#pragma once
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <vulkan/vulkan.h>
+
+#include <cctype>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "../system/vikLog.hpp"
+
+namespace vik {
+
+/*
+ * Pipeline cache kept on disk between runs.
+ *
+ * The file lives in $XDG_CACHE_HOME/vitamin-k, falling back to
+ * ~/.cache/vitamin-k. Its name contains the application name, vendor and
+ * device ID, driver version and pipeline cache UUID, so a driver update
+ * starts over with a new file instead of feeding the driver stale data.
+ *
+ * Loaded data is only passed to the driver when its header matches the
+ * device. Saving writes a temporary file and renames it over the old one,
+ * so an interrupted run never leaves a truncated cache behind.
+ */
+class PipelineCacheFile {
+  // VkPipelineCacheHeaderVersionOne
+  static const size_t HEADER_SIZE = 16 + VK_UUID_SIZE;
+
+  VkDevice device = VK_NULL_HANDLE;
+  VkPhysicalDeviceProperties properties;
+  std::string directory;
+  std::string path;
+
+ public:
+  void init(VkDevice d, const VkPhysicalDeviceProperties &props,
+            const std::string &name) {
+    device = d;
+    properties = props;
+
+    directory = get_cache_directory();
+    if (directory.empty()) {
+      vik_log_w("Neither XDG_CACHE_HOME nor HOME are set, "
+                "not persisting the pipeline cache.");
+      return;
+    }
+
+    path = directory + "/" + get_file_name(name);
+  }
+
+  void create(VkPipelineCache *cache) {
+    std::vector<char> data = load();
+
+    VkPipelineCacheCreateInfo pipeline_cache_info = {
+      .sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO,
+      .initialDataSize = data.size(),
+      .pInitialData = data.empty() ? nullptr : data.data()
+    };
+    vik_log_check(vkCreatePipelineCache(device, &pipeline_cache_info,
+                                        nullptr, cache));
+  }
+
+  void save(VkPipelineCache cache) {
+    if (path.empty())
+      return;
+
+    size_t size = 0;
+    vik_log_check(vkGetPipelineCacheData(device, cache, &size, nullptr));
+    std::vector<char> data(size);
+    vik_log_check(vkGetPipelineCacheData(device, cache, &size, data.data()));
+    data.resize(size);
+
+    if (!make_directories(directory)) {
+      vik_log_w("Could not create %s: %s", directory.c_str(), strerror(errno));
+      return;
+    }
+
+    std::string tmp_path = path + ".tmp." + std::to_string(getpid());
+
+    FILE *file = fopen(tmp_path.c_str(), "wb");
+    if (file == nullptr) {
+      vik_log_w("Could not open %s: %s", tmp_path.c_str(), strerror(errno));
+      return;
+    }
+
+    bool written = fwrite(data.data(), 1, data.size(), file) == data.size()
+        && fflush(file) == 0
+        && fsync(fileno(file)) == 0;
+    written = fclose(file) == 0 && written;
+
+    if (!written || rename(tmp_path.c_str(), path.c_str()) != 0) {
+      vik_log_w("Could not write pipeline cache to %s: %s",
+                path.c_str(), strerror(errno));
+      unlink(tmp_path.c_str());
+      return;
+    }
+
+    vik_log_d("Saved %zu bytes of pipeline cache to %s.", size, path.c_str());
+  }
+
+ private:
+  std::vector<char> load() {
+    std::vector<char> data;
+    if (path.empty())
+      return data;
+
+    FILE *file = fopen(path.c_str(), "rb");
+    if (file == nullptr) {
+      vik_log_d("No pipeline cache at %s.", path.c_str());
+      return data;
+    }
+
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    if (size > 0) {
+      data.resize(size);
+      if (fread(data.data(), 1, size, file) != (size_t) size)
+        data.clear();
+    }
+    fclose(file);
+
+    if (!is_header_valid(data)) {
+      vik_log_w("Ignoring pipeline cache %s, it does not match the device.",
+                path.c_str());
+      data.clear();
+      return data;
+    }
+
+    vik_log_d("Loaded %ld bytes of pipeline cache from %s.", size, path.c_str());
+    return data;
+  }
+
+  bool is_header_valid(const std::vector<char> &data) {
+    if (data.size() < HEADER_SIZE)
+      return false;
+
+    uint32_t header[4];
+    memcpy(header, data.data(), sizeof(header));
+
+    uint32_t header_size = header[0];
+    uint32_t version = header[1];
+    uint32_t vendor_id = header[2];
+    uint32_t device_id = header[3];
+
+    return header_size >= HEADER_SIZE
+        && header_size <= data.size()
+        && version == VK_PIPELINE_CACHE_HEADER_VERSION_ONE
+        && vendor_id == properties.vendorID
+        && device_id == properties.deviceID
+        && memcmp(data.data() + 16, properties.pipelineCacheUUID,
+                  VK_UUID_SIZE) == 0;
+  }
+
+  static std::string get_cache_directory() {
+    const char *xdg_cache_home = getenv("XDG_CACHE_HOME");
+    if (xdg_cache_home != nullptr && xdg_cache_home[0] == '/')
+      return std::string(xdg_cache_home) + "/vitamin-k";
+
+    const char *home = getenv("HOME");
+    if (home != nullptr && home[0] != '\0')
+      return std::string(home) + "/.cache/vitamin-k";
+
+    return "";
+  }
+
+  std::string get_file_name(const std::string &name) {
+    std::stringstream ss;
+
+    for (char c : name)
+      ss << (char) (isalnum(c) ? tolower(c) : '-');
+
+    ss << std::hex << std::setfill('0')
+       << "-" << std::setw(4) << properties.vendorID
+       << "-" << std::setw(4) << properties.deviceID
+       << "-" << std::setw(8) << properties.driverVersion
+       << "-";
+    for (uint32_t i = 0; i < VK_UUID_SIZE; i++)
+      ss << std::setw(2) << (uint32_t) properties.pipelineCacheUUID[i];
+    ss << ".bin";
+
+    return ss.str();
+  }
+
+  static bool make_directories(const std::string &dir) {
+    for (size_t pos = 1; pos != std::string::npos; pos++) {
+      pos = dir.find('/', pos);
+      std::string sub = dir.substr(0, pos);
+      if (mkdir(sub.c_str(), 0755) != 0 && errno != EEXIST)
+        return false;
+      if (pos == std::string::npos)
+        break;
+    }
+    return true;
+  }
+};
+}  // namespace vik
@@ -15,6 +15,7 @@
 #define VK_PROTOTYPES
 #include <vulkan/vulkan.h>
 
+#include <chrono>
 #include <string>
 #include <vector>
 #include <functional>
@@ -25,8 +26,16 @@
 #include "vikSwapChainVK.hpp"
 #include "vikTimer.hpp"
 #include "vikShader.hpp"
-
+#include "vikUploadArena.hpp"
+#include "vikFramePacer.hpp"
+#include "vikGpuProfiler.hpp"
+#include "vikPipelineCache.hpp"
+#include "vikPipelineBuilder.hpp"
+#include "vikSecondaryRecorder.hpp"
+
+#include "../system/vikAssetLoader.hpp"
 #include "../system/vikSettings.hpp"
+#include "../system/vikTrace.hpp"
 #include "../window/vikWindow.hpp"
 
 namespace vik {
@@ -53,6 +62,8 @@ class Renderer {
   Window *window;
 
   Timer timer;
+  FramePacer pacer;
+  GpuProfiler gpu_profiler;
   Device *vik_device;
 
   VkPhysicalDeviceProperties device_properties;
@@ -65,21 +76,42 @@ class Renderer {
   VkFormat depth_format;
   VkDescriptorPool descriptor_pool = VK_NULL_HANDLE;
   VkPipelineCache pipeline_cache;
+  PipelineCacheFile pipeline_cache_file;
+  PipelineBuilder pipeline_builder;
+  SecondaryRecorder secondary_recorder;
+  AssetLoader asset_loader;
+
+  // Per frame storage for uniform and dynamic vertex data
+  UploadArena upload_arena;
 
   VkClearColorValue default_clear_color = { { 0.025f, 0.025f, 0.025f, 1.0f } };
 
   struct {
     VkImage image;
-    VkDeviceMemory mem;
+    Allocation allocation;
     VkImageView view;
   } depth_stencil;
 
+  // One set of synchronization primitives per frame in flight
   struct {
-    VkSemaphore present_complete;
-    VkSemaphore render_complete;
+    std::vector<VkSemaphore> present_complete;
+    std::vector<VkSemaphore> render_complete;
   } semaphores;
 
+  // Signaled when all work submitted for a frame slot has finished
+  std::vector<VkFence> frame_fences;
+  // Fence of the frame slot that last rendered into each swap chain image
+  std::vector<VkFence> image_fences;
+
   uint32_t current_buffer = 0;
+  uint32_t current_frame = 0;
+
+  // CPU time spent in the phases of the last frame
+  struct {
+    double prepare_ms = 0.0;
+    double record_ms = 0.0;
+    double submit_ms = 0.0;
+  } cpu_timings;
 
   std::function<void()> window_resize_cb;
   std::function<void()> enabled_features_cb;
@@ -88,6 +120,7 @@ class Renderer {
     settings = s;
     width = s->size.first;
     height = s->size.second;
+    timer.frame_budget_ms = s->frame_budget_ms;
   }
 
   virtual ~Renderer() {
@@ -102,14 +135,25 @@ class Renderer {
 
     vkDestroyImageView(device, depth_stencil.view, nullptr);
     vkDestroyImage(device, depth_stencil.image, nullptr);
-    vkFreeMemory(device, depth_stencil.mem, nullptr);
+    vik_device->allocator.free(depth_stencil.allocation);
 
+    pipeline_builder.destroy();
+    asset_loader.destroy();
+    pipeline_cache_file.save(pipeline_cache);
     vkDestroyPipelineCache(device, pipeline_cache, nullptr);
 
+    upload_arena.destroy();
+    gpu_profiler.destroy();
+
+    secondary_recorder.destroy();
     vkDestroyCommandPool(device, cmd_pool, nullptr);
 
-    vkDestroySemaphore(device, semaphores.present_complete, nullptr);
-    vkDestroySemaphore(device, semaphores.render_complete, nullptr);
+    for (auto& semaphore : semaphores.present_complete)
+      vkDestroySemaphore(device, semaphore, nullptr);
+    for (auto& semaphore : semaphores.render_complete)
+      vkDestroySemaphore(device, semaphore, nullptr);
+    for (auto& fence : frame_fences)
+      vkDestroyFence(device, fence, nullptr);
 
     delete vik_device;
 
@@ -144,9 +188,23 @@ class Renderer {
     window->set_size_only_cb(size_only_cb);
 
     window->set_render_frame_cb([this](){
+      typedef std::chrono::steady_clock clock;
+      typedef std::chrono::duration<double, std::milli> milliseconds;
+
+      clock::time_point start = clock::now();
       prepare_frame();
-      render_cb();
+      clock::time_point prepared = clock::now();
+      {
+        vik_trace_zone("record");
+        render_cb();
+      }
+      clock::time_point recorded = clock::now();
       submit_frame();
+      clock::time_point submitted = clock::now();
+
+      cpu_timings.prepare_ms = milliseconds(prepared - start).count();
+      cpu_timings.record_ms = milliseconds(recorded - prepared).count();
+      cpu_timings.submit_ms = milliseconds(submitted - recorded).count();
     });
   }
 
@@ -254,16 +312,26 @@ class Renderer {
   }
   void init(const std::string &name) {
     init_vulkan(name, window->required_extensions());
-    create_pipeline_cache();
+    create_pipeline_cache(name);
+    pipeline_builder.init(device, pipeline_cache);
 
     window->update_window_title(make_title_string(name));
     window->get_swap_chain()->set_context(instance, physical_device, device);
     window->init_swap_chain(width, height);
 
-    // KMS render callback
+    pacer.init(settings->pacing, settings->present_mode);
+
+    // KMS render callback, with the frame slot handling of
+    // prepare_frame() and submit_frame()
     auto _render_cb = [this](uint32_t index) {
+      vik_log_check(vkWaitForFences(device, 1, &frame_fences[current_frame],
+                                    VK_TRUE, UINT64_MAX));
       current_buffer = index;
+      wait_for_image();
+      begin_frame();
       render_cb();
+      submit_frame_fence();
+      advance_frame();
     };
     window->get_swap_chain()->set_render_cb(_render_cb);
 
@@ -271,6 +339,11 @@ class Renderer {
       debugmarker::setup(device);
 
     create_command_pool(window->get_swap_chain()->get_queue_index());
+    secondary_recorder.init(device, window->get_swap_chain()->get_queue_index(),
+                            settings->record_threads, settings->frames_in_flight);
+
+    upload_arena.init(vik_device, settings->frames_in_flight);
+    asset_loader.init(vik_device, settings->load_threads);
 
     // need format
     init_depth_stencil();
@@ -278,6 +351,11 @@ class Renderer {
 
     assert(window->get_swap_chain()->image_count > 0);
     create_buffers(window->get_swap_chain()->image_count);
+    image_fences.assign(window->get_swap_chain()->image_count, VK_NULL_HANDLE);
+
+    gpu_profiler.init(vik_device, instance, queue,
+                      window->get_swap_chain()->image_count,
+                      settings->gpu_profile_csv);
   }
 
   void wait_idle() {
@@ -285,6 +363,27 @@ class Renderer {
     vkDeviceWaitIdle(device);
   }
 
+  // Block until the GPU has finished every frame that is still in flight
+  void wait_frames_in_flight() {
+    vik_log_check(vkWaitForFences(device, frame_fences.size(),
+                                  frame_fences.data(), VK_TRUE, UINT64_MAX));
+  }
+
+  // Block until the frames in flight before the current one are done
+  void wait_other_frames() {
+    std::vector<VkFence> fences;
+    for (uint32_t i = 0; i < frame_fences.size(); i++)
+      if (i != current_frame)
+        fences.push_back(frame_fences[i]);
+    if (!fences.empty())
+      vik_log_check(vkWaitForFences(device, fences.size(), fences.data(),
+                                    VK_TRUE, UINT64_MAX));
+  }
+
+  uint32_t get_frames_in_flight() {
+    return frame_fences.size();
+  }
+
   bool check_command_buffers() {
     for (auto& cmd_buffer : cmd_buffers)
       if (cmd_buffer == VK_NULL_HANDLE)
@@ -315,12 +414,10 @@ class Renderer {
     return cmd_buffer;
   }
 
-  void create_pipeline_cache() {
-    VkPipelineCacheCreateInfo pipeline_cache_info = {
-      .sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO
-    };
-    vik_log_check(vkCreatePipelineCache(device, &pipeline_cache_info,
-                                        nullptr, &pipeline_cache));
+  // Reuse the pipelines compiled by previous runs
+  void create_pipeline_cache(const std::string &name) {
+    pipeline_cache_file.init(device, device_properties, name);
+    pipeline_cache_file.create(&pipeline_cache);
   }
 
   void init_physical_device() {
@@ -428,6 +525,9 @@ class Renderer {
     // and encapsulates functions related to a device
     vik_device = new Device(physical_device);
 
+    if (is_extension_supported(VK_KHR_GET_PHYSICAL_DEVICE_PROPERTIES_2_EXTENSION_NAME))
+      vik_device->query_multiview_support(instance);
+
     VkResult res = vik_device->createLogicalDevice(enabled_features,
                                                    window->required_device_extensions());
     vik_log_f_if(res != VK_SUCCESS,
@@ -447,6 +547,7 @@ class Renderer {
     assert(validDepthFormat);
 
     init_semaphores();
+    init_frame_fences();
   }
 
   bool enable_if_supported(std::vector<const char*> *extensions,
@@ -491,12 +592,30 @@ class Renderer {
     VkSemaphoreCreateInfo semaphore_info = {
       .sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
     };
-    // Create a semaphore used to synchronize image presentation
-    // Ensures that the image is displayed before we start submitting new commands to the queu
-    vik_log_check(vkCreateSemaphore(device, &semaphore_info, nullptr, &semaphores.present_complete));
-    // Create a semaphore used to synchronize command submission
-    // Ensures that the image is not presented until all commands have been sumbitted and executed
-    vik_log_check(vkCreateSemaphore(device, &semaphore_info, nullptr, &semaphores.render_complete));
+
+    semaphores.present_complete.resize(settings->frames_in_flight);
+    semaphores.render_complete.resize(settings->frames_in_flight);
+
+    for (uint32_t i = 0; i < settings->frames_in_flight; i++) {
+      // Create a semaphore used to synchronize image presentation
+      // Ensures that the image is displayed before we start submitting new commands to the queu
+      vik_log_check(vkCreateSemaphore(device, &semaphore_info, nullptr, &semaphores.present_complete[i]));
+      // Create a semaphore used to synchronize command submission
+      // Ensures that the image is not presented until all commands have been sumbitted and executed
+      vik_log_check(vkCreateSemaphore(device, &semaphore_info, nullptr, &semaphores.render_complete[i]));
+    }
+  }
+
+  void init_frame_fences() {
+    // Create in signaled state so we don't wait on the first use of each frame slot
+    VkFenceCreateInfo fence_info = {
+      .sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO,
+      .flags = VK_FENCE_CREATE_SIGNALED_BIT
+    };
+
+    frame_fences.resize(settings->frames_in_flight);
+    for (auto& fence : frame_fences)
+      vik_log_check(vkCreateFence(device, &fence_info, nullptr, &fence));
   }
 
   void create_command_pool(uint32_t index) {
@@ -534,7 +653,7 @@ class Renderer {
 
     vkDestroyImageView(device, depth_stencil.view, nullptr);
     vkDestroyImage(device, depth_stencil.image, nullptr);
-    vkFreeMemory(device, depth_stencil.mem, nullptr);
+    vik_device->allocator.free(depth_stencil.allocation);
     init_depth_stencil();
 
     for (uint32_t i = 0; i < frame_buffers.size(); i++)
@@ -546,6 +665,9 @@ class Renderer {
     destroy_command_buffers();
     allocate_command_buffers(window->get_swap_chain()->image_count);
 
+    image_fences.assign(window->get_swap_chain()->image_count, VK_NULL_HANDLE);
+    gpu_profiler.resize(window->get_swap_chain()->image_count);
+
     window_resize_cb();
   }
 
@@ -565,11 +687,11 @@ class Renderer {
       // submit_info.pWaitDstStageMask = stage_flags.data();
       .waitSemaphoreCount = 1,
       // Semaphore(s) to wait upon before the submitted command buffer starts executing
-      .pWaitSemaphores = &semaphores.present_complete,
+      .pWaitSemaphores = &semaphores.present_complete[current_frame],
       .commandBufferCount = 1,
       .signalSemaphoreCount = 1,
       // Semaphore(s) to be signaled when command buffers have completed
-      .pSignalSemaphores = &semaphores.render_complete
+      .pSignalSemaphores = &semaphores.render_complete[current_frame]
     };
 
     return submit_info;
@@ -670,24 +792,8 @@ class Renderer {
       .pDependencies = dependencies.data()
     };
 
-#if 0
-    // VK_KHX_multiview
-    uint32_t correlationMasks[] = { 2 };
-    uint32_t viewMasks[] = { 1 };
-    int32_t viewOffsets[] = { 2 };
-
-    VkRenderPassMultiviewCreateInfo renderPassMvInfo = {
-      .sType = VK_STRUCTURE_TYPE_RENDER_PASS_MULTIVIEW_CREATE_INFO,
-      .subpassCount = 1,
-      .dependencyCount = 1,
-      .correlationMaskCount = 1,
-      .pCorrelationMasks = correlationMasks,
-      .pViewMasks = viewMasks,
-      .pViewOffsets = viewOffsets,
-    };
-    render_pass_info.pNext = &renderPassMvInfo;
-#endif
-
+    // The swap chain images have a single layer, multiview stereo is
+    // rendered by vik::OffscreenPass.
     vik_log_check(vkCreateRenderPass(device, &render_pass_info,
                                      nullptr, &render_pass));
   }
@@ -709,19 +815,9 @@ class Renderer {
       .usage = VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT
     };
 
-    VkMemoryRequirements memReqs;
-
     vik_log_check(vkCreateImage(device, &image, nullptr, &depth_stencil.image));
-    vkGetImageMemoryRequirements(device, depth_stencil.image, &memReqs);
-
-    VkMemoryAllocateInfo mem_alloc = {
-      .sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
-      .allocationSize = memReqs.size,
-      .memoryTypeIndex = vik_device->getMemoryType(memReqs.memoryTypeBits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT)
-    };
-
-    vik_log_check(vkAllocateMemory(device, &mem_alloc, nullptr, &depth_stencil.mem));
-    vik_log_check(vkBindImageMemory(device, depth_stencil.image, depth_stencil.mem, 0));
+    depth_stencil.allocation = vik_device->allocator.allocate_image(
+          depth_stencil.image, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
 
     VkImageViewCreateInfo depthStencilView = {
       .sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
@@ -742,14 +838,24 @@ class Renderer {
   virtual void check_tick_finnished() {
     if (timer.tick_finnished()) {
       timer.update_fps();
+      if (pacer.enabled)
+        vik_log_d("%s", pacer.get_stats_string().c_str());
       timer.reset();
     }
   }
 
   void prepare_frame() {
+    vik_trace_zone("prepare_frame");
+    pacer.begin_acquire();
+
+    // Wait until the GPU is done with the frame slot we are about to reuse
+    vik_log_check(vkWaitForFences(device, 1, &frame_fences[current_frame],
+                                  VK_TRUE, UINT64_MAX));
+
     // Acquire the next image from the swap chain
-    SwapChainVK *sc = (SwapChainVK*) window->get_swap_chain();
-    VkResult err = sc->acquire_next_image(semaphores.present_complete, &current_buffer);
+    SwapChain *sc = window->get_swap_chain();
+    VkResult err = sc->acquire_next_image(semaphores.present_complete[current_frame],
+                                          &current_buffer);
     // Recreate the swapchain if it's no longer compatible with the surface
     // (OUT_OF_DATE) or no longer optimal for presentation (SUBOPTIMAL)
     if ((err == VK_ERROR_OUT_OF_DATE_KHR) || (err == VK_SUBOPTIMAL_KHR)) {
@@ -758,6 +864,53 @@ class Renderer {
     } else {
       vik_log_check(err);
     }
+
+    wait_for_image();
+
+    pacer.end_acquire();
+
+    begin_frame();
+  }
+
+  // The command buffer of the acquired image may still be executing
+  // for an older frame slot when there are more slots than images
+  void wait_for_image() {
+    VkFence image_fence = image_fences[current_buffer];
+    if (image_fence != VK_NULL_HANDLE && image_fence != frame_fences[current_frame])
+      vik_log_check(vkWaitForFences(device, 1, &image_fence, VK_TRUE, UINT64_MAX));
+    image_fences[current_buffer] = frame_fences[current_frame];
+  }
+
+  // Called once the slot's fence and the image are idle
+  void begin_frame() {
+    // The last frame rendered to this image is done, read its timestamps
+    gpu_profiler.collect(current_buffer);
+
+    vik_log_check(vkResetFences(device, 1, &frame_fences[current_frame]));
+
+    // The GPU is done with this slot, its uploads can be overwritten
+    upload_arena.begin_frame(current_frame);
+
+    // Asset uploads are submitted ahead of the frame using them
+    vik_device->upload_batcher.flush();
+    asset_loader.update();
+  }
+
+  // An empty submission signals the fence once all work previously
+  // submitted to the queue has completed, so applications are free to
+  // split a frame into as many batches as they like
+  void submit_frame_fence() {
+    vik_log_check(vkQueueSubmit(queue, 0, nullptr, frame_fences[current_frame]));
+  }
+
+  // Signaled once the most recently submitted frame is done
+  VkFence get_last_frame_fence() {
+    uint32_t count = frame_fences.size();
+    return frame_fences[(current_frame + count - 1) % count];
+  }
+
+  void advance_frame() {
+    current_frame = (current_frame + 1) % frame_fences.size();
   }
 
   // Present the current buffer to the swap chain
@@ -766,17 +919,32 @@ class Renderer {
   // This ensures that the image is not presented to the windowing system
   // until all commands have been submitted
   virtual void submit_frame() {
-    SwapChainVK *sc = (SwapChainVK*) window->get_swap_chain();
-    vik_log_check(sc->present(queue, current_buffer, semaphores.render_complete));
-    vik_log_check(vkQueueWaitIdle(queue));
+    vik_trace_zone("present");
+    submit_frame_fence();
+    pacer.frame_submitted();
+    SwapChain *sc = window->get_swap_chain();
+    vik_log_check(sc->present(queue, current_buffer,
+                              semaphores.render_complete[current_frame]));
+    advance_frame();
   }
 
   void render() {
+    vik_trace_zone("frame");
     timer.start();
+    // Sleep before input and pose are sampled
+    {
+      vik_trace_zone("pacing");
+      pacer.wait_for_frame_start(device, get_last_frame_fence());
+    }
     frame_start_cb();
-    window->iterate();
+    {
+      vik_trace_zone("window_iterate");
+      window->iterate();
+    }
     timer.increment();
-    float frame_time = timer.update_frame_time();
+    // The frame to frame time drives animation, the statistics only
+    // count the CPU work
+    float frame_time = timer.update_frame_time(pacer.get_idle_ms());
     frame_end_cb(frame_time);
     timer.update_animation_timer();
     check_tick_finnished();
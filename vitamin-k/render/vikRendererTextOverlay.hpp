@@ -24,13 +24,16 @@ class RendererTextOverlay : public Renderer {
  public:
   TextOverlay *text_overlay;
 
-  VkSemaphore text_overlay_complete;
+  std::vector<VkSemaphore> text_overlay_complete;
 
   std::string name;
+  std::string fps_string;
+  std::vector<std::string> stats_strings;
 
   explicit RendererTextOverlay(Settings *s) : Renderer(s) {}
   ~RendererTextOverlay() {
-    vkDestroySemaphore(device, text_overlay_complete, nullptr);
+    for (auto& semaphore : text_overlay_complete)
+      vkDestroySemaphore(device, semaphore, nullptr);
     delete text_overlay;
   }
 
@@ -40,7 +43,8 @@ class RendererTextOverlay : public Renderer {
     name = n;
     if (settings->enable_text_overlay) {
       init_text_overlay(cb);
-      update_text_overlay();
+      update_fps_string();
+      update_stats_strings();
     }
   }
 
@@ -54,27 +58,47 @@ class RendererTextOverlay : public Renderer {
           vik_device,
           queue,
           &frame_buffers,
+          settings->frames_in_flight,
           window->get_swap_chain()->surface_format.format,
           depth_format,
           &width,
           &height,
-          shaderStages);
+          shaderStages,
+          &pipeline_builder);
     text_overlay->set_update_cb(cb);
+    text_overlay->set_profiler(&gpu_profiler);
+    upload_arena.reserve(TextOverlay::getVertexBufferSize());
   }
 
-  void update_text_overlay() {
-    if (!settings->enable_text_overlay)
-      return;
-
+  void update_fps_string() {
     std::stringstream ss;
     ss << std::fixed
        << std::setprecision(3)
-       << (timer.frame_time_seconds * 1000.0f)
+       << timer.measured_frame_ms
        << "ms (" << timer.frames_per_second
        << " fps)";
-    std::string deviceName(device_properties.deviceName);
+    fps_string = ss.str();
+  }
+
+  // Additional HUD lines, refreshed together with the fps
+  void update_stats_strings() {
+    stats_strings.clear();
+    stats_strings.push_back(timer.get_histogram_string());
+    if (gpu_profiler.enabled)
+      stats_strings.push_back(gpu_profiler.get_stats_string());
+    if (pacer.enabled)
+      stats_strings.push_back(pacer.get_stats_string());
+  }
 
-    text_overlay->update(name, ss.str(), deviceName);
+  // The text vertices live in the upload arena, so the overlay is rebuilt
+  // into the current slice and the command buffer of the frame re-recorded
+  void update_text_overlay() {
+    if (!settings->enable_text_overlay)
+      return;
+
+    std::string deviceName(device_properties.deviceName);
+    text_overlay->update(&upload_arena, current_frame, current_buffer,
+                         name, fps_string, deviceName, stats_strings);
   }
 
   void submit_text_overlay() {
@@ -83,12 +107,12 @@ class RendererTextOverlay : public Renderer {
     VkSubmitInfo submit_info = {
       .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
       .waitSemaphoreCount = 1,
-      .pWaitSemaphores = &semaphores.render_complete,
+      .pWaitSemaphores = &semaphores.render_complete[current_frame],
       .pWaitDstStageMask = &stageFlags,
       .commandBufferCount = 1,
-      .pCommandBuffers = &text_overlay->cmdBuffers[current_buffer],
+      .pCommandBuffers = &text_overlay->cmdBuffers[current_frame],
       .signalSemaphoreCount = 1,
-      .pSignalSemaphores = &text_overlay_complete
+      .pSignalSemaphores = &text_overlay_complete[current_frame]
     };
 
     vik_log_check(vkQueueSubmit(queue, 1, &submit_info, VK_NULL_HANDLE));
@@ -97,32 +121,36 @@ class RendererTextOverlay : public Renderer {
   void check_tick_finnished() {
     if (timer.tick_finnished()) {
       timer.update_fps();
-      if (settings->enable_text_overlay)
-        update_text_overlay();
+      if (settings->enable_text_overlay) {
+        update_fps_string();
+        update_stats_strings();
+      }
       timer.reset();
     }
   }
 
   void resize() {
     Renderer::resize();
-    if (settings->enable_text_overlay) {
+    if (settings->enable_text_overlay)
       text_overlay->reallocateCommandBuffers();
-      update_text_overlay();
-    }
   }
 
   void submit_frame() {
+    vik_trace_zone("present");
     VkSemaphore waitSemaphore;
     if (settings->enable_text_overlay && text_overlay->visible) {
+      update_text_overlay();
       submit_text_overlay();
-      waitSemaphore = text_overlay_complete;
+      waitSemaphore = text_overlay_complete[current_frame];
     } else {
-      waitSemaphore = semaphores.render_complete;
+      waitSemaphore = semaphores.render_complete[current_frame];
     }
 
-    SwapChainVK *sc = (SwapChainVK*) window->get_swap_chain();
+    submit_frame_fence();
+    pacer.frame_submitted();
+    SwapChain *sc = window->get_swap_chain();
     vik_log_check(sc->present(queue, current_buffer, waitSemaphore));
-    vik_log_check(vkQueueWaitIdle(queue));
+    advance_frame();
   }
 
   void init_semaphores() {
@@ -133,7 +161,9 @@ class RendererTextOverlay : public Renderer {
     // Create a semaphore used to synchronize command submission
     // Ensures that the image is not presented until all commands for the text overlay have been sumbitted and executed
     // Will be inserted after the render complete semaphore if the text overlay is enabled
-    vik_log_check(vkCreateSemaphore(device, &semaphore_info, nullptr, &text_overlay_complete));
+    text_overlay_complete.resize(settings->frames_in_flight);
+    for (auto& semaphore : text_overlay_complete)
+      vik_log_check(vkCreateSemaphore(device, &semaphore_info, nullptr, &semaphore));
   }
 };
 }  // namespace vik
@@ -0,0 +1,220 @@
+/*
+ * vitamin-k
+ *
+ * Copyright 2017-2018 Collabora Ltd.
+ *
+ * Authors: Lubosz Sarnecki <lubosz.sarnecki@collabora.com>
+ * SPDX-License-Identifier: MIT
+ */
+
+#pragma once
+
+#include <vulkan/vulkan.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "../system/vikLog.hpp"
+#include "../system/vikTrace.hpp"
+
+namespace vik {
+
+/*
+ * Records a render pass in parallel into secondary command buffers.
+ *
+ * The items to draw are split into one chunk per worker thread. Each worker
+ * owns a command pool per frame slot, so pools are never shared between
+ * threads and a slot's pool can be reset once the renderer has waited for
+ * the slot's fence. The primary command buffer executes the returned
+ * secondaries in chunk order, in a subpass begun with
+ * VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS.
+ *
+ * Dynamic state is not inherited, so the record callback has to set the
+ * viewports and scissors of every secondary command buffer.
+ */
+class SecondaryRecorder {
+ public:
+  // Record the items [first, first + count) of a chunk into cmd_buffer
+  typedef std::function<void(VkCommandBuffer cmd_buffer, uint32_t chunk,
+                             uint32_t first, uint32_t count)> RecordFunc;
+
+  bool enabled = false;
+
+ private:
+  struct Worker {
+    std::thread thread;
+    std::vector<VkCommandPool> pools;
+    std::vector<VkCommandBuffer> cmd_buffers;
+  };
+
+  VkDevice device = VK_NULL_HANDLE;
+  std::vector<std::unique_ptr<Worker>> workers;
+  std::vector<VkCommandBuffer> recorded;
+
+  std::mutex mutex;
+  std::condition_variable start_condition;
+  std::condition_variable done_condition;
+  uint64_t generation = 0;
+  uint32_t pending = 0;
+  bool stopping = false;
+
+  // The job of the current generation
+  uint32_t job_slot = 0;
+  VkCommandBufferInheritanceInfo job_inheritance;
+  uint32_t job_item_count = 0;
+  RecordFunc job_func;
+
+ public:
+  ~SecondaryRecorder() {
+    destroy();
+  }
+
+  void init(VkDevice d, uint32_t queue_family_index,
+            uint32_t thread_count, uint32_t slot_count) {
+    if (thread_count == 0)
+      return;
+
+    device = d;
+    enabled = true;
+
+    VkCommandPoolCreateInfo pool_info = {
+      .sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
+      .flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT,
+      .queueFamilyIndex = queue_family_index
+    };
+
+    for (uint32_t i = 0; i < thread_count; i++) {
+      Worker *worker = new Worker();
+      worker->pools.resize(slot_count);
+      worker->cmd_buffers.resize(slot_count);
+
+      for (uint32_t slot = 0; slot < slot_count; slot++) {
+        vik_log_check(vkCreateCommandPool(device, &pool_info, nullptr,
+                                          &worker->pools[slot]));
+
+        VkCommandBufferAllocateInfo cmd_buffer_info = {
+          .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+          .commandPool = worker->pools[slot],
+          .level = VK_COMMAND_BUFFER_LEVEL_SECONDARY,
+          .commandBufferCount = 1
+        };
+        vik_log_check(vkAllocateCommandBuffers(device, &cmd_buffer_info,
+                                               &worker->cmd_buffers[slot]));
+      }
+
+      workers.emplace_back(worker);
+    }
+
+    for (uint32_t i = 0; i < thread_count; i++)
+      workers[i]->thread = std::thread([this, i]() { work(i); });
+
+    recorded.resize(thread_count);
+
+    vik_log_d("Recording secondary command buffers on %d threads.", thread_count);
+  }
+
+  void destroy() {
+    if (!enabled)
+      return;
+
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    start_condition.notify_all();
+
+    for (auto& worker : workers) {
+      worker->thread.join();
+      for (auto& pool : worker->pools)
+        vkDestroyCommandPool(device, pool, nullptr);
+    }
+    workers.clear();
+    enabled = false;
+  }
+
+  /*
+   * Record item_count items split over the workers and return one
+   * secondary command buffer per worker. Blocks until all are recorded.
+   * The GPU has to be done with the slot's previous command buffers.
+   */
+  const std::vector<VkCommandBuffer>& record(
+      uint32_t slot, const VkCommandBufferInheritanceInfo &inheritance,
+      uint32_t item_count, const RecordFunc &func) {
+    std::unique_lock<std::mutex> lock(mutex);
+
+    job_slot = slot;
+    job_inheritance = inheritance;
+    job_item_count = item_count;
+    job_func = func;
+
+    pending = workers.size();
+    generation++;
+    start_condition.notify_all();
+
+    done_condition.wait(lock, [this]() { return pending == 0; });
+
+    for (uint32_t i = 0; i < workers.size(); i++)
+      recorded[i] = workers[i]->cmd_buffers[slot];
+
+    return recorded;
+  }
+
+ private:
+  void work(uint32_t index) {
+    uint64_t seen_generation = 0;
+
+    while (true) {
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        start_condition.wait(lock, [this, seen_generation]() {
+          return stopping || generation != seen_generation;
+        });
+        if (stopping)
+          return;
+        seen_generation = generation;
+      }
+
+      record_chunk(index);
+
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (--pending == 0)
+          done_condition.notify_one();
+      }
+    }
+  }
+
+  // The job members are only written while no worker is recording
+  void record_chunk(uint32_t index) {
+    vik_trace_zone("record_secondary");
+
+    Worker *worker = workers[index].get();
+
+    uint32_t worker_count = workers.size();
+    uint32_t chunk_size = (job_item_count + worker_count - 1) / worker_count;
+    uint32_t first = std::min(index * chunk_size, job_item_count);
+    uint32_t count = std::min(chunk_size, job_item_count - first);
+
+    vik_log_check(vkResetCommandPool(device, worker->pools[job_slot], 0));
+
+    VkCommandBuffer cmd_buffer = worker->cmd_buffers[job_slot];
+
+    VkCommandBufferBeginInfo begin_info = {
+      .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+      .flags = VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT
+             | VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,
+      .pInheritanceInfo = &job_inheritance
+    };
+    vik_log_check(vkBeginCommandBuffer(cmd_buffer, &begin_info));
+
+    job_func(cmd_buffer, index, first, count);
+
+    vik_log_check(vkEndCommandBuffer(cmd_buffer));
+  }
+};
+}  // namespace vik
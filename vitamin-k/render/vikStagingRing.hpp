@@ -0,0 +1,166 @@
+/*
+ * vitamin-k
+ *
+ * Copyright 2017-2018 Collabora Ltd.
+ *
+ * Authors: Lubosz Sarnecki <lubosz.sarnecki@collabora.com>
+ * SPDX-License-Identifier: MIT
+ */
+
+#pragma once
+
+#include <vulkan/vulkan.h>
+
+#include "../system/vikLog.hpp"
+
+namespace vik {
+
+// Memory a loader writes its upload data to
+struct StagingRegion {
+  VkBuffer buffer;
+  VkDeviceSize offset;
+  void *data;
+};
+
+/*
+ * Persistently mapped staging buffer that is allocated from like a ring.
+ *
+ * head and tail are byte positions that only grow, the offset in the buffer
+ * is the position modulo the capacity. An allocation that does not fit in
+ * front of the end of the buffer starts over at offset 0. The owner frees
+ * everything written before a position with release() once the GPU has
+ * consumed it, so space is reclaimed in allocation order.
+ *
+ * Uploads larger than the ring get a dedicated buffer, which the caller
+ * destroys once the copy has completed.
+ */
+class StagingRing {
+  VkDevice device = VK_NULL_HANDLE;
+  VkPhysicalDeviceMemoryProperties memory_properties;
+
+  VkBuffer buffer = VK_NULL_HANDLE;
+  VkDeviceMemory memory = VK_NULL_HANDLE;
+  uint8_t *mapped = nullptr;
+
+  VkDeviceSize capacity = 0;
+  VkDeviceSize head = 0;
+  VkDeviceSize tail = 0;
+
+ public:
+  // Optimal copy offsets, and the texel block sizes that are powers of two
+  static const VkDeviceSize ALIGNMENT = 16;
+
+  // Image copies start at multiples of the texel block size, like 3 or 12
+  static VkDeviceSize get_alignment(VkDeviceSize texel_block_size) {
+    VkDeviceSize alignment = ALIGNMENT;
+    while (alignment % texel_block_size != 0)
+      alignment += ALIGNMENT;
+    return alignment;
+  }
+
+  void init(VkDevice d, const VkPhysicalDeviceMemoryProperties &properties,
+            VkDeviceSize size) {
+    device = d;
+    memory_properties = properties;
+    capacity = align(size);
+
+    create_buffer(capacity, &buffer, &memory, (void **) &mapped);
+
+    vik_log_d("Staging ring of %ld MiB.", capacity / (1024 * 1024));
+  }
+
+  void destroy() {
+    if (buffer == VK_NULL_HANDLE)
+      return;
+    // Freeing the memory unmaps it
+    vkDestroyBuffer(device, buffer, nullptr);
+    vkFreeMemory(device, memory, nullptr);
+    buffer = VK_NULL_HANDLE;
+  }
+
+  bool fits(VkDeviceSize size) {
+    return align(size) <= capacity;
+  }
+
+  // Returns false when the ring has no room until older uploads are released
+  bool allocate(VkDeviceSize size, StagingRegion *region,
+                VkDeviceSize alignment = ALIGNMENT) {
+    size = align(size);
+    if (size > capacity)
+      return false;
+
+    VkDeviceSize position = head;
+    VkDeviceSize offset = position % capacity;
+    VkDeviceSize padding = (alignment - offset % alignment) % alignment;
+    if (offset + padding + size > capacity)
+      position += capacity - offset;
+    else
+      position += padding;
+
+    if (position + size - tail > capacity)
+      return false;
+
+    head = position + size;
+
+    region->buffer = buffer;
+    region->offset = position % capacity;
+    region->data = mapped + region->offset;
+    return true;
+  }
+
+  // Position up to which the current allocations reach
+  VkDeviceSize get_head() {
+    return head;
+  }
+
+  // The GPU is done with everything allocated before position
+  void release(VkDeviceSize position) {
+    tail = position;
+  }
+
+  void create_dedicated(VkDeviceSize size, StagingRegion *region,
+                        VkDeviceMemory *dedicated_memory) {
+    create_buffer(size, &region->buffer, dedicated_memory, &region->data);
+    region->offset = 0;
+  }
+
+ private:
+  static VkDeviceSize align(VkDeviceSize size) {
+    return (size + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+  }
+
+  void create_buffer(VkDeviceSize size, VkBuffer *b, VkDeviceMemory *m,
+                     void **data) {
+    VkBufferCreateInfo buffer_info = {
+      .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+      .size = size,
+      .usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+      .sharingMode = VK_SHARING_MODE_EXCLUSIVE
+    };
+    vik_log_check(vkCreateBuffer(device, &buffer_info, nullptr, b));
+
+    VkMemoryRequirements requirements;
+    vkGetBufferMemoryRequirements(device, *b, &requirements);
+
+    VkMemoryAllocateInfo alloc_info = {
+      .sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+      .allocationSize = requirements.size,
+      .memoryTypeIndex = get_memory_type(
+        requirements.memoryTypeBits,
+        VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT)
+    };
+    vik_log_check(vkAllocateMemory(device, &alloc_info, nullptr, m));
+    vik_log_check(vkBindBufferMemory(device, *b, *m, 0));
+    vik_log_check(vkMapMemory(device, *m, 0, VK_WHOLE_SIZE, 0, data));
+  }
+
+  uint32_t get_memory_type(uint32_t type_bits, VkMemoryPropertyFlags flags) {
+    for (uint32_t i = 0; i < memory_properties.memoryTypeCount; i++)
+      if ((type_bits & (1 << i))
+          && (memory_properties.memoryTypes[i].propertyFlags & flags) == flags)
+        return i;
+    vik_log_f("Could not find a host visible memory type for staging.");
+    return 0;
+  }
+};
+}  // namespace vik
@@ -52,6 +52,18 @@ class SwapChain {
 
   virtual void create(uint32_t width, uint32_t height) = 0;
 
+  // Used by the renderer's frame loop, KMS drives frames on its own
+  virtual VkResult acquire_next_image(VkSemaphore semaphore, uint32_t *index) {
+    vik_log_f("Swap chain does not support acquiring images.");
+    return VK_ERROR_FEATURE_NOT_PRESENT;
+  }
+
+  virtual VkResult present(VkQueue queue, uint32_t index,
+                           VkSemaphore semaphore = VK_NULL_HANDLE) {
+    vik_log_f("Swap chain does not support presenting images.");
+    return VK_ERROR_FEATURE_NOT_PRESENT;
+  }
+
   void set_settings(Settings *s) {
     settings = s;
   }
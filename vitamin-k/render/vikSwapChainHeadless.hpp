@@ -0,0 +1,177 @@
+/*
+ * vitamin-k
+ *
+ * Copyright 2017-2018 Collabora Ltd.
+ *
+ * Authors: Lubosz Sarnecki <lubosz.sarnecki@collabora.com>
+ * SPDX-License-Identifier: MIT
+ */
+
+#pragma once
+
+#include <vulkan/vulkan.h>
+
+#include <vector>
+
+#include "vikSwapChain.hpp"
+
+namespace vik {
+
+/*
+ * Swap chain without a surface.
+ *
+ * Renders into a ring of plain images, which are handed out in order.
+ * Acquire and present are empty queue submissions that signal and consume
+ * the semaphores the renderer passes, so the frame loop runs unchanged.
+ * Reuse of an image is guarded by the renderer's per image fences.
+ */
+class SwapChainHeadless : public SwapChain {
+ public:
+  std::vector<VkDeviceMemory> memory;
+
+  VkQueue queue = VK_NULL_HANDLE;
+  uint32_t queue_index = 0;
+  uint32_t next_index = 0;
+
+  SwapChainHeadless() {
+    image_count = 3;
+  }
+
+  ~SwapChainHeadless() {}
+
+  uint32_t get_queue_index() {
+    return queue_index;
+  }
+
+  void create(uint32_t width, uint32_t height) {
+    destroy();
+
+    select_queue();
+
+    buffers.resize(image_count);
+    memory.resize(image_count);
+
+    for (uint32_t i = 0; i < image_count; i++) {
+      create_image(width, height, &buffers[i].image, &memory[i]);
+      create_image_view(device, buffers[i].image,
+                        surface_format.format, &buffers[i].view);
+    }
+
+    next_index = 0;
+
+    vik_log_d("Created %d headless images of %dx%d.", image_count, width, height);
+  }
+
+  // Same family Device picks for graphics, the first one supporting it
+  void select_queue() {
+    uint32_t count = 0;
+    vkGetPhysicalDeviceQueueFamilyProperties(physical_device, &count, nullptr);
+    std::vector<VkQueueFamilyProperties> families(count);
+    vkGetPhysicalDeviceQueueFamilyProperties(physical_device, &count, families.data());
+
+    for (uint32_t i = 0; i < count; i++) {
+      if (families[i].queueFlags & VK_QUEUE_GRAPHICS_BIT) {
+        queue_index = i;
+        break;
+      }
+    }
+
+    vkGetDeviceQueue(device, queue_index, 0, &queue);
+  }
+
+  void create_image(uint32_t width, uint32_t height,
+                    VkImage *image, VkDeviceMemory *mem) {
+    VkImageCreateInfo image_info = {
+      .sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,
+      .imageType = VK_IMAGE_TYPE_2D,
+      .format = surface_format.format,
+      .extent = {
+        .width = width,
+        .height = height,
+        .depth = 1
+      },
+      .mipLevels = 1,
+      .arrayLayers = 1,
+      .samples = VK_SAMPLE_COUNT_1_BIT,
+      .tiling = VK_IMAGE_TILING_OPTIMAL,
+      .usage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT
+             | VK_IMAGE_USAGE_TRANSFER_SRC_BIT,
+      .sharingMode = VK_SHARING_MODE_EXCLUSIVE,
+      .initialLayout = VK_IMAGE_LAYOUT_UNDEFINED
+    };
+    vik_log_check(vkCreateImage(device, &image_info, nullptr, image));
+
+    VkMemoryRequirements mem_reqs;
+    vkGetImageMemoryRequirements(device, *image, &mem_reqs);
+
+    VkMemoryAllocateInfo alloc_info = {
+      .sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+      .allocationSize = mem_reqs.size,
+      .memoryTypeIndex = get_memory_type(mem_reqs.memoryTypeBits,
+                                         VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT)
+    };
+    vik_log_check(vkAllocateMemory(device, &alloc_info, nullptr, mem));
+    vik_log_check(vkBindImageMemory(device, *image, *mem, 0));
+  }
+
+  uint32_t get_memory_type(uint32_t type_bits, VkMemoryPropertyFlags properties) {
+    VkPhysicalDeviceMemoryProperties mem_props;
+    vkGetPhysicalDeviceMemoryProperties(physical_device, &mem_props);
+
+    for (uint32_t i = 0; i < mem_props.memoryTypeCount; i++)
+      if ((type_bits & (1 << i))
+          && (mem_props.memoryTypes[i].propertyFlags & properties) == properties)
+        return i;
+
+    // Software implementations may not flag anything as device local
+    for (uint32_t i = 0; i < mem_props.memoryTypeCount; i++)
+      if (type_bits & (1 << i))
+        return i;
+
+    vik_log_f("Could not find a memory type for the headless images.");
+    return 0;
+  }
+
+  VkResult acquire_next_image(VkSemaphore semaphore, uint32_t *index) {
+    *index = next_index;
+    next_index = (next_index + 1) % image_count;
+
+    VkSubmitInfo submit_info = {
+      .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+      .signalSemaphoreCount = 1,
+      .pSignalSemaphores = &semaphore
+    };
+    return vkQueueSubmit(queue, 1, &submit_info, VK_NULL_HANDLE);
+  }
+
+  // Nothing is displayed, only consume the render semaphore
+  VkResult present(VkQueue q, uint32_t index,
+                   VkSemaphore semaphore = VK_NULL_HANDLE) {
+    if (semaphore == VK_NULL_HANDLE)
+      return VK_SUCCESS;
+
+    VkPipelineStageFlags stage_flags = VK_PIPELINE_STAGE_ALL_COMMANDS_BIT;
+    VkSubmitInfo submit_info = {
+      .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+      .waitSemaphoreCount = 1,
+      .pWaitSemaphores = &semaphore,
+      .pWaitDstStageMask = &stage_flags
+    };
+    return vkQueueSubmit(q, 1, &submit_info, VK_NULL_HANDLE);
+  }
+
+  void destroy() {
+    for (uint32_t i = 0; i < buffers.size(); i++) {
+      vkDestroyImageView(device, buffers[i].view, nullptr);
+      vkDestroyImage(device, buffers[i].image, nullptr);
+      vkFreeMemory(device, memory[i], nullptr);
+    }
+    buffers.clear();
+    memory.clear();
+  }
+
+  void cleanup() {
+    destroy();
+  }
+};
+}  // namespace vik
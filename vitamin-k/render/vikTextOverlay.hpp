@@ -25,6 +25,9 @@
 #include "vikDebug.hpp"
 #include "vikBuffer.hpp"
 #include "vikDevice.hpp"
+#include "vikUploadArena.hpp"
+#include "vikGpuProfiler.hpp"
+#include "vikPipelineBuilder.hpp"
 
 #include "stb_font_consolas_24_latin1.inl"
 
@@ -60,14 +63,15 @@ class TextOverlay {
   VkSampler sampler;
   VkImage image;
   VkImageView view;
-  Buffer vertexBuffer;
-  VkDeviceMemory imageMemory;
+  Allocation imageAllocation;
   VkDescriptorPool descriptorPool;
   VkDescriptorSetLayout descriptorSetLayout;
   VkDescriptorSet descriptorSet;
   VkPipelineLayout pipelineLayout;
-  VkPipelineCache pipelineCache;
-  VkPipeline pipeline;
+  PipelineBuilder *pipelineBuilder;
+  // Built in the background, resolved on first use
+  std::shared_future<VkPipeline> pipelineFuture;
+  VkPipeline pipeline = VK_NULL_HANDLE;
   VkRenderPass renderPass;
   VkCommandPool commandPool;
   std::vector<VkFramebuffer*> frameBuffers;
@@ -77,9 +81,16 @@ class TextOverlay {
   // Used during text updates
   glm::vec4 *mappedLocal = nullptr;
 
+  // Vertices of the current frame live in the renderer's upload arena
+  VkBuffer vertexBuffer = VK_NULL_HANDLE;
+  VkDeviceSize vertexOffset = 0;
+
   stb_fontchar stbFontData[STB_NUM_CHARS];
   uint32_t numLetters;
 
+  GpuProfiler *profiler = nullptr;
+  uint32_t profilerScope = 0;
+
  public:
   enum TextAlign { alignLeft, alignCenter, alignRight };
 
@@ -95,23 +106,33 @@ class TextOverlay {
     update_cb = cb;
   }
 
+  void set_profiler(GpuProfiler *p) {
+    profiler = p;
+    profilerScope = profiler->add_scope("overlay");
+  }
+
+  // One per frame in flight, re-recorded with the frame's vertices
   std::vector<VkCommandBuffer> cmdBuffers;
 
   /**
   * Default constructor
   *
   * @param vulkanDevice Pointer to a valid VulkanDevice
+  * @param framecount Number of frames in flight
   */
   TextOverlay(
       Device *vulkanDevice,
       VkQueue queue,
       std::vector<VkFramebuffer> *framebuffers,
+      uint32_t framecount,
       VkFormat colorformat,
       VkFormat depthformat,
       uint32_t *framebufferwidth,
       uint32_t *framebufferheight,
-      std::vector<VkPipelineShaderStageCreateInfo> shaderstages) {
+      std::vector<VkPipelineShaderStageCreateInfo> shaderstages,
+      PipelineBuilder *pipelineBuilder) {
     this->vulkanDevice = vulkanDevice;
+    this->pipelineBuilder = pipelineBuilder;
     this->queue = queue;
     this->colorFormat = colorformat;
     this->depthFormat = depthformat;
@@ -125,7 +146,7 @@ class TextOverlay {
     this->frameBufferWidth = framebufferwidth;
     this->frameBufferHeight = framebufferheight;
 
-    cmdBuffers.resize(framebuffers->size());
+    cmdBuffers.resize(framecount);
     prepareResources();
     prepareRenderPass();
     preparePipeline();
@@ -136,23 +157,19 @@ class TextOverlay {
   */
   ~TextOverlay() {
     // Free up all Vulkan resources requested by the text overlay
-    vertexBuffer.destroy();
     vkDestroySampler(vulkanDevice->logicalDevice, sampler, nullptr);
     vkDestroyImage(vulkanDevice->logicalDevice, image, nullptr);
     vkDestroyImageView(vulkanDevice->logicalDevice, view, nullptr);
-    vkFreeMemory(vulkanDevice->logicalDevice, imageMemory, nullptr);
+    vulkanDevice->allocator.free(imageAllocation);
     vkDestroyDescriptorSetLayout(vulkanDevice->logicalDevice, descriptorSetLayout, nullptr);
     vkDestroyDescriptorPool(vulkanDevice->logicalDevice, descriptorPool, nullptr);
     vkDestroyPipelineLayout(vulkanDevice->logicalDevice, pipelineLayout, nullptr);
-    vkDestroyPipelineCache(vulkanDevice->logicalDevice, pipelineCache, nullptr);
-    vkDestroyPipeline(vulkanDevice->logicalDevice, pipeline, nullptr);
+    vkDestroyPipeline(vulkanDevice->logicalDevice, getPipeline(), nullptr);
     vkDestroyRenderPass(vulkanDevice->logicalDevice, renderPass, nullptr);
     vkFreeCommandBuffers(vulkanDevice->logicalDevice, commandPool, static_cast<uint32_t>(cmdBuffers.size()), cmdBuffers.data());
     vkDestroyCommandPool(vulkanDevice->logicalDevice, commandPool, nullptr);
     vkDestroyFence(vulkanDevice->logicalDevice, fence, nullptr);
 
-    vkDestroyShaderModule(vulkanDevice->logicalDevice, shaderStages[0].module, nullptr);
-    vkDestroyShaderModule(vulkanDevice->logicalDevice, shaderStages[1].module, nullptr);
   }
 
   /**
@@ -183,16 +200,6 @@ class TextOverlay {
 
     vik_log_check(vkAllocateCommandBuffers(vulkanDevice->logicalDevice, &cmdBufAllocateInfo, cmdBuffers.data()));
 
-    // Vertex buffer
-    vik_log_check(vulkanDevice->createBuffer(
-                      VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
-                      VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-                      &vertexBuffer,
-                      MAX_CHAR_COUNT * sizeof(glm::vec4)));
-
-    // Map persistent
-    vertexBuffer.map();
-
     // Font texture
     VkImageCreateInfo imageInfo = {
       .sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,
@@ -214,49 +221,7 @@ class TextOverlay {
 
     vik_log_check(vkCreateImage(vulkanDevice->logicalDevice, &imageInfo, nullptr, &image));
 
-    VkMemoryRequirements memReqs;
-    vkGetImageMemoryRequirements(vulkanDevice->logicalDevice, image, &memReqs);
-
-    VkMemoryAllocateInfo allocInfo {
-      .sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
-      .allocationSize = memReqs.size,
-      .memoryTypeIndex = vulkanDevice->getMemoryType(memReqs.memoryTypeBits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT)
-    };
-
-    vik_log_check(vkAllocateMemory(vulkanDevice->logicalDevice, &allocInfo, nullptr, &imageMemory));
-    vik_log_check(vkBindImageMemory(vulkanDevice->logicalDevice, image, imageMemory, 0));
-
-    // Staging
-    Buffer stagingBuffer;
-
-    vik_log_check(vulkanDevice->createBuffer(
-                      VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-                      VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-                      &stagingBuffer,
-                      allocInfo.allocationSize));
-
-    stagingBuffer.map();
-    // Only one channel, so data size = W * H (*R8)
-    memcpy(stagingBuffer.mapped, &font24pixels[0][0], STB_FONT_WIDTH * STB_FONT_HEIGHT);
-    stagingBuffer.unmap();
-
-    // Copy to image
-    VkCommandBuffer copyCmd;
-    cmdBufAllocateInfo.commandBufferCount = 1;
-    vik_log_check(vkAllocateCommandBuffers(vulkanDevice->logicalDevice, &cmdBufAllocateInfo, &copyCmd));
-
-    VkCommandBufferBeginInfo cmdBufInfo = {
-      .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO
-    };
-    vik_log_check(vkBeginCommandBuffer(copyCmd, &cmdBufInfo));
-
-    // Prepare for transfer
-    tools::setImageLayout(
-          copyCmd,
-          image,
-          VK_IMAGE_ASPECT_COLOR_BIT,
-          VK_IMAGE_LAYOUT_PREINITIALIZED,
-          VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
+    imageAllocation = vulkanDevice->allocator.allocate_image(image, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
 
     VkBufferImageCopy bufferCopyRegion = {
       .imageSubresource = {
@@ -271,37 +236,23 @@ class TextOverlay {
       },
     };
 
-    vkCmdCopyBufferToImage(
-          copyCmd,
-          stagingBuffer.buffer,
-          image,
-          VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-          1,
-          &bufferCopyRegion);
+    VkImageSubresourceRange subresourceRange = {
+      .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+      .baseMipLevel = 0,
+      .levelCount = 1,
+      .layerCount = 1
+    };
 
-    // Prepare for shader read
-    tools::setImageLayout(
-          copyCmd,
+    // Copy through the staging ring, only one channel, so data size = W * H (*R8)
+    vulkanDevice->upload_batcher.upload_image(
+          &font24pixels[0][0],
+          STB_FONT_WIDTH * STB_FONT_HEIGHT,
+          1,
           image,
-          VK_IMAGE_ASPECT_COLOR_BIT,
-          VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+          { bufferCopyRegion },
+          subresourceRange,
           VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
 
-    vik_log_check(vkEndCommandBuffer(copyCmd));
-
-    VkSubmitInfo submitInfo = {
-      .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
-      .commandBufferCount = 1,
-      .pCommandBuffers = &copyCmd
-    };
-
-    vik_log_check(vkQueueSubmit(queue, 1, &submitInfo, VK_NULL_HANDLE));
-    vik_log_check(vkQueueWaitIdle(queue));
-
-    stagingBuffer.destroy();
-
-    vkFreeCommandBuffers(vulkanDevice->logicalDevice, commandPool, 1, &copyCmd);
-
     VkImageViewCreateInfo imageViewInfo = {
       .sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
       .image = image,
@@ -410,11 +361,6 @@ class TextOverlay {
     };
     vkUpdateDescriptorSets(vulkanDevice->logicalDevice, static_cast<uint32_t>(writeDescriptorSets.size()), writeDescriptorSets.data(), 0, nullptr);
 
-    // Pipeline cache
-    VkPipelineCacheCreateInfo pipelineCacheCreateInfo = {};
-    pipelineCacheCreateInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
-    vik_log_check(vkCreatePipelineCache(vulkanDevice->logicalDevice, &pipelineCacheCreateInfo, nullptr, &pipelineCache));
-
     // Command buffer execution fence
     VkFenceCreateInfo fenceCreateInfo = {
       .sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO
@@ -552,7 +498,13 @@ class TextOverlay {
       .basePipelineHandle = VK_NULL_HANDLE,
       .basePipelineIndex = -1
     };
-    vik_log_check(vkCreateGraphicsPipelines(vulkanDevice->logicalDevice, pipelineCache, 1, &pipelineCreateInfo, nullptr, &pipeline));
+    pipelineFuture = pipelineBuilder->build(pipelineCreateInfo);
+  }
+
+  VkPipeline getPipeline() {
+    if (pipeline == VK_NULL_HANDLE)
+      pipeline = pipelineFuture.get();
+    return pipeline;
   }
 
   /**
@@ -642,10 +594,15 @@ class TextOverlay {
   }
 
   /**
-  * Maps the buffer, resets letter count
+  * Reserves vertex space in the current arena slice, resets letter count
+  *
+  * @param arena Upload arena of the frame the text is drawn in
   */
-  void beginTextUpdate() {
-    mappedLocal = (glm::vec4*)vertexBuffer.mapped;
+  void beginTextUpdate(UploadArena *arena) {
+    UploadArena::Allocation allocation = arena->allocate(getVertexBufferSize());
+    mappedLocal = (glm::vec4*)allocation.data;
+    vertexBuffer = arena->buffer.buffer;
+    vertexOffset = allocation.offset;
     numLetters = 0;
   }
 
@@ -658,7 +615,7 @@ class TextOverlay {
   * @param align Alignment for the new text (left, right, center)
   */
   void addText(std::string text, float x, float y, TextAlign align) {
-    assert(vertexBuffer.mapped != nullptr);
+    assert(mappedLocal != nullptr);
 
     if (align == alignLeft) {
       x *= scale;
@@ -694,6 +651,12 @@ class TextOverlay {
 
     // Generate a uv mapped quad per char in the new text
     for (auto letter : text) {
+      // Four vertices per letter
+      if ((numLetters + 1) * 4 > MAX_CHAR_COUNT) {
+        vik_log_w("Text overlay is full, dropping remaining letters.");
+        break;
+      }
+
       stb_fontchar *charData = &stbFontData[(uint32_t)letter - STB_FIRST_CHAR];
 
       mappedLocal->x = (x + (float)charData->x0 * charW);
@@ -726,17 +689,28 @@ class TextOverlay {
     }
   }
 
+  /** @brief Per frame vertex space to reserve in the upload arena */
+  static VkDeviceSize getVertexBufferSize() {
+    return MAX_CHAR_COUNT * sizeof(glm::vec4);
+  }
+
   /**
-  * Unmap buffer and update command buffers
+  * Finish the update and record the command buffer of the current frame
+  *
+  * @param frame Index of the frame in flight
+  * @param image Index of the frame buffer the text will be drawn to
   */
-  void endTextUpdate() {
-    updateCommandBuffers();
+  void endTextUpdate(uint32_t frame, uint32_t image) {
+    mappedLocal = nullptr;
+    updateCommandBuffer(frame, image);
   }
 
   /**
-  * Update the command buffers to reflect text changes
+  * Record the command buffer of a frame in flight to reflect text changes
   */
-  void updateCommandBuffers() {
+  void updateCommandBuffer(uint32_t frame, uint32_t image) {
+    VkCommandBuffer cmdBuffer = cmdBuffers[frame];
+
     VkCommandBufferBeginInfo cmdBufInfo = {
       .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO
     };
@@ -755,56 +729,62 @@ class TextOverlay {
       .pClearValues = nullptr
     };
 
-    for (size_t i = 0; i < cmdBuffers.size(); ++i) {
-      renderPassBeginInfo.framebuffer = *frameBuffers[i];
+    renderPassBeginInfo.framebuffer = *frameBuffers[image];
 
-      vik_log_check(vkBeginCommandBuffer(cmdBuffers[i], &cmdBufInfo));
+    vik_log_check(vkBeginCommandBuffer(cmdBuffer, &cmdBufInfo));
 
-      if (debugmarker::active)
-        debugmarker::beginRegion(cmdBuffers[i], "Text overlay", glm::vec4(1.0f, 0.94f, 0.3f, 1.0f));
+    if (debugmarker::active)
+      debugmarker::beginRegion(cmdBuffer, "Text overlay", glm::vec4(1.0f, 0.94f, 0.3f, 1.0f));
 
-      vkCmdBeginRenderPass(cmdBuffers[i], &renderPassBeginInfo, VK_SUBPASS_CONTENTS_INLINE);
+    if (profiler) {
+      profiler->reset(cmdBuffer, image, profilerScope);
+      profiler->begin(cmdBuffer, image, profilerScope);
+    }
 
-      VkViewport viewport = {
-        .width = (float)*frameBufferWidth,
-        .height = (float)*frameBufferHeight,
-        .minDepth = 0.0f,
-        .maxDepth = 1.0f
-      };
-      vkCmdSetViewport(cmdBuffers[i], 0, 1, &viewport);
+    vkCmdBeginRenderPass(cmdBuffer, &renderPassBeginInfo, VK_SUBPASS_CONTENTS_INLINE);
 
-      VkRect2D scissor = {
-        .offset = { .x = 0, .y = 0 },
-        .extent = { .width = *frameBufferWidth, .height = *frameBufferHeight }
-      };
-      vkCmdSetScissor(cmdBuffers[i], 0, 1, &scissor);
+    VkViewport viewport = {
+      .width = (float)*frameBufferWidth,
+      .height = (float)*frameBufferHeight,
+      .minDepth = 0.0f,
+      .maxDepth = 1.0f
+    };
+    vkCmdSetViewport(cmdBuffer, 0, 1, &viewport);
 
-      vkCmdBindPipeline(cmdBuffers[i], VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline);
-      vkCmdBindDescriptorSets(cmdBuffers[i], VK_PIPELINE_BIND_POINT_GRAPHICS, pipelineLayout, 0, 1, &descriptorSet, 0, NULL);
+    VkRect2D scissor = {
+      .offset = { .x = 0, .y = 0 },
+      .extent = { .width = *frameBufferWidth, .height = *frameBufferHeight }
+    };
+    vkCmdSetScissor(cmdBuffer, 0, 1, &scissor);
 
-      VkDeviceSize offsets = 0;
-      vkCmdBindVertexBuffers(cmdBuffers[i], 0, 1, &vertexBuffer.buffer, &offsets);
-      vkCmdBindVertexBuffers(cmdBuffers[i], 1, 1, &vertexBuffer.buffer, &offsets);
-      for (uint32_t j = 0; j < numLetters; j++)
-        vkCmdDraw(cmdBuffers[i], 4, 1, j * 4, 0);
+    vkCmdBindPipeline(cmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, getPipeline());
+    vkCmdBindDescriptorSets(cmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelineLayout, 0, 1, &descriptorSet, 0, NULL);
 
-      vkCmdEndRenderPass(cmdBuffers[i]);
+    VkDeviceSize offsets = vertexOffset;
+    vkCmdBindVertexBuffers(cmdBuffer, 0, 1, &vertexBuffer, &offsets);
+    vkCmdBindVertexBuffers(cmdBuffer, 1, 1, &vertexBuffer, &offsets);
+    for (uint32_t j = 0; j < numLetters; j++)
+      vkCmdDraw(cmdBuffer, 4, 1, j * 4, 0);
 
-      if (debugmarker::active)
-        debugmarker::endRegion(cmdBuffers[i]);
+    vkCmdEndRenderPass(cmdBuffer);
 
-      vik_log_check(vkEndCommandBuffer(cmdBuffers[i]));
-    }
+    if (profiler)
+      profiler->end(cmdBuffer, image, profilerScope);
+
+    if (debugmarker::active)
+      debugmarker::endRegion(cmdBuffer);
+
+    vik_log_check(vkEndCommandBuffer(cmdBuffer));
   }
 
   /**
   * Submit the text command buffers to a queue
   */
-  void submit(VkQueue queue, uint32_t bufferindex, VkSubmitInfo submitInfo) {
+  void submit(VkQueue queue, uint32_t frame, VkSubmitInfo submitInfo) {
     if (!visible)
       return;
 
-    submitInfo.pCommandBuffers = &cmdBuffers[bufferindex];
+    submitInfo.pCommandBuffers = &cmdBuffers[frame];
     submitInfo.commandBufferCount = 1;
 
     vik_log_check(vkQueueSubmit(queue, 1, &submitInfo, fence));
@@ -830,13 +810,20 @@ class TextOverlay {
     vik_log_check(vkAllocateCommandBuffers(vulkanDevice->logicalDevice, &cmdBufAllocateInfo, cmdBuffers.data()));
   }
 
-  void update(const std::string& title, const std::string& fps, const std::string& device) {
-    beginTextUpdate();
+  void update(UploadArena *arena, uint32_t frame, uint32_t image,
+              const std::string& title, const std::string& fps, const std::string& device,
+              const std::vector<std::string>& stats) {
+    beginTextUpdate(arena);
     addText(title, 5.0f, 5.0f, TextOverlay::alignLeft);
     addText(fps, 5.0f, 25.0f, TextOverlay::alignLeft);
     addText(device, 5.0f, 45.0f, TextOverlay::alignLeft);
+    float y = 65.0f;
+    for (auto line : stats) {
+      addText(line, 5.0f, y, TextOverlay::alignLeft);
+      y += 20.0f;
+    }
     update_cb(this);
-    endTextUpdate();
+    endTextUpdate(frame, image);
   }
 };
 }  // namespace vik
@@ -13,6 +13,7 @@
 #include <vulkan/vulkan.h>
 #include <gli/gli.hpp>
 
+#include <array>
 #include <string>
 #include <fstream>
 #include <vector>
@@ -21,7 +22,9 @@
 #include "vikDevice.hpp"
 #include "vikBuffer.hpp"
 
+#include "../system/vikAssetPack.hpp"
 #include "../system/vikLog.hpp"
+#include "../system/vikTrace.hpp"
 
 namespace vik {
 /** @brief Vulkan texture base class */
@@ -31,6 +34,8 @@ class Texture {
   VkImage image;
   VkImageLayout imageLayout;
   VkDeviceMemory deviceMemory;
+  /** @brief Range of device memory the image is bound to */
+  Allocation allocation;
   VkImageView view;
   uint32_t width, height;
   uint32_t mipLevels;
@@ -47,13 +52,18 @@ class Texture {
     descriptor.imageLayout = imageLayout;
   }
 
+  /** @brief Bytes per texel block, gli formats use the Vulkan values */
+  static VkDeviceSize get_texel_block_size(VkFormat format) {
+    return gli::block_size(static_cast<gli::format>(format));
+  }
+
   /** @brief Release all Vulkan resources held by this texture */
   void destroy() {
     vkDestroyImageView(device->logicalDevice, view, nullptr);
     vkDestroyImage(device->logicalDevice, image, nullptr);
     if (sampler)
       vkDestroySampler(device->logicalDevice, sampler, nullptr);
-    vkFreeMemory(device->logicalDevice, deviceMemory, nullptr);
+    device->allocator.free(allocation);
   }
 };
 
@@ -80,6 +90,7 @@ class Texture2D : public Texture {
       VkImageUsageFlags imageUsageFlags = VK_IMAGE_USAGE_SAMPLED_BIT,
       VkImageLayout imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
       bool forceLinear = false) {
+    vik_trace_zone("load_texture");
     bool exists = tools::fileExists(filename);
     vik_log_f_if(!exists, "File not found: Could not load texture from %s", filename.c_str());
 
@@ -103,45 +114,7 @@ class Texture2D : public Texture {
     // limited amount of formats and features (mip maps, cubemaps, arrays, etc.)
     VkBool32 useStaging = !forceLinear;
 
-    VkMemoryAllocateInfo memAllocInfo = {
-      .sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
-    };
-    VkMemoryRequirements memReqs;
-
-    // Use a separate command buffer for texture loading
-    VkCommandBuffer copyCmd = device->createCommandBuffer(VK_COMMAND_BUFFER_LEVEL_PRIMARY, true);
-
     if (useStaging) {
-      // Create a host-visible staging buffer that contains the raw image data
-      VkBuffer stagingBuffer;
-      VkDeviceMemory stagingMemory;
-
-      VkBufferCreateInfo bufferCreateInfo = {
-        .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
-        .size = tex2D.size(),
-        // This buffer is used as a transfer source for the buffer copy
-        .usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-        .sharingMode = VK_SHARING_MODE_EXCLUSIVE
-      };
-
-      vik_log_check(vkCreateBuffer(device->logicalDevice, &bufferCreateInfo, nullptr, &stagingBuffer));
-
-      // Get memory requirements for the staging buffer (alignment, memory type bits)
-      vkGetBufferMemoryRequirements(device->logicalDevice, stagingBuffer, &memReqs);
-
-      memAllocInfo.allocationSize = memReqs.size;
-      // Get memory type index for a host visible buffer
-      memAllocInfo.memoryTypeIndex = device->getMemoryType(memReqs.memoryTypeBits, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
-
-      vik_log_check(vkAllocateMemory(device->logicalDevice, &memAllocInfo, nullptr, &stagingMemory));
-      vik_log_check(vkBindBufferMemory(device->logicalDevice, stagingBuffer, stagingMemory, 0));
-
-      // Copy texture data into staging buffer
-      uint8_t *data;
-      vik_log_check(vkMapMemory(device->logicalDevice, stagingMemory, 0, memReqs.size, 0, (void **)&data));
-      memcpy(data, tex2D.data(), tex2D.size());
-      vkUnmapMemory(device->logicalDevice, stagingMemory);
-
       // Setup buffer copy regions for each mip level
       std::vector<VkBufferImageCopy> bufferCopyRegions;
       uint32_t offset = 0;
@@ -191,13 +164,9 @@ class Texture2D : public Texture {
         imageCreateInfo.usage |= VK_IMAGE_USAGE_TRANSFER_DST_BIT;
       vik_log_check(vkCreateImage(device->logicalDevice, &imageCreateInfo, nullptr, &image));
 
-      vkGetImageMemoryRequirements(device->logicalDevice, image, &memReqs);
-
-      memAllocInfo.allocationSize = memReqs.size;
-
-      memAllocInfo.memoryTypeIndex = device->getMemoryType(memReqs.memoryTypeBits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
-      vik_log_check(vkAllocateMemory(device->logicalDevice, &memAllocInfo, nullptr, &deviceMemory));
-      vik_log_check(vkBindImageMemory(device->logicalDevice, image, deviceMemory, 0));
+      allocation = device->allocator.allocate_image(
+            image, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+      deviceMemory = allocation.memory;
 
       VkImageSubresourceRange subresourceRange = {
         .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
@@ -206,38 +175,17 @@ class Texture2D : public Texture {
         .layerCount = 1
       };
 
-      // Image barrier for optimal image (target)
-      // Optimal image will be used as destination for the copy
-      tools::setImageLayout(
-            copyCmd,
-            image,
-            VK_IMAGE_LAYOUT_UNDEFINED,
-            VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-            subresourceRange);
-
-      // Copy mip levels from staging buffer
-      vkCmdCopyBufferToImage(
-            copyCmd,
-            stagingBuffer,
-            image,
-            VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-            static_cast<uint32_t>(bufferCopyRegions.size()),
-            bufferCopyRegions.data());
-
-      // Change texture image layout to shader read after all mip levels have been copied
+      // Copy mip levels through the staging ring
+      // The image ends up in the requested layout once the batch completed
       this->imageLayout = imageLayout;
-      tools::setImageLayout(
-            copyCmd,
+      device->upload_batcher.upload_image(
+            tex2D.data(),
+            tex2D.size(),
+            get_texel_block_size(format),
             image,
-            VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-            imageLayout,
-            subresourceRange);
-
-      device->flushCommandBuffer(copyCmd, copyQueue);
-
-      // Clean up staging resources
-      vkFreeMemory(device->logicalDevice, stagingMemory, nullptr);
-      vkDestroyBuffer(device->logicalDevice, stagingBuffer, nullptr);
+            bufferCopyRegions,
+            subresourceRange,
+            imageLayout);
     } else {
       // Prefer using optimal tiling, as linear tiling
       // may support only a small set of features
@@ -247,7 +195,6 @@ class Texture2D : public Texture {
       assert(formatProperties.linearTilingFeatures & VK_FORMAT_FEATURE_SAMPLED_IMAGE_BIT);
 
       VkImage mappableImage;
-      VkDeviceMemory mappableMemory;
 
       VkImageCreateInfo imageCreateInfo = {
         .sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,
@@ -271,20 +218,11 @@ class Texture2D : public Texture {
       vik_log_check(vkCreateImage(device->logicalDevice, &imageCreateInfo,
                                   nullptr, &mappableImage));
 
-      // Get memory requirements for this image
-      // like size and alignment
-      vkGetImageMemoryRequirements(device->logicalDevice, mappableImage, &memReqs);
-      // Set memory allocation size to required memory size
-      memAllocInfo.allocationSize = memReqs.size;
-
-      // Get memory type that can be mapped to host memory
-      memAllocInfo.memoryTypeIndex = device->getMemoryType(memReqs.memoryTypeBits, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
-
-      // Allocate host memory
-      vik_log_check(vkAllocateMemory(device->logicalDevice, &memAllocInfo, nullptr, &mappableMemory));
-
-      // Bind allocated image for use
-      vik_log_check(vkBindImageMemory(device->logicalDevice, mappableImage, mappableMemory, 0));
+      // Sub-allocate host visible memory, which stays mapped
+      allocation = device->allocator.allocate_image(
+            mappableImage,
+            VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+            VK_IMAGE_TILING_LINEAR);
 
       // Get sub resource layout
       // Mip map count, array layer, etc.
@@ -294,27 +232,23 @@ class Texture2D : public Texture {
       };
 
       VkSubresourceLayout subResLayout;
-      void *data;
 
       // Get sub resources layout
       // Includes row pitch, size offsets, etc.
       vkGetImageSubresourceLayout(device->logicalDevice, mappableImage, &subRes, &subResLayout);
 
-      // Map image memory
-      vik_log_check(vkMapMemory(device->logicalDevice, mappableMemory, 0, memReqs.size, 0, &data));
-
       // Copy image data into memory
+      uint8_t *data = (uint8_t *) allocation.mapped + subResLayout.offset;
       memcpy(data, tex2D[subRes.mipLevel].data(), tex2D[subRes.mipLevel].size());
 
-      vkUnmapMemory(device->logicalDevice, mappableMemory);
-
       // Linear tiled images don't need to be staged
       // and can be directly used as textures
       image = mappableImage;
-      deviceMemory = mappableMemory;
+      deviceMemory = allocation.memory;
       this->imageLayout = imageLayout;
 
       // Setup image memory barrier
+      VkCommandBuffer copyCmd = device->createCommandBuffer(VK_COMMAND_BUFFER_LEVEL_PRIMARY, true);
       tools::setImageLayout(copyCmd, image, VK_IMAGE_ASPECT_COLOR_BIT,
                             VK_IMAGE_LAYOUT_UNDEFINED, imageLayout);
 
@@ -386,7 +320,6 @@ class Texture2D : public Texture {
     * @param height Height of the texture to create
     * @param format Vulkan format of the image data stored in the file
     * @param device Vulkan device to create the texture on
-    * @param copyQueue Queue used for the texture staging copy commands (must support transfer)
     * @param (Optional) filter Texture filtering for the sampler (defaults to VK_FILTER_LINEAR)
     * @param (Optional) imageUsageFlags Usage flags for the texture's image (defaults to VK_IMAGE_USAGE_SAMPLED_BIT)
     * @param (Optional) imageLayout Usage layout for the texture (defaults VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL)
@@ -398,7 +331,6 @@ class Texture2D : public Texture {
       uint32_t width,
       uint32_t height,
       Device *device,
-      VkQueue copyQueue,
       VkFilter filter = VK_FILTER_LINEAR,
       VkImageUsageFlags imageUsageFlags = VK_IMAGE_USAGE_SAMPLED_BIT,
       VkImageLayout imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL) {
@@ -409,44 +341,6 @@ class Texture2D : public Texture {
     this->height = height;
     mipLevels = 1;
 
-    // Use a separate command buffer for texture loading
-    VkCommandBuffer copyCmd = device->createCommandBuffer(VK_COMMAND_BUFFER_LEVEL_PRIMARY, true);
-
-    // Create a host-visible staging buffer that contains the raw image data
-    VkBuffer stagingBuffer;
-    VkDeviceMemory stagingMemory;
-
-    VkBufferCreateInfo bufferCreateInfo = {
-      .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
-      .size = bufferSize,
-      // This buffer is used as a transfer source for the buffer copy
-      .usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-      .sharingMode = VK_SHARING_MODE_EXCLUSIVE
-    };
-
-    vik_log_check(vkCreateBuffer(device->logicalDevice, &bufferCreateInfo,
-                                 nullptr, &stagingBuffer));
-
-    VkMemoryRequirements memReqs;
-    // Get memory requirements for the staging buffer (alignment, memory type bits)
-    vkGetBufferMemoryRequirements(device->logicalDevice, stagingBuffer, &memReqs);
-
-    VkMemoryAllocateInfo memAllocInfo = {
-      .sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
-      .allocationSize = memReqs.size,
-      // Get memory type index for a host visible buffer
-      .memoryTypeIndex = device->getMemoryType(memReqs.memoryTypeBits, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT)
-    };
-
-    vik_log_check(vkAllocateMemory(device->logicalDevice, &memAllocInfo, nullptr, &stagingMemory));
-    vik_log_check(vkBindBufferMemory(device->logicalDevice, stagingBuffer, stagingMemory, 0));
-
-    // Copy texture data into staging buffer
-    uint8_t *data;
-    vik_log_check(vkMapMemory(device->logicalDevice, stagingMemory, 0, memReqs.size, 0, (void **)&data));
-    memcpy(data, buffer, bufferSize);
-    vkUnmapMemory(device->logicalDevice, stagingMemory);
-
     VkBufferImageCopy bufferCopyRegion = {
       .bufferOffset = 0,
       .imageSubresource = {
@@ -486,13 +380,9 @@ class Texture2D : public Texture {
       imageCreateInfo.usage |= VK_IMAGE_USAGE_TRANSFER_DST_BIT;
     vik_log_check(vkCreateImage(device->logicalDevice, &imageCreateInfo, nullptr, &image));
 
-    vkGetImageMemoryRequirements(device->logicalDevice, image, &memReqs);
-
-    memAllocInfo.allocationSize = memReqs.size;
-
-    memAllocInfo.memoryTypeIndex = device->getMemoryType(memReqs.memoryTypeBits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
-    vik_log_check(vkAllocateMemory(device->logicalDevice, &memAllocInfo, nullptr, &deviceMemory));
-    vik_log_check(vkBindImageMemory(device->logicalDevice, image, deviceMemory, 0));
+    allocation = device->allocator.allocate_image(
+          image, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+    deviceMemory = allocation.memory;
 
     VkImageSubresourceRange subresourceRange = {
       .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
@@ -501,38 +391,17 @@ class Texture2D : public Texture {
       .layerCount = 1
     };
 
-    // Image barrier for optimal image (target)
-    // Optimal image will be used as destination for the copy
-    tools::setImageLayout(
-          copyCmd,
-          image,
-          VK_IMAGE_LAYOUT_UNDEFINED,
-          VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-          subresourceRange);
-
-    // Copy mip levels from staging buffer
-    vkCmdCopyBufferToImage(
-          copyCmd,
-          stagingBuffer,
-          image,
-          VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-          1,
-          &bufferCopyRegion);
-
-    // Change texture image layout to shader read after all mip levels have been copied
+    // Copy the image through the staging ring
+    // The image ends up in the requested layout once the batch completed
     this->imageLayout = imageLayout;
-    tools::setImageLayout(
-          copyCmd,
+    device->upload_batcher.upload_image(
+          buffer,
+          bufferSize,
+          get_texel_block_size(format),
           image,
-          VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-          imageLayout,
-          subresourceRange);
-
-    device->flushCommandBuffer(copyCmd, copyQueue);
-
-    // Clean up staging resources
-    vkFreeMemory(device->logicalDevice, stagingMemory, nullptr);
-    vkDestroyBuffer(device->logicalDevice, stagingBuffer, nullptr);
+          { bufferCopyRegion },
+          subresourceRange,
+          imageLayout);
 
     // Create sampler
     VkSamplerCreateInfo samplerCreateInfo = {
@@ -589,7 +458,6 @@ class Texture2DArray : public Texture {
     * @param filename File to load (supports .ktx and .dds)
     * @param format Vulkan format of the image data stored in the file
     * @param device Vulkan device to create the texture on
-    * @param copyQueue Queue used for the texture staging copy commands (must support transfer)
     * @param (Optional) imageUsageFlags Usage flags for the texture's image (defaults to VK_IMAGE_USAGE_SAMPLED_BIT)
     * @param (Optional) imageLayout Usage layout for the texture (defaults VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL)
     *
@@ -598,9 +466,9 @@ class Texture2DArray : public Texture {
       std::string filename,
       VkFormat format,
       Device *device,
-      VkQueue copyQueue,
       VkImageUsageFlags imageUsageFlags = VK_IMAGE_USAGE_SAMPLED_BIT,
       VkImageLayout imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL) {
+    vik_trace_zone("load_texture");
     vik_log_f_if(!tools::fileExists(filename),
                  "File not found: Could not load texture from %s",
                  filename.c_str());
@@ -615,40 +483,6 @@ class Texture2DArray : public Texture {
     layerCount = static_cast<uint32_t>(tex2DArray.layers());
     mipLevels = static_cast<uint32_t>(tex2DArray.levels());
 
-    // Create a host-visible staging buffer that contains the raw image data
-    VkBuffer stagingBuffer;
-    VkDeviceMemory stagingMemory;
-
-    VkBufferCreateInfo bufferCreateInfo = {
-      .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
-      .size = tex2DArray.size(),
-      // This buffer is used as a transfer source for the buffer copy
-      .usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-      .sharingMode = VK_SHARING_MODE_EXCLUSIVE
-    };
-
-    vik_log_check(vkCreateBuffer(device->logicalDevice, &bufferCreateInfo, nullptr, &stagingBuffer));
-
-    // Get memory requirements for the staging buffer (alignment, memory type bits)
-    VkMemoryRequirements memReqs;
-    vkGetBufferMemoryRequirements(device->logicalDevice, stagingBuffer, &memReqs);
-
-    VkMemoryAllocateInfo memAllocInfo = {
-      .sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
-      .allocationSize = memReqs.size,
-      // Get memory type index for a host visible buffer
-      .memoryTypeIndex = device->getMemoryType(memReqs.memoryTypeBits, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT)
-    };
-
-    vik_log_check(vkAllocateMemory(device->logicalDevice, &memAllocInfo, nullptr, &stagingMemory));
-    vik_log_check(vkBindBufferMemory(device->logicalDevice, stagingBuffer, stagingMemory, 0));
-
-    // Copy texture data into staging buffer
-    uint8_t *data;
-    vik_log_check(vkMapMemory(device->logicalDevice, stagingMemory, 0, memReqs.size, 0, (void **)&data));
-    memcpy(data, tex2DArray.data(), static_cast<size_t>(tex2DArray.size()));
-    vkUnmapMemory(device->logicalDevice, stagingMemory);
-
     // Setup buffer copy regions for each layer including all of it's miplevels
     std::vector<VkBufferImageCopy> bufferCopyRegions;
     size_t offset = 0;
@@ -701,19 +535,10 @@ class Texture2DArray : public Texture {
 
     vik_log_check(vkCreateImage(device->logicalDevice, &imageCreateInfo, nullptr, &image));
 
-    vkGetImageMemoryRequirements(device->logicalDevice, image, &memReqs);
-
-    memAllocInfo.allocationSize = memReqs.size;
-    memAllocInfo.memoryTypeIndex = device->getMemoryType(memReqs.memoryTypeBits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+    allocation = device->allocator.allocate_image(
+          image, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+    deviceMemory = allocation.memory;
 
-    vik_log_check(vkAllocateMemory(device->logicalDevice, &memAllocInfo, nullptr, &deviceMemory));
-    vik_log_check(vkBindImageMemory(device->logicalDevice, image, deviceMemory, 0));
-
-    // Use a separate command buffer for texture loading
-    VkCommandBuffer copyCmd = device->createCommandBuffer(VK_COMMAND_BUFFER_LEVEL_PRIMARY, true);
-
-    // Image barrier for optimal image (target)
-    // Set initial layout for all array layers (faces) of the optimal (target) tiled texture
     VkImageSubresourceRange subresourceRange = {
       .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
       .baseMipLevel = 0,
@@ -721,32 +546,17 @@ class Texture2DArray : public Texture {
       .layerCount = layerCount
     };
 
-    tools::setImageLayout(
-          copyCmd,
-          image,
-          VK_IMAGE_LAYOUT_UNDEFINED,
-          VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-          subresourceRange);
-
-    // Copy the layers and mip levels from the staging buffer to the optimal tiled image
-    vkCmdCopyBufferToImage(
-          copyCmd,
-          stagingBuffer,
-          image,
-          VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-          static_cast<uint32_t>(bufferCopyRegions.size()),
-          bufferCopyRegions.data());
-
-    // Change texture image layout to shader read after all faces have been copied
+    // Copy the layers and mip levels through the staging ring to the optimal tiled image
+    // The image ends up in the requested layout once the batch completed
     this->imageLayout = imageLayout;
-    tools::setImageLayout(
-          copyCmd,
+    device->upload_batcher.upload_image(
+          tex2DArray.data(),
+          tex2DArray.size(),
+          get_texel_block_size(format),
           image,
-          VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-          imageLayout,
-          subresourceRange);
-
-    device->flushCommandBuffer(copyCmd, copyQueue);
+          bufferCopyRegions,
+          subresourceRange,
+          imageLayout);
 
     // Create sampler
     VkSamplerCreateInfo samplerCreateInfo = {
@@ -792,10 +602,6 @@ class Texture2DArray : public Texture {
     vik_log_check(vkCreateImageView(device->logicalDevice, &viewCreateInfo,
                                     nullptr, &view));
 
-    // Clean up staging resources
-    vkFreeMemory(device->logicalDevice, stagingMemory, nullptr);
-    vkDestroyBuffer(device->logicalDevice, stagingBuffer, nullptr);
-
     // Update descriptor image info member that can be used for setting up descriptor sets
     updateDescriptor();
   }
@@ -807,10 +613,11 @@ class TextureCubeMap : public Texture {
   /**
     * Load a cubemap texture including all mip levels from a single file
     *
+    * @note Uploads the cooked mip chain from the asset pack when there is one
+    *
     * @param filename File to load (supports .ktx and .dds)
     * @param format Vulkan format of the image data stored in the file
     * @param device Vulkan device to create the texture on
-    * @param copyQueue Queue used for the texture staging copy commands (must support transfer)
     * @param (Optional) imageUsageFlags Usage flags for the texture's image (defaults to VK_IMAGE_USAGE_SAMPLED_BIT)
     * @param (Optional) imageLayout Usage layout for the texture (defaults VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL)
     *
@@ -819,9 +626,13 @@ class TextureCubeMap : public Texture {
       std::string filename,
       VkFormat format,
       Device *device,
-      VkQueue copyQueue,
       VkImageUsageFlags imageUsageFlags = VK_IMAGE_USAGE_SAMPLED_BIT,
       VkImageLayout imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL) {
+    vik_trace_zone("load_texture");
+
+    if (loadFromPack(filename, format, device, imageUsageFlags, imageLayout))
+      return;
+
     vik_log_f_if(!tools::fileExists(filename),
                  "File not found: Could not load texture from %s",
                  filename.c_str());
@@ -835,39 +646,6 @@ class TextureCubeMap : public Texture {
     height = static_cast<uint32_t>(texCube.extent().y);
     mipLevels = static_cast<uint32_t>(texCube.levels());
 
-    // Create a host-visible staging buffer that contains the raw image data
-    VkBuffer stagingBuffer;
-    VkDeviceMemory stagingMemory;
-
-    VkBufferCreateInfo bufferCreateInfo = {
-      .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
-      .size = texCube.size(),
-      // This buffer is used as a transfer source for the buffer copy
-      .usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-      .sharingMode = VK_SHARING_MODE_EXCLUSIVE
-    };
-    vik_log_check(vkCreateBuffer(device->logicalDevice, &bufferCreateInfo, nullptr, &stagingBuffer));
-
-    // Get memory requirements for the staging buffer (alignment, memory type bits)
-    VkMemoryRequirements memReqs;
-    vkGetBufferMemoryRequirements(device->logicalDevice, stagingBuffer, &memReqs);
-
-    VkMemoryAllocateInfo memAllocInfo = {
-      .sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
-      .allocationSize = memReqs.size,
-      // Get memory type index for a host visible buffer
-      .memoryTypeIndex = device->getMemoryType(memReqs.memoryTypeBits, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT)
-    };
-
-    vik_log_check(vkAllocateMemory(device->logicalDevice, &memAllocInfo, nullptr, &stagingMemory));
-    vik_log_check(vkBindBufferMemory(device->logicalDevice, stagingBuffer, stagingMemory, 0));
-
-    // Copy texture data into staging buffer
-    uint8_t *data;
-    vik_log_check(vkMapMemory(device->logicalDevice, stagingMemory, 0, memReqs.size, 0, (void **)&data));
-    memcpy(data, texCube.data(), texCube.size());
-    vkUnmapMemory(device->logicalDevice, stagingMemory);
-
     // Setup buffer copy regions for each face including all of it's miplevels
     std::vector<VkBufferImageCopy> bufferCopyRegions;
     size_t offset = 0;
@@ -895,6 +673,129 @@ class TextureCubeMap : public Texture {
       }
     }
 
+    upload(texCube.data(), texCube.size(), bufferCopyRegions, format,
+           imageUsageFlags, imageLayout);
+  }
+
+  /**
+    * Load a cooked cubemap from the mapped asset pack
+    *
+    * @return false if the pack has no cube map cooked from the file in this format
+    */
+  bool loadFromPack(
+      const std::string &filename,
+      VkFormat format,
+      Device *device,
+      VkImageUsageFlags imageUsageFlags = VK_IMAGE_USAGE_SAMPLED_BIT,
+      VkImageLayout imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL) {
+    AssetPack& pack = AssetPack::get();
+
+    const PackEntry *entry = pack.find(filename, PACK_ENTRY_CUBE_MAP);
+    if (entry == nullptr || entry->size < sizeof(PackTexture))
+      return false;
+
+    const PackTexture *cooked = pack.get<PackTexture>(entry->offset);
+    if (cooked->layers != 6
+        || !pack.contains(cooked->data_offset, cooked->data_size)
+        || !pack.contains(cooked->regions_offset,
+                          cooked->region_count * sizeof(PackRegion)))
+      return false;
+
+    if (cooked->format != static_cast<uint32_t>(format)) {
+      vik_log_w("%s was cooked as format %d, not %d.",
+                entry->name, cooked->format, format);
+      return false;
+    }
+
+    const PackRegion *regions = pack.get<PackRegion>(cooked->regions_offset);
+    for (uint32_t i = 0; i < cooked->region_count; i++)
+      if (regions[i].size > cooked->data_size
+          || regions[i].offset > cooked->data_size - regions[i].size
+          || regions[i].layer >= cooked->layers
+          || regions[i].level >= cooked->levels)
+        return false;
+
+    this->device = device;
+    width = cooked->width;
+    height = cooked->height;
+    mipLevels = cooked->levels;
+
+    std::vector<VkBufferImageCopy> bufferCopyRegions;
+    for (uint32_t i = 0; i < cooked->region_count; i++) {
+      VkBufferImageCopy bufferCopyRegion = {
+        .bufferOffset = regions[i].offset,
+        .imageSubresource = {
+          .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+          .mipLevel = regions[i].level,
+          .baseArrayLayer = regions[i].layer,
+          .layerCount = 1
+        },
+        .imageExtent = {
+          .width = regions[i].width,
+          .height = regions[i].height,
+          .depth = 1
+        }
+      };
+      bufferCopyRegions.push_back(bufferCopyRegion);
+    }
+
+    upload(pack.get<uint8_t>(cooked->data_offset), cooked->data_size,
+           bufferCopyRegions, format, imageUsageFlags, imageLayout);
+
+    vik_log_d("Loaded %s from the asset pack.", entry->name);
+    return true;
+  }
+
+  /**
+    * Create a cube map with one color on all faces
+    *
+    * @note Used in place of a cube map that is still loading
+    *
+    * @param color Face color, packed as VK_FORMAT_R8G8B8A8_UNORM
+    * @param device Vulkan device to create the texture on
+    */
+  void fromColor(uint32_t color, Device *device) {
+    this->device = device;
+    width = 1;
+    height = 1;
+    mipLevels = 1;
+
+    std::array<uint32_t, 6> faces;
+    faces.fill(color);
+
+    std::vector<VkBufferImageCopy> bufferCopyRegions;
+    for (uint32_t face = 0; face < 6; face++) {
+      VkBufferImageCopy bufferCopyRegion = {
+        .bufferOffset = face * sizeof(uint32_t),
+        .imageSubresource = {
+          .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+          .mipLevel = 0,
+          .baseArrayLayer = face,
+          .layerCount = 1
+        },
+        .imageExtent = {
+          .width = 1,
+          .height = 1,
+          .depth = 1
+        }
+      };
+      bufferCopyRegions.push_back(bufferCopyRegion);
+    }
+
+    upload(faces.data(), sizeof(faces), bufferCopyRegions,
+           VK_FORMAT_R8G8B8A8_UNORM, VK_IMAGE_USAGE_SAMPLED_BIT,
+           VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+  }
+
+ private:
+  /** @brief Create the image, sampler and view and upload the faces to the image */
+  void upload(
+      const void *data,
+      VkDeviceSize size,
+      const std::vector<VkBufferImageCopy> &bufferCopyRegions,
+      VkFormat format,
+      VkImageUsageFlags imageUsageFlags,
+      VkImageLayout imageLayout) {
     // Create optimal tiled target image
     VkImageCreateInfo imageCreateInfo = {
       .sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,
@@ -924,19 +825,10 @@ class TextureCubeMap : public Texture {
     vik_log_check(vkCreateImage(device->logicalDevice, &imageCreateInfo,
                                 nullptr, &image));
 
-    vkGetImageMemoryRequirements(device->logicalDevice, image, &memReqs);
-
-    memAllocInfo.allocationSize = memReqs.size;
-    memAllocInfo.memoryTypeIndex = device->getMemoryType(memReqs.memoryTypeBits,VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+    allocation = device->allocator.allocate_image(
+          image, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+    deviceMemory = allocation.memory;
 
-    vik_log_check(vkAllocateMemory(device->logicalDevice, &memAllocInfo, nullptr, &deviceMemory));
-    vik_log_check(vkBindImageMemory(device->logicalDevice, image, deviceMemory, 0));
-
-    // Use a separate command buffer for texture loading
-    VkCommandBuffer copyCmd = device->createCommandBuffer(VK_COMMAND_BUFFER_LEVEL_PRIMARY, true);
-
-    // Image barrier for optimal image (target)
-    // Set initial layout for all array layers (faces) of the optimal (target) tiled texture
     VkImageSubresourceRange subresourceRange = {
       .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
       .baseMipLevel = 0,
@@ -944,32 +836,17 @@ class TextureCubeMap : public Texture {
       .layerCount = 6
     };
 
-    tools::setImageLayout(
-          copyCmd,
-          image,
-          VK_IMAGE_LAYOUT_UNDEFINED,
-          VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-          subresourceRange);
-
-    // Copy the cube map faces from the staging buffer to the optimal tiled image
-    vkCmdCopyBufferToImage(
-          copyCmd,
-          stagingBuffer,
-          image,
-          VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-          static_cast<uint32_t>(bufferCopyRegions.size()),
-          bufferCopyRegions.data());
-
-    // Change texture image layout to shader read after all faces have been copied
+    // Copy the cube map faces through the staging ring to the optimal tiled image
+    // The image ends up in the requested layout once the batch completed
     this->imageLayout = imageLayout;
-    tools::setImageLayout(
-          copyCmd,
+    device->upload_batcher.upload_image(
+          data,
+          size,
+          get_texel_block_size(format),
           image,
-          VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-          imageLayout,
-          subresourceRange);
-
-    device->flushCommandBuffer(copyCmd, copyQueue);
+          bufferCopyRegions,
+          subresourceRange,
+          imageLayout);
 
     // Create sampler
     VkSamplerCreateInfo samplerCreateInfo = {
@@ -1015,10 +892,6 @@ class TextureCubeMap : public Texture {
     vik_log_check(vkCreateImageView(device->logicalDevice, &viewCreateInfo,
                                     nullptr, &view));
 
-    // Clean up staging resources
-    vkFreeMemory(device->logicalDevice, stagingMemory, nullptr);
-    vkDestroyBuffer(device->logicalDevice, stagingBuffer, nullptr);
-
     // Update descriptor image info member that can be used for setting up descriptor sets
     updateDescriptor();
   }
@@ -12,7 +12,15 @@
 
 #pragma once
 
+#include <algorithm>
+#include <array>
+#include <atomic>
 #include <chrono>
+#include <iomanip>
+#include <sstream>
+#include <string>
+
+#include "../system/vikLog.hpp"
 
 namespace vik {
 class Timer {
@@ -26,6 +34,16 @@ class Timer {
 
   /** @brief Last frame time measured using a high performance timer (if available) */
   double frame_time_seconds = 1.0;
+  // Wall clock time of the last frame, even when a fixed timestep is used
+  double measured_frame_ms = 0.0;
+  // Part of it the CPU spent working, not sleeping for pacing or blocking
+  // in the swap chain
+  double cpu_frame_ms = 0.0;
+  // Animation time passed since start
+  double elapsed_seconds = 0.0;
+
+  // Advance animations by this instead of the measured time if set
+  double fixed_timestep_seconds = 0.0;
 
   // Defines a frame rate independent timer value clamped from -1.0...1.0
   // For use in animations, rotations, etc.
@@ -35,7 +53,30 @@ class Timer {
 
   bool animation_paused = false;
 
-  Timer() {}
+  // CPU frame times of the most recent frames. Single writer, readers on
+  // other threads can copy it without taking a lock.
+  static const uint32_t FRAME_RING_SIZE = 1024;
+  std::array<std::atomic<float>, FRAME_RING_SIZE> frame_ring;
+  std::atomic<uint64_t> frame_ring_head;
+
+  // Streaming histogram of the CPU frame times, 0.1ms buckets up to 100ms,
+  // the last bucket collects everything above
+  static const uint32_t HISTOGRAM_BUCKETS = 1000;
+  const double HISTOGRAM_BUCKET_MS = 0.1;
+  std::array<uint64_t, HISTOGRAM_BUCKETS + 1> histogram;
+  uint64_t histogram_count = 0;
+  double max_frame_ms = 0.0;
+
+  // Frames with more CPU time than the display refresh period cause judder
+  double frame_budget_ms = 1000.0 / 90.0;
+  uint64_t missed_budget = 0;
+
+  Timer() {
+    for (auto& duration : frame_ring)
+      duration.store(0.0f, std::memory_order_relaxed);
+    frame_ring_head.store(0, std::memory_order_relaxed);
+    histogram.fill(0);
+  }
   ~Timer() {}
 
   bool tick_finnished() {
@@ -73,13 +114,88 @@ class Timer {
     animation_paused = !animation_paused;
   }
 
-  float update_frame_time() {
+  // idle_ms of the frame were spent waiting, not working
+  float update_frame_time(double idle_ms = 0.0) {
     auto frame_time_end = std::chrono::high_resolution_clock::now();
     auto frame_time_milli = std::chrono::duration<double, std::milli>(frame_time_end - frame_time_start).count();
 
-    frame_time_seconds = frame_time_milli / 1000.0f;  // to second
+    if (fixed_timestep_seconds > 0.0)
+      frame_time_seconds = fixed_timestep_seconds;
+    else
+      frame_time_seconds = frame_time_milli / 1000.0f;  // to second
+    elapsed_seconds += frame_time_seconds;
+    measured_frame_ms = frame_time_milli;
+    cpu_frame_ms = std::max(frame_time_milli - idle_ms, 0.0);
     time_since_tick += frame_time_milli;
+    record_frame_time(cpu_frame_ms);
     return frame_time_seconds;
   }
+
+  void record_frame_time(double ms) {
+    uint64_t head = frame_ring_head.load(std::memory_order_relaxed);
+    frame_ring[head % FRAME_RING_SIZE].store(ms, std::memory_order_relaxed);
+    frame_ring_head.store(head + 1, std::memory_order_release);
+
+    uint32_t bucket = ms / HISTOGRAM_BUCKET_MS;
+    if (bucket > HISTOGRAM_BUCKETS)
+      bucket = HISTOGRAM_BUCKETS;
+    histogram[bucket]++;
+    histogram_count++;
+
+    if (ms > max_frame_ms)
+      max_frame_ms = ms;
+    if (ms > frame_budget_ms)
+      missed_budget++;
+  }
+
+  // Copy up to count of the latest frame durations, oldest first
+  uint32_t copy_recent_frame_times(float *out, uint32_t count) {
+    uint64_t head = frame_ring_head.load(std::memory_order_acquire);
+    if (count > FRAME_RING_SIZE)
+      count = FRAME_RING_SIZE;
+    if (count > head)
+      count = head;
+    for (uint32_t i = 0; i < count; i++)
+      out[i] = frame_ring[(head - count + i) % FRAME_RING_SIZE].load(
+            std::memory_order_relaxed);
+    return count;
+  }
+
+  // Upper edge of the bucket containing the given percentile
+  double get_percentile(double percentile) {
+    if (histogram_count == 0)
+      return 0.0;
+
+    uint64_t rank = percentile / 100.0 * histogram_count;
+    uint64_t sum = 0;
+    for (uint32_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+      sum += histogram[i];
+      if (sum > rank)
+        return (i + 1) * HISTOGRAM_BUCKET_MS;
+    }
+    return max_frame_ms;
+  }
+
+  std::string get_histogram_string() {
+    std::stringstream ss;
+    ss << std::fixed << std::setprecision(2)
+       << "p50 " << get_percentile(50.0)
+       << " p90 " << get_percentile(90.0)
+       << " p99 " << get_percentile(99.0)
+       << " p99.9 " << get_percentile(99.9)
+       << " max " << max_frame_ms << "ms, "
+       << missed_budget << " missed " << frame_budget_ms << "ms";
+    return ss.str();
+  }
+
+  void print_histogram() {
+    vik_log_i_short("Frame times of %lu frames:", histogram_count);
+    vik_log_i_short("  p50 %.2fms p90 %.2fms p99 %.2fms p99.9 %.2fms max %.2fms",
+                    get_percentile(50.0), get_percentile(90.0),
+                    get_percentile(99.0), get_percentile(99.9),
+                    max_frame_ms);
+    vik_log_i_short("  %lu frames missed the budget of %.2fms",
+                    missed_budget, frame_budget_ms);
+  }
 };
 }  // namespace vik
@@ -0,0 +1,139 @@
+/*
+ * vitamin-k
+ *
+ * Copyright 2017-2018 Collabora Ltd.
+ *
+ * Authors: Lubosz Sarnecki <lubosz.sarnecki@collabora.com>
+ * SPDX-License-Identifier: MIT
+ */
+
+#pragma once
+
+#include <vulkan/vulkan.h>
+
+#include "vikBuffer.hpp"
+#include "vikDevice.hpp"
+#include "../system/vikLog.hpp"
+
+namespace vik {
+
+/*
+ * Linear allocator for data that is rewritten every frame.
+ *
+ * One persistently mapped buffer is split into a slice per frame in flight.
+ * Allocations bump a head inside the current slice and are aligned to
+ * minUniformBufferOffsetAlignment, so the returned offsets can be used as
+ * dynamic uniform buffer offsets as well as vertex buffer offsets.
+ * The renderer resets the slice once the fence of its frame has signaled.
+ *
+ * The slice is sized from what its users reserve during setup. The buffer
+ * is created on the first descriptor or frame, reserving after that is an
+ * error, since the recorded descriptors would point to the old buffer.
+ */
+class UploadArena {
+ public:
+  struct Allocation {
+    void *data;
+    VkDeviceSize offset;
+  };
+
+  Buffer buffer;
+
+  VkDeviceSize slice_size = 0;
+  VkDeviceSize alignment = 1;
+  uint32_t slice_count = 0;
+
+ private:
+  Device *device = nullptr;
+  VkDeviceSize slice_begin = 0;
+  VkDeviceSize head = 0;
+
+ public:
+  void init(Device *d, uint32_t slices) {
+    device = d;
+    alignment = device->properties.limits.minUniformBufferOffsetAlignment;
+    if (alignment == 0)
+      alignment = 1;
+
+    slice_count = slices;
+  }
+
+  // Add the size of a per frame allocation to the slice
+  void reserve(VkDeviceSize size) {
+    vik_log_f_if(buffer.buffer != VK_NULL_HANDLE,
+                 "Upload arena reserved after it was created.");
+    slice_size += align(size);
+  }
+
+  void create() {
+    if (buffer.buffer != VK_NULL_HANDLE || slice_size == 0)
+      return;
+
+    vik_log_check(device->createBuffer(
+                    VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT
+                    | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
+                    VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT
+                    | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                    &buffer, slice_size * slice_count));
+
+    // Map persistent
+    vik_log_check(buffer.map());
+
+    vik_log_d("Upload arena: %d slices of %ld bytes, alignment %ld",
+              slice_count, slice_size, alignment);
+  }
+
+  void destroy() {
+    buffer.destroy();
+  }
+
+  VkDeviceSize align(VkDeviceSize offset) {
+    return (offset + alignment - 1) / alignment * alignment;
+  }
+
+  // Start writing into the slice of the given frame.
+  // The caller must make sure the GPU is done reading from it.
+  void begin_frame(uint32_t frame) {
+    create();
+    slice_begin = (frame % slice_count) * slice_size;
+    head = 0;
+  }
+
+  Allocation allocate(VkDeviceSize size) {
+    VkDeviceSize offset = align(head);
+    vik_log_f_if(offset + size > slice_size,
+                 "Upload arena slice exhausted (%ld of %ld bytes used, %ld requested).",
+                 offset, slice_size, size);
+    head = offset + size;
+
+    Allocation allocation = {
+      .data = (char*) buffer.mapped + slice_begin + offset,
+      .offset = slice_begin + offset
+    };
+    return allocation;
+  }
+
+  // Copy data into the current slice, returns its offset in the buffer
+  uint32_t push(const void *data, VkDeviceSize size) {
+    Allocation allocation = allocate(size);
+    memcpy(allocation.data, data, size);
+    return (uint32_t) allocation.offset;
+  }
+
+  // Descriptor for a dynamic uniform buffer of the given size.
+  // The actual location is passed as dynamic offset when binding.
+  VkDescriptorBufferInfo get_descriptor(VkDeviceSize range) {
+    create();
+    VkDescriptorBufferInfo info = {
+      .buffer = buffer.buffer,
+      .offset = 0,
+      .range = range
+    };
+    return info;
+  }
+
+  VkDeviceSize get_used_size() {
+    return head;
+  }
+};
+}  // namespace vik
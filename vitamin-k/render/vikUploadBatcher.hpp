@@ -0,0 +1,527 @@
+/*
+ * vitamin-k
+ *
+ * Copyright 2017-2018 Collabora Ltd.
+ *
+ * Authors: Lubosz Sarnecki <lubosz.sarnecki@collabora.com>
+ * SPDX-License-Identifier: MIT
+ */
+
+#pragma once
+
+#include <string.h>
+
+#include <vulkan/vulkan.h>
+
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "vikStagingRing.hpp"
+#include "../system/vikLog.hpp"
+#include "../system/vikTrace.hpp"
+
+namespace vik {
+
+/*
+ * Collects staging copies into batches submitted on the transfer queue.
+ *
+ * Loaders write their data to memory from stage() and record copies from
+ * it into the open batch. Staging memory comes from the device's staging
+ * ring and is reclaimed once the batch has completed. A batch is submitted
+ * when flush() is called or when its staging data grows past a threshold.
+ * Each submitted batch has a ticket, and wait() blocks until the batch
+ * with a ticket has completed.
+ *
+ * When the ring is full, stage() submits the open batch and waits for the
+ * oldest batches until there is room. Uploads that don't fit in the ring
+ * at all get a dedicated staging buffer, freed with the batch.
+ *
+ * Uploads may be recorded from any thread, but only the thread that called
+ * init() submits, since the graphics queue is not synchronized with the
+ * renderer. Other threads let the open batch grow past the threshold and
+ * fall back to dedicated staging buffers when the ring is full.
+ *
+ * With a dedicated transfer family, the destination resources are
+ * released by the transfer queue and acquired on the graphics queue in a
+ * second command buffer, which waits on a semaphore and signals the
+ * batch's fence. Otherwise everything goes through the graphics queue in
+ * one command buffer.
+ */
+class UploadBatcher {
+  struct Staging {
+    VkBuffer buffer;
+    VkDeviceMemory memory;
+  };
+
+  struct Batch {
+    uint64_t ticket;
+    VkCommandBuffer transfer_cmd;
+    VkCommandBuffer acquire_cmd;
+    VkSemaphore semaphore;
+    VkFence fence;
+    std::vector<Staging> staging;
+    VkDeviceSize staging_size;
+    // Ring position the batch's staging memory reaches to
+    VkDeviceSize ring_head;
+  };
+
+  VkDevice device = VK_NULL_HANDLE;
+  StagingRing *ring = nullptr;
+
+  uint32_t transfer_family = 0;
+  uint32_t graphics_family = 0;
+  VkQueue transfer_queue = VK_NULL_HANDLE;
+  VkQueue graphics_queue = VK_NULL_HANDLE;
+  VkCommandPool transfer_pool = VK_NULL_HANDLE;
+  VkCommandPool graphics_pool = VK_NULL_HANDLE;
+
+  std::recursive_mutex mutex;
+  std::thread::id submit_thread;
+  bool has_open_batch = false;
+  Batch open_batch;
+  std::deque<Batch> submitted;
+
+  uint64_t next_ticket = 1;
+  uint64_t completed_ticket = 0;
+
+ public:
+  // Submit the open batch once it holds this much staging memory
+  VkDeviceSize flush_threshold = 16 * 1024 * 1024;
+
+  void init(VkDevice d, StagingRing *staging_ring,
+            uint32_t transfer, uint32_t graphics,
+            const VkQueueFamilyProperties &transfer_properties) {
+    device = d;
+    ring = staging_ring;
+    submit_thread = std::this_thread::get_id();
+    graphics_family = graphics;
+    transfer_family = transfer;
+
+    // Compressed mip tails can't be copied at a coarser granularity
+    VkExtent3D granularity = transfer_properties.minImageTransferGranularity;
+    if (transfer_family != graphics_family
+        && (granularity.width != 1 || granularity.height != 1
+            || granularity.depth != 1)) {
+      vik_log_w("Transfer queue has a coarse image granularity, "
+                "uploading on the graphics queue.");
+      transfer_family = graphics_family;
+    }
+
+    vkGetDeviceQueue(device, graphics_family, 0, &graphics_queue);
+    vkGetDeviceQueue(device, transfer_family, 0, &transfer_queue);
+
+    transfer_pool = create_pool(transfer_family);
+    if (has_ownership_transfer())
+      graphics_pool = create_pool(graphics_family);
+
+    vik_log_d("Uploading on queue family %d.", transfer_family);
+  }
+
+  void destroy() {
+    if (device == VK_NULL_HANDLE)
+      return;
+
+    wait_idle();
+
+    if (has_open_batch) {
+      destroy_batch(&open_batch);
+      has_open_batch = false;
+    }
+
+    vkDestroyCommandPool(device, transfer_pool, nullptr);
+    if (graphics_pool != VK_NULL_HANDLE)
+      vkDestroyCommandPool(device, graphics_pool, nullptr);
+
+    device = VK_NULL_HANDLE;
+  }
+
+  bool has_ownership_transfer() {
+    return transfer_family != graphics_family;
+  }
+
+  /*
+   * Host memory for size bytes of upload data, valid until the copies from
+   * it have been recorded. Has to be followed by those copies before other
+   * uploads are recorded, since a full ring submits the open batch.
+   */
+  StagingRegion stage(VkDeviceSize size,
+                      VkDeviceSize alignment = StagingRing::ALIGNMENT) {
+    std::lock_guard<std::recursive_mutex> lock(mutex);
+    StagingRegion region;
+
+    if (!ring->fits(size)) {
+      vik_log_d("Upload of %ld bytes does not fit the staging ring.", size);
+      return stage_dedicated(size);
+    }
+
+    if (!ring->allocate(size, &region, alignment)) {
+      if (!can_submit())
+        return stage_dedicated(size);
+
+      vik_trace_zone("wait_for_staging");
+      flush();
+      while (!ring->allocate(size, &region, alignment)) {
+        vik_log_f_if(submitted.empty(), "Staging ring is out of space.");
+        wait(submitted.front().ticket);
+      }
+    }
+
+    get_open_batch()->staging_size += size;
+    return region;
+  }
+
+  // Stage data and copy it to the start of a device buffer
+  void upload_buffer(const void *data, VkDeviceSize size, VkBuffer dst,
+                     VkPipelineStageFlags dst_stage, VkAccessFlags dst_access) {
+    std::lock_guard<std::recursive_mutex> lock(mutex);
+    StagingRegion staging = stage(size);
+    memcpy(staging.data, data, size);
+
+    VkBufferCopy region = {
+      .srcOffset = staging.offset,
+      .dstOffset = 0,
+      .size = size
+    };
+    copy_buffer(staging.buffer, dst, region, dst_stage, dst_access);
+  }
+
+  // Stage data and copy it to an image, region offsets are relative to data
+  void upload_image(const void *data, VkDeviceSize size,
+                    VkDeviceSize texel_block_size, VkImage dst,
+                    std::vector<VkBufferImageCopy> regions,
+                    const VkImageSubresourceRange &range,
+                    VkImageLayout final_layout) {
+    std::lock_guard<std::recursive_mutex> lock(mutex);
+    StagingRegion staging = stage(size,
+                                  StagingRing::get_alignment(texel_block_size));
+    memcpy(staging.data, data, size);
+
+    for (auto& region : regions)
+      region.bufferOffset += staging.offset;
+    copy_buffer_to_image(staging.buffer, dst, regions, range, final_layout);
+  }
+
+  /*
+   * Copy a staging buffer region into a device buffer. The destination is
+   * made available to dst_stage and dst_access on the graphics queue.
+   */
+  void copy_buffer(VkBuffer src, VkBuffer dst, const VkBufferCopy &region,
+                   VkPipelineStageFlags dst_stage, VkAccessFlags dst_access) {
+    std::lock_guard<std::recursive_mutex> lock(mutex);
+    Batch *batch = get_open_batch();
+
+    vkCmdCopyBuffer(batch->transfer_cmd, src, dst, 1, &region);
+
+    VkBufferMemoryBarrier barrier = {
+      .sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER,
+      .srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+      .dstAccessMask = dst_access,
+      .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+      .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+      .buffer = dst,
+      .offset = region.dstOffset,
+      .size = region.size
+    };
+
+    if (has_ownership_transfer()) {
+      barrier.srcQueueFamilyIndex = transfer_family;
+      barrier.dstQueueFamilyIndex = graphics_family;
+
+      // Release, access masks of the other queue are ignored
+      barrier.dstAccessMask = 0;
+      vkCmdPipelineBarrier(batch->transfer_cmd,
+                           VK_PIPELINE_STAGE_TRANSFER_BIT,
+                           VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+                           0, 0, nullptr, 1, &barrier, 0, nullptr);
+
+      // Acquire
+      barrier.srcAccessMask = 0;
+      barrier.dstAccessMask = dst_access;
+      vkCmdPipelineBarrier(batch->acquire_cmd,
+                           VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, dst_stage,
+                           0, 0, nullptr, 1, &barrier, 0, nullptr);
+    } else {
+      vkCmdPipelineBarrier(batch->transfer_cmd,
+                           VK_PIPELINE_STAGE_TRANSFER_BIT, dst_stage,
+                           0, 0, nullptr, 1, &barrier, 0, nullptr);
+    }
+
+    flush_if_full();
+  }
+
+  /*
+   * Copy regions of a staging buffer into an image with undefined
+   * contents, which ends up in final_layout, readable by shaders.
+   */
+  void copy_buffer_to_image(VkBuffer src, VkImage dst,
+                            const std::vector<VkBufferImageCopy> &regions,
+                            const VkImageSubresourceRange &range,
+                            VkImageLayout final_layout,
+                            VkPipelineStageFlags dst_stage
+                              = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT) {
+    std::lock_guard<std::recursive_mutex> lock(mutex);
+    Batch *batch = get_open_batch();
+
+    VkImageMemoryBarrier barrier = {
+      .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+      .srcAccessMask = 0,
+      .dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+      .oldLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+      .newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+      .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+      .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+      .image = dst,
+      .subresourceRange = range
+    };
+    vkCmdPipelineBarrier(batch->transfer_cmd,
+                         VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+                         VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         0, 0, nullptr, 0, nullptr, 1, &barrier);
+
+    vkCmdCopyBufferToImage(batch->transfer_cmd, src, dst,
+                           VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                           regions.size(), regions.data());
+
+    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+    barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+    barrier.newLayout = final_layout;
+
+    if (has_ownership_transfer()) {
+      // The layout transition happens once, between release and acquire
+      barrier.srcQueueFamilyIndex = transfer_family;
+      barrier.dstQueueFamilyIndex = graphics_family;
+
+      barrier.dstAccessMask = 0;
+      vkCmdPipelineBarrier(batch->transfer_cmd,
+                           VK_PIPELINE_STAGE_TRANSFER_BIT,
+                           VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+                           0, 0, nullptr, 0, nullptr, 1, &barrier);
+
+      barrier.srcAccessMask = 0;
+      barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+      vkCmdPipelineBarrier(batch->acquire_cmd,
+                           VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, dst_stage,
+                           0, 0, nullptr, 0, nullptr, 1, &barrier);
+    } else {
+      vkCmdPipelineBarrier(batch->transfer_cmd,
+                           VK_PIPELINE_STAGE_TRANSFER_BIT, dst_stage,
+                           0, 0, nullptr, 0, nullptr, 1, &barrier);
+    }
+
+    flush_if_full();
+  }
+
+  // Submit the open batch, returns the ticket to wait for
+  uint64_t flush() {
+    std::lock_guard<std::recursive_mutex> lock(mutex);
+
+    collect();
+
+    if (!has_open_batch)
+      return next_ticket - 1;
+
+    vik_trace_zone("flush_uploads");
+
+    Batch batch = open_batch;
+    batch.ring_head = ring->get_head();
+    has_open_batch = false;
+
+    vik_log_check(vkEndCommandBuffer(batch.transfer_cmd));
+
+    if (has_ownership_transfer()) {
+      vik_log_check(vkEndCommandBuffer(batch.acquire_cmd));
+
+      VkSubmitInfo transfer_info = {
+        .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+        .commandBufferCount = 1,
+        .pCommandBuffers = &batch.transfer_cmd,
+        .signalSemaphoreCount = 1,
+        .pSignalSemaphores = &batch.semaphore
+      };
+      vik_log_check(vkQueueSubmit(transfer_queue, 1, &transfer_info,
+                                  VK_NULL_HANDLE));
+
+      VkPipelineStageFlags wait_stage = VK_PIPELINE_STAGE_ALL_COMMANDS_BIT;
+      VkSubmitInfo acquire_info = {
+        .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+        .waitSemaphoreCount = 1,
+        .pWaitSemaphores = &batch.semaphore,
+        .pWaitDstStageMask = &wait_stage,
+        .commandBufferCount = 1,
+        .pCommandBuffers = &batch.acquire_cmd
+      };
+      vik_log_check(vkQueueSubmit(graphics_queue, 1, &acquire_info,
+                                  batch.fence));
+    } else {
+      VkSubmitInfo submit_info = {
+        .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+        .commandBufferCount = 1,
+        .pCommandBuffers = &batch.transfer_cmd
+      };
+      vik_log_check(vkQueueSubmit(transfer_queue, 1, &submit_info,
+                                  batch.fence));
+    }
+
+    vik_log_d("Submitted upload batch %ld with %ld staging buffers.",
+              batch.ticket, batch.staging.size());
+
+    submitted.push_back(batch);
+    return batch.ticket;
+  }
+
+  // Block until the batch with this ticket and all before it completed
+  void wait(uint64_t ticket) {
+    std::lock_guard<std::recursive_mutex> lock(mutex);
+
+    for (auto& batch : submitted)
+      if (batch.ticket <= ticket)
+        vik_log_check(vkWaitForFences(device, 1, &batch.fence,
+                                      VK_TRUE, UINT64_MAX));
+    collect();
+  }
+
+  // Submit what was recorded and wait for all uploads
+  void wait_idle() {
+    std::lock_guard<std::recursive_mutex> lock(mutex);
+    wait(flush());
+  }
+
+  // Ticket of the batch the uploads recorded so far are submitted with
+  uint64_t get_ticket() {
+    std::lock_guard<std::recursive_mutex> lock(mutex);
+    return has_open_batch ? open_batch.ticket : next_ticket - 1;
+  }
+
+  bool is_complete(uint64_t ticket) {
+    std::lock_guard<std::recursive_mutex> lock(mutex);
+    collect();
+    return ticket <= completed_ticket;
+  }
+
+ private:
+  bool can_submit() {
+    return std::this_thread::get_id() == submit_thread;
+  }
+
+  StagingRegion stage_dedicated(VkDeviceSize size) {
+    StagingRegion region;
+    VkDeviceMemory memory;
+    ring->create_dedicated(size, &region, &memory);
+    add_staging(region.buffer, memory, size);
+    return region;
+  }
+
+  // Destroy a dedicated staging buffer once the open batch has completed
+  void add_staging(VkBuffer buffer, VkDeviceMemory memory, VkDeviceSize size) {
+    Batch *batch = get_open_batch();
+    Staging staging = {
+      .buffer = buffer,
+      .memory = memory
+    };
+    batch->staging.push_back(staging);
+    batch->staging_size += size;
+  }
+
+  // Only called after a copy, when no staged data is waiting to be copied
+  void flush_if_full() {
+    if (open_batch.staging_size >= flush_threshold && can_submit())
+      flush();
+  }
+
+  VkCommandPool create_pool(uint32_t family) {
+    VkCommandPoolCreateInfo pool_info = {
+      .sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
+      .flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT,
+      .queueFamilyIndex = family
+    };
+    VkCommandPool pool;
+    vik_log_check(vkCreateCommandPool(device, &pool_info, nullptr, &pool));
+    return pool;
+  }
+
+  VkCommandBuffer begin_command_buffer(VkCommandPool pool) {
+    VkCommandBufferAllocateInfo cmd_buffer_info = {
+      .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+      .commandPool = pool,
+      .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+      .commandBufferCount = 1
+    };
+    VkCommandBuffer cmd_buffer;
+    vik_log_check(vkAllocateCommandBuffers(device, &cmd_buffer_info, &cmd_buffer));
+
+    VkCommandBufferBeginInfo begin_info = {
+      .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+      .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT
+    };
+    vik_log_check(vkBeginCommandBuffer(cmd_buffer, &begin_info));
+
+    return cmd_buffer;
+  }
+
+  Batch* get_open_batch() {
+    if (has_open_batch)
+      return &open_batch;
+
+    open_batch = {
+      .ticket = next_ticket++,
+      .transfer_cmd = begin_command_buffer(transfer_pool),
+      .acquire_cmd = VK_NULL_HANDLE,
+      .semaphore = VK_NULL_HANDLE,
+      .fence = VK_NULL_HANDLE,
+      .staging = {},
+      .staging_size = 0,
+      .ring_head = 0
+    };
+
+    if (has_ownership_transfer()) {
+      open_batch.acquire_cmd = begin_command_buffer(graphics_pool);
+      VkSemaphoreCreateInfo semaphore_info = {
+        .sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO
+      };
+      vik_log_check(vkCreateSemaphore(device, &semaphore_info, nullptr,
+                                      &open_batch.semaphore));
+    }
+
+    VkFenceCreateInfo fence_info = {
+      .sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO
+    };
+    vik_log_check(vkCreateFence(device, &fence_info, nullptr, &open_batch.fence));
+
+    has_open_batch = true;
+    return &open_batch;
+  }
+
+  // Free the resources of batches that completed, in submission order
+  void collect() {
+    while (!submitted.empty()) {
+      Batch *batch = &submitted.front();
+      VkResult status = vkGetFenceStatus(device, batch->fence);
+      if (status == VK_NOT_READY)
+        break;
+      vik_log_check(status);
+
+      completed_ticket = batch->ticket;
+      ring->release(batch->ring_head);
+      destroy_batch(batch);
+      submitted.pop_front();
+    }
+  }
+
+  void destroy_batch(Batch *batch) {
+    for (auto& staging : batch->staging) {
+      vkDestroyBuffer(device, staging.buffer, nullptr);
+      vkFreeMemory(device, staging.memory, nullptr);
+    }
+
+    vkFreeCommandBuffers(device, transfer_pool, 1, &batch->transfer_cmd);
+    if (batch->acquire_cmd != VK_NULL_HANDLE)
+      vkFreeCommandBuffers(device, graphics_pool, 1, &batch->acquire_cmd);
+    if (batch->semaphore != VK_NULL_HANDLE)
+      vkDestroySemaphore(device, batch->semaphore, nullptr);
+    vkDestroyFence(device, batch->fence, nullptr);
+  }
+};
+}  // namespace vik
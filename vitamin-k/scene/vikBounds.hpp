@@ -0,0 +1,53 @@
+/*
+ * vitamin-k
+ *
+ * Copyright 2017-2018 Collabora Ltd.
+ *
+ * Authors: Lubosz Sarnecki <lubosz.sarnecki@collabora.com>
+ * SPDX-License-Identifier: MIT
+ */
+
+#pragma once
+
+#include <glm/glm.hpp>
+
+namespace vik {
+
+struct BoundingSphere {
+  glm::vec3 center;
+  float radius;
+};
+
+// Axis aligned bounding box
+struct AABB {
+  glm::vec3 min;
+  glm::vec3 max;
+
+  glm::vec3 get_center() const {
+    return (min + max) * 0.5f;
+  }
+
+  glm::vec3 get_extent() const {
+    return (max - min) * 0.5f;
+  }
+
+  // Encloses the box
+  BoundingSphere get_sphere() const {
+    return { get_center(), glm::length(get_extent()) };
+  }
+
+  // Box around the transformed box, for affine transforms
+  AABB transform(const glm::mat4 &matrix) const {
+    glm::vec3 center = glm::vec3(matrix * glm::vec4(get_center(), 1.0f));
+    glm::vec3 extent = get_extent();
+
+    glm::vec3 world_extent;
+    for (int i = 0; i < 3; i++)
+      world_extent[i] = glm::abs(matrix[0][i]) * extent.x
+                      + glm::abs(matrix[1][i]) * extent.y
+                      + glm::abs(matrix[2][i]) * extent.z;
+
+    return { center - world_extent, center + world_extent };
+  }
+};
+}  // namespace vik
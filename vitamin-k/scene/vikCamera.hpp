@@ -18,6 +18,7 @@
 
 #include "../render/vikBuffer.hpp"
 #include "../render/vikDevice.hpp"
+#include "../render/vikUploadArena.hpp"
 
 #include "../input/vikInput.hpp"
 
@@ -59,7 +60,11 @@ class Camera {
   } keys;
 
  public:
-  Buffer uniform_buffer;
+  // Dynamic uniform buffer in the upload arena
+  VkDescriptorBufferInfo uniform_descriptor;
+  uint32_t uniform_offset = 0;
+  // This frame's copy, stays writable until the frame is submitted
+  void *uniform_mapped = nullptr;
 
   struct StereoView {
     glm::mat4 view[2];
@@ -72,9 +77,7 @@ class Camera {
     glm::vec3 position;
   } ubo;
 
-  virtual ~Camera() {
-    uniform_buffer.destroy();
-  }
+  virtual ~Camera() {}
 
   virtual void update_movement(float deltaTime) {}
   virtual void keyboard_key_cb(Input::Key key, bool state) {}
@@ -90,16 +93,28 @@ class Camera {
     return glm::mat4();
   }
 
-  virtual void update_uniform_buffer() {
+  virtual void update_uniform_buffer(UploadArena *arena) {
     ubo.projection[0] = matrices.projection;
     ubo.view[0] = matrices.view;
     ubo.sky_view[0] = glm::mat4(glm::mat3(matrices.view));
     ubo.position = position * -1.0f;
-    memcpy(uniform_buffer.mapped, &ubo, sizeof(ubo));
+    write_uniform_buffer(arena);
+  }
+
+  void write_uniform_buffer(UploadArena *arena) {
+    UploadArena::Allocation allocation = arena->allocate(sizeof(ubo));
+    memcpy(allocation.data, &ubo, sizeof(ubo));
+    uniform_mapped = allocation.data;
+    uniform_offset = (uint32_t) allocation.offset;
   }
 
-  void init_uniform_buffer(Device *device) {
-    device->create_and_map(&uniform_buffer, sizeof(ubo));
+  // Refresh the view in the already written uniform buffer of this frame.
+  // Called immediately before the frame is submitted, the recorded command
+  // buffers read the same location and don't need to be rebuilt.
+  virtual void late_latch() {}
+
+  void init_uniform_buffer(UploadArena *arena) {
+    uniform_descriptor = arena->get_descriptor(sizeof(ubo));
   }
 
   std::function<void()> view_updated_cb = [](){};
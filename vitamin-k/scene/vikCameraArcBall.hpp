@@ -74,6 +74,6 @@ class CameraArcBall : public Camera {
     return matrix;
   }
 
-  void update_uniform_buffer() {}
+  void update_uniform_buffer(UploadArena *arena) {}
 };
 }  // namespace vik
@@ -28,7 +28,20 @@ class CameraHMD : public CameraFirstPerson {
     m[2][1] = -m[2][1];
   }
 
-  void update_uniform_buffer() {
+  void update_uniform_buffer(UploadArena *arena) {
+    update_pose();
+    write_uniform_buffer(arena);
+  }
+
+  // Sample the latest pose and overwrite this frame's matrices
+  void late_latch() {
+    if (uniform_mapped == nullptr)
+      return;
+    update_pose();
+    memcpy(uniform_mapped, &ubo, sizeof(ubo));
+  }
+
+  void update_pose() {
     glm::mat4 hmd_projection_left, hmd_projection_right;
     glm::mat4 hmd_view_left, hmd_view_right;
 
@@ -49,8 +62,6 @@ class CameraHMD : public CameraFirstPerson {
     ubo.sky_view[1] = hmd_view_right;
 
     ubo.position = position * -1.0f;
-
-    memcpy(uniform_buffer.mapped, &ubo, sizeof(ubo));
   }
 };
 }  // namespace vik
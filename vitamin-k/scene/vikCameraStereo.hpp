@@ -31,7 +31,7 @@ class CameraStereo : public CameraFirstPerson {
     eye_separation += delta;
   }
 
-  void update_uniform_buffer() {
+  void update_uniform_buffer(UploadArena *arena) {
     // Geometry shader matrices for the two viewports
     // See http://paulbourke.net/stereographics/stereorender/
 
@@ -79,7 +79,7 @@ class CameraStereo : public CameraFirstPerson {
 
     ubo.position = position * -1.0f;
 
-    memcpy(uniform_buffer.mapped, &ubo, sizeof(ubo));
+    write_uniform_buffer(arena);
   }
 };
 }  // namespace vik
@@ -0,0 +1,192 @@
+/*
+ * vitamin-k
+ *
+ * Copyright 2017-2018 Collabora Ltd.
+ *
+ * Authors: Lubosz Sarnecki <lubosz.sarnecki@collabora.com>
+ * SPDX-License-Identifier: MIT
+ */
+
+#pragma once
+
+#include <glm/glm.hpp>
+
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+
+#include <array>
+
+#include "vikBounds.hpp"
+#include "vikCamera.hpp"
+
+namespace vik {
+
+/*
+ * Planes of a view frustum in world space.
+ *
+ * Each plane is (normal, distance) with the normal pointing inside, so a
+ * point p is inside when dot(plane.xyz, p) + plane.w >= 0 for all planes.
+ * Extracted from the combined projection and view matrix, for clip space
+ * depth from 0 to 1.
+ */
+struct Frustum {
+  enum Side { LEFT = 0, RIGHT, BOTTOM, TOP, NEAR, FAR, SIDE_COUNT };
+
+  std::array<glm::vec4, SIDE_COUNT> planes;
+
+  explicit Frustum(const glm::mat4 &view_projection) {
+    glm::vec4 rows[4];
+    for (int i = 0; i < 4; i++)
+      rows[i] = glm::vec4(view_projection[0][i], view_projection[1][i],
+                          view_projection[2][i], view_projection[3][i]);
+
+    planes[LEFT] = rows[3] + rows[0];
+    planes[RIGHT] = rows[3] - rows[0];
+    planes[BOTTOM] = rows[3] + rows[1];
+    planes[TOP] = rows[3] - rows[1];
+    planes[NEAR] = rows[2];
+    planes[FAR] = rows[3] - rows[2];
+
+    for (auto& plane : planes)
+      plane /= glm::length(glm::vec3(plane));
+  }
+
+  bool intersects_sphere(const glm::vec3 &center, float radius) const {
+    for (auto& plane : planes)
+      if (glm::dot(glm::vec3(plane), center) + plane.w < -radius)
+        return false;
+    return true;
+  }
+};
+
+// The frusta of both eyes, in the layout the cull shader reads them
+struct StereoFrustum {
+  std::array<Frustum, 2> eyes;
+
+  explicit StereoFrustum(const Camera::UBOCamera &ubo)
+    : eyes({{ Frustum(ubo.projection[0] * ubo.view[0]),
+              Frustum(ubo.projection[1] * ubo.view[1]) }}) {}
+
+  // Visible to either eye
+  bool intersects_sphere(const glm::vec3 &center, float radius) const {
+    return eyes[0].intersects_sphere(center, radius)
+        || eyes[1].intersects_sphere(center, radius);
+  }
+};
+
+/*
+ * The 12 planes of both eyes transposed into batches of four, to test a
+ * volume against four planes per SSE instruction. Planes 0 to 5 are the
+ * left eye, 6 to 11 the right eye.
+ */
+class PackedStereoFrustum {
+  static const int BATCHES = 3;
+  static const int LEFT_MASK = 0x03f;
+  static const int RIGHT_MASK = 0xfc0;
+
+  // Plane normals, their absolute values and distances
+  alignas(16) float nx[BATCHES][4], ny[BATCHES][4], nz[BATCHES][4];
+  alignas(16) float ax[BATCHES][4], ay[BATCHES][4], az[BATCHES][4];
+  alignas(16) float d[BATCHES][4];
+
+  // Widens the planes for head motion after culling
+  glm::vec3 margin_eye = glm::vec3(0);
+  float margin_sin = 0.0f;
+  float margin_distance = 0.0f;
+
+ public:
+  explicit PackedStereoFrustum(const StereoFrustum &frusta) {
+    for (int i = 0; i < BATCHES * 4; i++) {
+      const glm::vec4 &plane = frusta.eyes[i / Frustum::SIDE_COUNT]
+          .planes[i % Frustum::SIDE_COUNT];
+      nx[i / 4][i % 4] = plane.x;
+      ny[i / 4][i % 4] = plane.y;
+      nz[i / 4][i % 4] = plane.z;
+      ax[i / 4][i % 4] = glm::abs(plane.x);
+      ay[i / 4][i % 4] = glm::abs(plane.y);
+      az[i / 4][i % 4] = glm::abs(plane.z);
+      d[i / 4][i % 4] = plane.w;
+    }
+  }
+
+  /*
+   * Keep volumes that would enter the frusta when the head turns by up to
+   * angle or moves by up to distance around eye. A point at range r from
+   * the eye moves by at most r * sin(angle) relative to the planes.
+   */
+  void set_pose_margin(const glm::vec3 &eye, float angle, float distance) {
+    margin_eye = eye;
+    margin_sin = glm::sin(angle);
+    margin_distance = distance;
+  }
+
+  // Visible to either eye
+  bool intersects_sphere(const BoundingSphere &sphere) const {
+    float margin = get_margin(sphere.center, sphere.radius);
+    return is_visible(get_outside_mask(sphere.center, glm::vec3(0),
+                                       sphere.radius + margin));
+  }
+
+  bool intersects_aabb(const AABB &aabb) const {
+    glm::vec3 extent = aabb.get_extent();
+    float margin = get_margin(aabb.get_center(), glm::length(extent));
+    return is_visible(get_outside_mask(aabb.get_center(), extent, margin));
+  }
+
+ private:
+  float get_margin(const glm::vec3 &center, float radius) const {
+    if (margin_sin == 0.0f && margin_distance == 0.0f)
+      return 0.0f;
+    return margin_distance
+        + (glm::distance(center, margin_eye) + radius) * margin_sin;
+  }
+
+  static bool is_visible(int outside_mask) {
+    return (outside_mask & LEFT_MASK) == 0 || (outside_mask & RIGHT_MASK) == 0;
+  }
+
+  /*
+   * Bit i is set when the volume is behind plane i. The box extent is
+   * projected onto each plane normal, which adds to the sphere radius.
+   */
+  int get_outside_mask(const glm::vec3 &center, const glm::vec3 &extent,
+                       float radius) const {
+    int mask = 0;
+#ifdef __SSE__
+    __m128 cx = _mm_set1_ps(center.x);
+    __m128 cy = _mm_set1_ps(center.y);
+    __m128 cz = _mm_set1_ps(center.z);
+    __m128 ex = _mm_set1_ps(extent.x);
+    __m128 ey = _mm_set1_ps(extent.y);
+    __m128 ez = _mm_set1_ps(extent.z);
+    __m128 r = _mm_set1_ps(radius);
+
+    for (int i = 0; i < BATCHES; i++) {
+      __m128 distance = _mm_add_ps(
+            _mm_add_ps(_mm_mul_ps(_mm_load_ps(nx[i]), cx),
+                       _mm_mul_ps(_mm_load_ps(ny[i]), cy)),
+            _mm_add_ps(_mm_mul_ps(_mm_load_ps(nz[i]), cz),
+                       _mm_load_ps(d[i])));
+      __m128 reach = _mm_add_ps(
+            _mm_add_ps(_mm_mul_ps(_mm_load_ps(ax[i]), ex),
+                       _mm_mul_ps(_mm_load_ps(ay[i]), ey)),
+            _mm_add_ps(_mm_mul_ps(_mm_load_ps(az[i]), ez), r));
+      __m128 outside = _mm_cmplt_ps(_mm_add_ps(distance, reach), _mm_setzero_ps());
+      mask |= _mm_movemask_ps(outside) << (i * 4);
+    }
+#else
+    for (int i = 0; i < BATCHES * 4; i++) {
+      int b = i / 4, j = i % 4;
+      float distance = nx[b][j] * center.x + ny[b][j] * center.y
+                     + nz[b][j] * center.z + d[b][j];
+      float reach = ax[b][j] * extent.x + ay[b][j] * extent.y
+                  + az[b][j] * extent.z + radius;
+      if (distance + reach < 0.0f)
+        mask |= 1 << i;
+    }
+#endif
+    return mask;
+  }
+};
+}  // namespace vik
@@ -8,12 +8,15 @@
  * SPDX-License-Identifier: MIT
  */
 
+#include <stddef.h>
+
 #include <glm/glm.hpp>
 
 #include <vector>
 
 #include "../render/vikBuffer.hpp"
 #include "../render/vikDevice.hpp"
+#include "../render/vikMeshOptimizer.hpp"
 
 namespace vik {
 struct Vertex {
@@ -43,29 +46,55 @@ class Gear {
   Buffer vertexBuffer;
   Buffer indexBuffer;
   uint32_t indexCount;
+  VkIndexType indexType = VK_INDEX_TYPE_UINT32;
+  // Tooth count the buffers were sized for by the GPU generator
+  int toothCount = 0;
+
+  // Size of the mesh from build(), before optimization
+  static const uint32_t verticesPerTooth = 40;
+  static const uint32_t indicesPerTooth = 66;
 
   ~Gear() {
+    destroy();
+  }
+
+  void destroy() {
     // Clean up vulkan resources
     vertexBuffer.destroy();
     indexBuffer.destroy();
+    toothCount = 0;
   }
 
-  int32_t newVertex(std::vector<Vertex> *vBuffer, float x, float y, float z, const glm::vec3& normal) {
+  static int32_t newVertex(std::vector<Vertex> *vBuffer, float x, float y, float z, const glm::vec3& normal) {
     Vertex v(glm::vec3(x, y, z), normal);
     vBuffer->push_back(v);
     return static_cast<int32_t>(vBuffer->size()) - 1;
   }
 
-  void newFace(std::vector<uint32_t> *iBuffer, int a, int b, int c) {
+  static void newFace(std::vector<uint32_t> *iBuffer, int a, int b, int c) {
     iBuffer->push_back(a);
     iBuffer->push_back(b);
     iBuffer->push_back(c);
   }
 
-  void generate(Device *vulkanDevice, GearInfo *gearinfo, VkQueue queue) {
+  void generate(Device *vulkanDevice, GearInfo *gearinfo) {
     std::vector<Vertex> vBuffer;
     std::vector<uint32_t> iBuffer;
+    build(gearinfo, &vBuffer, &iBuffer);
+
+    // Faces share corners and the front face repeats its inner vertex
+    const int32_t positionOffset = offsetof(Vertex, pos) / sizeof(float);
+    MeshStats generated = MeshOptimizer::get_stats(vBuffer, 1, iBuffer, sizeof(uint32_t));
+    MeshOptimizer::optimize(&vBuffer, 1, positionOffset, &iBuffer);
+
+    upload(vulkanDevice, vBuffer, iBuffer);
+
+    uint32_t indexSize = indexType == VK_INDEX_TYPE_UINT16 ? sizeof(uint16_t) : sizeof(uint32_t);
+    generated.print_comparison("Gear", MeshOptimizer::get_stats(vBuffer, 1, iBuffer, indexSize));
+  }
 
+  // Generate the mesh on the CPU, see gear.comp for the GPU version
+  static void build(GearInfo *gearinfo, std::vector<Vertex> *vBuffer, std::vector<uint32_t> *iBuffer) {
     int i;
     float r0, r1, r2;
     float ta, da;
@@ -105,114 +134,110 @@ class Gear {
 
       // front face
       normal = glm::vec3(0.0f, 0.0f, 1.0f);
-      ix0 = newVertex(&vBuffer, r0 * cos_ta, r0 * sin_ta, gearinfo->width * 0.5f, normal);
-      ix1 = newVertex(&vBuffer, r1 * cos_ta, r1 * sin_ta, gearinfo->width * 0.5f, normal);
-      ix2 = newVertex(&vBuffer, r0 * cos_ta, r0 * sin_ta, gearinfo->width * 0.5f, normal);
-      ix3 = newVertex(&vBuffer, r1 * cos_ta_3da, r1 * sin_ta_3da, gearinfo->width * 0.5f, normal);
-      ix4 = newVertex(&vBuffer, r0 * cos_ta_4da, r0 * sin_ta_4da, gearinfo->width * 0.5f, normal);
-      ix5 = newVertex(&vBuffer, r1 * cos_ta_4da, r1 * sin_ta_4da, gearinfo->width * 0.5f, normal);
-      newFace(&iBuffer, ix0, ix1, ix2);
-      newFace(&iBuffer, ix1, ix3, ix2);
-      newFace(&iBuffer, ix2, ix3, ix4);
-      newFace(&iBuffer, ix3, ix5, ix4);
+      ix0 = newVertex(vBuffer, r0 * cos_ta, r0 * sin_ta, gearinfo->width * 0.5f, normal);
+      ix1 = newVertex(vBuffer, r1 * cos_ta, r1 * sin_ta, gearinfo->width * 0.5f, normal);
+      ix2 = newVertex(vBuffer, r0 * cos_ta, r0 * sin_ta, gearinfo->width * 0.5f, normal);
+      ix3 = newVertex(vBuffer, r1 * cos_ta_3da, r1 * sin_ta_3da, gearinfo->width * 0.5f, normal);
+      ix4 = newVertex(vBuffer, r0 * cos_ta_4da, r0 * sin_ta_4da, gearinfo->width * 0.5f, normal);
+      ix5 = newVertex(vBuffer, r1 * cos_ta_4da, r1 * sin_ta_4da, gearinfo->width * 0.5f, normal);
+      newFace(iBuffer, ix0, ix1, ix2);
+      newFace(iBuffer, ix1, ix3, ix2);
+      newFace(iBuffer, ix2, ix3, ix4);
+      newFace(iBuffer, ix3, ix5, ix4);
 
       // front sides of teeth
       normal = glm::vec3(0.0f, 0.0f, 1.0f);
-      ix0 = newVertex(&vBuffer, r1 * cos_ta, r1 * sin_ta, gearinfo->width * 0.5f, normal);
-      ix1 = newVertex(&vBuffer, r2 * cos_ta_1da, r2 * sin_ta_1da, gearinfo->width * 0.5f, normal);
-      ix2 = newVertex(&vBuffer, r1 * cos_ta_3da, r1 * sin_ta_3da, gearinfo->width * 0.5f, normal);
-      ix3 = newVertex(&vBuffer, r2 * cos_ta_2da, r2 * sin_ta_2da, gearinfo->width * 0.5f, normal);
-      newFace(&iBuffer, ix0, ix1, ix2);
-      newFace(&iBuffer, ix1, ix3, ix2);
+      ix0 = newVertex(vBuffer, r1 * cos_ta, r1 * sin_ta, gearinfo->width * 0.5f, normal);
+      ix1 = newVertex(vBuffer, r2 * cos_ta_1da, r2 * sin_ta_1da, gearinfo->width * 0.5f, normal);
+      ix2 = newVertex(vBuffer, r1 * cos_ta_3da, r1 * sin_ta_3da, gearinfo->width * 0.5f, normal);
+      ix3 = newVertex(vBuffer, r2 * cos_ta_2da, r2 * sin_ta_2da, gearinfo->width * 0.5f, normal);
+      newFace(iBuffer, ix0, ix1, ix2);
+      newFace(iBuffer, ix1, ix3, ix2);
 
       // back face
       normal = glm::vec3(0.0f, 0.0f, -1.0f);
-      ix0 = newVertex(&vBuffer, r1 * cos_ta, r1 * sin_ta, -gearinfo->width * 0.5f, normal);
-      ix1 = newVertex(&vBuffer, r0 * cos_ta, r0 * sin_ta, -gearinfo->width * 0.5f, normal);
-      ix2 = newVertex(&vBuffer, r1 * cos_ta_3da, r1 * sin_ta_3da, -gearinfo->width * 0.5f, normal);
-      ix3 = newVertex(&vBuffer, r0 * cos_ta, r0 * sin_ta, -gearinfo->width * 0.5f, normal);
-      ix4 = newVertex(&vBuffer, r1 * cos_ta_4da, r1 * sin_ta_4da, -gearinfo->width * 0.5f, normal);
-      ix5 = newVertex(&vBuffer, r0 * cos_ta_4da, r0 * sin_ta_4da, -gearinfo->width * 0.5f, normal);
-      newFace(&iBuffer, ix0, ix1, ix2);
-      newFace(&iBuffer, ix1, ix3, ix2);
-      newFace(&iBuffer, ix2, ix3, ix4);
-      newFace(&iBuffer, ix3, ix5, ix4);
+      ix0 = newVertex(vBuffer, r1 * cos_ta, r1 * sin_ta, -gearinfo->width * 0.5f, normal);
+      ix1 = newVertex(vBuffer, r0 * cos_ta, r0 * sin_ta, -gearinfo->width * 0.5f, normal);
+      ix2 = newVertex(vBuffer, r1 * cos_ta_3da, r1 * sin_ta_3da, -gearinfo->width * 0.5f, normal);
+      ix3 = newVertex(vBuffer, r0 * cos_ta, r0 * sin_ta, -gearinfo->width * 0.5f, normal);
+      ix4 = newVertex(vBuffer, r1 * cos_ta_4da, r1 * sin_ta_4da, -gearinfo->width * 0.5f, normal);
+      ix5 = newVertex(vBuffer, r0 * cos_ta_4da, r0 * sin_ta_4da, -gearinfo->width * 0.5f, normal);
+      newFace(iBuffer, ix0, ix1, ix2);
+      newFace(iBuffer, ix1, ix3, ix2);
+      newFace(iBuffer, ix2, ix3, ix4);
+      newFace(iBuffer, ix3, ix5, ix4);
 
       // back sides of teeth
       normal = glm::vec3(0.0f, 0.0f, -1.0f);
-      ix0 = newVertex(&vBuffer, r1 * cos_ta_3da, r1 * sin_ta_3da, -gearinfo->width * 0.5f, normal);
-      ix1 = newVertex(&vBuffer, r2 * cos_ta_2da, r2 * sin_ta_2da, -gearinfo->width * 0.5f, normal);
-      ix2 = newVertex(&vBuffer, r1 * cos_ta, r1 * sin_ta, -gearinfo->width * 0.5f, normal);
-      ix3 = newVertex(&vBuffer, r2 * cos_ta_1da, r2 * sin_ta_1da, -gearinfo->width * 0.5f, normal);
-      newFace(&iBuffer, ix0, ix1, ix2);
-      newFace(&iBuffer, ix1, ix3, ix2);
+      ix0 = newVertex(vBuffer, r1 * cos_ta_3da, r1 * sin_ta_3da, -gearinfo->width * 0.5f, normal);
+      ix1 = newVertex(vBuffer, r2 * cos_ta_2da, r2 * sin_ta_2da, -gearinfo->width * 0.5f, normal);
+      ix2 = newVertex(vBuffer, r1 * cos_ta, r1 * sin_ta, -gearinfo->width * 0.5f, normal);
+      ix3 = newVertex(vBuffer, r2 * cos_ta_1da, r2 * sin_ta_1da, -gearinfo->width * 0.5f, normal);
+      newFace(iBuffer, ix0, ix1, ix2);
+      newFace(iBuffer, ix1, ix3, ix2);
 
       // draw outward faces of teeth
       normal = glm::vec3(v1, -u1, 0.0f);
-      ix0 = newVertex(&vBuffer, r1 * cos_ta, r1 * sin_ta, gearinfo->width * 0.5f, normal);
-      ix1 = newVertex(&vBuffer, r1 * cos_ta, r1 * sin_ta, -gearinfo->width * 0.5f, normal);
-      ix2 = newVertex(&vBuffer, r2 * cos_ta_1da, r2 * sin_ta_1da, gearinfo->width * 0.5f, normal);
-      ix3 = newVertex(&vBuffer, r2 * cos_ta_1da, r2 * sin_ta_1da, -gearinfo->width * 0.5f, normal);
-      newFace(&iBuffer, ix0, ix1, ix2);
-      newFace(&iBuffer, ix1, ix3, ix2);
+      ix0 = newVertex(vBuffer, r1 * cos_ta, r1 * sin_ta, gearinfo->width * 0.5f, normal);
+      ix1 = newVertex(vBuffer, r1 * cos_ta, r1 * sin_ta, -gearinfo->width * 0.5f, normal);
+      ix2 = newVertex(vBuffer, r2 * cos_ta_1da, r2 * sin_ta_1da, gearinfo->width * 0.5f, normal);
+      ix3 = newVertex(vBuffer, r2 * cos_ta_1da, r2 * sin_ta_1da, -gearinfo->width * 0.5f, normal);
+      newFace(iBuffer, ix0, ix1, ix2);
+      newFace(iBuffer, ix1, ix3, ix2);
 
       normal = glm::vec3(cos_ta, sin_ta, 0.0f);
-      ix0 = newVertex(&vBuffer, r2 * cos_ta_1da, r2 * sin_ta_1da, gearinfo->width * 0.5f, normal);
-      ix1 = newVertex(&vBuffer, r2 * cos_ta_1da, r2 * sin_ta_1da, -gearinfo->width * 0.5f, normal);
-      ix2 = newVertex(&vBuffer, r2 * cos_ta_2da, r2 * sin_ta_2da, gearinfo->width * 0.5f, normal);
-      ix3 = newVertex(&vBuffer, r2 * cos_ta_2da, r2 * sin_ta_2da, -gearinfo->width * 0.5f, normal);
-      newFace(&iBuffer, ix0, ix1, ix2);
-      newFace(&iBuffer, ix1, ix3, ix2);
+      ix0 = newVertex(vBuffer, r2 * cos_ta_1da, r2 * sin_ta_1da, gearinfo->width * 0.5f, normal);
+      ix1 = newVertex(vBuffer, r2 * cos_ta_1da, r2 * sin_ta_1da, -gearinfo->width * 0.5f, normal);
+      ix2 = newVertex(vBuffer, r2 * cos_ta_2da, r2 * sin_ta_2da, gearinfo->width * 0.5f, normal);
+      ix3 = newVertex(vBuffer, r2 * cos_ta_2da, r2 * sin_ta_2da, -gearinfo->width * 0.5f, normal);
+      newFace(iBuffer, ix0, ix1, ix2);
+      newFace(iBuffer, ix1, ix3, ix2);
 
       normal = glm::vec3(v2, -u2, 0.0f);
-      ix0 = newVertex(&vBuffer, r2 * cos_ta_2da, r2 * sin_ta_2da, gearinfo->width * 0.5f, normal);
-      ix1 = newVertex(&vBuffer, r2 * cos_ta_2da, r2 * sin_ta_2da, -gearinfo->width * 0.5f, normal);
-      ix2 = newVertex(&vBuffer, r1 * cos_ta_3da, r1 * sin_ta_3da, gearinfo->width * 0.5f, normal);
-      ix3 = newVertex(&vBuffer, r1 * cos_ta_3da, r1 * sin_ta_3da, -gearinfo->width * 0.5f, normal);
-      newFace(&iBuffer, ix0, ix1, ix2);
-      newFace(&iBuffer, ix1, ix3, ix2);
+      ix0 = newVertex(vBuffer, r2 * cos_ta_2da, r2 * sin_ta_2da, gearinfo->width * 0.5f, normal);
+      ix1 = newVertex(vBuffer, r2 * cos_ta_2da, r2 * sin_ta_2da, -gearinfo->width * 0.5f, normal);
+      ix2 = newVertex(vBuffer, r1 * cos_ta_3da, r1 * sin_ta_3da, gearinfo->width * 0.5f, normal);
+      ix3 = newVertex(vBuffer, r1 * cos_ta_3da, r1 * sin_ta_3da, -gearinfo->width * 0.5f, normal);
+      newFace(iBuffer, ix0, ix1, ix2);
+      newFace(iBuffer, ix1, ix3, ix2);
 
       normal = glm::vec3(cos_ta, sin_ta, 0.0f);
-      ix0 = newVertex(&vBuffer, r1 * cos_ta_3da, r1 * sin_ta_3da, gearinfo->width * 0.5f, normal);
-      ix1 = newVertex(&vBuffer, r1 * cos_ta_3da, r1 * sin_ta_3da, -gearinfo->width * 0.5f, normal);
-      ix2 = newVertex(&vBuffer, r1 * cos_ta_4da, r1 * sin_ta_4da, gearinfo->width * 0.5f, normal);
-      ix3 = newVertex(&vBuffer, r1 * cos_ta_4da, r1 * sin_ta_4da, -gearinfo->width * 0.5f, normal);
-      newFace(&iBuffer, ix0, ix1, ix2);
-      newFace(&iBuffer, ix1, ix3, ix2);
+      ix0 = newVertex(vBuffer, r1 * cos_ta_3da, r1 * sin_ta_3da, gearinfo->width * 0.5f, normal);
+      ix1 = newVertex(vBuffer, r1 * cos_ta_3da, r1 * sin_ta_3da, -gearinfo->width * 0.5f, normal);
+      ix2 = newVertex(vBuffer, r1 * cos_ta_4da, r1 * sin_ta_4da, gearinfo->width * 0.5f, normal);
+      ix3 = newVertex(vBuffer, r1 * cos_ta_4da, r1 * sin_ta_4da, -gearinfo->width * 0.5f, normal);
+      newFace(iBuffer, ix0, ix1, ix2);
+      newFace(iBuffer, ix1, ix3, ix2);
 
       // draw inside radius cylinder
-      ix0 = newVertex(&vBuffer, r0 * cos_ta, r0 * sin_ta, -gearinfo->width * 0.5f, glm::vec3(-cos_ta, -sin_ta, 0.0f));
-      ix1 = newVertex(&vBuffer, r0 * cos_ta, r0 * sin_ta, gearinfo->width * 0.5f, glm::vec3(-cos_ta, -sin_ta, 0.0f));
-      ix2 = newVertex(&vBuffer, r0 * cos_ta_4da, r0 * sin_ta_4da, -gearinfo->width * 0.5f, glm::vec3(-cos_ta_4da, -sin_ta_4da, 0.0f));
-      ix3 = newVertex(&vBuffer, r0 * cos_ta_4da, r0 * sin_ta_4da, gearinfo->width * 0.5f, glm::vec3(-cos_ta_4da, -sin_ta_4da, 0.0f));
-      newFace(&iBuffer, ix0, ix1, ix2);
-      newFace(&iBuffer, ix1, ix3, ix2);
+      ix0 = newVertex(vBuffer, r0 * cos_ta, r0 * sin_ta, -gearinfo->width * 0.5f, glm::vec3(-cos_ta, -sin_ta, 0.0f));
+      ix1 = newVertex(vBuffer, r0 * cos_ta, r0 * sin_ta, gearinfo->width * 0.5f, glm::vec3(-cos_ta, -sin_ta, 0.0f));
+      ix2 = newVertex(vBuffer, r0 * cos_ta_4da, r0 * sin_ta_4da, -gearinfo->width * 0.5f, glm::vec3(-cos_ta_4da, -sin_ta_4da, 0.0f));
+      ix3 = newVertex(vBuffer, r0 * cos_ta_4da, r0 * sin_ta_4da, gearinfo->width * 0.5f, glm::vec3(-cos_ta_4da, -sin_ta_4da, 0.0f));
+      newFace(iBuffer, ix0, ix1, ix2);
+      newFace(iBuffer, ix1, ix3, ix2);
+    }
+
+  }
+
+  // Copy a mesh to device local buffers in the next upload batch
+  void upload(Device *vulkanDevice, const std::vector<Vertex> &vBuffer, const std::vector<uint32_t> &iBuffer) {
+    std::vector<uint16_t> shortIndices;
+    const void *indexData = iBuffer.data();
+    size_t indexSize = sizeof(uint32_t);
+    if (vBuffer.size() < 65536) {
+      shortIndices.assign(iBuffer.begin(), iBuffer.end());
+      indexData = shortIndices.data();
+      indexSize = sizeof(uint16_t);
+      indexType = VK_INDEX_TYPE_UINT16;
     }
 
     size_t vertexBufferSize = vBuffer.size() * sizeof(Vertex);
-    size_t indexBufferSize = iBuffer.size() * sizeof(uint32_t);
+    size_t indexBufferSize = iBuffer.size() * indexSize;
 
     bool useStaging = true;
 
     if (useStaging) {
-      Buffer vertexStaging, indexStaging;
-
-      // Create staging buffers
-      // Vertex data
-      vulkanDevice->createBuffer(
-            VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-            VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT,
-            &vertexStaging,
-            vertexBufferSize,
-            vBuffer.data());
-      // Index data
-      vulkanDevice->createBuffer(
-            VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-            VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT,
-            &indexStaging,
-            indexBufferSize,
-            iBuffer.data());
-
       // Create device local buffers
       // Vertex buffer
       vulkanDevice->createBuffer(
@@ -227,33 +252,19 @@ class Gear {
             &indexBuffer,
             indexBufferSize);
 
-      // Copy from staging buffers
-      VkCommandBuffer copyCmd = vulkanDevice->createCommandBuffer(VK_COMMAND_BUFFER_LEVEL_PRIMARY, true);
-
-      VkBufferCopy copyRegion = {};
-
-      copyRegion.size = vertexBufferSize;
-      vkCmdCopyBuffer(
-            copyCmd,
-            vertexStaging.buffer,
+      // Copy through the staging ring in the next upload batch
+      vulkanDevice->upload_batcher.upload_buffer(
+            vBuffer.data(),
+            vertexBufferSize,
             vertexBuffer.buffer,
-            1,
-            &copyRegion);
-
-      copyRegion.size = indexBufferSize;
-      vkCmdCopyBuffer(
-            copyCmd,
-            indexStaging.buffer,
+            VK_PIPELINE_STAGE_VERTEX_INPUT_BIT,
+            VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT);
+      vulkanDevice->upload_batcher.upload_buffer(
+            indexData,
+            indexBufferSize,
             indexBuffer.buffer,
-            1,
-            &copyRegion);
-
-      vulkanDevice->flushCommandBuffer(copyCmd, queue, true);
-
-      vkDestroyBuffer(vulkanDevice->logicalDevice, vertexStaging.buffer, nullptr);
-      vkFreeMemory(vulkanDevice->logicalDevice, vertexStaging.memory, nullptr);
-      vkDestroyBuffer(vulkanDevice->logicalDevice, indexStaging.buffer, nullptr);
-      vkFreeMemory(vulkanDevice->logicalDevice, indexStaging.memory, nullptr);
+            VK_PIPELINE_STAGE_VERTEX_INPUT_BIT,
+            VK_ACCESS_INDEX_READ_BIT);
     } else {
       // Vertex buffer
       vulkanDevice->createBuffer(
@@ -261,14 +272,14 @@ class Gear {
             VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT,
             &vertexBuffer,
             vertexBufferSize,
-            vBuffer.data());
+            const_cast<Vertex *>(vBuffer.data()));
       // Index buffer
       vulkanDevice->createBuffer(
             VK_BUFFER_USAGE_INDEX_BUFFER_BIT,
             VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT,
             &indexBuffer,
             indexBufferSize,
-            iBuffer.data());
+            const_cast<void *>(indexData));
     }
 
     indexCount = iBuffer.size();
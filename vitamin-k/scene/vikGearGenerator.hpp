@@ -0,0 +1,399 @@
+/*
+ * vitamin-k
+ *
+ * Copyright 2017-2018 Collabora Ltd.
+ *
+ * Authors: Lubosz Sarnecki <lubosz.sarnecki@collabora.com>
+ * SPDX-License-Identifier: MIT
+ */
+
+#pragma once
+
+#include <vulkan/vulkan.h>
+
+#include <array>
+#include <chrono>
+#include <vector>
+
+#include "vikGear.hpp"
+#include "../render/vikDevice.hpp"
+#include "../render/vikMeshOptimizer.hpp"
+#include "../render/vikShader.hpp"
+#include "../system/vikLog.hpp"
+
+namespace vik {
+
+/*
+ * Generates gear meshes with a compute shader.
+ *
+ * generate() sizes the gear's buffers from the tooth count and queues the
+ * gear, record() then dispatches one invocation per tooth for the queued
+ * gears into a command buffer, outside of a render pass. The mesh is
+ * written straight into the device local vertex and index buffers and is
+ * visible to draws recorded after it in the same queue.
+ *
+ * A gear can be generated again with different parameters. When the tooth
+ * count changes its buffers are recreated and its descriptor set is
+ * rewritten, so the caller waits until no frame in flight uses them.
+ */
+class GearGenerator {
+  struct PushConstants {
+    float inner_radius;
+    float outer_radius;
+    float width;
+    float tooth_depth;
+    uint32_t tooth_count;
+  };
+
+  struct Request {
+    Gear *gear;
+    PushConstants constants;
+  };
+
+  static const uint32_t WORKGROUP_SIZE = 64;
+  static const uint32_t MAX_GEARS = 64;
+
+  Device *device = nullptr;
+  VkDescriptorSetLayout descriptor_set_layout = VK_NULL_HANDLE;
+  VkDescriptorPool descriptor_pool = VK_NULL_HANDLE;
+  VkPipelineLayout pipeline_layout = VK_NULL_HANDLE;
+  VkPipeline pipeline = VK_NULL_HANDLE;
+
+  // Descriptor set of each gear, by the gear's index in gears
+  std::vector<Gear*> gears;
+  std::vector<VkDescriptorSet> descriptor_sets;
+
+  std::vector<Request> pending;
+
+ public:
+  ~GearGenerator() {
+    destroy();
+  }
+
+  void init(Device *d, VkPipelineCache pipeline_cache) {
+    device = d;
+    VkDevice vk_device = device->logicalDevice;
+
+    std::array<VkDescriptorSetLayoutBinding, 2> bindings;
+    for (uint32_t i = 0; i < bindings.size(); i++)
+      bindings[i] = {
+        .binding = i,
+        .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+        .descriptorCount = 1,
+        .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT
+      };
+
+    VkDescriptorSetLayoutCreateInfo layout_info = {
+      .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
+      .bindingCount = static_cast<uint32_t>(bindings.size()),
+      .pBindings = bindings.data()
+    };
+    vik_log_check(vkCreateDescriptorSetLayout(vk_device, &layout_info,
+                                              nullptr, &descriptor_set_layout));
+
+    VkPushConstantRange push_constant_range = {
+      .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT,
+      .offset = 0,
+      .size = sizeof(PushConstants)
+    };
+    VkPipelineLayoutCreateInfo pipeline_layout_info = {
+      .sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
+      .setLayoutCount = 1,
+      .pSetLayouts = &descriptor_set_layout,
+      .pushConstantRangeCount = 1,
+      .pPushConstantRanges = &push_constant_range
+    };
+    vik_log_check(vkCreatePipelineLayout(vk_device, &pipeline_layout_info,
+                                         nullptr, &pipeline_layout));
+
+    VkComputePipelineCreateInfo pipeline_info = {
+      .sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO,
+      .stage = Shader::load(vk_device, "xrgears/gear.comp.spv",
+                            VK_SHADER_STAGE_COMPUTE_BIT),
+      .layout = pipeline_layout
+    };
+    vik_log_check(vkCreateComputePipelines(vk_device, pipeline_cache, 1,
+                                           &pipeline_info, nullptr, &pipeline));
+    vkDestroyShaderModule(vk_device, pipeline_info.stage.module, nullptr);
+
+    VkDescriptorPoolSize pool_size = {
+      .type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+      .descriptorCount = 2 * MAX_GEARS
+    };
+    VkDescriptorPoolCreateInfo pool_info = {
+      .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
+      .maxSets = MAX_GEARS,
+      .poolSizeCount = 1,
+      .pPoolSizes = &pool_size
+    };
+    vik_log_check(vkCreateDescriptorPool(vk_device, &pool_info,
+                                         nullptr, &descriptor_pool));
+  }
+
+  void destroy() {
+    if (device == nullptr)
+      return;
+
+    VkDevice vk_device = device->logicalDevice;
+    vkDestroyPipeline(vk_device, pipeline, nullptr);
+    vkDestroyPipelineLayout(vk_device, pipeline_layout, nullptr);
+    vkDestroyDescriptorPool(vk_device, descriptor_pool, nullptr);
+    vkDestroyDescriptorSetLayout(vk_device, descriptor_set_layout, nullptr);
+    gears.clear();
+    descriptor_sets.clear();
+    pending.clear();
+    device = nullptr;
+  }
+
+  // Size the gear's buffers for the tooth count and queue its generation
+  void generate(Gear *gear, const GearInfo &info) {
+    if (gear->toothCount != info.tooth_count)
+      allocate(gear, info.tooth_count);
+
+    Request request = {
+      .gear = gear,
+      .constants = {
+        .inner_radius = info.inner_radius,
+        .outer_radius = info.outer_radius,
+        .width = info.width,
+        .tooth_depth = info.tooth_depth,
+        .tooth_count = static_cast<uint32_t>(info.tooth_count)
+      }
+    };
+    pending.push_back(request);
+  }
+
+  bool has_pending() {
+    return !pending.empty();
+  }
+
+  // Dispatch the queued gears, outside of a render pass
+  void record(VkCommandBuffer command_buffer) {
+    if (pending.empty())
+      return;
+
+    // Draws of earlier frames may still read the buffers
+    VkMemoryBarrier barrier = {
+      .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+      .srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT,
+      .dstAccessMask = VK_ACCESS_SHADER_WRITE_BIT
+    };
+    vkCmdPipelineBarrier(command_buffer,
+                         VK_PIPELINE_STAGE_VERTEX_INPUT_BIT
+                         | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                         VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                         0, 1, &barrier, 0, nullptr, 0, nullptr);
+
+    vkCmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_COMPUTE, pipeline);
+
+    for (auto& request : pending) {
+      VkDescriptorSet descriptor_set = descriptor_sets[get_index(request.gear)];
+      vkCmdBindDescriptorSets(command_buffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+                              pipeline_layout, 0, 1, &descriptor_set, 0, nullptr);
+      vkCmdPushConstants(command_buffer, pipeline_layout,
+                         VK_SHADER_STAGE_COMPUTE_BIT, 0,
+                         sizeof(PushConstants), &request.constants);
+      uint32_t group_count = (request.constants.tooth_count + WORKGROUP_SIZE - 1)
+          / WORKGROUP_SIZE;
+      vkCmdDispatch(command_buffer, group_count, 1, 1);
+    }
+
+    barrier.dstAccessMask = VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT
+        | VK_ACCESS_INDEX_READ_BIT;
+    vkCmdPipelineBarrier(command_buffer,
+                         VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                         VK_PIPELINE_STAGE_VERTEX_INPUT_BIT,
+                         0, 1, &barrier, 0, nullptr, 0, nullptr);
+
+    pending.clear();
+  }
+
+  /*
+   * Time generating a gear on the CPU against the compute shader.
+   *
+   * The CPU times are split into building the mesh, optimizing it and
+   * uploading it through the staging ring. The GPU time is measured with
+   * timestamps around the dispatch, the submit time includes waiting for
+   * the queue.
+   */
+  void benchmark(const GearInfo &gear_info, uint32_t iterations, VkQueue queue) {
+    typedef std::chrono::steady_clock clock;
+    auto ms_since = [](clock::time_point start) {
+      return std::chrono::duration<double, std::milli>(clock::now() - start).count();
+    };
+
+    GearInfo info = gear_info;
+    double build_ms = 0, optimize_ms = 0, upload_ms = 0;
+    MeshStats stats;
+
+    for (uint32_t i = 0; i < iterations; i++) {
+      std::vector<Vertex> vertices;
+      std::vector<uint32_t> indices;
+
+      clock::time_point start = clock::now();
+      Gear::build(&info, &vertices, &indices);
+      build_ms += ms_since(start);
+
+      start = clock::now();
+      MeshOptimizer::optimize(&vertices, 1, offsetof(Vertex, pos) / sizeof(float),
+                              &indices);
+      optimize_ms += ms_since(start);
+
+      start = clock::now();
+      Gear gear;
+      gear.upload(device, vertices, indices);
+      device->upload_batcher.wait_idle();
+      upload_ms += ms_since(start);
+    }
+
+    VkQueryPoolCreateInfo query_pool_info = {
+      .sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO,
+      .queryType = VK_QUERY_TYPE_TIMESTAMP,
+      .queryCount = 2
+    };
+    VkQueryPool query_pool;
+    vik_log_check(vkCreateQueryPool(device->logicalDevice, &query_pool_info,
+                                    nullptr, &query_pool));
+
+    Gear gear;
+    double gpu_ms = 0, submit_ms = 0;
+    for (uint32_t i = 0; i < iterations; i++) {
+      generate(&gear, info);
+
+      VkCommandBuffer command_buffer =
+          device->createCommandBuffer(VK_COMMAND_BUFFER_LEVEL_PRIMARY, true);
+      vkCmdResetQueryPool(command_buffer, query_pool, 0, 2);
+      vkCmdWriteTimestamp(command_buffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+                          query_pool, 0);
+      record(command_buffer);
+      vkCmdWriteTimestamp(command_buffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+                          query_pool, 1);
+
+      clock::time_point start = clock::now();
+      device->flushCommandBuffer(command_buffer, queue);
+      submit_ms += ms_since(start);
+
+      std::array<uint64_t, 2> timestamps;
+      vik_log_check(vkGetQueryPoolResults(device->logicalDevice, query_pool, 0, 2,
+                                          sizeof(timestamps), timestamps.data(),
+                                          sizeof(uint64_t),
+                                          VK_QUERY_RESULT_64_BIT
+                                          | VK_QUERY_RESULT_WAIT_BIT));
+      gpu_ms += (timestamps[1] - timestamps[0])
+          * device->properties.limits.timestampPeriod / 1e6;
+    }
+    release(&gear);
+
+    vkDestroyQueryPool(device->logicalDevice, query_pool, nullptr);
+
+    vik_log_i("Gear generation, %d teeth, mean of %d runs:",
+              info.tooth_count, iterations);
+    vik_log_i("  CPU: build %.3f ms, optimize %.3f ms, upload %.3f ms",
+              build_ms / iterations, optimize_ms / iterations,
+              upload_ms / iterations);
+    vik_log_i("  GPU: dispatch %.3f ms, submit and wait %.3f ms",
+              gpu_ms / iterations, submit_ms / iterations);
+  }
+
+  // Forget a gear's descriptor set, before the gear is destroyed
+  void release(Gear *gear) {
+    for (uint32_t i = 0; i < gears.size(); i++) {
+      if (gears[i] != gear)
+        continue;
+      gears[i] = nullptr;
+      // Reused by the next gear, the pool can't free single sets
+      return;
+    }
+  }
+
+ private:
+  uint32_t get_index(Gear *gear) {
+    for (uint32_t i = 0; i < gears.size(); i++)
+      if (gears[i] == gear)
+        return i;
+    vik_log_f("Gear was not generated by this generator.");
+    return 0;
+  }
+
+  void allocate(Gear *gear, int tooth_count) {
+    gear->destroy();
+
+    VkDeviceSize vertex_size = tooth_count * Gear::verticesPerTooth * sizeof(Vertex);
+    VkDeviceSize index_size = tooth_count * Gear::indicesPerTooth * sizeof(uint32_t);
+
+    vik_log_check(device->createBuffer(
+                    VK_BUFFER_USAGE_VERTEX_BUFFER_BIT
+                    | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                    VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                    &gear->vertexBuffer, vertex_size));
+    vik_log_check(device->createBuffer(
+                    VK_BUFFER_USAGE_INDEX_BUFFER_BIT
+                    | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                    VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                    &gear->indexBuffer, index_size));
+
+    gear->toothCount = tooth_count;
+    gear->indexCount = tooth_count * Gear::indicesPerTooth;
+    gear->indexType = VK_INDEX_TYPE_UINT32;
+
+    VkDescriptorSet descriptor_set = get_descriptor_set(gear);
+
+    std::array<VkDescriptorBufferInfo, 2> buffer_infos = {
+      (VkDescriptorBufferInfo) {
+        .buffer = gear->vertexBuffer.buffer,
+        .offset = 0,
+        .range = vertex_size
+      },
+      (VkDescriptorBufferInfo) {
+        .buffer = gear->indexBuffer.buffer,
+        .offset = 0,
+        .range = index_size
+      }
+    };
+
+    std::array<VkWriteDescriptorSet, 2> writes;
+    for (uint32_t i = 0; i < writes.size(); i++)
+      writes[i] = {
+        .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+        .dstSet = descriptor_set,
+        .dstBinding = i,
+        .descriptorCount = 1,
+        .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+        .pBufferInfo = &buffer_infos[i]
+      };
+    vkUpdateDescriptorSets(device->logicalDevice,
+                           static_cast<uint32_t>(writes.size()), writes.data(),
+                           0, nullptr);
+  }
+
+  // The gear's set, or a released or new one
+  VkDescriptorSet get_descriptor_set(Gear *gear) {
+    for (uint32_t i = 0; i < gears.size(); i++)
+      if (gears[i] == gear)
+        return descriptor_sets[i];
+
+    for (uint32_t i = 0; i < gears.size(); i++) {
+      if (gears[i] == nullptr) {
+        gears[i] = gear;
+        return descriptor_sets[i];
+      }
+    }
+
+    vik_log_f_if(gears.size() == MAX_GEARS,
+                 "Can't generate more than %d gears.", MAX_GEARS);
+
+    VkDescriptorSetAllocateInfo alloc_info = {
+      .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
+      .descriptorPool = descriptor_pool,
+      .descriptorSetCount = 1,
+      .pSetLayouts = &descriptor_set_layout
+    };
+    VkDescriptorSet descriptor_set;
+    vik_log_check(vkAllocateDescriptorSets(device->logicalDevice, &alloc_info,
+                                           &descriptor_set));
+    gears.push_back(gear);
+    descriptor_sets.push_back(descriptor_set);
+    return descriptor_set;
+  }
+};
+}  // namespace vik
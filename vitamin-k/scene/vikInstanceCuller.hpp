@@ -0,0 +1,305 @@
+/*
+ * vitamin-k
+ *
+ * Copyright 2017-2018 Collabora Ltd.
+ *
+ * Authors: Lubosz Sarnecki <lubosz.sarnecki@collabora.com>
+ * SPDX-License-Identifier: MIT
+ */
+
+#pragma once
+
+#include <vulkan/vulkan.h>
+
+#include <array>
+#include <vector>
+
+#include "../render/vikBuffer.hpp"
+#include "../render/vikDevice.hpp"
+#include "../render/vikShader.hpp"
+#include "../system/vikLog.hpp"
+
+namespace vik {
+
+/*
+ * Frustum culls instances on the GPU.
+ *
+ * record() resets the instance counts of the indirect draws from a
+ * template, and dispatches cull.comp, which tests the bounding sphere of
+ * each instance against the frusta of both eyes. Visible instances are
+ * appended to their draw and their index is written to the visible list
+ * the vertex shader reads.
+ *
+ * The number of visible instances is copied to a host visible slot per
+ * frame in flight, and read when the slot is recorded again, after the
+ * frame's fence was waited for. It never stalls and lags behind by the
+ * number of frames in flight.
+ */
+class InstanceCuller {
+ public:
+  // Buffers of the scene the culler reads and writes
+  struct Buffers {
+    VkDescriptorBufferInfo instances;
+    VkDescriptorBufferInfo bounds;
+    VkDescriptorBufferInfo draws;
+    VkDescriptorBufferInfo visible;
+    // Dynamic uniform buffer with the planes of both eyes
+    VkDescriptorBufferInfo frusta;
+    // Draws with zero instances, copied over the draws every frame
+    VkBuffer draw_template;
+  };
+
+ private:
+  struct PushConstants {
+    float time;
+    uint32_t instance_count;
+  };
+
+  static const uint32_t WORKGROUP_SIZE = 64;
+
+  Device *device = nullptr;
+  Buffers buffers;
+  uint32_t instance_count = 0;
+
+  VkDescriptorSetLayout descriptor_set_layout = VK_NULL_HANDLE;
+  VkDescriptorPool descriptor_pool = VK_NULL_HANDLE;
+  VkDescriptorSet descriptor_set = VK_NULL_HANDLE;
+  VkPipelineLayout pipeline_layout = VK_NULL_HANDLE;
+  VkPipeline pipeline = VK_NULL_HANDLE;
+
+  Buffer stats_buffer;
+  Buffer readback_buffer;
+  std::vector<bool> readback_written;
+  uint32_t visible_count = 0;
+
+ public:
+  ~InstanceCuller() {
+    if (device == nullptr)
+      return;
+
+    VkDevice vk_device = device->logicalDevice;
+    vkDestroyPipeline(vk_device, pipeline, nullptr);
+    vkDestroyPipelineLayout(vk_device, pipeline_layout, nullptr);
+    vkDestroyDescriptorPool(vk_device, descriptor_pool, nullptr);
+    vkDestroyDescriptorSetLayout(vk_device, descriptor_set_layout, nullptr);
+    stats_buffer.destroy();
+    readback_buffer.destroy();
+  }
+
+  void init(Device *d, VkPipelineCache pipeline_cache, uint32_t frames,
+            const Buffers &b, uint32_t count) {
+    device = d;
+    buffers = b;
+    instance_count = count;
+    visible_count = count;
+    VkDevice vk_device = device->logicalDevice;
+
+    vik_log_check(device->createBuffer(
+                    VK_BUFFER_USAGE_STORAGE_BUFFER_BIT
+                    | VK_BUFFER_USAGE_TRANSFER_SRC_BIT
+                    | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                    VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                    &stats_buffer, sizeof(uint32_t)));
+    stats_buffer.setupDescriptor(sizeof(uint32_t));
+
+    vik_log_check(device->createBuffer(
+                    VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                    VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT
+                    | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                    &readback_buffer, frames * sizeof(uint32_t)));
+    vik_log_check(readback_buffer.map());
+    readback_written.resize(frames, false);
+
+    std::array<VkDescriptorSetLayoutBinding, 6> bindings;
+    for (uint32_t i = 0; i < bindings.size(); i++)
+      bindings[i] = {
+        .binding = i,
+        .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+        .descriptorCount = 1,
+        .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT
+      };
+    bindings[5].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
+
+    VkDescriptorSetLayoutCreateInfo layout_info = {
+      .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
+      .bindingCount = static_cast<uint32_t>(bindings.size()),
+      .pBindings = bindings.data()
+    };
+    vik_log_check(vkCreateDescriptorSetLayout(vk_device, &layout_info,
+                                              nullptr, &descriptor_set_layout));
+
+    VkPushConstantRange push_constant_range = {
+      .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT,
+      .offset = 0,
+      .size = sizeof(PushConstants)
+    };
+    VkPipelineLayoutCreateInfo pipeline_layout_info = {
+      .sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
+      .setLayoutCount = 1,
+      .pSetLayouts = &descriptor_set_layout,
+      .pushConstantRangeCount = 1,
+      .pPushConstantRanges = &push_constant_range
+    };
+    vik_log_check(vkCreatePipelineLayout(vk_device, &pipeline_layout_info,
+                                         nullptr, &pipeline_layout));
+
+    VkComputePipelineCreateInfo pipeline_info = {
+      .sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO,
+      .stage = Shader::load(vk_device, "xrgears/cull.comp.spv",
+                            VK_SHADER_STAGE_COMPUTE_BIT),
+      .layout = pipeline_layout
+    };
+    vik_log_check(vkCreateComputePipelines(vk_device, pipeline_cache, 1,
+                                           &pipeline_info, nullptr, &pipeline));
+    vkDestroyShaderModule(vk_device, pipeline_info.stage.module, nullptr);
+
+    init_descriptor_set();
+  }
+
+  void record(VkCommandBuffer command_buffer, uint32_t frame,
+              uint32_t frusta_offset, float time) {
+    // The frame's fence was waited for, its last result is complete
+    uint32_t *results = static_cast<uint32_t*>(readback_buffer.mapped);
+    if (readback_written[frame])
+      visible_count = results[frame];
+
+    // Earlier frames may still draw from the buffers, write them in the
+    // cull pass or copy the stats to their readback slot
+    VkMemoryBarrier barrier = {
+      .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+      .srcAccessMask = VK_ACCESS_INDIRECT_COMMAND_READ_BIT
+                     | VK_ACCESS_SHADER_READ_BIT
+                     | VK_ACCESS_SHADER_WRITE_BIT
+                     | VK_ACCESS_TRANSFER_READ_BIT,
+      .dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT
+    };
+    vkCmdPipelineBarrier(command_buffer,
+                         VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT
+                         | VK_PIPELINE_STAGE_VERTEX_SHADER_BIT
+                         | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT
+                         | VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         0, 1, &barrier, 0, nullptr, 0, nullptr);
+
+    VkBufferCopy copy = {
+      .srcOffset = 0,
+      .dstOffset = buffers.draws.offset,
+      .size = buffers.draws.range
+    };
+    vkCmdCopyBuffer(command_buffer, buffers.draw_template,
+                    buffers.draws.buffer, 1, &copy);
+    vkCmdFillBuffer(command_buffer, stats_buffer.buffer, 0, sizeof(uint32_t), 0);
+
+    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+    vkCmdPipelineBarrier(command_buffer,
+                         VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                         0, 1, &barrier, 0, nullptr, 0, nullptr);
+
+    vkCmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_COMPUTE, pipeline);
+    vkCmdBindDescriptorSets(command_buffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+                            pipeline_layout, 0, 1, &descriptor_set,
+                            1, &frusta_offset);
+    PushConstants constants = {
+      .time = time,
+      .instance_count = instance_count
+    };
+    vkCmdPushConstants(command_buffer, pipeline_layout,
+                       VK_SHADER_STAGE_COMPUTE_BIT, 0,
+                       sizeof(constants), &constants);
+    vkCmdDispatch(command_buffer,
+                  (instance_count + WORKGROUP_SIZE - 1) / WORKGROUP_SIZE, 1, 1);
+
+    barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_INDIRECT_COMMAND_READ_BIT
+                          | VK_ACCESS_SHADER_READ_BIT
+                          | VK_ACCESS_TRANSFER_READ_BIT;
+    vkCmdPipelineBarrier(command_buffer,
+                         VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                         VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT
+                         | VK_PIPELINE_STAGE_VERTEX_SHADER_BIT
+                         | VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         0, 1, &barrier, 0, nullptr, 0, nullptr);
+
+    VkBufferCopy stats_copy = {
+      .srcOffset = 0,
+      .dstOffset = frame * sizeof(uint32_t),
+      .size = sizeof(uint32_t)
+    };
+    vkCmdCopyBuffer(command_buffer, stats_buffer.buffer,
+                    readback_buffer.buffer, 1, &stats_copy);
+
+    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+    vkCmdPipelineBarrier(command_buffer,
+                         VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         VK_PIPELINE_STAGE_HOST_BIT,
+                         0, 1, &barrier, 0, nullptr, 0, nullptr);
+
+    readback_written[frame] = true;
+  }
+
+  // Visible instances of a recent frame
+  uint32_t get_visible_count() {
+    return visible_count;
+  }
+
+ private:
+  void init_descriptor_set() {
+    std::array<VkDescriptorPoolSize, 2> pool_sizes = {{
+      {
+        .type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+        .descriptorCount = 5
+      },
+      {
+        .type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC,
+        .descriptorCount = 1
+      }
+    }};
+    VkDescriptorPoolCreateInfo pool_info = {
+      .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
+      .maxSets = 1,
+      .poolSizeCount = static_cast<uint32_t>(pool_sizes.size()),
+      .pPoolSizes = pool_sizes.data()
+    };
+    vik_log_check(vkCreateDescriptorPool(device->logicalDevice, &pool_info,
+                                         nullptr, &descriptor_pool));
+
+    VkDescriptorSetAllocateInfo alloc_info = {
+      .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
+      .descriptorPool = descriptor_pool,
+      .descriptorSetCount = 1,
+      .pSetLayouts = &descriptor_set_layout
+    };
+    vik_log_check(vkAllocateDescriptorSets(device->logicalDevice, &alloc_info,
+                                           &descriptor_set));
+
+    // In binding order of cull.comp
+    std::array<VkDescriptorBufferInfo*, 6> infos = {{
+      &buffers.instances,
+      &buffers.bounds,
+      &buffers.draws,
+      &buffers.visible,
+      &stats_buffer.descriptor,
+      &buffers.frusta
+    }};
+
+    std::array<VkWriteDescriptorSet, 6> writes;
+    for (uint32_t i = 0; i < writes.size(); i++)
+      writes[i] = {
+        .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+        .dstSet = descriptor_set,
+        .dstBinding = i,
+        .descriptorCount = 1,
+        .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+        .pBufferInfo = infos[i]
+      };
+    writes[5].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
+
+    vkUpdateDescriptorSets(device->logicalDevice,
+                           static_cast<uint32_t>(writes.size()), writes.data(),
+                           0, nullptr);
+  }
+};
+}  // namespace vik
@@ -0,0 +1,653 @@
+/*
+ * vitamin-k
+ *
+ * Copyright 2017-2018 Collabora Ltd.
+ *
+ * Authors: Lubosz Sarnecki <lubosz.sarnecki@collabora.com>
+ * SPDX-License-Identifier: MIT
+ */
+
+#pragma once
+
+#include <vulkan/vulkan.h>
+
+#include <float.h>
+#include <stddef.h>
+
+#include <algorithm>
+#include <array>
+#include <string>
+#include <vector>
+
+#include "vikGear.hpp"
+#include "vikInstanceCuller.hpp"
+#include "vikNode.hpp"
+#include "vikSkyBox.hpp"
+#include "../render/vikDevice.hpp"
+#include "../render/vikMeshOptimizer.hpp"
+#include "../render/vikModel.hpp"
+#include "../render/vikPipelineBuilder.hpp"
+#include "../render/vikShader.hpp"
+#include "../system/vikAssetLoader.hpp"
+#include "../system/vikLog.hpp"
+
+namespace vik {
+
+/*
+ * Draws gears and models from merged buffers with indirect draws.
+ *
+ * The geometry of all meshes is packed into one vertex and one index
+ * buffer, and every mesh is drawn with all of its instances by one
+ * indirect draw command. The whole scene is recorded with one
+ * vkCmdDrawIndexedIndirectCount, or vkCmdDrawIndexedIndirect without
+ * VK_KHR_draw_indirect_count, without binding buffers per mesh.
+ *
+ * Position, animation and material of each instance live in a storage
+ * buffer. The commands start at the first instance of their mesh, and the
+ * vertex shader finds its instance in the visible list at gl_InstanceIndex.
+ * The list is the identity, unless an InstanceCuller compacts it.
+ */
+class InstancedScene {
+ public:
+  // std430 layout of the Instance struct in scene_instanced.vert
+  struct Instance {
+    glm::vec3 position;
+    float rotation_speed;
+    glm::vec3 color;
+    float rotation_offset;
+    float roughness;
+    float metallic;
+    uint32_t mesh;
+    float padding;
+  };
+
+ private:
+  // Where the geometry of a mesh comes from, built by the asset loader
+  struct Mesh {
+    bool is_gear;
+    GearInfo gear_info;
+    std::string model_path;
+    float model_scale;
+    std::vector<Instance> instances;
+  };
+
+  // Merged geometry of all meshes
+  struct Geometry {
+    Buffer vertices;
+    Buffer indices;
+
+    void destroy() {
+      vertices.destroy();
+      indices.destroy();
+    }
+  };
+
+  Device *device = nullptr;
+  std::vector<Mesh> meshes;
+  AssetHandle<Geometry> geometry;
+
+  Buffer instance_buffer;
+  Buffer visible_buffer;
+  Buffer bounds_buffer;
+  Buffer draw_buffer;
+  Buffer draw_template_buffer;
+  Buffer draw_count_buffer;
+  uint32_t draw_count = 0;
+  uint32_t instance_count = 0;
+  uint64_t upload_ticket = 0;
+  bool instances_ready = false;
+
+  InstanceCuller *culler = nullptr;
+
+#ifdef VK_KHR_draw_indirect_count
+  PFN_vkCmdDrawIndexedIndirectCountKHR draw_indexed_indirect_count = nullptr;
+#endif
+  bool multi_draw_indirect = false;
+
+  VkDescriptorSetLayout descriptor_set_layout = VK_NULL_HANDLE;
+  VkPipelineLayout pipeline_layout = VK_NULL_HANDLE;
+  VkDescriptorSet descriptor_set = VK_NULL_HANDLE;
+  VkPipeline pipeline = VK_NULL_HANDLE;
+  std::shared_future<VkPipeline> pipeline_future;
+
+ public:
+  /*
+   * multi_draw_indirect is the enabled device feature, without it every
+   * command is drawn with its own vkCmdDrawIndexedIndirect.
+   */
+  InstancedScene(Device *d, bool multi_draw) : device(d) {
+    multi_draw_indirect = multi_draw;
+#ifdef VK_KHR_draw_indirect_count
+    if (device->enable_draw_indirect_count)
+      draw_indexed_indirect_count =
+          (PFN_vkCmdDrawIndexedIndirectCountKHR)
+          vkGetDeviceProcAddr(device->logicalDevice,
+                              "vkCmdDrawIndexedIndirectCountKHR");
+#endif
+  }
+
+  ~InstancedScene() {
+    delete culler;
+    VkDevice vk_device = device->logicalDevice;
+    vkDestroyPipeline(vk_device, pipeline, nullptr);
+    vkDestroyPipelineLayout(vk_device, pipeline_layout, nullptr);
+    vkDestroyDescriptorSetLayout(vk_device, descriptor_set_layout, nullptr);
+    instance_buffer.destroy();
+    visible_buffer.destroy();
+    bounds_buffer.destroy();
+    draw_buffer.destroy();
+    draw_template_buffer.destroy();
+    draw_count_buffer.destroy();
+  }
+
+  // Returns the index to add instances of this mesh with
+  uint32_t add_gear(const GearInfo &gear_info) {
+    Mesh mesh = {};
+    mesh.is_gear = true;
+    mesh.gear_info = gear_info;
+    meshes.push_back(mesh);
+    return meshes.size() - 1;
+  }
+
+  uint32_t add_model(const std::string &path, float scale) {
+    Mesh mesh = {};
+    mesh.is_gear = false;
+    mesh.model_path = path;
+    mesh.model_scale = scale;
+    meshes.push_back(mesh);
+    return meshes.size() - 1;
+  }
+
+  void add(uint32_t mesh, const Node::NodeInfo &info) {
+    const Material::PushBlock &material = info.material.params;
+    Instance instance = {
+      .position = info.position,
+      .rotation_speed = info.rotation_speed,
+      .color = glm::vec3(material.r, material.g, material.b),
+      .rotation_offset = info.rotation_offset,
+      .roughness = material.roughness,
+      .metallic = material.metallic,
+      .mesh = mesh
+    };
+    meshes[mesh].instances.push_back(instance);
+  }
+
+  /*
+   * Upload the instances, grouped by mesh, and load the geometry of the
+   * meshes in the vertex layout of the Gear vertices.
+   */
+  void load(AssetLoader *loader, const VertexLayout &layout) {
+    vik_log_f_if(layout.stride() != sizeof(Vertex),
+                 "Models must have the layout of the gear vertices.");
+
+    std::vector<Instance> instances;
+    std::vector<uint32_t> first_instances;
+    for (auto& mesh : meshes) {
+      first_instances.push_back(instances.size());
+      instances.insert(instances.end(),
+                       mesh.instances.begin(), mesh.instances.end());
+    }
+
+    vik_log_f_if(instances.empty(), "Instanced scene has no instances.");
+
+    VkDeviceSize size = instances.size() * sizeof(Instance);
+    vik_log_check(device->createBuffer(
+                    VK_BUFFER_USAGE_STORAGE_BUFFER_BIT
+                    | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                    VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                    &instance_buffer, size));
+    instance_buffer.setupDescriptor(size);
+
+    device->upload_batcher.upload_buffer(instances.data(), size,
+                                         instance_buffer.buffer,
+                                         VK_PIPELINE_STAGE_VERTEX_SHADER_BIT,
+                                         VK_ACCESS_SHADER_READ_BIT);
+
+    // Without culling every instance is visible, in order
+    instance_count = instances.size();
+    std::vector<uint32_t> visible(instance_count);
+    for (uint32_t i = 0; i < instance_count; i++)
+      visible[i] = i;
+
+    VkDeviceSize visible_size = instance_count * sizeof(uint32_t);
+    vik_log_check(device->createBuffer(
+                    VK_BUFFER_USAGE_STORAGE_BUFFER_BIT
+                    | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                    VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                    &visible_buffer, visible_size));
+    visible_buffer.setupDescriptor(visible_size);
+
+    device->upload_batcher.upload_buffer(visible.data(), visible_size,
+                                         visible_buffer.buffer,
+                                         VK_PIPELINE_STAGE_VERTEX_SHADER_BIT,
+                                         VK_ACCESS_SHADER_READ_BIT);
+    upload_ticket = device->upload_batcher.get_ticket();
+
+    // Written with the geometry, the index ranges are not known yet
+    draw_count = meshes.size();
+    VkDeviceSize draws_size = draw_count * sizeof(VkDrawIndexedIndirectCommand);
+    vik_log_check(device->createBuffer(
+                    VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT
+                    | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT
+                    | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                    VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                    &draw_buffer, draws_size));
+    draw_buffer.setupDescriptor(draws_size);
+    vik_log_check(device->createBuffer(
+                    VK_BUFFER_USAGE_TRANSFER_SRC_BIT
+                    | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                    VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                    &draw_template_buffer, draws_size));
+
+    VkDeviceSize bounds_size = meshes.size() * sizeof(glm::vec4);
+    vik_log_check(device->createBuffer(
+                    VK_BUFFER_USAGE_STORAGE_BUFFER_BIT
+                    | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                    VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                    &bounds_buffer, bounds_size));
+    bounds_buffer.setupDescriptor(bounds_size);
+    vik_log_check(device->createBuffer(
+                    VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT
+                    | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                    VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                    &draw_count_buffer, sizeof(uint32_t)));
+
+    Device *d = device;
+    std::vector<Mesh> sources = meshes;
+    Targets targets = {
+      .draws = draw_buffer.buffer,
+      .draw_template = draw_template_buffer.buffer,
+      .draw_count = draw_count_buffer.buffer,
+      .bounds = bounds_buffer.buffer
+    };
+    geometry = loader->load<Geometry>(
+          [d, sources, first_instances, layout, targets](Geometry *g) {
+      build(d, sources, first_instances, layout, targets, g);
+    });
+
+    vik_log_i("%zu instances of %zu meshes", instances.size(), meshes.size());
+  }
+
+  // Check if the instance upload completed, call between frames
+  void update() {
+    if (!instances_ready)
+      instances_ready = device->upload_batcher.is_complete(upload_ticket);
+  }
+
+  /*
+   * Cull the instances against the frusta of both eyes before drawing.
+   * frusta_descriptor is the dynamic uniform buffer a StereoFrustum is
+   * pushed to every frame.
+   */
+  void init_culling(VkPipelineCache pipeline_cache, uint32_t frames,
+                    const VkDescriptorBufferInfo &frusta_descriptor) {
+    InstanceCuller::Buffers buffers = {
+      .instances = instance_buffer.descriptor,
+      .bounds = bounds_buffer.descriptor,
+      .draws = draw_buffer.descriptor,
+      .visible = visible_buffer.descriptor,
+      .frusta = frusta_descriptor,
+      .draw_template = draw_template_buffer.buffer
+    };
+    culler = new InstanceCuller();
+    culler->init(device, pipeline_cache, frames, buffers, instance_count);
+  }
+
+  // Record outside of the render pass, before draw()
+  void cull(VkCommandBuffer command_buffer, uint32_t frame,
+            uint32_t frusta_offset, float time) {
+    if (culler == nullptr || !instances_ready || !geometry.is_ready())
+      return;
+    culler->record(command_buffer, frame, frusta_offset, time);
+  }
+
+  uint32_t get_instance_count() {
+    return instance_count;
+  }
+
+  uint32_t get_visible_count() {
+    if (culler == nullptr)
+      return instance_count;
+    return culler->get_visible_count();
+  }
+
+  void init_descriptor_set_layout(bool enable_sky) {
+    std::vector<VkDescriptorSetLayoutBinding> set_layout_bindings = {
+      // instances
+      {
+        .binding = 0,
+        .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+        .descriptorCount = 1,
+        .stageFlags = VK_SHADER_STAGE_VERTEX_BIT
+      },
+      // ubo lights
+      {
+        .binding = 1,
+        .descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC,
+        .descriptorCount = 1,
+        .stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT
+      },
+      // ubo camera
+      {
+        .binding = 2,
+        .descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC,
+        .descriptorCount = 1,
+        .stageFlags = VK_SHADER_STAGE_VERTEX_BIT
+                    | VK_SHADER_STAGE_GEOMETRY_BIT
+                    | VK_SHADER_STAGE_FRAGMENT_BIT
+      },
+      // visible instances
+      {
+        .binding = 4,
+        .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+        .descriptorCount = 1,
+        .stageFlags = VK_SHADER_STAGE_VERTEX_BIT
+      }
+    };
+
+    // cube map sampler
+    if (enable_sky)
+      set_layout_bindings.push_back({
+        .binding = 3,
+        .descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+        .descriptorCount = 1,
+        .stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT
+      });
+
+    VkDescriptorSetLayoutCreateInfo descriptor_layout = {
+      .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
+      .bindingCount = static_cast<uint32_t>(set_layout_bindings.size()),
+      .pBindings = set_layout_bindings.data()
+    };
+    vik_log_check(vkCreateDescriptorSetLayout(device->logicalDevice,
+                                              &descriptor_layout,
+                                              nullptr, &descriptor_set_layout));
+
+    // Animation time
+    VkPushConstantRange push_constant_range = {
+      .stageFlags = VK_SHADER_STAGE_VERTEX_BIT,
+      .offset = 0,
+      .size = sizeof(float)
+    };
+
+    VkPipelineLayoutCreateInfo pipeline_layout_info = {
+      .sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
+      .setLayoutCount = 1,
+      .pSetLayouts = &descriptor_set_layout,
+      .pushConstantRangeCount = 1,
+      .pPushConstantRanges = &push_constant_range
+    };
+    vik_log_check(vkCreatePipelineLayout(device->logicalDevice,
+                                         &pipeline_layout_info,
+                                         nullptr, &pipeline_layout));
+  }
+
+  /*
+   * Uses the state of the scene pipeline with the instanced shaders. With
+   * multiview the vertex shader projects for each view, without the
+   * geometry shader.
+   */
+  void init_pipeline(VkGraphicsPipelineCreateInfo pipeline_info,
+                     PipelineBuilder *pipeline_builder, bool enable_sky,
+                     bool multiview) {
+    VkDevice vk_device = device->logicalDevice;
+
+    std::array<VkPipelineShaderStageCreateInfo, 3> shader_stages;
+    shader_stages[0] = Shader::load(vk_device, multiview
+                                    ? "xrgears/scene_instanced_multiview.vert.spv"
+                                    : "xrgears/scene_instanced.vert.spv",
+                                    VK_SHADER_STAGE_VERTEX_BIT);
+    shader_stages[1] = Shader::load(vk_device, enable_sky
+                                    ? "xrgears/scene.frag.spv"
+                                    : "xrgears/scene_no_sky.frag.spv",
+                                    VK_SHADER_STAGE_FRAGMENT_BIT);
+    if (!multiview)
+      shader_stages[2] = Shader::load(vk_device, "xrgears/multiview_instanced.geom.spv",
+                                      VK_SHADER_STAGE_GEOMETRY_BIT);
+
+    pipeline_info.stageCount = multiview ? 2 : 3;
+    pipeline_info.pStages = shader_stages.data();
+    pipeline_info.layout = pipeline_layout;
+
+    pipeline_future = pipeline_builder->build(pipeline_info);
+  }
+
+  void wait_for_pipeline() {
+    pipeline = pipeline_future.get();
+  }
+
+  void create_descriptor_set(VkDescriptorPool descriptor_pool,
+                             VkDescriptorBufferInfo *lights_descriptor,
+                             VkDescriptorBufferInfo *camera_descriptor,
+                             SkyBox *sky_box) {
+    VkDescriptorSetAllocateInfo alloc_info = {
+      .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
+      .descriptorPool = descriptor_pool,
+      .descriptorSetCount = 1,
+      .pSetLayouts = &descriptor_set_layout
+    };
+    vik_log_check(vkAllocateDescriptorSets(device->logicalDevice,
+                                           &alloc_info, &descriptor_set));
+
+    std::vector<VkWriteDescriptorSet> write_descriptor_sets = {
+      (VkWriteDescriptorSet) {
+        .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+        .dstSet = descriptor_set,
+        .dstBinding = 0,
+        .descriptorCount = 1,
+        .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+        .pBufferInfo = &instance_buffer.descriptor
+      },
+      (VkWriteDescriptorSet) {
+        .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+        .dstSet = descriptor_set,
+        .dstBinding = 1,
+        .descriptorCount = 1,
+        .descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC,
+        .pBufferInfo = lights_descriptor
+      },
+      (VkWriteDescriptorSet) {
+        .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+        .dstSet = descriptor_set,
+        .dstBinding = 2,
+        .descriptorCount = 1,
+        .descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC,
+        .pBufferInfo = camera_descriptor
+      },
+      (VkWriteDescriptorSet) {
+        .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+        .dstSet = descriptor_set,
+        .dstBinding = 4,
+        .descriptorCount = 1,
+        .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+        .pBufferInfo = &visible_buffer.descriptor
+      }
+    };
+
+    if (sky_box != nullptr)
+      write_descriptor_sets.push_back(
+            sky_box->get_cube_map_write_descriptor_set(3, descriptor_set));
+
+    vkUpdateDescriptorSets(device->logicalDevice,
+                           static_cast<uint32_t>(write_descriptor_sets.size()),
+                           write_descriptor_sets.data(), 0, nullptr);
+  }
+
+  // Rewrite the cube map binding after the sky's texture changed
+  void update_sky_descriptor(SkyBox *sky_box) {
+    VkWriteDescriptorSet write =
+        sky_box->get_cube_map_write_descriptor_set(3, descriptor_set);
+    vkUpdateDescriptorSets(device->logicalDevice, 1, &write, 0, nullptr);
+  }
+
+  void draw(VkCommandBuffer command_buffer, uint32_t lights_offset,
+            uint32_t camera_offset, float time) {
+    if (!instances_ready || !geometry.is_ready())
+      return;
+
+    vkCmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline);
+
+    // Dynamic offsets of the lights and camera
+    std::array<uint32_t, 2> offsets = { lights_offset, camera_offset };
+    vkCmdBindDescriptorSets(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+                            pipeline_layout, 0, 1, &descriptor_set,
+                            offsets.size(), offsets.data());
+    vkCmdPushConstants(command_buffer, pipeline_layout,
+                       VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(float), &time);
+
+    VkDeviceSize vertex_offset = 0;
+    vkCmdBindVertexBuffers(command_buffer, 0, 1,
+                           &geometry->vertices.buffer, &vertex_offset);
+    vkCmdBindIndexBuffer(command_buffer, geometry->indices.buffer, 0,
+                         VK_INDEX_TYPE_UINT32);
+
+    const uint32_t stride = sizeof(VkDrawIndexedIndirectCommand);
+#ifdef VK_KHR_draw_indirect_count
+    if (draw_indexed_indirect_count && multi_draw_indirect) {
+      draw_indexed_indirect_count(command_buffer, draw_buffer.buffer, 0,
+                                  draw_count_buffer.buffer, 0,
+                                  draw_count, stride);
+      return;
+    }
+#endif
+
+    if (multi_draw_indirect) {
+      vkCmdDrawIndexedIndirect(command_buffer, draw_buffer.buffer, 0,
+                               draw_count, stride);
+    } else {
+      for (uint32_t i = 0; i < draw_count; i++)
+        vkCmdDrawIndexedIndirect(command_buffer, draw_buffer.buffer,
+                                 i * stride, 1, stride);
+    }
+  }
+
+ private:
+  // Buffers build() writes besides the geometry
+  struct Targets {
+    VkBuffer draws;
+    VkBuffer draw_template;
+    VkBuffer draw_count;
+    VkBuffer bounds;
+  };
+
+  // Runs on a loader thread, the meshes are a copy
+  static void build(Device *device, const std::vector<Mesh> &meshes,
+                    const std::vector<uint32_t> &first_instances,
+                    const VertexLayout &layout, const Targets &targets,
+                    Geometry *g) {
+    const uint32_t stride = sizeof(Vertex) / sizeof(float);
+    std::vector<float> vertices;
+    std::vector<uint32_t> indices;
+    std::vector<VkDrawIndexedIndirectCommand> draws;
+    std::vector<glm::vec4> bounds;
+
+    for (uint32_t i = 0; i < meshes.size(); i++) {
+      std::vector<float> mesh_vertices;
+      std::vector<uint32_t> mesh_indices;
+      get_mesh(meshes[i], layout, &mesh_vertices, &mesh_indices);
+      bounds.push_back(get_bounding_sphere(mesh_vertices, stride));
+
+      draws.push_back({
+        .indexCount = static_cast<uint32_t>(mesh_indices.size()),
+        .instanceCount = static_cast<uint32_t>(meshes[i].instances.size()),
+        .firstIndex = static_cast<uint32_t>(indices.size()),
+        .vertexOffset = static_cast<int32_t>(vertices.size() / stride),
+        .firstInstance = first_instances[i]
+      });
+
+      vertices.insert(vertices.end(), mesh_vertices.begin(), mesh_vertices.end());
+      indices.insert(indices.end(), mesh_indices.begin(), mesh_indices.end());
+    }
+
+    VkDeviceSize vertex_size = vertices.size() * sizeof(float);
+    VkDeviceSize index_size = indices.size() * sizeof(uint32_t);
+    vik_log_check(device->createBuffer(
+                    VK_BUFFER_USAGE_VERTEX_BUFFER_BIT
+                    | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                    VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                    &g->vertices, vertex_size));
+    vik_log_check(device->createBuffer(
+                    VK_BUFFER_USAGE_INDEX_BUFFER_BIT
+                    | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                    VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                    &g->indices, index_size));
+
+    UploadBatcher *batcher = &device->upload_batcher;
+    batcher->upload_buffer(vertices.data(), vertex_size, g->vertices.buffer,
+                           VK_PIPELINE_STAGE_VERTEX_INPUT_BIT,
+                           VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT);
+    batcher->upload_buffer(indices.data(), index_size, g->indices.buffer,
+                           VK_PIPELINE_STAGE_VERTEX_INPUT_BIT,
+                           VK_ACCESS_INDEX_READ_BIT);
+    VkDeviceSize draws_size = draws.size() * sizeof(VkDrawIndexedIndirectCommand);
+    batcher->upload_buffer(draws.data(), draws_size, targets.draws,
+                           VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT,
+                           VK_ACCESS_INDIRECT_COMMAND_READ_BIT);
+    uint32_t count = draws.size();
+    batcher->upload_buffer(&count, sizeof(count), targets.draw_count,
+                           VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT,
+                           VK_ACCESS_INDIRECT_COMMAND_READ_BIT);
+
+    // The culler counts the visible instances up from zero
+    for (auto& draw : draws)
+      draw.instanceCount = 0;
+    batcher->upload_buffer(draws.data(), draws_size, targets.draw_template,
+                           VK_PIPELINE_STAGE_TRANSFER_BIT,
+                           VK_ACCESS_TRANSFER_READ_BIT);
+    batcher->upload_buffer(bounds.data(), bounds.size() * sizeof(glm::vec4),
+                           targets.bounds,
+                           VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                           VK_ACCESS_SHADER_READ_BIT);
+
+    vik_log_d("Merged %zu vertices and %zu indices of %zu meshes",
+              vertices.size() / stride, indices.size(), meshes.size());
+  }
+
+  // Center of the bounds and the distance of the farthest vertex
+  static glm::vec4 get_bounding_sphere(const std::vector<float> &vertices,
+                                       uint32_t stride) {
+    const uint32_t position = offsetof(Vertex, pos) / sizeof(float);
+    glm::vec3 min(FLT_MAX);
+    glm::vec3 max(-FLT_MAX);
+    for (uint32_t i = position; i + 2 < vertices.size(); i += stride) {
+      glm::vec3 p(vertices[i], vertices[i + 1], vertices[i + 2]);
+      min = glm::min(min, p);
+      max = glm::max(max, p);
+    }
+
+    glm::vec3 center = (min + max) * 0.5f;
+    float radius = 0.0f;
+    for (uint32_t i = position; i + 2 < vertices.size(); i += stride) {
+      glm::vec3 p(vertices[i], vertices[i + 1], vertices[i + 2]);
+      radius = std::max(radius, glm::distance(center, p));
+    }
+    return glm::vec4(center, radius);
+  }
+
+  static void get_mesh(const Mesh &mesh, const VertexLayout &layout,
+                       std::vector<float> *vertices,
+                       std::vector<uint32_t> *indices) {
+    if (mesh.is_gear) {
+      GearInfo info = mesh.gear_info;
+      std::vector<Vertex> gear_vertices;
+      Gear::build(&info, &gear_vertices, indices);
+      MeshOptimizer::optimize(&gear_vertices, 1,
+                              offsetof(Vertex, pos) / sizeof(float), indices);
+      const float *data = gear_vertices[0].pos;
+      vertices->assign(data, data + gear_vertices.size() * sizeof(Vertex) / sizeof(float));
+      return;
+    }
+
+    Model model;
+    ModelCreateInfo info(mesh.model_scale, 1.0f, 0.0f);
+    vik_log_f_if(!model.loadVertices(mesh.model_path, layout, &info,
+                                     vertices, indices),
+                 "Could not load model %s.", mesh.model_path.c_str());
+
+    // The part indices start at each part's first vertex
+    for (auto& part : model.parts)
+      for (uint32_t i = part.indexBase; i < part.indexBase + part.indexCount; i++)
+        (*indices)[i] += part.vertexBase;
+  }
+};
+}  // namespace vik
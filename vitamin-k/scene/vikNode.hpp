@@ -10,15 +10,19 @@
 
 #pragma once
 
+#include <array>
 #include <vector>
 #include <glm/gtc/matrix_inverse.hpp>
 
 #include "../render/vikModel.hpp"
+#include "../render/vikUploadArena.hpp"
 
+#include "vikBounds.hpp"
 #include "vikMaterial.hpp"
 #include "../system/vikAssets.hpp"
 #include "vikSkyBox.hpp"
 #include "vikCamera.hpp"
+#include "vikFrustum.hpp"
 
 namespace vik {
 class Node {
@@ -37,14 +41,25 @@ class Node {
     Material material;
   } info;
 
-  Buffer uniformBuffer;
+  // Dynamic uniform buffer in the upload arena
+  VkDescriptorBufferInfo uniform_descriptor;
+  uint32_t uniform_offset = 0;
+
+  // In world space, updated with the uniform buffer
+  BoundingSphere world_sphere;
+  AABB world_aabb;
+
+ protected:
+  // In model space, nodes without bounds are never culled
+  AABB local_aabb;
+  bool has_bounds = false;
+
+ public:
 
   Node() {
   }
 
-  virtual ~Node() {
-    uniformBuffer.destroy();
-  }
+  virtual ~Node() {}
 
   void setMateral(const Material& m) {
     info.material = m;
@@ -81,15 +96,15 @@ class Node {
         .dstSet = descriptor_set,
         .dstBinding = 0,
         .descriptorCount = 1,
-        .descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
-        .pBufferInfo = &uniformBuffer.descriptor
+        .descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC,
+        .pBufferInfo = &uniform_descriptor
       },
       (VkWriteDescriptorSet) {
         .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
         .dstSet = descriptor_set,
         .dstBinding = 1,
         .descriptorCount = 1,
-        .descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
+        .descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC,
         .pBufferInfo = lightsDescriptor
       },
       (VkWriteDescriptorSet) {
@@ -97,7 +112,7 @@ class Node {
         .dstSet = descriptor_set,
         .dstBinding = 2,
         .descriptorCount = 1,
-        .descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
+        .descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC,
         .pBufferInfo = cameraDescriptor
       }
     };
@@ -112,7 +127,22 @@ class Node {
                            nullptr);
   }
 
-  void update_uniform_buffer(Camera::StereoView sv, float timer) {
+  // Rewrite the cube map binding after the sky's texture changed
+  void update_sky_descriptor(const VkDevice& device, vik::SkyBox *skyDome) {
+    VkWriteDescriptorSet write =
+        skyDome->get_cube_map_write_descriptor_set(3, descriptor_set);
+    vkUpdateDescriptorSets(device, 1, &write, 0, nullptr);
+  }
+
+  bool is_visible(const PackedStereoFrustum &frusta) {
+    if (!has_bounds)
+      return true;
+    return frusta.intersects_sphere(world_sphere)
+        && frusta.intersects_aabb(world_aabb);
+  }
+
+  void update_uniform_buffer(Camera::StereoView sv, float timer,
+                             UploadArena *arena) {
     ubo.model = glm::mat4();
 
     ubo.model = glm::translate(ubo.model, info.position);
@@ -121,13 +151,50 @@ class Node {
 
     ubo.normal[0] = glm::inverseTranspose(sv.view[0] * ubo.model);
     ubo.normal[1] = glm::inverseTranspose(sv.view[1] * ubo.model);
-    memcpy(uniformBuffer.mapped, &ubo, sizeof(ubo));
+    uniform_offset = arena->push(&ubo, sizeof(ubo));
+
+    update_bounds();
+  }
+
+  void set_local_bounds(const glm::vec3 &min, const glm::vec3 &max) {
+    local_aabb = { min, max };
+    has_bounds = true;
+  }
+
+  void init_uniform_buffer(UploadArena *arena) {
+    uniform_descriptor = arena->get_descriptor(sizeof(ubo));
+  }
+
+  void bind_descriptor_set(VkCommandBuffer command_buffer,
+                           VkPipelineLayout pipeline_layout,
+                           uint32_t lights_offset, uint32_t camera_offset) {
+    // Dynamic offsets are consumed in binding order
+    std::array<uint32_t, 3> offsets = {
+      uniform_offset, lights_offset, camera_offset
+    };
+    vkCmdBindDescriptorSets(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+                            pipeline_layout, 0, 1, &descriptor_set,
+                            offsets.size(), offsets.data());
   }
 
-  void init_uniform_buffer(Device *vulkanDevice) {
-    vulkanDevice->create_and_map(&uniformBuffer, sizeof(ubo));
+  // Called until the node has bounds, for geometry that loads later
+  virtual void init_bounds() {}
+
+  // Model has no scale, the sphere keeps its radius
+  void update_bounds() {
+    if (!has_bounds)
+      init_bounds();
+    if (!has_bounds)
+      return;
+    BoundingSphere sphere = local_aabb.get_sphere();
+    world_sphere.center = glm::vec3(ubo.model * glm::vec4(sphere.center, 1.0f));
+    world_sphere.radius = sphere.radius;
+    world_aabb = local_aabb.transform(ubo.model);
   }
 
-  virtual void draw(VkCommandBuffer cmdbuffer, VkPipelineLayout pipelineLayout) {}
+  // instance_count is 2 when the vertex shader picks the eye by instance
+  virtual void draw(VkCommandBuffer cmdbuffer, VkPipelineLayout pipelineLayout,
+                    uint32_t lights_offset, uint32_t camera_offset,
+                    uint32_t instance_count) {}
 };
 }  // namespace vik
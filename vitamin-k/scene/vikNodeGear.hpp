@@ -28,32 +28,79 @@
 
 #include "vikMaterial.hpp"
 #include "vikGear.hpp"
+#include "vikGearGenerator.hpp"
 #include "vikSkyBox.hpp"
 #include "vikNode.hpp"
+#include "../system/vikAssetLoader.hpp"
 
 namespace vik {
 class NodeGear : public Node {
  private:
-  Gear gear;
+  AssetHandle<Gear> gear;
+  GearInfo gear_info;
 
  public:
-  void generate(Device *vik_device, GearInfo *gear_info, VkQueue queue) {
-    gear.generate(vik_device, gear_info, queue);
+  void generate(AssetLoader *loader, Device *vik_device, GearInfo *gear_info) {
+    set_gear_bounds(*gear_info);
+    this->gear_info = *gear_info;
+    GearInfo info = *gear_info;
+    gear = loader->load<Gear>([vik_device, info](Gear *g) mutable {
+      g->generate(vik_device, &info);
+    });
   }
 
-  void draw(VkCommandBuffer command_buffer, VkPipelineLayout pipeline_layout) {
+  // Generated on the GPU by the next command buffer the generator records
+  void generate(GearGenerator *generator, GearInfo *gear_info) {
+    set_gear_bounds(*gear_info);
+    this->gear_info = *gear_info;
+    auto asset = std::make_shared<Asset<Gear>>();
+    generator->generate(&asset->resource, *gear_info);
+    asset->loaded = true;
+    asset->ready = true;
+    gear = AssetHandle<Gear>(asset);
+  }
+
+  /*
+   * Only for gears from the generator. A new tooth count recreates the
+   * buffers and rewrites the generator's descriptor set, so the caller
+   * waits for the other frames in flight first.
+   */
+  void regenerate(GearGenerator *generator, GearInfo *gear_info) {
+    set_gear_bounds(*gear_info);
+    this->gear_info = *gear_info;
+    generator->generate(gear.get(), *gear_info);
+  }
+
+  const GearInfo& get_gear_info() const {
+    return gear_info;
+  }
+
+  // The teeth reach half their depth past the outer radius
+  void set_gear_bounds(const GearInfo &gear_info) {
+    float radius = gear_info.outer_radius + gear_info.tooth_depth / 2.0f;
+    float half_width = gear_info.width / 2.0f;
+    set_local_bounds(glm::vec3(-radius, -radius, -half_width),
+                     glm::vec3(radius, radius, half_width));
+  }
+
+  void draw(VkCommandBuffer command_buffer, VkPipelineLayout pipeline_layout,
+            uint32_t lights_offset, uint32_t camera_offset,
+            uint32_t instance_count) {
+    if (!gear.is_ready())
+      return;
+
     VkDeviceSize offsets[1] = { 0 };
-    vkCmdBindDescriptorSets(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline_layout, 0, 1, &descriptor_set, 0, NULL);
-    vkCmdBindVertexBuffers(command_buffer, 0, 1, &gear.vertexBuffer.buffer, offsets);
-    vkCmdBindIndexBuffer(command_buffer, gear.indexBuffer.buffer, 0, VK_INDEX_TYPE_UINT32);
+    bind_descriptor_set(command_buffer, pipeline_layout, lights_offset, camera_offset);
+    vkCmdBindVertexBuffers(command_buffer, 0, 1, &gear->vertexBuffer.buffer, offsets);
+    vkCmdBindIndexBuffer(command_buffer, gear->indexBuffer.buffer, 0, gear->indexType);
 
     vkCmdPushConstants(command_buffer,
                        pipeline_layout,
-                       VK_SHADER_STAGE_FRAGMENT_BIT,
+                       VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_GEOMETRY_BIT,
                        sizeof(glm::vec3),
                        sizeof(Material::PushBlock), &info.material);
 
-    vkCmdDrawIndexed(command_buffer, gear.indexCount, 1, 0, 0, 1);
+    vkCmdDrawIndexed(command_buffer, gear->indexCount, instance_count, 0, 0, 1);
   }
 };
 }  // namespace vik
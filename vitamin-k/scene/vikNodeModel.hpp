@@ -13,37 +13,47 @@
 #include <string>
 
 #include "vikNode.hpp"
+#include "../system/vikAssetLoader.hpp"
 
 namespace vik {
 class NodeModel : public Node {
-  Model model;
+  ModelHandle model;
+  float model_scale = 1.0f;
 
  public:
-  ~NodeModel() {
-    model.destroy();
+  void load_model(AssetLoader *loader, const std::string& name,
+                  VertexLayout layout, float scale, Device *device) {
+    std::string path = vik::Assets::get_asset_path() + "models/" + name;
+    model_scale = scale;
+    model = loader->load<Model>([path, layout, scale, device](Model *m) {
+      m->loadFromFile(path, layout, scale, device);
+    });
   }
 
-  void load_model(const std::string& name, VertexLayout layout,
-                 float scale,  Device *device, VkQueue queue) {
-    model.loadFromFile(vik::Assets::get_asset_path() + "models/" + name,
-                       layout,
-                       scale,
-                       device,
-                       queue);
+  // The dimensions are from the file, before scaling and flipping y
+  void init_bounds() {
+    if (!model.is_ready())
+      return;
+    const Model::Dimension &dim = model->dim;
+    glm::vec3 min(dim.min.x, -dim.max.y, dim.min.z);
+    glm::vec3 max(dim.max.x, -dim.min.y, dim.max.z);
+    set_local_bounds(min * model_scale, max * model_scale);
   }
 
-  void draw(VkCommandBuffer command_buffer, VkPipelineLayout pipeline_layout) {
-    vkCmdBindDescriptorSets(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
-                            pipeline_layout, 0, 1, &descriptor_set, 0, nullptr);
-    VkDeviceSize offsets[1] = { 0 };
-    vkCmdBindVertexBuffers(command_buffer, 0, 1, &model.vertices.buffer, offsets);
-    vkCmdBindIndexBuffer(command_buffer, model.indices.buffer, 0, VK_INDEX_TYPE_UINT32);
+  void draw(VkCommandBuffer command_buffer, VkPipelineLayout pipeline_layout,
+            uint32_t lights_offset, uint32_t camera_offset,
+            uint32_t instance_count) {
+    // Nothing to draw until the model is resident
+    if (!model.is_ready())
+      return;
+
+    bind_descriptor_set(command_buffer, pipeline_layout, lights_offset, camera_offset);
     vkCmdPushConstants(command_buffer,
                        pipeline_layout,
-                       VK_SHADER_STAGE_FRAGMENT_BIT,
+                       VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_GEOMETRY_BIT,
                        sizeof(glm::vec3),
                        sizeof(Material::PushBlock), &info.material);
-    vkCmdDrawIndexed(command_buffer, model.indexCount, 1, 0, 0, 0);
+    model->draw(command_buffer, 0, instance_count);
   }
 };
 }  // namespace vik
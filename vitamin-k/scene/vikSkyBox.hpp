@@ -10,6 +10,7 @@
 
 #pragma once
 
+#include <array>
 #include <vector>
 #include <string>
 
@@ -17,36 +18,68 @@
 #include "../render/vikModel.hpp"
 
 #include "../system/vikAssets.hpp"
+#include "../system/vikAssetLoader.hpp"
 #include "../render/vikShader.hpp"
+#include "../render/vikGpuProfiler.hpp"
+#include "../render/vikPipelineBuilder.hpp"
 
 namespace vik {
 class SkyBox {
  private:
-  TextureCubeMap cube_map;
+  CubeMapHandle cube_map;
+  // Sampled until the cube map is loaded
+  TextureCubeMap placeholder;
+  bool cube_map_bound = false;
   VkDescriptorSet descriptor_set;
   VkDevice device;
   VkDescriptorImageInfo texture_descriptor;
-  Model model;
-  VkPipeline pipeline;
+  ModelHandle model;
+  VkPipeline pipeline = VK_NULL_HANDLE;
+  std::shared_future<VkPipeline> pipeline_future;
+
+  GpuProfiler *profiler = nullptr;
+  uint32_t profiler_scope = 0;
 
  public:
   explicit SkyBox(VkDevice device) : device(device) {}
 
   ~SkyBox() {
-    cube_map.destroy();
-    model.destroy();
+    placeholder.destroy();
     vkDestroyPipeline(device, pipeline, nullptr);
   }
 
-  void init_texture_descriptor() {
+  // The scope is reset by the owner of the render pass the sky is drawn in
+  void set_profiler(GpuProfiler *p, uint32_t scope) {
+    profiler = p;
+    profiler_scope = scope;
+  }
+
+  void init_texture_descriptor(const TextureCubeMap &texture) {
     // Image descriptor for the cube map texture
     texture_descriptor = {
-      .sampler = cube_map.sampler,
-      .imageView = cube_map.view,
-      .imageLayout = cube_map.imageLayout
+      .sampler = texture.sampler,
+      .imageView = texture.view,
+      .imageLayout = texture.imageLayout
     };
   }
 
+  // The cube map is loaded, but the descriptors still use the placeholder
+  bool has_pending_cube_map() {
+    return !cube_map_bound && cube_map.is_ready();
+  }
+
+  /*
+   * Switch the descriptors to the loaded cube map. The owner has to make
+   * sure no frame using them is in flight, and rewrite the descriptor
+   * sets of the nodes reflecting the sky.
+   */
+  void bind_cube_map() {
+    init_texture_descriptor(*cube_map.get());
+    VkWriteDescriptorSet write = get_cube_map_write_descriptor_set(3, descriptor_set);
+    vkUpdateDescriptorSets(device, 1, &write, 0, nullptr);
+    cube_map_bound = true;
+  }
+
   VkWriteDescriptorSet
   get_cube_map_write_descriptor_set(unsigned binding, VkDescriptorSet ds) {
     return  (VkWriteDescriptorSet) {
@@ -59,12 +92,20 @@ class SkyBox {
     };
   }
 
-  void load_assets(VertexLayout vertexLayout, Device *vik_device, VkQueue queue,
-                   const std::string& file_name, VkFormat format) {
-    model.loadFromFile(vik::Assets::get_asset_path() + "models/cube.obj",
-                       vertexLayout, 10.0f, vik_device, queue);
-    cube_map.loadFromFile(file_name, format, vik_device, queue);
-    init_texture_descriptor();
+  void load_assets(AssetLoader *loader, VertexLayout vertexLayout,
+                   Device *vik_device, const std::string& file_name,
+                   VkFormat format) {
+    std::string model_path = vik::Assets::get_asset_path() + "models/cube.obj";
+    model = loader->load<Model>([model_path, vertexLayout, vik_device](Model *m) {
+      m->loadFromFile(model_path, vertexLayout, 10.0f, vik_device);
+    });
+    cube_map = loader->load<TextureCubeMap>([file_name, format, vik_device](TextureCubeMap *t) {
+      t->loadFromFile(file_name, format, vik_device);
+    });
+
+    // A grey sky is reflected until the cube map is resident
+    placeholder.fromColor(0xff808080, vik_device);
+    init_texture_descriptor(placeholder);
   }
 
   void create_descriptor_set(const VkDescriptorSetAllocateInfo& allocInfo,
@@ -77,7 +118,7 @@ class SkyBox {
         .dstSet = descriptor_set,
         .dstBinding = 2,
         .descriptorCount = 1,
-        .descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
+        .descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC,
         .pBufferInfo = cameraDescriptor
       },
       get_cube_map_write_descriptor_set(3, descriptor_set)
@@ -89,21 +130,33 @@ class SkyBox {
                            nullptr);
   }
 
-  void draw(VkCommandBuffer cmdbuffer, VkPipelineLayout pipelineLayout) {
-    VkDeviceSize offsets[1] = { 0 };
+  void draw(VkCommandBuffer cmdbuffer, VkPipelineLayout pipelineLayout,
+            uint32_t camera_offset) {
+    // The clear color is the background until the sky is loaded
+    if (!cube_map_bound || !model.is_ready())
+      return;
 
-    vkCmdBindDescriptorSets(cmdbuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
-                            pipelineLayout, 0, 1, &descriptor_set, 0, nullptr);
-    vkCmdBindVertexBuffers(cmdbuffer, 0, 1, &model.vertices.buffer, offsets);
-    vkCmdBindIndexBuffer(cmdbuffer, model.indices.buffer, 0, VK_INDEX_TYPE_UINT32);
+    // The layout has dynamic node, lights and camera buffers,
+    // the sky only reads the camera
+    std::array<uint32_t, 3> dynamic_offsets = { 0, 0, camera_offset };
 
+    vkCmdBindDescriptorSets(cmdbuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+                            pipelineLayout, 0, 1, &descriptor_set,
+                            dynamic_offsets.size(), dynamic_offsets.data());
     vkCmdBindPipeline(cmdbuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline);
 
-    vkCmdDrawIndexed(cmdbuffer, model.indexCount, 1, 0, 0, 0);
+    if (profiler)
+      profiler->begin(cmdbuffer, profiler->current_pool, profiler_scope);
+
+    model->draw(cmdbuffer);
+
+    if (profiler)
+      profiler->end(cmdbuffer, profiler->current_pool, profiler_scope);
   }
 
+  // With multiview the vertex shader projects for each view
   void init_pipeline(VkGraphicsPipelineCreateInfo* pipeline_info,
-                     const VkPipelineCache& pipeline_cache) {
+                     PipelineBuilder *pipeline_builder, bool multiview) {
     VkPipelineRasterizationStateCreateInfo rasterization_state = {
       .sType = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO,
       .depthClampEnable = VK_FALSE,
@@ -116,20 +169,23 @@ class SkyBox {
     // Skybox pipeline (background cube)
     std::array<VkPipelineShaderStageCreateInfo, 3> shader_stages;
 
-    shader_stages[0] = vik::Shader::load(device, "xrgears/sky.vert.spv", VK_SHADER_STAGE_VERTEX_BIT);
+    if (multiview)
+      shader_stages[0] = vik::Shader::load(device, "xrgears/sky_multiview.vert.spv", VK_SHADER_STAGE_VERTEX_BIT);
+    else
+      shader_stages[0] = vik::Shader::load(device, "xrgears/sky.vert.spv", VK_SHADER_STAGE_VERTEX_BIT);
     shader_stages[1] = vik::Shader::load(device, "xrgears/sky.frag.spv", VK_SHADER_STAGE_FRAGMENT_BIT);
-    shader_stages[2] = vik::Shader::load(device, "xrgears/sky.geom.spv", VK_SHADER_STAGE_GEOMETRY_BIT);
+    if (!multiview)
+      shader_stages[2] = vik::Shader::load(device, "xrgears/sky.geom.spv", VK_SHADER_STAGE_GEOMETRY_BIT);
 
-    pipeline_info->stageCount = shader_stages.size();
+    pipeline_info->stageCount = multiview ? 2 : 3;
     pipeline_info->pStages = shader_stages.data();
     pipeline_info->pRasterizationState = &rasterization_state;
 
-    vik_log_check(vkCreateGraphicsPipelines(device, pipeline_cache, 1,
-                                            pipeline_info, nullptr, &pipeline));
+    pipeline_future = pipeline_builder->build(*pipeline_info);
+  }
 
-    vkDestroyShaderModule(device, shader_stages[0].module, nullptr);
-    vkDestroyShaderModule(device, shader_stages[1].module, nullptr);
-    vkDestroyShaderModule(device, shader_stages[2].module, nullptr);
+  void wait_for_pipeline() {
+    pipeline = pipeline_future.get();
   }
 };
 }  // namespace vik
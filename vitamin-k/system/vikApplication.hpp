@@ -21,6 +21,8 @@
 #include <vector>
 
 #include "vikSettings.hpp"
+#include "vikBenchmark.hpp"
+#include "vikTrace.hpp"
 
 #include "../window/vikWindowXCB.hpp"
 #include "../window/vikWindowWaylandXDG.hpp"
@@ -32,6 +34,7 @@
 
 #include "../window/vikWindowDirectMode.hpp"
 #include "../window/vikWindowDirectWayland.hpp"
+#include "../window/vikWindowHeadless.hpp"
 
 #include "../render/vikTools.hpp"
 #include "../scene/vikCamera.hpp"
@@ -51,6 +54,7 @@ namespace vik {
 class Application {
  public:
   Settings settings;
+  Benchmark benchmark;
   Window *window;
   bool quit = false;
 
@@ -66,6 +70,8 @@ class Application {
     if (!settings.parse_args(argc, argv))
       vik_log_f("Invalid arguments.");
 
+    Trace::get().init(settings.trace_path);
+
     if (settings.list_hmds_and_exit) {
        HMD::enumerate_hmds();
        exit(0);
@@ -76,6 +82,12 @@ class Application {
     else
       renderer = new Renderer(&settings);
 
+    benchmark.init(&settings);
+    if (benchmark.enabled) {
+      settings.frame_count = benchmark.get_total_frames();
+      renderer->timer.fixed_timestep_seconds = settings.frame_budget_ms / 1000.0;
+    }
+
     init_window();
 
     auto set_window_resize_cb = [this]() { resize(); };
@@ -90,6 +102,8 @@ class Application {
     renderer->set_frame_start_cb(frame_start_cb);
 
     auto frame_end_cb = [this](float frame_time) {
+      if (benchmark.enabled)
+        record_benchmark_frame();
       update_camera(frame_time);
     };
     renderer->set_frame_end_cb(frame_end_cb);
@@ -135,6 +149,14 @@ class Application {
             ((RendererTextOverlay*)renderer)->text_overlay->visible =
               !((RendererTextOverlay*)renderer)->text_overlay->visible;
           break;
+        case Input::Key::F2:
+          if (state)
+            Trace::get().dump();
+          break;
+        case Input::Key::F3:
+          if (state)
+            renderer->vik_device->allocator.print_stats();
+          break;
         case Input::Key::ESCAPE:
           quit = true;
           break;
@@ -181,6 +203,9 @@ class Application {
       case Settings::DIRECT_WAYLAND:
         window = new WindowDirectWayland(&settings);
         return set_and_init_window();
+      case Settings::HEADLESS:
+        window = new WindowHeadless(&settings);
+        return set_and_init_window();
       default:
         vik_log_f("Usupported Window Type %d", settings.window_type);
         return -1;
@@ -236,12 +261,39 @@ class Application {
   }
 
   void loop() {
-    while (!quit)
+    uint32_t frames = 0;
+    while (!quit) {
       renderer->render();
+      if (settings.frame_count > 0 && ++frames >= settings.frame_count)
+        quit = true;
+    }
     renderer->wait_idle();
+    renderer->timer.print_histogram();
+    renderer->vik_device->allocator.print_stats();
+    Trace::get().dump();
+
+    if (benchmark.enabled)
+      benchmark.write_report(name, renderer->device_properties.deviceName,
+                             &settings);
+  }
+
+  void record_benchmark_frame() {
+    Benchmark::Sample sample = {
+      .frame_ms = (float) renderer->timer.measured_frame_ms,
+      .cpu_frame_ms = (float) renderer->timer.cpu_frame_ms,
+      .prepare_ms = (float) renderer->cpu_timings.prepare_ms,
+      .record_ms = (float) renderer->cpu_timings.record_ms,
+      .submit_ms = (float) renderer->cpu_timings.submit_ms
+    };
+    benchmark.record(sample);
   }
 
   void update_camera(float frame_time) {
+    if (benchmark.enabled) {
+      benchmark.update_camera(camera);
+      return;
+    }
+
     camera->update_movement(frame_time);
     if (camera->moving())
       view_updated = true;
@@ -0,0 +1,222 @@
+/*
+ * vitamin-k
+ *
+ * Copyright 2017-2018 Collabora Ltd.
+ *
+ * Authors: Lubosz Sarnecki <lubosz.sarnecki@collabora.com>
+ * SPDX-License-Identifier: MIT
+ */
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "../render/vikDevice.hpp"
+#include "../render/vikModel.hpp"
+#include "../render/vikTexture.hpp"
+#include "vikLog.hpp"
+#include "vikTrace.hpp"
+
+namespace vik {
+
+// Progress of an asset, shared by the loader and the asset's handles
+struct AssetState {
+  // The worker created the resource and recorded its uploads
+  std::atomic<bool> loaded { false };
+  // The uploads completed, set on the render thread between frames
+  std::atomic<bool> ready { false };
+  uint64_t upload_ticket = 0;
+
+  virtual ~AssetState() {}
+};
+
+template <typename T>
+struct Asset : public AssetState {
+  T resource;
+
+  ~Asset() {
+    if (loaded)
+      resource.destroy();
+  }
+};
+
+// Reference to an asset that may still be loading
+template <typename T>
+class AssetHandle {
+  std::shared_ptr<Asset<T>> asset;
+
+ public:
+  AssetHandle() {}
+  explicit AssetHandle(const std::shared_ptr<Asset<T>> &a) : asset(a) {}
+
+  // The resource is resident and can be drawn
+  bool is_ready() const {
+    return asset && asset->ready;
+  }
+
+  T* get() const {
+    return &asset->resource;
+  }
+
+  T* operator->() const {
+    return get();
+  }
+};
+
+typedef AssetHandle<Model> ModelHandle;
+typedef AssetHandle<Texture2D> TextureHandle;
+typedef AssetHandle<TextureCubeMap> CubeMapHandle;
+
+/*
+ * Loads assets on a pool of worker threads.
+ *
+ * A worker does the file I/O, parsing and vertex conversion of an asset,
+ * creates its resources and records their uploads with the device's upload
+ * batcher. The render thread submits the uploads at the start of the next
+ * frame, and update() marks an asset ready once they have completed, so a
+ * handle never becomes ready in the middle of recording a frame.
+ *
+ * Loaders run on the workers have to upload through the batcher and must
+ * not submit to a queue themselves.
+ *
+ * Without worker threads, assets are loaded and uploaded in load().
+ */
+class AssetLoader {
+  struct Job {
+    std::shared_ptr<AssetState> asset;
+    std::function<void()> load;
+  };
+
+  Device *device = nullptr;
+
+  std::vector<std::thread> workers;
+  std::deque<Job> jobs;
+  // Assets that are not ready yet
+  std::vector<std::shared_ptr<AssetState>> pending;
+  std::mutex mutex;
+  std::condition_variable jobs_available;
+  bool stopping = false;
+
+ public:
+  ~AssetLoader() {
+    destroy();
+  }
+
+  void init(Device *d, uint32_t thread_count) {
+    device = d;
+
+    for (uint32_t i = 0; i < thread_count; i++)
+      workers.push_back(std::thread([this]() { work(); }));
+
+    if (thread_count > 0)
+      vik_log_d("Loading assets on %d threads.", thread_count);
+  }
+
+  /*
+   * Drops the jobs that have not started and waits for the uploads of the
+   * ones that have, so their resources can be destroyed.
+   */
+  void destroy() {
+    if (device == nullptr)
+      return;
+
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+      jobs.clear();
+    }
+    jobs_available.notify_all();
+
+    for (auto& worker : workers)
+      worker.join();
+    workers.clear();
+
+    device->upload_batcher.wait_idle();
+    pending.clear();
+    device = nullptr;
+  }
+
+  // Returns a handle right away, load_func fills in the resource
+  template <typename T>
+  AssetHandle<T> load(std::function<void(T*)> load_func) {
+    std::shared_ptr<Asset<T>> asset = std::make_shared<Asset<T>>();
+
+    Job job = {
+      .asset = asset,
+      .load = [asset, load_func]() { load_func(&asset->resource); }
+    };
+
+    if (workers.empty()) {
+      run(&job);
+      device->upload_batcher.wait(device->upload_batcher.flush());
+      asset->ready = true;
+      return AssetHandle<T>(asset);
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      vik_log_f_if(stopping, "Asset loader was already destroyed.");
+      jobs.push_back(job);
+      pending.push_back(asset);
+    }
+    jobs_available.notify_one();
+
+    return AssetHandle<T>(asset);
+  }
+
+  // Mark assets with completed uploads as ready, call between frames
+  void update() {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    auto it = pending.begin();
+    while (it != pending.end()) {
+      AssetState *asset = it->get();
+      if (asset->loaded
+          && device->upload_batcher.is_complete(asset->upload_ticket)) {
+        asset->ready = true;
+        it = pending.erase(it);
+      } else {
+        ++it;
+      }
+    }
+  }
+
+  bool is_idle() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return pending.empty();
+  }
+
+ private:
+  void run(Job *job) {
+    vik_trace_zone("load_asset");
+    job->load();
+    // The uploads are in this batch or in one submitted before it
+    job->asset->upload_ticket = device->upload_batcher.get_ticket();
+    job->asset->loaded = true;
+  }
+
+  void work() {
+    while (true) {
+      Job job;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        jobs_available.wait(lock, [this]() {
+          return stopping || !jobs.empty();
+        });
+        if (jobs.empty())
+          return;
+        job = std::move(jobs.front());
+        jobs.pop_front();
+      }
+      run(&job);
+    }
+  }
+};
+}  // namespace vik
@@ -0,0 +1,240 @@
+/*
+ * vitamin-k
+ *
+ * Copyright 2017-2018 Collabora Ltd.
+ *
+ * Authors: Lubosz Sarnecki <lubosz.sarnecki@collabora.com>
+ * SPDX-License-Identifier: MIT
+ */
+
+#pragma once
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <string>
+
+#include "vikAssets.hpp"
+#include "vikLog.hpp"
+
+namespace vik {
+
+/*
+ * Layout of a cooked asset pack, as written by vik-cook.
+ *
+ * The file starts with a PackHeader, followed by the data of the entries
+ * and the index table of PackEntry structs at index_offset. Every offset
+ * is relative to the start of the file and aligned to PACK_ALIGNMENT, so
+ * the data can be read in place from a mapping of the file.
+ */
+static const char PACK_MAGIC[4] = { 'V', 'I', 'K', 'P' };
+static const uint32_t PACK_VERSION = 3;
+static const uint64_t PACK_ALIGNMENT = 16;
+static const uint32_t PACK_MAX_COMPONENTS = 8;
+
+enum PackEntryType {
+  PACK_ENTRY_MODEL = 1,
+  PACK_ENTRY_CUBE_MAP = 2
+};
+
+struct PackHeader {
+  char magic[4];
+  uint32_t version;
+  uint32_t entry_count;
+  uint32_t reserved;
+  uint64_t index_offset;
+};
+
+struct PackEntry {
+  // Path relative to the asset directory
+  char name[128];
+  uint32_t type;
+  uint32_t reserved;
+  // Size and modification time of the source file it was cooked from
+  uint64_t source_size;
+  int64_t source_mtime;
+  // Position of the PackModel or PackTexture
+  uint64_t offset;
+  uint64_t size;
+};
+
+// Vertex and index data converted and optimized for one vertex layout and scale
+struct PackModel {
+  uint32_t import_flags;
+  uint32_t component_count;
+  uint32_t components[PACK_MAX_COMPONENTS];
+  float scale[3];
+  float uvscale[2];
+  float center[3];
+
+  float dim_min[3];
+  float dim_max[3];
+
+  uint32_t vertex_count;
+  uint32_t index_count;
+  uint32_t part_count;
+  // VkIndexType of the index data, indices are relative to their part
+  uint32_t index_type;
+
+  uint64_t vertex_offset;
+  uint64_t vertex_size;
+  uint64_t index_offset;
+  uint64_t index_size;
+  // PackModelPart[part_count]
+  uint64_t parts_offset;
+};
+
+struct PackModelPart {
+  uint32_t vertex_base;
+  uint32_t vertex_count;
+  uint32_t index_base;
+  uint32_t index_count;
+};
+
+// All faces and mip levels, in the order they are copied to the image
+struct PackTexture {
+  uint32_t width;
+  uint32_t height;
+  uint32_t levels;
+  uint32_t layers;
+  uint32_t region_count;
+  // VkFormat of the data, gli formats use the same values
+  uint32_t format;
+
+  uint64_t data_offset;
+  uint64_t data_size;
+  // PackRegion[region_count]
+  uint64_t regions_offset;
+};
+
+struct PackRegion {
+  // Relative to the texture's data
+  uint64_t offset;
+  uint64_t size;
+  uint32_t layer;
+  uint32_t level;
+  uint32_t width;
+  uint32_t height;
+};
+
+/*
+ * Read only mapping of the asset pack.
+ *
+ * Loaders look up their source path in the pack and upload straight from
+ * the mapping. Entries whose source file changed since cooking are
+ * skipped, so loaders fall back to parsing the source.
+ */
+class AssetPack {
+  void *mapping = MAP_FAILED;
+  uint64_t size = 0;
+  const PackHeader *header = nullptr;
+  const PackEntry *entries = nullptr;
+
+ public:
+  static AssetPack& get() {
+    static AssetPack pack(Assets::get_asset_path() + "assets.pack");
+    return pack;
+  }
+
+  explicit AssetPack(const std::string &path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+      return;
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && (uint64_t) st.st_size >= sizeof(PackHeader)) {
+      size = st.st_size;
+      mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+
+    if (mapping == MAP_FAILED) {
+      vik_log_w("Could not map asset pack %s.", path.c_str());
+      return;
+    }
+
+    const PackHeader *h = get<PackHeader>(0);
+    if (memcmp(h->magic, PACK_MAGIC, sizeof(PACK_MAGIC)) != 0
+        || h->version != PACK_VERSION
+        || !contains(h->index_offset, h->entry_count * sizeof(PackEntry))) {
+      vik_log_w("Ignoring invalid asset pack %s.", path.c_str());
+      return;
+    }
+
+    header = h;
+    entries = get<PackEntry>(header->index_offset);
+    vik_log_i("Mapped asset pack %s with %d entries.",
+              path.c_str(), header->entry_count);
+  }
+
+  ~AssetPack() {
+    if (mapping != MAP_FAILED)
+      munmap(mapping, size);
+  }
+
+  bool is_open() {
+    return header != nullptr;
+  }
+
+  // Key of a source file in the pack
+  static std::string get_name(const std::string &path) {
+    const std::string asset_path = Assets::get_asset_path();
+    if (path.compare(0, asset_path.size(), asset_path) == 0)
+      return path.substr(asset_path.size());
+    return path;
+  }
+
+  /*
+   * Next entry of the given type cooked from path, after the entry
+   * previous. Models can be cooked several times with different layouts.
+   */
+  const PackEntry* find(const std::string &path, uint32_t type,
+                        const PackEntry *previous = nullptr) {
+    if (!is_open())
+      return nullptr;
+
+    std::string name = get_name(path);
+    uint32_t first = previous ? (previous - entries) + 1 : 0;
+
+    for (uint32_t i = first; i < header->entry_count; i++) {
+      const PackEntry *entry = &entries[i];
+      if (entry->type != type
+          || strncmp(entry->name, name.c_str(), sizeof(entry->name)) != 0)
+        continue;
+      if (!contains(entry->offset, entry->size)) {
+        vik_log_w("Asset pack entry %s is out of bounds.", name.c_str());
+        continue;
+      }
+      if (!is_current(entry, path)) {
+        vik_log_w("%s changed since it was cooked.", name.c_str());
+        continue;
+      }
+      return entry;
+    }
+    return nullptr;
+  }
+
+  // Pointer into the mapping, offsets are checked by find()
+  template <typename T>
+  const T* get(uint64_t offset) {
+    return reinterpret_cast<const T*>((const uint8_t *) mapping + offset);
+  }
+
+  bool contains(uint64_t offset, uint64_t length) {
+    return offset <= size && length <= size - offset;
+  }
+
+ private:
+  // The source does not have to be shipped next to the pack
+  bool is_current(const PackEntry *entry, const std::string &path) {
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0)
+      return true;
+    return (uint64_t) st.st_size == entry->source_size
+        && (int64_t) st.st_mtime == entry->source_mtime;
+  }
+};
+}  // namespace vik
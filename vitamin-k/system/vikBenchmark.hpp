@@ -0,0 +1,220 @@
+/*
+ * vitamin-k
+ *
+ * Copyright 2017-2018 Collabora Ltd.
+ *
+ * Authors: Lubosz Sarnecki <lubosz.sarnecki@collabora.com>
+ * SPDX-License-Identifier: MIT
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "vikSettings.hpp"
+#include "vikLog.hpp"
+#include "../scene/vikCamera.hpp"
+
+namespace vik {
+
+/*
+ * Repeatable benchmark runs.
+ *
+ * The animation advances with a fixed timestep and the camera follows a
+ * scripted path, so every run renders the same frames. After the warm up
+ * the frame time, the CPU frame time and the CPU time of the frame phases
+ * are collected, and written as JSON report once the run is finished.
+ */
+class Benchmark {
+ public:
+  struct Sample {
+    float frame_ms;
+    // Without pacing sleep and swap chain blocking
+    float cpu_frame_ms;
+    float prepare_ms;
+    float record_ms;
+    float submit_ms;
+  };
+
+  bool enabled = false;
+
+  uint32_t warmup_frames = 0;
+  uint32_t measured_frames = 0;
+  uint32_t frame = 0;
+
+  std::string report_path;
+
+  // Length of one sweep of the scripted camera
+  uint32_t camera_period_frames = 600;
+
+ private:
+  std::vector<Sample> samples;
+
+  glm::vec3 start_position;
+  glm::vec3 start_rotation;
+  bool has_start = false;
+
+ public:
+  void init(Settings *settings) {
+    if (settings->benchmark_frames == 0)
+      return;
+
+    enabled = true;
+    warmup_frames = settings->benchmark_warmup;
+    measured_frames = settings->benchmark_frames;
+    report_path = settings->benchmark_report;
+    samples.reserve(measured_frames);
+
+    vik_log_i("Benchmark: %d warm up and %d measured frames.",
+              warmup_frames, measured_frames);
+  }
+
+  uint32_t get_total_frames() {
+    return warmup_frames + measured_frames;
+  }
+
+  // Yaw back and forth while strafing, relative to the initial view
+  void update_camera(Camera *camera) {
+    if (!has_start) {
+      start_position = camera->position;
+      start_rotation = camera->rotation;
+      has_start = true;
+    }
+
+    float phase = 2.0f * M_PI * (frame % camera_period_frames)
+        / camera_period_frames;
+
+    camera->set_rotation(start_rotation + glm::vec3(0.0f, 20.0f * sin(phase), 0.0f));
+    camera->set_position(start_position + glm::vec3(2.0f * sin(phase), 0.0f, 0.0f));
+  }
+
+  void record(const Sample &sample) {
+    if (frame >= warmup_frames)
+      samples.push_back(sample);
+    frame++;
+  }
+
+  void write_report(const std::string &name, const std::string &device_name,
+                    Settings *settings) {
+    std::ofstream report(report_path);
+    if (!report.is_open()) {
+      vik_log_e("Could not write benchmark report to %s.", report_path.c_str());
+      return;
+    }
+
+    uint32_t missed = 0;
+    for (auto sample : samples)
+      if (sample.cpu_frame_ms > settings->frame_budget_ms)
+        missed++;
+
+    report << "{\n"
+           << "  \"application\": " << json_string(name) << ",\n"
+           << "  \"device\": " << json_string(device_name) << ",\n"
+           << "  \"settings\": {\n"
+           << "    \"width\": " << settings->size.first << ",\n"
+           << "    \"height\": " << settings->size.second << ",\n"
+           << "    \"window\": " << settings->window_type << ",\n"
+           << "    \"present_mode\": "
+           << json_string(Log::present_mode_string(settings->present_mode)) << ",\n"
+           << "    \"color_format\": "
+           << json_string(Log::color_format_string(settings->color_format)) << ",\n"
+           << "    \"frames_in_flight\": " << settings->frames_in_flight << ",\n"
+           << "    \"distortion\": " << settings->distortion_type << ",\n"
+           << "    \"text_overlay\": " << bool_string(settings->enable_text_overlay) << ",\n"
+           << "    \"pacing\": " << bool_string(settings->pacing) << ",\n"
+           << "    \"late_latch\": " << bool_string(settings->late_latch) << ",\n"
+           << "    \"timestep_ms\": " << settings->frame_budget_ms << "\n"
+           << "  },\n"
+           << "  \"warmup_frames\": " << warmup_frames << ",\n"
+           << "  \"frames\": " << samples.size() << ",\n"
+           << "  \"frame_budget_ms\": " << settings->frame_budget_ms << ",\n"
+           << "  \"missed_budget\": " << missed << ",\n"
+           << "  \"frame_time_ms\": ";
+    write_distribution(&report, &Sample::frame_ms);
+    report << ",\n  \"cpu_frame_time_ms\": ";
+    write_distribution(&report, &Sample::cpu_frame_ms);
+    report << ",\n  \"cpu_phases_ms\": {\n"
+           << "    \"prepare\": ";
+    write_distribution(&report, &Sample::prepare_ms);
+    report << ",\n    \"record\": ";
+    write_distribution(&report, &Sample::record_ms);
+    report << ",\n    \"submit\": ";
+    write_distribution(&report, &Sample::submit_ms);
+    report << "\n  }\n}\n";
+
+    vik_log_i("Wrote benchmark report to %s.", report_path.c_str());
+  }
+
+ private:
+  static const char* bool_string(bool b) {
+    return b ? "true" : "false";
+  }
+
+  // Quoted, with quotes, backslashes and control characters escaped
+  static std::string json_string(const std::string &s) {
+    std::string out = "\"";
+    for (char c : s) {
+      switch (c) {
+        case '"':
+          out += "\\\"";
+          break;
+        case '\\':
+          out += "\\\\";
+          break;
+        case '\n':
+          out += "\\n";
+          break;
+        case '\t':
+          out += "\\t";
+          break;
+        default:
+          if ((unsigned char) c < 0x20) {
+            char escaped[7];
+            snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+            out += escaped;
+          } else {
+            out += c;
+          }
+          break;
+      }
+    }
+    return out + "\"";
+  }
+
+  void write_distribution(std::ofstream *out, float Sample::*field) {
+    std::vector<float> values;
+    values.reserve(samples.size());
+    for (auto sample : samples)
+      values.push_back(sample.*field);
+    std::sort(values.begin(), values.end());
+
+    double sum = 0.0;
+    for (auto value : values)
+      sum += value;
+
+    *out << "{ "
+         << "\"mean\": " << (values.empty() ? 0.0 : sum / values.size()) << ", "
+         << "\"min\": " << percentile(values, 0.0) << ", "
+         << "\"p50\": " << percentile(values, 50.0) << ", "
+         << "\"p90\": " << percentile(values, 90.0) << ", "
+         << "\"p99\": " << percentile(values, 99.0) << ", "
+         << "\"p99.9\": " << percentile(values, 99.9) << ", "
+         << "\"max\": " << percentile(values, 100.0)
+         << " }";
+  }
+
+  static float percentile(const std::vector<float> &sorted, double p) {
+    if (sorted.empty())
+      return 0.0f;
+    size_t index = std::ceil(p / 100.0 * sorted.size());
+    if (index > 0)
+      index--;
+    return sorted[std::min(index, sorted.size() - 1)];
+  }
+};
+}  // namespace vik
@@ -12,6 +12,7 @@
 #include <stdint.h>
 #include <getopt.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include <string>
@@ -32,6 +33,7 @@ class Settings {
     WAYLAND_SHELL,
     DIRECT_MODE,
     DIRECT_WAYLAND,
+    HEADLESS,
     INVALID
   };
 
@@ -78,6 +80,40 @@ class Settings {
   enum DistortionType distortion_type = DISTORTION_TYPE_PANOTOOLS;
 
   bool enable_text_overlay = true;
+  bool late_latch = true;
+  bool pacing = false;
+
+  uint32_t frames_in_flight = 2;
+  // Threads recording the scene into secondary command buffers, 0 records inline
+  uint32_t record_threads = 0;
+  // Threads loading assets while the first frames render, 0 loads at init
+  uint32_t load_threads = 2;
+  // Quit after rendering this many frames, 0 runs until quit
+  uint32_t frame_count = 0;
+  // Refresh period frame times are checked against, 90 Hz HMDs by default
+  double frame_budget_ms = 1000.0 / 90.0;
+
+  std::string gpu_profile_csv;
+  std::string trace_path;
+
+  uint32_t benchmark_frames = 0;
+  uint32_t benchmark_warmup = 60;
+  std::string benchmark_report = "benchmark.json";
+
+  // Generate the gears in a compute shader instead of on the CPU
+  bool gpu_gears = false;
+  // Time CPU against GPU gear generation N times and quit, 0 disables
+  uint32_t gear_benchmark = 0;
+  // Draw this many instanced gears instead of the nodes, 0 disables
+  uint32_t gear_instances = 0;
+  // Draw the scene from merged buffers with indirect draws
+  bool merged_draws = false;
+  // Skip drawing what is outside of both eye frusta
+  bool culling = true;
+  // Render both eyes with VK_KHR_multiview when rendering offscreen
+  bool multiview = true;
+  // Without multiview, pick the eye's viewport in the vertex shader
+  bool stereo_instancing = true;
 
   std::pair<uint32_t, uint32_t> size = {1280, 720};
 
@@ -91,11 +127,16 @@ class Settings {
         "  -d, --display D          Display to fullscreen on. (default: 0)\n"
         "  -m, --mode M             Mode for fullscreen (used in wayland-shell only) (default: 0)\n"
         "  -w, --window WS          Window system to use (default: auto)\n"
-        "                           [xcb, wayland, wayland-shell, kms, direct]\n"
+        "                           [xcb, wayland, wayland-shell, kms, direct, headless]\n"
         "  -g, --gpu GPU            GPU to use (default: 0)\n"
         "      --hmd HMD            HMD to use (default: 0)\n"
         "      --format F           Color format to use (default: VK_FORMAT_B8G8R8A8_UNORM)\n"
         "      --presentmode M      Present mode to use (default: VK_PRESENT_MODE_FIFO_KHR)\n"
+        "      --frames-in-flight N Frames the CPU may record ahead of the GPU (default: 2)\n"
+        "      --record-threads N   Record the scene on N threads (default: 0, inline)\n"
+        "      --load-threads N     Load assets on N threads (default: 2, 0 blocks at start)\n"
+        "      --frames N           Quit after rendering N frames (default: 0, unlimited)\n"
+        "      --frame-budget MS    CPU frame time to count missed frames against (default: 11.11)\n"
         "\n"
         "      --list-gpus          List available GPUs\n"
         "      --list-displays      List available displays\n"
@@ -105,6 +146,23 @@ class Settings {
         "\n"
         "      --disable-overlay    Disable text overlay\n"
         "      --mouse-navigation   Use mouse instead of HMD for camera control.\n"
+        "      --disable-late-latch Don't resample the HMD pose right before submit\n"
+        "      --pacing             Start frames just in time for the next vblank\n"
+        "      --gpu-profile-csv F  Write per pass GPU times of every frame to F\n"
+        "      --trace F            Record a chrome://tracing JSON to F, F2 writes it\n"
+        "\n"
+        "      --benchmark N        Render N frames with a fixed timestep and scripted camera\n"
+        "      --benchmark-warmup N Frames to render before measuring (default: 60)\n"
+        "      --benchmark-report F JSON report file (default: benchmark.json)\n"
+        "      --gpu-gears          Generate the gears in a compute shader\n"
+        "                           Keypad +/- changes their tooth count\n"
+        "      --gear-benchmark N   Time CPU and GPU gear generation N times and quit\n"
+        "      --gear-instances N   Draw N instanced gears, implies --merged-draws\n"
+        "      --merged-draws       Draw the scene from merged buffers with one indirect draw\n"
+        "      --disable-culling    Draw everything, without frustum culling\n"
+        "      --disable-multiview  Render the eyes with a geometry shader instead of VK_KHR_multiview\n"
+        "      --disable-stereo-instancing\n"
+        "                           Pick the eye's viewport in a geometry shader instead of the vertex shader\n"
         "      --distortion         HMD lens distortion (default: panotools)\n"
         "                           [none, panotools, vive]\n"
         "  -v, --validation         Run Vulkan validation\n"
@@ -160,6 +218,11 @@ class Settings {
       {"hmd", 1, 0, 0},
       {"format", 1, 0, 0},
       {"presentmode", 1, 0, 0},
+      {"frames-in-flight", 1, 0, 0},
+      {"record-threads", 1, 0, 0},
+      {"load-threads", 1, 0, 0},
+      {"frames", 1, 0, 0},
+      {"frame-budget", 1, 0, 0},
       {"list-gpus", 0, 0, 0},
       {"list-displays", 0, 0, 0},
       {"list-hmds", 0, 0, 0},
@@ -167,6 +230,20 @@ class Settings {
       {"list-presentmodes", 0, 0, 0},
       {"disable-overlay", 0, 0, 0},
       {"mouse-navigation", 0, 0, 0},
+      {"disable-late-latch", 0, 0, 0},
+      {"pacing", 0, 0, 0},
+      {"gpu-profile-csv", 1, 0, 0},
+      {"trace", 1, 0, 0},
+      {"benchmark", 1, 0, 0},
+      {"benchmark-warmup", 1, 0, 0},
+      {"benchmark-report", 1, 0, 0},
+      {"gpu-gears", 0, 0, 0},
+      {"gear-benchmark", 1, 0, 0},
+      {"gear-instances", 1, 0, 0},
+      {"merged-draws", 0, 0, 0},
+      {"disable-culling", 0, 0, 0},
+      {"disable-multiview", 0, 0, 0},
+      {"disable-stereo-instancing", 0, 0, 0},
       {"distortion", 1, 0, 0},
       {0, 0, 0, 0}
     };
@@ -203,6 +280,20 @@ class Settings {
         size = parse_size(optarg);
       } else if (optname == "presentmode") {
         present_mode = Log::string_to_present_mode(optarg);
+      } else if (optname == "frames-in-flight") {
+        frames_in_flight = parse_id(optarg);
+        if (frames_in_flight < 1 || frames_in_flight > 3)
+          vik_log_f("option --frames-in-flight must be between 1 and 3.");
+      } else if (optname == "record-threads") {
+        record_threads = parse_id(optarg);
+      } else if (optname == "load-threads") {
+        load_threads = parse_id(optarg);
+      } else if (optname == "frames") {
+        frame_count = parse_id(optarg);
+      } else if (optname == "frame-budget") {
+        frame_budget_ms = parse_double(optarg);
+        if (frame_budget_ms <= 0.0)
+          vik_log_f("option --frame-budget must be positive.");
       } else if (optname == "format") {
         color_format = Log::string_to_color_format(optarg);
       } else if (opt == 'f' || optname == "fullscreen") {
@@ -223,6 +314,34 @@ class Settings {
           vik_log_f("option -w given bad display mode");
       } else if (optname == "mouse-navigation") {
         mouse_navigation = true;
+      } else if (optname == "disable-late-latch") {
+        late_latch = false;
+      } else if (optname == "pacing") {
+        pacing = true;
+      } else if (optname == "gpu-profile-csv") {
+        gpu_profile_csv = optarg;
+      } else if (optname == "trace") {
+        trace_path = optarg;
+      } else if (optname == "benchmark") {
+        benchmark_frames = parse_id(optarg);
+      } else if (optname == "benchmark-warmup") {
+        benchmark_warmup = parse_id(optarg);
+      } else if (optname == "benchmark-report") {
+        benchmark_report = optarg;
+      } else if (optname == "gpu-gears") {
+        gpu_gears = true;
+      } else if (optname == "gear-benchmark") {
+        gear_benchmark = parse_id(optarg);
+      } else if (optname == "gear-instances") {
+        gear_instances = parse_id(optarg);
+      } else if (optname == "merged-draws") {
+        merged_draws = true;
+      } else if (optname == "disable-culling") {
+        culling = false;
+      } else if (optname == "disable-multiview") {
+        multiview = false;
+      } else if (optname == "disable-stereo-instancing") {
+        stereo_instancing = false;
       } else if (optname == "distortion") {
         distortion_type = distortion_type_from_string(optarg);
         if (distortion_type == DISTORTION_TYPE_INVALID)
@@ -252,6 +371,14 @@ class Settings {
     return std::stoi(str, nullptr);
   }
 
+  double parse_double(std::string const& str) {
+    char *end = nullptr;
+    double value = strtod(str.c_str(), &end);
+    if (str.empty() || *end != '\0')
+      vik_log_f("%s is not a valid number", str.c_str());
+    return value;
+  }
+
   static inline bool streq(const char *a, const char *b) {
     return strcmp(a, b) == 0;
   }
@@ -271,6 +398,8 @@ class Settings {
       return DIRECT_MODE;
     else if (streq(s, "direct-wayland"))
       return DIRECT_WAYLAND;
+    else if (streq(s, "headless"))
+      return HEADLESS;
     else
       return INVALID;
   }
@@ -0,0 +1,205 @@
+/*
+ * vitamin-k
+ *
+ * Copyright 2017-2018 Collabora Ltd.
+ *
+ * Authors: Lubosz Sarnecki <lubosz.sarnecki@collabora.com>
+ * SPDX-License-Identifier: MIT
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "vikLog.hpp"
+
+#define VIK_TRACE_CONCAT_(a, b) a##b
+#define VIK_TRACE_CONCAT(a, b) VIK_TRACE_CONCAT_(a, b)
+// Record the time until the end of the enclosing scope
+#define vik_trace_zone(name) \
+  vik::TraceZone VIK_TRACE_CONCAT(vik_trace_zone_, __LINE__)(name)
+
+namespace vik {
+
+/*
+ * Scoped zone tracing, exported in the chrome://tracing JSON format,
+ * which Perfetto loads as well.
+ *
+ * Every thread writes into its own ring of events, so recording zones only
+ * takes an uncontended lock. GPU zones are added by the GPU profiler in
+ * CPU time, when the device can calibrate its timestamps.
+ */
+class Trace {
+ public:
+  struct Event {
+    const char *name;
+    int64_t begin_ns;
+    int64_t end_ns;
+  };
+
+  struct GpuEvent {
+    std::string name;
+    int64_t begin_ns;
+    int64_t end_ns;
+  };
+
+  // Events kept per thread, older ones are overwritten
+  static const size_t RING_SIZE = 1 << 18;
+
+  bool enabled = false;
+  std::string path;
+
+ private:
+  struct ThreadBuffer {
+    uint32_t tid;
+    std::mutex mutex;
+    std::vector<Event> events;
+    size_t head = 0;
+  };
+
+  std::mutex buffers_mutex;
+  std::vector<std::unique_ptr<ThreadBuffer>> buffers;
+
+  std::mutex gpu_mutex;
+  std::vector<GpuEvent> gpu_events;
+  size_t gpu_head = 0;
+
+ public:
+  static Trace& get() {
+    static Trace trace;
+    return trace;
+  }
+
+  void init(const std::string& p) {
+    path = p;
+    enabled = !path.empty();
+  }
+
+  // Same clock as VK_TIME_DOMAIN_CLOCK_MONOTONIC_EXT
+  static int64_t now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+          std::chrono::steady_clock::now().time_since_epoch()).count();
+  }
+
+  void add(const char *name, int64_t begin_ns, int64_t end_ns) {
+    ThreadBuffer *buffer = get_thread_buffer();
+    Event event = {
+      .name = name,
+      .begin_ns = begin_ns,
+      .end_ns = end_ns
+    };
+
+    std::lock_guard<std::mutex> lock(buffer->mutex);
+    push(&buffer->events, &buffer->head, event);
+  }
+
+  void add_gpu(const std::string& name, int64_t begin_ns, int64_t end_ns) {
+    GpuEvent event = {
+      .name = name,
+      .begin_ns = begin_ns,
+      .end_ns = end_ns
+    };
+
+    std::lock_guard<std::mutex> lock(gpu_mutex);
+    push(&gpu_events, &gpu_head, event);
+  }
+
+  void dump() {
+    if (!enabled)
+      return;
+
+    std::ofstream out(path);
+    if (!out.is_open()) {
+      vik_log_e("Could not write trace to %s.", path.c_str());
+      return;
+    }
+
+    // Timestamps are in microseconds
+    out << std::fixed << std::setprecision(3);
+    out << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+    out << "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 1, "
+        << "\"args\": {\"name\": \"CPU\"}},\n";
+    out << "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 2, "
+        << "\"args\": {\"name\": \"GPU\"}}";
+
+    size_t count = 0;
+    {
+      std::lock_guard<std::mutex> lock(buffers_mutex);
+      for (auto& buffer : buffers) {
+        std::lock_guard<std::mutex> buffer_lock(buffer->mutex);
+        for (auto event : buffer->events)
+          write_event(&out, event.name, 1, buffer->tid,
+                      event.begin_ns, event.end_ns);
+        count += buffer->events.size();
+      }
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(gpu_mutex);
+      for (auto event : gpu_events)
+        write_event(&out, event.name.c_str(), 2, 0,
+                    event.begin_ns, event.end_ns);
+      count += gpu_events.size();
+    }
+
+    out << "\n]}\n";
+
+    vik_log_i("Wrote %ld trace events to %s.", count, path.c_str());
+  }
+
+ private:
+  ThreadBuffer* get_thread_buffer() {
+    static thread_local ThreadBuffer *buffer = nullptr;
+    if (buffer == nullptr) {
+      std::lock_guard<std::mutex> lock(buffers_mutex);
+      buffers.emplace_back(new ThreadBuffer());
+      buffer = buffers.back().get();
+      buffer->tid = buffers.size();
+      buffer->events.reserve(1024);
+    }
+    return buffer;
+  }
+
+  template <typename T>
+  static void push(std::vector<T> *ring, size_t *head, const T& event) {
+    if (ring->size() < RING_SIZE) {
+      ring->push_back(event);
+    } else {
+      (*ring)[*head] = event;
+      *head = (*head + 1) % RING_SIZE;
+    }
+  }
+
+  static void write_event(std::ofstream *out, const char *name,
+                          uint32_t pid, uint32_t tid,
+                          int64_t begin_ns, int64_t end_ns) {
+    *out << ",\n{\"name\": \"" << name << "\", \"ph\": \"X\", "
+         << "\"pid\": " << pid << ", \"tid\": " << tid << ", "
+         << "\"ts\": " << begin_ns / 1000.0 << ", "
+         << "\"dur\": " << (end_ns - begin_ns) / 1000.0 << "}";
+  }
+};
+
+class TraceZone {
+  const char *name;
+  int64_t begin_ns;
+
+ public:
+  explicit TraceZone(const char *n) : name(n) {
+    begin_ns = Trace::get().enabled ? Trace::now_ns() : 0;
+  }
+
+  ~TraceZone() {
+    if (Trace::get().enabled)
+      Trace::get().add(name, begin_ns, Trace::now_ns());
+  }
+};
+}  // namespace vik
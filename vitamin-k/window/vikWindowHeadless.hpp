@@ -0,0 +1,68 @@
+/*
+ * vitamin-k
+ *
+ * Copyright 2017-2018 Collabora Ltd.
+ *
+ * Authors: Lubosz Sarnecki <lubosz.sarnecki@collabora.com>
+ * SPDX-License-Identifier: MIT
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "vikWindow.hpp"
+
+#include "../render/vikSwapChainHeadless.hpp"
+
+namespace vik {
+
+// Window back end without a display, for CI and software implementations
+class WindowHeadless : public Window {
+  SwapChainHeadless swap_chain;
+
+ public:
+  explicit WindowHeadless(Settings *s) : Window(s) {
+    name = "headless";
+  }
+
+  ~WindowHeadless() {}
+
+  int init() {
+    size_only_cb(settings->size.first, settings->size.second);
+    return 0;
+  }
+
+  void iterate() {
+    render_frame_cb();
+  }
+
+  void init_swap_chain(uint32_t width, uint32_t height) {
+    swap_chain.set_settings(settings);
+    swap_chain.surface_format = {
+      .format = settings->color_format,
+      .colorSpace = VK_COLOR_SPACE_SRGB_NONLINEAR_KHR
+    };
+    swap_chain.create(width, height);
+  }
+
+  SwapChain* get_swap_chain() {
+    return (SwapChain*) &swap_chain;
+  }
+
+  const std::vector<const char*> required_extensions() {
+    return {};
+  }
+
+  const std::vector<const char*> required_device_extensions() {
+    return {};
+  }
+
+  void update_window_title(const std::string& title) {}
+
+  VkBool32 check_support(VkPhysicalDevice physical_device) {
+    return true;
+  }
+};
+}  // namespace vik
@@ -97,6 +97,10 @@ class WindowWayland : public Window {
         return Input::Key::P;
       case KEY_F1:
         return Input::Key::F1;
+      case KEY_F2:
+        return Input::Key::F2;
+      case KEY_F3:
+        return Input::Key::F3;
       case KEY_ESC:
         return Input::Key::ESCAPE;
       case KEY_SPACE:
@@ -290,6 +290,10 @@ class WindowXCB : public Window {
         return Input::Key::P;
       case XK_F1:
         return Input::Key::F1;
+      case XK_F2:
+        return Input::Key::F2;
+      case XK_F3:
+        return Input::Key::F3;
       case XK_Escape:
         return Input::Key::ESCAPE;
       case XK_space: